@@ -8,6 +8,9 @@ OUTPUT_PATH=${OUTPUT_PATH:-"/app/output"}
 LISTEN_ADDRESS=${LISTEN_ADDRESS:-"0.0.0.0"}
 VRAM_MODE=${VRAM_MODE:-"highvram"}
 PREVIEW_METHOD=${PREVIEW_METHOD:-"auto"}
+# Huge page wrapper for checkpoint loads: off, on, auto (when the host has a huge page pool).
+# Off by default: the pool is planned for llama-cpu, which falls back to 4KB pages if it is drained.
+HUGEPAGE_WRAPPER=${HUGEPAGE_WRAPPER:-"off"}
 
 # Silence git warnings for non-critical operations
 export GIT_PYTHON_REFRESH=quiet
@@ -63,5 +66,15 @@ elif [[ "$VRAM_MODE" == "novram" ]]; then
     CMD_ARGS+=("--novram")
 fi
 
+# Checkpoints are loaded through safetensors, which maps each file whole; the
+# wrapper copies them into huge pages on parallel threads before the GPU upload.
+# Without a pool it would fall back to an anonymous copy, so auto needs one.
+HUGEPAGES_FREE=$(awk '/^HugePages_Free:/ {print $2}' /proc/meminfo)
+if [[ "$HUGEPAGE_WRAPPER" == "on" || ( "$HUGEPAGE_WRAPPER" == "auto" && "${HUGEPAGES_FREE:-0}" -gt 0 ) ]]; then
+    export HUGEPAGE_WRAPPER_METRICS=${HUGEPAGE_WRAPPER_METRICS:-/app/logs/hugepage_wrapper.prom}
+    export LD_PRELOAD=/app/hugepage_mmap_wrapper.so
+    echo "Hugepage wrapper enabled for checkpoint loads ($HUGEPAGES_FREE huge pages free)"
+fi
+
 # Execute ComfyUI
 exec "${CMD_ARGS[@]}"
\ No newline at end of file
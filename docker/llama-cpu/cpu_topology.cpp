@@ -0,0 +1,313 @@
+/*
+ * cpu_topology.cpp
+ *
+ * Shows the SMT topology behind the llama-cpu cpuset, sizes a cpuset of
+ * whole cores for it, and checks a running server's thread placement
+ * (thread_placement.cpp) against sysfs.
+ *
+ * The thread placement library puts one compute worker on each physical core
+ * of the cpuset and every other thread on the cores' SMT siblings, so the
+ * cpuset should hold both siblings of each core it uses. Whether "0-11" does
+ * depends on the machine's numbering: on AMD the siblings of core N are
+ * usually N and N + (CPUs / 2), so 0-11 is 12 cores without siblings. This
+ * tool:
+ * 1. Without options, lists the cores of the online CPUs (or --cpus) with
+ *    their logical CPUs and L2/L3 domains
+ * 2. With --cores N, prints a cpuset of N whole cores spread across the L3
+ *    domains, and the CPU quota for it, as docker-compose variables
+ *    (LLAMA_CPU_CPUSET, LLAMA_CPU_CPUS) to put into .env
+ * 3. With --pid PID, reads the affinity of every thread of PID from /proc
+ *    and checks it against the topology of the process's cpuset: each
+ *    compute worker pinned to its own core, the other threads on the
+ *    siblings only. Threads allowed on compute CPUs and cores shared by two
+ *    compute workers are reported
+ *
+ * Exit codes: 0 ok, 1 error, 2 placement problems found (--pid) or the CPUs
+ * have fewer whole cores than asked for (--cores).
+ */
+
+#include <dirent.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "cpu_topology.h"
+
+#define EXIT_OK 0
+#define EXIT_ERROR 1
+#define EXIT_PROBLEMS 2
+
+struct TopologyOptions {
+    std::string sysfs = CPU_SYSFS;
+    std::vector<int> cpus;  // Empty: online CPUs
+    int cores = 0;
+    pid_t pid = 0;
+    bool verbose = false;
+};
+
+// One thread of the checked process
+struct ThreadPlacement {
+    pid_t tid;
+    std::string name;
+    std::vector<int> allowed;
+    int last_cpu;
+};
+
+static std::string read_line(const std::string& path) {
+    FILE* f = fopen(path.c_str(), "r");
+    if (!f) {
+        return "";
+    }
+    char line[4096] = "";
+    if (!fgets(line, sizeof(line), f)) line[0] = '\0';
+    fclose(f);
+    std::string s = line;
+    while (!s.empty() && s.back() == '\n') s.pop_back();
+    return s;
+}
+
+static int run_list(const CpuTopology& t) {
+    printf("%-6s %-12s %-8s %-8s\n", "CORE", "CPUS", "L2", "L3");
+    for (size_t i = 0; i < t.cores.size(); i++) {
+        const CpuCore& core = t.cores[i];
+        std::string cpus = format_cpu_list(core.cpus);
+        if ((int)core.cpus.size() < core.threads) cpus += " (of " + std::to_string(core.threads) + ")";
+        printf("%-6zu %-12s %-8d %-8s\n", i, cpus.c_str(), core.l2,
+               core.l3 < 0 ? "-" : std::to_string(core.l3).c_str());
+    }
+    std::vector<int> auxiliary = auxiliary_cpus(t);
+    printf("\nCompute CPUs:   %s (%zu cores)\n", format_cpu_list(compute_cpus(t)).c_str(), t.cores.size());
+    printf("Auxiliary CPUs: %s\n", auxiliary.empty() ? "none (no SMT siblings)" : format_cpu_list(auxiliary).c_str());
+    return EXIT_OK;
+}
+
+static int run_cores(const CpuTopology& t, int wanted) {
+    // Cores in compute order, so the set spreads over the L3 domains
+    std::vector<int> order = compute_cpus(t);
+    std::vector<int> cpuset;
+    int whole = 0;
+    for (int cpu : order) {
+        if (whole == wanted) break;
+        const CpuCore& core = t.cores[core_of(t, cpu)];
+        cpuset.insert(cpuset.end(), core.cpus.begin(), core.cpus.end());
+        whole++;
+    }
+    if (whole < wanted) {
+        fprintf(stderr, "cpu_topology: only %d cores available, %d asked for\n", whole, wanted);
+    }
+    std::sort(cpuset.begin(), cpuset.end());
+    printf("LLAMA_CPU_CPUSET=%s\n", format_cpu_list(cpuset).c_str());
+    printf("LLAMA_CPU_CPUS=%zu\n", cpuset.size());
+    if (cpuset.size() == (size_t)whole) {
+        fprintf(stderr, "cpu_topology: no SMT siblings; auxiliary threads will share the compute cores\n");
+    }
+    return whole < wanted ? EXIT_PROBLEMS : EXIT_OK;
+}
+
+// CPUs of the process's cpuset: its cgroup's effective cpuset if readable,
+// else the union of its threads' affinity
+static std::vector<int> process_cpus(pid_t pid, const std::vector<ThreadPlacement>& threads) {
+    std::vector<int> cpus;
+    std::string cgroup = read_line("/proc/" + std::to_string(pid) + "/cgroup");
+    if (cgroup.compare(0, 3, "0::") == 0) {
+        std::string dir = "/sys/fs/cgroup" + cgroup.substr(3);
+        if (read_cpu_list_file(dir + "/cpuset.cpus.effective", &cpus) && !cpus.empty()) return cpus;
+        if (read_cpu_list_file("/sys/fs/cgroup/cpuset.cpus.effective", &cpus) && !cpus.empty()) return cpus;
+    }
+    cpus.clear();
+    for (const ThreadPlacement& thread : threads) {
+        cpus.insert(cpus.end(), thread.allowed.begin(), thread.allowed.end());
+    }
+    std::sort(cpus.begin(), cpus.end());
+    cpus.erase(std::unique(cpus.begin(), cpus.end()), cpus.end());
+    return cpus;
+}
+
+static bool read_threads(pid_t pid, std::vector<ThreadPlacement>* out) {
+    std::string dir = "/proc/" + std::to_string(pid) + "/task";
+    DIR* d = opendir(dir.c_str());
+    if (!d) {
+        return false;
+    }
+    while (struct dirent* e = readdir(d)) {
+        if (e->d_name[0] == '.') continue;
+        ThreadPlacement thread = {(pid_t)atoi(e->d_name), "", {}, -1};
+        std::string base = dir + "/" + e->d_name;
+        thread.name = read_line(base + "/comm");
+        FILE* f = fopen((base + "/status").c_str(), "r");
+        if (!f) continue;  // Thread exited
+        char line[4096];
+        while (fgets(line, sizeof(line), f)) {
+            if (strncmp(line, "Cpus_allowed_list:", 18) == 0) {
+                parse_cpu_list(line + 18 + strspn(line + 18, " \t"), &thread.allowed);
+            }
+        }
+        fclose(f);
+        // Field 39 of stat is the CPU the thread last ran on; skip past the
+        // parenthesized name, which may hold spaces
+        std::string stat = read_line(base + "/stat");
+        size_t p = stat.rfind(')');
+        if (p != std::string::npos) {
+            int field = 2;
+            for (size_t i = p + 1; i < stat.size() && field < 39; i++) {
+                if (stat[i] == ' ') {
+                    field++;
+                    if (field == 39) thread.last_cpu = atoi(stat.c_str() + i + 1);
+                }
+            }
+        }
+        out->push_back(thread);
+    }
+    closedir(d);
+    std::sort(out->begin(), out->end(),
+              [](const ThreadPlacement& a, const ThreadPlacement& b) { return a.tid < b.tid; });
+    return true;
+}
+
+static int run_check(pid_t pid, const TopologyOptions& o) {
+    std::vector<ThreadPlacement> threads;
+    if (!read_threads(pid, &threads) || threads.empty()) {
+        fprintf(stderr, "cpu_topology: no threads for PID %d\n", (int)pid);
+        return EXIT_ERROR;
+    }
+    std::vector<int> cpus = process_cpus(pid, threads);
+    CpuTopology t;
+    if (!cpu_topology(cpus, &t, o.sysfs.c_str())) {
+        fprintf(stderr, "cpu_topology: incomplete topology in %s, CPUs without it count as cores\n", o.sysfs.c_str());
+    }
+    std::vector<int> compute = compute_cpus(t);
+    std::vector<int> auxiliary = auxiliary_cpus(t);
+    printf("Cpuset %s: %zu cores, compute CPUs %s, auxiliary CPUs %s\n", format_cpu_list(cpus).c_str(),
+           t.cores.size(), format_cpu_list(compute).c_str(),
+           auxiliary.empty() ? "none" : format_cpu_list(auxiliary).c_str());
+
+    std::vector<std::vector<pid_t>> workers(t.cores.size());  // Compute workers pinned to each core
+    size_t n_compute = 0, n_auxiliary = 0, n_unplaced = 0;
+    std::vector<std::string> problems;
+    if (o.verbose) printf("\n%-8s %-16s %-12s %-6s %s\n", "TID", "NAME", "ALLOWED", "LAST", "ROLE");
+    for (const ThreadPlacement& thread : threads) {
+        const char* role;
+        if (thread.allowed.size() == 1 && cpus.size() > 1 && core_of(t, thread.allowed[0]) >= 0) {
+            // A single CPU: a compute worker, on a sibling if the team outgrew the cores
+            int core = core_of(t, thread.allowed[0]);
+            workers[core].push_back(thread.tid);
+            role = std::find(compute.begin(), compute.end(), thread.allowed[0]) != compute.end()
+                ? "compute" : "compute (sibling)";
+            n_compute++;
+        } else if (!auxiliary.empty() && thread.allowed == auxiliary) {
+            role = "auxiliary";
+            n_auxiliary++;
+        } else {
+            role = "unplaced";
+            n_unplaced++;
+            if (!auxiliary.empty()) {
+                problems.push_back("thread " + std::to_string(thread.tid) + " (" + thread.name +
+                                   ") may run on compute CPUs " + format_cpu_list(thread.allowed));
+            }
+        }
+        if (o.verbose) {
+            printf("%-8d %-16s %-12s %-6d %s\n", (int)thread.tid, thread.name.c_str(),
+                   format_cpu_list(thread.allowed).c_str(), thread.last_cpu, role);
+        }
+    }
+    for (size_t i = 0; i < workers.size(); i++) {
+        if (workers[i].size() > 1) {
+            problems.push_back(std::to_string(workers[i].size()) + " compute workers share core " +
+                               std::to_string(i) + " (CPUs " + format_cpu_list(t.cores[i].cpus) + ")");
+        }
+    }
+    if (auxiliary.empty()) {
+        problems.push_back("no SMT siblings in the cpuset, auxiliary threads share the compute cores "
+                           "(see make cpu-topology)");
+    }
+    if (n_compute == 0) {
+        problems.push_back("no compute workers pinned (thread_placement.so not loaded, or no request served yet)");
+    }
+
+    printf("\n%zu threads: %zu compute, %zu auxiliary, %zu unplaced\n", threads.size(), n_compute, n_auxiliary,
+           n_unplaced);
+    for (const std::string& problem : problems) {
+        printf("  PROBLEM: %s\n", problem.c_str());
+    }
+    return problems.empty() ? EXIT_OK : EXIT_PROBLEMS;
+}
+
+static void usage(const char* prog) {
+    fprintf(stderr,
+        "Usage: %s [OPTIONS]\n"
+        "\n"
+        "Show the SMT topology of the CPUs, size a cpuset of whole cores, or check\n"
+        "the thread placement of a running llama-server.\n"
+        "\n"
+        "Options:\n"
+        "  --cpus LIST          CPUs to show or pick cores from (default: online CPUs)\n"
+        "  --cores N            Print a cpuset of N whole cores and its CPU quota\n"
+        "                       (LLAMA_CPU_CPUSET, LLAMA_CPU_CPUS)\n"
+        "  --pid PID            Check the placement of PID's threads\n"
+        "  --sysfs DIR          CPU topology directory (default: " CPU_SYSFS ")\n"
+        "  --verbose            With --pid, list every thread\n",
+        prog);
+}
+
+int main(int argc, char** argv) {
+    enum { OPT_CORES = 1, OPT_CPUS, OPT_PID, OPT_SYSFS, OPT_VERBOSE, OPT_HELP };
+    static const struct option long_options[] = {
+        {"cores", required_argument, nullptr, OPT_CORES},
+        {"cpus", required_argument, nullptr, OPT_CPUS},
+        {"pid", required_argument, nullptr, OPT_PID},
+        {"sysfs", required_argument, nullptr, OPT_SYSFS},
+        {"verbose", no_argument, nullptr, OPT_VERBOSE},
+        {"help", no_argument, nullptr, OPT_HELP},
+        {nullptr, 0, nullptr, 0},
+    };
+
+    TopologyOptions o;
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", long_options, nullptr)) != -1) {
+        switch (opt) {
+            case OPT_CORES:
+                o.cores = atoi(optarg);
+                if (o.cores <= 0) {
+                    fprintf(stderr, "cpu_topology: invalid --cores '%s'\n", optarg);
+                    return EXIT_ERROR;
+                }
+                break;
+            case OPT_CPUS:
+                if (!parse_cpu_list(optarg, &o.cpus) || o.cpus.empty()) {
+                    fprintf(stderr, "cpu_topology: invalid --cpus '%s'\n", optarg);
+                    return EXIT_ERROR;
+                }
+                break;
+            case OPT_PID:
+                o.pid = (pid_t)atoi(optarg);
+                if (o.pid <= 0) {
+                    fprintf(stderr, "cpu_topology: invalid --pid '%s'\n", optarg);
+                    return EXIT_ERROR;
+                }
+                break;
+            case OPT_SYSFS: o.sysfs = optarg; break;
+            case OPT_VERBOSE: o.verbose = true; break;
+            case OPT_HELP: usage(argv[0]); return EXIT_OK;
+            default: usage(argv[0]); return EXIT_ERROR;
+        }
+    }
+
+    if (o.pid > 0) {
+        return run_check(o.pid, o);
+    }
+    std::vector<int> cpus = o.cpus.empty() ? online_cpus(o.sysfs.c_str()) : o.cpus;
+    if (cpus.empty()) {
+        fprintf(stderr, "cpu_topology: no online CPUs in %s\n", o.sysfs.c_str());
+        return EXIT_ERROR;
+    }
+    CpuTopology t;
+    if (!cpu_topology(cpus, &t, o.sysfs.c_str())) {
+        fprintf(stderr, "cpu_topology: incomplete topology in %s, CPUs without it count as cores\n", o.sysfs.c_str());
+    }
+    return o.cores > 0 ? run_cores(t, o.cores) : run_list(t);
+}
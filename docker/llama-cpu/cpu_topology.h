@@ -0,0 +1,212 @@
+/*
+ * cpu_topology.h
+ *
+ * SMT topology of a set of logical CPUs from sysfs, used by the
+ * thread_placement library to put one compute worker on each physical core
+ * and auxiliary threads on the cores' SMT siblings, and by the cpu_topology
+ * tool to size the llama-cpu cpuset and check a running server's placement.
+ *
+ * Logical CPUs are grouped into physical cores by thread_siblings_list, and
+ * cores into L2 and L3 domains by the caches' shared_cpu_list, so the same
+ * code covers AMD and Intel numbering (siblings adjacent or half the CPU
+ * count apart) and a cpuset holding only some siblings of a core.
+ */
+
+#pragma once
+
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#define CPU_SYSFS "/sys/devices/system/cpu"
+
+// One physical core, restricted to the CPUs of the set it was built from
+struct CpuCore {
+    std::vector<int> cpus;  // Logical CPUs of the core in the set, ascending; cpus[0] runs compute
+    int threads;            // Logical CPUs the core has online, in the set or not
+    int l2;                 // Lowest CPU sharing the core's L2 (or the core itself)
+    int l3;                 // Lowest CPU sharing the core's L3, -1 if unknown
+};
+
+struct CpuTopology {
+    std::vector<CpuCore> cores;  // By cpus[0]
+};
+
+// Parses a kernel CPU list ("0-3,8,10-11")
+static inline bool parse_cpu_list(const char* text, std::vector<int>* out) {
+    out->clear();
+    const char* p = text;
+    while (*p && *p != '\n') {
+        char* end = nullptr;
+        long first = strtol(p, &end, 10);
+        if (end == p || first < 0) {
+            return false;
+        }
+        long last = first;
+        p = end;
+        if (*p == '-') {
+            last = strtol(p + 1, &end, 10);
+            if (end == p + 1 || last < first) {
+                return false;
+            }
+            p = end;
+        }
+        for (long cpu = first; cpu <= last; cpu++) {
+            out->push_back((int)cpu);
+        }
+        if (*p == ',') {
+            p++;
+        }
+    }
+    std::sort(out->begin(), out->end());
+    out->erase(std::unique(out->begin(), out->end()), out->end());
+    return true;
+}
+
+static inline std::string format_cpu_list(std::vector<int> cpus) {
+    std::sort(cpus.begin(), cpus.end());
+    std::string out;
+    for (size_t i = 0; i < cpus.size();) {
+        size_t j = i;
+        while (j + 1 < cpus.size() && cpus[j + 1] == cpus[j] + 1) {
+            j++;
+        }
+        if (!out.empty()) out += ",";
+        out += std::to_string(cpus[i]);
+        if (j > i) out += "-" + std::to_string(cpus[j]);
+        i = j + 1;
+    }
+    return out;
+}
+
+static inline bool read_cpu_list_file(const std::string& path, std::vector<int>* out) {
+    FILE* f = fopen(path.c_str(), "r");
+    if (!f) {
+        return false;
+    }
+    char line[4096] = "";
+    bool ok = fgets(line, sizeof(line), f) && parse_cpu_list(line, out);
+    fclose(f);
+    return ok;
+}
+
+static inline std::vector<int> online_cpus(const char* sysfs = CPU_SYSFS) {
+    std::vector<int> cpus;
+    read_cpu_list_file(std::string(sysfs) + "/online", &cpus);
+    return cpus;
+}
+
+// CPUs the thread may run on (0 = calling thread)
+static inline std::vector<int> allowed_cpus(pid_t tid = 0) {
+    std::vector<int> cpus;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(tid, sizeof(set), &set) == 0) {
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &set)) cpus.push_back(cpu);
+        }
+    }
+    return cpus;
+}
+
+// Lowest CPU sharing the cache of the given level with cpu, or -1
+static inline int cache_domain(const char* sysfs, int cpu, int level) {
+    for (int index = 0;; index++) {
+        std::string dir = std::string(sysfs) + "/cpu" + std::to_string(cpu) + "/cache/index" + std::to_string(index);
+        FILE* f = fopen((dir + "/level").c_str(), "r");
+        if (!f) {
+            return -1;
+        }
+        int found = 0;
+        bool ok = fscanf(f, "%d", &found) == 1;
+        fclose(f);
+        std::vector<int> shared;
+        if (ok && found == level && read_cpu_list_file(dir + "/shared_cpu_list", &shared) && !shared.empty()) {
+            return shared[0];
+        }
+    }
+}
+
+// Groups cpus into physical cores. False if sysfs has no topology for one
+// of them (then every CPU is taken as a core of its own).
+static inline bool cpu_topology(const std::vector<int>& cpus, CpuTopology* out, const char* sysfs = CPU_SYSFS) {
+    out->cores.clear();
+    bool complete = true;
+    std::vector<int> assigned;
+    for (int cpu : cpus) {
+        if (std::find(assigned.begin(), assigned.end(), cpu) != assigned.end()) {
+            continue;
+        }
+        std::string base = std::string(sysfs) + "/cpu" + std::to_string(cpu);
+        std::vector<int> siblings;
+        if (!read_cpu_list_file(base + "/topology/thread_siblings_list", &siblings) || siblings.empty()) {
+            complete = false;
+            siblings = {cpu};
+        }
+        CpuCore core;
+        core.threads = (int)siblings.size();
+        for (int sibling : siblings) {
+            if (std::find(cpus.begin(), cpus.end(), sibling) != cpus.end()) {
+                core.cpus.push_back(sibling);
+                assigned.push_back(sibling);
+            }
+        }
+        if (core.cpus.empty()) {
+            core.cpus.push_back(cpu);  // Sysfs disagrees with itself; keep the CPU
+            assigned.push_back(cpu);
+        }
+        std::sort(core.cpus.begin(), core.cpus.end());
+        core.l2 = cache_domain(sysfs, core.cpus[0], 2);
+        core.l3 = cache_domain(sysfs, core.cpus[0], 3);
+        if (core.l2 < 0) core.l2 = core.cpus[0];
+        out->cores.push_back(core);
+    }
+    std::sort(out->cores.begin(), out->cores.end(),
+              [](const CpuCore& a, const CpuCore& b) { return a.cpus[0] < b.cpus[0]; });
+    return complete;
+}
+
+// CPUs for compute workers 0, 1, ...: one per core, alternating between L3
+// domains (CCDs) so a team smaller than the set still uses every CCD's link
+// to memory
+static inline std::vector<int> compute_cpus(const CpuTopology& t) {
+    std::vector<int> domains;
+    for (const CpuCore& core : t.cores) {
+        if (std::find(domains.begin(), domains.end(), core.l3) == domains.end()) domains.push_back(core.l3);
+    }
+    std::vector<std::vector<int>> by_domain(domains.size());
+    for (const CpuCore& core : t.cores) {
+        size_t d = std::find(domains.begin(), domains.end(), core.l3) - domains.begin();
+        by_domain[d].push_back(core.cpus[0]);
+    }
+    std::vector<int> order;
+    for (size_t round = 0; order.size() < t.cores.size(); round++) {
+        for (const std::vector<int>& cpus : by_domain) {
+            if (round < cpus.size()) order.push_back(cpus[round]);
+        }
+    }
+    return order;
+}
+
+// The SMT siblings of the compute CPUs within the set
+static inline std::vector<int> auxiliary_cpus(const CpuTopology& t) {
+    std::vector<int> cpus;
+    for (const CpuCore& core : t.cores) {
+        cpus.insert(cpus.end(), core.cpus.begin() + 1, core.cpus.end());
+    }
+    std::sort(cpus.begin(), cpus.end());
+    return cpus;
+}
+
+// Core of a CPU in the topology, or -1
+static inline int core_of(const CpuTopology& t, int cpu) {
+    for (size_t i = 0; i < t.cores.size(); i++) {
+        const std::vector<int>& cpus = t.cores[i].cpus;
+        if (std::find(cpus.begin(), cpus.end(), cpu) != cpus.end()) return (int)i;
+    }
+    return -1;
+}
@@ -12,6 +12,29 @@ UBATCH_SIZE=${UBATCH_SIZE:-2048}
 THREADS=${THREADS:-12}
 THREADS_BATCH=${THREADS_BATCH:-12}
 THREADS_HTTP=${THREADS_HTTP:-2}
+HUGEPAGE_PREFLIGHT=${HUGEPAGE_PREFLIGHT:-warn}
+# Speculative decoding draft model (off unless set; see make spec-eval)
+DRAFT_MODEL_PATH=${DRAFT_MODEL_PATH:-}
+DRAFT_MAX=${DRAFT_MAX:-16}
+DRAFT_MIN=${DRAFT_MIN:-0}
+THREADS_DRAFT=${THREADS_DRAFT:-$THREADS}
+# Additional llama-server flags, word-split (used by the evaluation harnesses)
+EXTRA_ARGS=${EXTRA_ARGS:-}
+# KV slot snapshots for the router (memory-backed directory shared by replicas)
+SLOT_SAVE_PATH=${SLOT_SAVE_PATH:-}
+# Wrapper placement decision and cgroup budget, in Prometheus text format
+export HUGEPAGE_WRAPPER_METRICS=${HUGEPAGE_WRAPPER_METRICS:-/app/logs/hugepage_wrapper.prom}
+# Live model load progress for the healthcheck and the router (hugepage_progress)
+export HUGEPAGE_WRAPPER_PROGRESS=${HUGEPAGE_WRAPPER_PROGRESS:-/app/logs/hugepage_wrapper.progress}
+# Huge page staging arenas for the HTTP threads (hugepage_arena.so, off if HUGEPAGE_ARENA=off)
+HUGEPAGE_ARENA=${HUGEPAGE_ARENA:-on}
+export HUGEPAGE_ARENA_MB=${HUGEPAGE_ARENA_MB:-32}
+export HUGEPAGE_ARENA_METRICS=${HUGEPAGE_ARENA_METRICS:-/app/logs/hugepage_arena.prom}
+# Compute thread governor (thread_governor.so, off if THREAD_GOVERNOR=off)
+THREAD_GOVERNOR=${THREAD_GOVERNOR:-on}
+export THREAD_GOVERNOR_METRICS=${THREAD_GOVERNOR_METRICS:-/app/logs/thread_governor.prom}
+# One compute worker per physical core, other threads on SMT siblings (thread_placement.so, off if THREAD_PLACEMENT=off)
+THREAD_PLACEMENT=${THREAD_PLACEMENT:-on}
 
 echo "=== Starting llama.cpp CPU Server ==="
 echo "  Port: $SERVER_PORT"
@@ -25,10 +48,98 @@ if [[ ! -f "$MODEL_PATH" ]]; then
     exit 1
 fi
 
+# Shared model image: replicas map one copy of the model from a hugetlbfs mount,
+# and a new revision of the model only rewrites the pages of changed tensors
+if [[ -n "$HUGEPAGE_WRAPPER_IMAGE_DIR" ]]; then
+    if [[ -d "$HUGEPAGE_WRAPPER_IMAGE_DIR" && -w "$HUGEPAGE_WRAPPER_IMAGE_DIR" ]]; then
+        echo "Shared model image: $HUGEPAGE_WRAPPER_IMAGE_DIR"
+    else
+        echo "WARNING: HUGEPAGE_WRAPPER_IMAGE_DIR $HUGEPAGE_WRAPPER_IMAGE_DIR is not a writable directory; loading the model privately"
+        unset HUGEPAGE_WRAPPER_IMAGE_DIR
+    fi
+fi
+
+# Pre-flight: check the huge page pool can hold the model (warn, strict or off)
+# The pool is shared with other replicas, so it must be sized on the host first
+if [[ "$HUGEPAGE_PREFLIGHT" != "off" ]]; then
+    PREFLIGHT_STATUS=0
+    ./hugepage_planner --model "$MODEL_PATH" --ctx-size "$CTX_SIZE" \
+        --batch-size "$BATCH_SIZE" --ubatch-size "$UBATCH_SIZE" \
+        ${HUGEPAGE_WRAPPER_IMAGE_DIR:+--image-dir "$HUGEPAGE_WRAPPER_IMAGE_DIR"} --check || PREFLIGHT_STATUS=$?
+    if [[ $PREFLIGHT_STATUS -ne 0 ]]; then
+        echo "WARNING: Huge page pool cannot hold the model; the wrapper will fall back to regular pages"
+        echo "  Reserve on the host with: make hugepage-reserve MODEL=<host path to model>"
+        if [[ "$HUGEPAGE_PREFLIGHT" == "strict" ]]; then
+            exit 1
+        fi
+    fi
+fi
+
+# Slot save/restore lets the router snapshot and restore reused prompt prefixes
+SLOT_ARGS=()
+if [[ -n "$SLOT_SAVE_PATH" ]]; then
+    if [[ -d "$SLOT_SAVE_PATH" && -w "$SLOT_SAVE_PATH" ]]; then
+        SLOT_ARGS=(--slot-save-path "$SLOT_SAVE_PATH")
+        echo "Slot snapshots enabled: $SLOT_SAVE_PATH"
+    else
+        echo "WARNING: SLOT_SAVE_PATH $SLOT_SAVE_PATH is not a writable directory; slot snapshots disabled"
+    fi
+fi
+
+# Speculative decoding: the draft model runs in the same process between main model steps
+DRAFT_ARGS=()
+if [[ -n "$DRAFT_MODEL_PATH" ]]; then
+    if [[ -f "$DRAFT_MODEL_PATH" ]]; then
+        DRAFT_ARGS=(--model-draft "$DRAFT_MODEL_PATH" --draft-max "$DRAFT_MAX" --draft-min "$DRAFT_MIN"
+                    --threads-draft "$THREADS_DRAFT" --threads-batch-draft "$THREADS_DRAFT")
+        # Draft models are usually below the wrapper's 1GB default; keep them on huge pages too
+        export HUGEPAGE_WRAPPER_MIN_SIZE_MB=${HUGEPAGE_WRAPPER_MIN_SIZE_MB:-64}
+        echo "Speculative decoding enabled: $DRAFT_MODEL_PATH (draft $DRAFT_MIN-$DRAFT_MAX, $THREADS_DRAFT threads)"
+    else
+        echo "WARNING: Draft model not found: $DRAFT_MODEL_PATH; speculative decoding disabled"
+    fi
+fi
+
+# Compute thread governor: THREADS and THREADS_BATCH become ceilings, and each
+# step runs with the thread count measured fastest for its phase
+if [[ "$THREAD_GOVERNOR" != "off" ]]; then
+    # Steps are told apart by the tokens in their ubatch, so the thread counts stay as given
+    export THREAD_GOVERNOR_DECODE=$THREADS
+    export THREAD_GOVERNOR_PROMPT=$THREADS_BATCH
+    # The main model verifies up to DRAFT_MAX drafted tokens and the next one per generation step
+    if [[ ${#DRAFT_ARGS[@]} -gt 0 ]]; then
+        export THREAD_GOVERNOR_DECODE_TOKENS=${THREAD_GOVERNOR_DECODE_TOKENS:-$((DRAFT_MAX + 1))}
+    fi
+    # A generation step reads about the whole model, for the bandwidth report
+    export THREAD_GOVERNOR_STEP_BYTES=$(stat -Lc %s "$MODEL_PATH")
+    echo "Compute thread governor enabled: generation up to $THREADS threads, prompts up to $THREADS_BATCH"
+    if [[ ${#DRAFT_ARGS[@]} -gt 0 ]] && (( THREADS_DRAFT == THREADS || THREADS_DRAFT == THREADS_BATCH )); then
+        echo "WARNING: THREADS_DRAFT ($THREADS_DRAFT) matches a governed thread count; draft steps are timed with that phase"
+    fi
+fi
+
+read -r -a EXTRA_ARGS_ARRAY <<< "$EXTRA_ARGS"
+if [[ ${#EXTRA_ARGS_ARRAY[@]} -gt 0 ]]; then
+    echo "Extra server arguments: ${EXTRA_ARGS_ARRAY[*]}"
+fi
+
 # Enable hugepage wrapper for explicit huge page support on large models
 # The wrapper will automatically use huge pages for models > 1GB
 export LD_PRELOAD=/app/hugepage_mmap_wrapper.so
 echo "Hugepage wrapper enabled for explicit huge page support (MAP_HUGETLB)"
+# Request staging buffers of the HTTP threads (std::thread) come from per-thread arenas
+if [[ "$HUGEPAGE_ARENA" != "off" ]]; then
+    export LD_PRELOAD="$LD_PRELOAD /app/hugepage_arena.so"
+    echo "HTTP staging arenas enabled: ${HUGEPAGE_ARENA_MB} MB per HTTP thread"
+fi
+if [[ "$THREAD_GOVERNOR" != "off" ]]; then
+    export LD_PRELOAD="$LD_PRELOAD /app/thread_governor.so"
+fi
+# After the governor, so its team sizes are placed; the plan is logged at the first request
+if [[ "$THREAD_PLACEMENT" != "off" ]]; then
+    export LD_PRELOAD="$LD_PRELOAD /app/thread_placement.so"
+    echo "Thread placement enabled: CPUs $(grep Cpus_allowed_list /proc/self/status | cut -f2), check with make placement-check"
+fi
 echo "  LD_PRELOAD set to: $LD_PRELOAD"
 
 # Memory status before loading
@@ -54,4 +165,7 @@ exec ./server \
     --metrics \
     --no-warmup \
     --mlock \
-    --threads-http "$THREADS_HTTP"
\ No newline at end of file
+    --threads-http "$THREADS_HTTP" \
+    "${SLOT_ARGS[@]}" \
+    "${DRAFT_ARGS[@]}" \
+    "${EXTRA_ARGS_ARRAY[@]}"
\ No newline at end of file
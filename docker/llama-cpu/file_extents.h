@@ -0,0 +1,104 @@
+/*
+ * file_extents.h
+ *
+ * Physical layout of model files (FIEMAP), used by the huge page wrapper to
+ * read a model in the order its blocks sit on the device and by the
+ * model_extents tool to report and repair fragmentation.
+ *
+ * A model downloaded in parallel pieces or written while the volume was
+ * nearly full ends up in many extents scattered over the device. Reading it
+ * in file order then seeks between them; reading the extents sorted by
+ * physical address streams the device front to back. Extents are merged
+ * into runs where the next one continues both the file and the device, since
+ * ext4 reports at most 128MB per extent even on a contiguous file.
+ */
+
+#pragma once
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <linux/fiemap.h>
+#include <linux/fs.h>
+#include <algorithm>
+#include <vector>
+
+#define FIEMAP_BATCH 512
+
+// Part of the file stored contiguously on the device
+struct FileExtent {
+    uint64_t logical;   // File offset
+    uint64_t physical;  // Device offset; 0 if unknown (delayed allocation, inline)
+    uint64_t length;
+    uint32_t flags;     // FIEMAP_EXTENT_*
+};
+
+// Extents of the file range [offset, offset + length) in file order, clipped
+// to the range and merged into runs. Holes have no extent. Returns false with
+// errno set if the filesystem cannot report extents (EOPNOTSUPP on tmpfs,
+// hugetlbfs and most network filesystems).
+static inline bool file_extents(int fd, uint64_t offset, uint64_t length, std::vector<FileExtent>* out) {
+    out->clear();
+    size_t bytes = sizeof(struct fiemap) + FIEMAP_BATCH * sizeof(struct fiemap_extent);
+    struct fiemap* fm = (struct fiemap*)calloc(1, bytes);
+    if (!fm) {
+        errno = ENOMEM;
+        return false;
+    }
+    uint64_t end = offset + length;
+    uint64_t next = offset;
+    bool last = false;
+    while (!last && next < end) {
+        memset(fm, 0, bytes);
+        fm->fm_start = next;
+        fm->fm_length = end - next;
+        fm->fm_extent_count = FIEMAP_BATCH;
+        if (ioctl(fd, FS_IOC_FIEMAP, fm) != 0) {
+            int saved = errno;
+            free(fm);
+            errno = saved == ENOTTY ? EOPNOTSUPP : saved;
+            return false;
+        }
+        if (fm->fm_mapped_extents == 0) {
+            break;
+        }
+        for (uint32_t i = 0; i < fm->fm_mapped_extents; i++) {
+            const struct fiemap_extent& e = fm->fm_extents[i];
+            last = last || (e.fe_flags & FIEMAP_EXTENT_LAST);
+            uint64_t start = std::max<uint64_t>(e.fe_logical, offset);
+            uint64_t stop = std::min<uint64_t>(e.fe_logical + e.fe_length, end);
+            next = std::max<uint64_t>(next, e.fe_logical + e.fe_length);
+            if (start >= stop) {
+                continue;
+            }
+            bool known = !(e.fe_flags & (FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DATA_INLINE));
+            FileExtent x = {start, known ? e.fe_physical + (start - e.fe_logical) : 0, stop - start, e.fe_flags};
+            if (!out->empty()) {
+                FileExtent& prev = out->back();
+                if (x.physical && prev.physical && prev.logical + prev.length == x.logical &&
+                    prev.physical + prev.length == x.physical) {
+                    prev.length += x.length;
+                    prev.flags |= x.flags & FIEMAP_EXTENT_LAST;
+                    continue;
+                }
+            }
+            out->push_back(x);
+        }
+    }
+    free(fm);
+    return true;
+}
+
+// Places where reading the extents in file order moves the device head:
+// the next extent does not start where the previous one ended
+static inline size_t extent_jumps(const std::vector<FileExtent>& extents) {
+    size_t jumps = 0;
+    for (size_t i = 1; i < extents.size(); i++) {
+        if (extents[i].physical != extents[i - 1].physical + extents[i - 1].length) {
+            jumps++;
+        }
+    }
+    return jumps;
+}
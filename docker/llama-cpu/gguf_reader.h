@@ -0,0 +1,375 @@
+/*
+ * gguf_reader.h
+ *
+ * Minimal GGUF header parser shared by the huge page wrapper and tools.
+ *
+ * Reads the metadata key/value section and the tensor index of a GGUF file
+ * with pread(), so it never moves the file offset of a descriptor the
+ * application is also using. Tensor data is never read.
+ */
+
+#pragma once
+
+#include <errno.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <string>
+#include <vector>
+
+#define GGUF_MAGIC 0x46554747u // "GGUF" little-endian
+#define GGUF_DEFAULT_ALIGNMENT 32
+
+// GGUF metadata value types
+enum GGUFValueType {
+    GGUF_TYPE_UINT8 = 0, GGUF_TYPE_INT8 = 1, GGUF_TYPE_UINT16 = 2, GGUF_TYPE_INT16 = 3,
+    GGUF_TYPE_UINT32 = 4, GGUF_TYPE_INT32 = 5, GGUF_TYPE_FLOAT32 = 6, GGUF_TYPE_BOOL = 7,
+    GGUF_TYPE_STRING = 8, GGUF_TYPE_ARRAY = 9, GGUF_TYPE_UINT64 = 10, GGUF_TYPE_INT64 = 11,
+    GGUF_TYPE_FLOAT64 = 12,
+};
+
+struct GGUFTensorInfo {
+    std::string name;
+    uint32_t type;
+    uint32_t n_dims;
+    uint64_t dims[4];
+    uint64_t offset; // Relative to the start of the data section
+    uint64_t size;   // Bytes, from the ggml type table or the next tensor's offset
+};
+
+struct GGUFModel {
+    uint32_t version = 0;
+    std::string architecture;
+    uint64_t alignment = GGUF_DEFAULT_ALIGNMENT;
+    uint64_t data_offset = 0; // Absolute file offset of the tensor data section
+    uint64_t file_size = 0;
+
+    // Hyperparameters used for memory sizing (0 when absent)
+    uint64_t n_layer = 0;
+    uint64_t n_embd = 0;
+    uint64_t n_head = 0;
+    uint64_t n_head_kv = 0; // Maximum over layers when stored per layer
+    uint64_t key_length = 0;
+    uint64_t value_length = 0;
+    uint64_t n_ctx_train = 0;
+    uint64_t n_ff = 0;
+    uint64_t n_expert_used = 0;
+    uint64_t n_ff_expert = 0;
+    uint64_t n_vocab = 0;
+
+    std::vector<GGUFTensorInfo> tensors;
+};
+
+// ggml type -> (block size in elements, block size in bytes); 0 for unknown types
+static inline void gguf_type_block(uint32_t type, uint64_t* elems, uint64_t* bytes) {
+    static const uint16_t table[][2] = {
+        {1, 4},     // 0  F32
+        {1, 2},     // 1  F16
+        {32, 18},   // 2  Q4_0
+        {32, 20},   // 3  Q4_1
+        {0, 0},     // 4  (removed Q4_2)
+        {0, 0},     // 5  (removed Q4_3)
+        {32, 22},   // 6  Q5_0
+        {32, 24},   // 7  Q5_1
+        {32, 34},   // 8  Q8_0
+        {32, 36},   // 9  Q8_1
+        {256, 84},  // 10 Q2_K
+        {256, 110}, // 11 Q3_K
+        {256, 144}, // 12 Q4_K
+        {256, 176}, // 13 Q5_K
+        {256, 210}, // 14 Q6_K
+        {256, 292}, // 15 Q8_K
+        {256, 66},  // 16 IQ2_XXS
+        {256, 74},  // 17 IQ2_XS
+        {256, 98},  // 18 IQ3_XXS
+        {256, 50},  // 19 IQ1_S
+        {32, 18},   // 20 IQ4_NL
+        {256, 110}, // 21 IQ3_S
+        {256, 82},  // 22 IQ2_S
+        {256, 136}, // 23 IQ4_XS
+        {1, 1},     // 24 I8
+        {1, 2},     // 25 I16
+        {1, 4},     // 26 I32
+        {1, 8},     // 27 I64
+        {1, 8},     // 28 F64
+        {256, 56},  // 29 IQ1_M
+        {1, 2},     // 30 BF16
+        {0, 0},     // 31 (removed Q4_0_4_4)
+        {0, 0},     // 32 (removed Q4_0_4_8)
+        {0, 0},     // 33 (removed Q4_0_8_8)
+        {256, 54},  // 34 TQ1_0
+        {256, 66},  // 35 TQ2_0
+        {0, 0},     // 36 (removed IQ4_NL_4_4)
+        {0, 0},     // 37 (removed IQ4_NL_4_8)
+        {0, 0},     // 38 (removed IQ4_NL_8_8)
+        {32, 17},   // 39 MXFP4
+    };
+    if (type < sizeof(table) / sizeof(table[0])) {
+        *elems = table[type][0];
+        *bytes = table[type][1];
+    } else {
+        *elems = 0;
+        *bytes = 0;
+    }
+}
+
+// Buffered sequential reader over pread()
+struct GGUFCursor {
+    int fd;
+    uint64_t pos;
+    uint64_t end;
+    char buf[64 * 1024];
+    uint64_t buf_start;
+    size_t buf_len;
+    bool failed;
+};
+
+static inline bool gguf_cursor_read(GGUFCursor* c, void* out, size_t n) {
+    char* dst = (char*)out;
+    while (n > 0 && !c->failed) {
+        if (c->pos < c->buf_start || c->pos >= c->buf_start + c->buf_len) {
+            if (c->pos >= c->end) {
+                c->failed = true;
+                break;
+            }
+            ssize_t got = pread(c->fd, c->buf, sizeof(c->buf), (off_t)c->pos);
+            if (got < 0 && errno == EINTR) {
+                continue;
+            }
+            if (got <= 0) {
+                c->failed = true;
+                break;
+            }
+            c->buf_start = c->pos;
+            c->buf_len = (size_t)got;
+        }
+        size_t avail = (size_t)(c->buf_start + c->buf_len - c->pos);
+        size_t take = n < avail ? n : avail;
+        memcpy(dst, c->buf + (c->pos - c->buf_start), take);
+        dst += take;
+        c->pos += take;
+        n -= take;
+    }
+    return !c->failed;
+}
+
+static inline uint64_t gguf_cursor_u64(GGUFCursor* c) {
+    uint64_t v = 0;
+    gguf_cursor_read(c, &v, sizeof(v));
+    return v;
+}
+
+static inline uint32_t gguf_cursor_u32(GGUFCursor* c) {
+    uint32_t v = 0;
+    gguf_cursor_read(c, &v, sizeof(v));
+    return v;
+}
+
+static inline bool gguf_cursor_string(GGUFCursor* c, std::string* out) {
+    uint64_t len = gguf_cursor_u64(c);
+    // Keys and strings in real models are far below this; anything larger is corruption
+    if (c->failed || len > (1ULL << 24)) {
+        c->failed = true;
+        return false;
+    }
+    out->resize(len);
+    return gguf_cursor_read(c, &(*out)[0], len);
+}
+
+static inline size_t gguf_scalar_size(uint32_t type) {
+    switch (type) {
+        case GGUF_TYPE_UINT8: case GGUF_TYPE_INT8: case GGUF_TYPE_BOOL: return 1;
+        case GGUF_TYPE_UINT16: case GGUF_TYPE_INT16: return 2;
+        case GGUF_TYPE_UINT32: case GGUF_TYPE_INT32: case GGUF_TYPE_FLOAT32: return 4;
+        case GGUF_TYPE_UINT64: case GGUF_TYPE_INT64: case GGUF_TYPE_FLOAT64: return 8;
+        default: return 0;
+    }
+}
+
+// Read an integer scalar of any integer type; returns false for non-integers
+static inline bool gguf_cursor_int(GGUFCursor* c, uint32_t type, uint64_t* out) {
+    size_t size = gguf_scalar_size(type);
+    if (size == 0 || type == GGUF_TYPE_FLOAT32 || type == GGUF_TYPE_FLOAT64) {
+        return false;
+    }
+    uint64_t v = 0;
+    gguf_cursor_read(c, &v, size);
+    *out = v;
+    return true;
+}
+
+// Skip (or, for integer arrays, reduce to their maximum) a metadata value
+static inline void gguf_cursor_value(GGUFCursor* c, uint32_t type, uint64_t* int_out, bool* has_int,
+                                     std::string* str_out, uint64_t* array_len) {
+    *has_int = false;
+    if (type == GGUF_TYPE_STRING) {
+        std::string tmp;
+        gguf_cursor_string(c, str_out ? str_out : &tmp);
+        return;
+    }
+    if (type == GGUF_TYPE_ARRAY) {
+        uint32_t item_type = gguf_cursor_u32(c);
+        uint64_t count = gguf_cursor_u64(c);
+        if (array_len) *array_len = count;
+        if (item_type == GGUF_TYPE_STRING) {
+            std::string tmp;
+            for (uint64_t i = 0; i < count && !c->failed; i++) {
+                gguf_cursor_string(c, &tmp);
+            }
+            return;
+        }
+        size_t size = gguf_scalar_size(item_type);
+        if (size == 0) {
+            c->failed = true; // Nested arrays do not occur in model files
+            return;
+        }
+        uint64_t max_v = 0;
+        for (uint64_t i = 0; i < count && !c->failed; i++) {
+            uint64_t v = 0;
+            if (gguf_cursor_int(c, item_type, &v)) {
+                if (v > max_v) max_v = v;
+                *has_int = true;
+            } else {
+                c->pos += size;
+            }
+        }
+        *int_out = max_v;
+        return;
+    }
+    if (gguf_cursor_int(c, type, int_out)) {
+        *has_int = true;
+        return;
+    }
+    size_t size = gguf_scalar_size(type);
+    if (size == 0) {
+        c->failed = true;
+        return;
+    }
+    c->pos += size;
+}
+
+// Map "<arch>.<suffix>" keys onto the hyperparameter fields
+static inline void gguf_assign_hparam(GGUFModel* m, const std::string& key, uint64_t v) {
+    const std::string& a = m->architecture;
+    if (a.empty() || key.compare(0, a.size() + 1, a + ".") != 0) {
+        return;
+    }
+    const char* k = key.c_str() + a.size() + 1;
+    if (strcmp(k, "block_count") == 0) m->n_layer = v;
+    else if (strcmp(k, "embedding_length") == 0) m->n_embd = v;
+    else if (strcmp(k, "attention.head_count") == 0) m->n_head = v;
+    else if (strcmp(k, "attention.head_count_kv") == 0) m->n_head_kv = v;
+    else if (strcmp(k, "attention.key_length") == 0) m->key_length = v;
+    else if (strcmp(k, "attention.value_length") == 0) m->value_length = v;
+    else if (strcmp(k, "context_length") == 0) m->n_ctx_train = v;
+    else if (strcmp(k, "feed_forward_length") == 0) m->n_ff = v;
+    else if (strcmp(k, "expert_used_count") == 0) m->n_expert_used = v;
+    else if (strcmp(k, "expert_feed_forward_length") == 0) m->n_ff_expert = v;
+    else if (strcmp(k, "vocab_size") == 0) m->n_vocab = v;
+}
+
+// Parse the GGUF header of an open file. On failure returns false and sets *error.
+static inline bool gguf_read(int fd, GGUFModel* m, std::string* error) {
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        *error = "fstat failed";
+        return false;
+    }
+
+    GGUFCursor* c = new GGUFCursor();
+    c->fd = fd;
+    c->pos = 0;
+    c->end = (uint64_t)st.st_size;
+    c->buf_start = 0;
+    c->buf_len = 0;
+    c->failed = false;
+    m->file_size = (uint64_t)st.st_size;
+
+    bool ok = false;
+    do {
+        if (gguf_cursor_u32(c) != GGUF_MAGIC) {
+            *error = "not a GGUF file";
+            break;
+        }
+        m->version = gguf_cursor_u32(c);
+        if (m->version < 2) {
+            *error = "unsupported GGUF version";
+            break;
+        }
+        uint64_t n_tensors = gguf_cursor_u64(c);
+        uint64_t n_kv = gguf_cursor_u64(c);
+
+        std::string key;
+        for (uint64_t i = 0; i < n_kv && !c->failed; i++) {
+            gguf_cursor_string(c, &key);
+            uint32_t type = gguf_cursor_u32(c);
+            uint64_t int_v = 0, array_len = 0;
+            bool has_int = false;
+            std::string str_v;
+            gguf_cursor_value(c, type, &int_v, &has_int, &str_v, &array_len);
+
+            if (key == "general.architecture") {
+                m->architecture = str_v;
+            } else if (key == "general.alignment" && has_int && int_v > 0) {
+                m->alignment = int_v;
+            } else if (key == "tokenizer.ggml.tokens") {
+                if (m->n_vocab == 0) m->n_vocab = array_len;
+            } else if (has_int) {
+                gguf_assign_hparam(m, key, int_v);
+            }
+        }
+        if (c->failed) {
+            *error = "truncated metadata section";
+            break;
+        }
+
+        m->tensors.reserve(n_tensors);
+        for (uint64_t i = 0; i < n_tensors && !c->failed; i++) {
+            GGUFTensorInfo t;
+            gguf_cursor_string(c, &t.name);
+            t.n_dims = gguf_cursor_u32(c);
+            if (t.n_dims > 4) {
+                c->failed = true;
+                break;
+            }
+            uint64_t n_elems = 1;
+            for (uint32_t d = 0; d < 4; d++) {
+                t.dims[d] = d < t.n_dims ? gguf_cursor_u64(c) : 1;
+                n_elems *= t.dims[d];
+            }
+            t.type = gguf_cursor_u32(c);
+            t.offset = gguf_cursor_u64(c);
+
+            uint64_t block_elems, block_bytes;
+            gguf_type_block(t.type, &block_elems, &block_bytes);
+            t.size = block_elems ? n_elems / block_elems * block_bytes : 0;
+            m->tensors.push_back(t);
+        }
+        if (c->failed) {
+            *error = "truncated tensor index";
+            break;
+        }
+
+        m->data_offset = (c->pos + m->alignment - 1) / m->alignment * m->alignment;
+
+        // Types missing from the table are sized by the gap to the next tensor
+        for (size_t i = 0; i < m->tensors.size(); i++) {
+            if (m->tensors[i].size != 0) continue;
+            uint64_t next = m->file_size - m->data_offset;
+            for (size_t j = 0; j < m->tensors.size(); j++) {
+                uint64_t o = m->tensors[j].offset;
+                if (o > m->tensors[i].offset && o < next) next = o;
+            }
+            m->tensors[i].size = next - m->tensors[i].offset;
+        }
+
+        if (m->key_length == 0 && m->n_head > 0) m->key_length = m->n_embd / m->n_head;
+        if (m->value_length == 0) m->value_length = m->key_length;
+        if (m->n_head_kv == 0) m->n_head_kv = m->n_head;
+        ok = true;
+    } while (0);
+
+    delete c;
+    return ok;
+}
@@ -0,0 +1,703 @@
+/*
+ * hugepage_arena.cpp
+ *
+ * LD_PRELOAD allocator layer giving llama-server's HTTP threads per-thread
+ * staging arenas in huge pages.
+ *
+ * With long prompts, request JSON parsing, tokenization and response
+ * serialization on the HTTP threads (--threads-http) make large short-lived
+ * allocations. glibc serves those above its mmap threshold with a fresh
+ * mmap/munmap pair each time, so every request faults its buffers in page by
+ * page and takes the process's mmap lock, which the compute threads need for
+ * their own faults. This library hands selected threads a private arena
+ * instead:
+ * 1. Threads are selected (HUGEPAGE_ARENA_THREADS) by the library that
+ *    created them, "site:libstdc++" matching std::thread, which cpp-httplib's
+ *    pool and llama-server's listener use while ggml's OpenMP workers come
+ *    from libgomp, or by the name a thread gives itself ("name:PREFIX")
+ * 2. A selected thread's first allocation of at least HUGEPAGE_ARENA_MIN_KB
+ *    maps its arena (HUGEPAGE_ARENA_MB) with MAP_HUGETLB, or THP-advised
+ *    memory if the pool is empty, and faults all of it in at once
+ * 3. From then on that thread's allocations of at least HUGEPAGE_ARENA_MIN_KB
+ *    are bumped off the arena. A free pops the top block and any freed blocks
+ *    under it, and when the last live block is freed (the end of a request)
+ *    the arena starts over. Blocks that outlive their request (handed to
+ *    another thread, cached) keep it from starting over and strand the freed
+ *    space under them; once the arena is full and its live blocks hold less
+ *    than half of it, the thread moves on to a fresh arena and the old one is
+ *    released with its last block
+ * 4. Allocations the arena cannot hold, smaller ones and those of all other
+ *    threads go to glibc
+ *
+ * The arenas are slots of one reserved address range, so free() tells an
+ * arena block from a glibc one with a single compare, and nothing takes a
+ * lock: only the owner allocates from an arena, and other threads freeing its
+ * blocks mark them and drop its live count atomically. An arena whose thread
+ * exits is released when its last block is freed.
+ *
+ * Usage is logged at exit and, if HUGEPAGE_ARENA_METRICS names a file,
+ * written there in Prometheus text format, at most once a second as arenas
+ * reset.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <dlfcn.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0x100000
+#endif
+
+#define ARENA_PAGE (2UL * 1024 * 1024)
+#define ARENA_MAP_HUGE_2MB (21 << MAP_HUGE_SHIFT)
+#define ARENA_ALIGN 16
+#define ARENA_MAX_ALIGN 4096
+#define MAX_ARENAS 64
+#define MAX_RULES 8
+#define NO_BLOCK UINT32_MAX
+
+#define DEFAULT_THREADS "site:libstdc++"
+#define DEFAULT_ARENA_MB 32
+#define DEFAULT_MIN_KB 16
+#define DEFAULT_ARENAS 16
+#define METRICS_INTERVAL_NS 1000000000ULL
+
+// glibc's allocator, which the interposed functions fall back to
+extern "C" {
+void* __libc_malloc(size_t);
+void __libc_free(void*);
+void* __libc_calloc(size_t, size_t);
+void* __libc_realloc(void*, size_t);
+void* __libc_memalign(size_t, size_t);
+}
+
+typedef void* (*mmap_fn)(void*, size_t, int, int, int, off_t);
+typedef int (*munmap_fn)(void*, size_t);
+typedef size_t (*usable_size_fn)(void*);
+typedef int (*pthread_create_fn)(pthread_t*, const pthread_attr_t*, void* (*)(void*), void*);
+typedef int (*setname_fn)(pthread_t, const char*);
+
+static mmap_fn real_mmap = nullptr;
+static munmap_fn real_munmap = nullptr;
+static usable_size_fn real_usable_size = nullptr;
+static pthread_create_fn real_pthread_create = nullptr;
+static setname_fn real_setname = nullptr;
+
+// Header in front of every arena block
+struct Block {
+    uint32_t start;   // Arena offset the block was bumped from, alignment padding included
+    uint32_t prev;    // Offset of the previous block's header, NO_BLOCK for the first
+    uint32_t size;    // Bytes requested
+    uint32_t freed;   // Set by whichever thread frees it
+};
+static_assert(sizeof(Block) == ARENA_ALIGN, "headers keep blocks aligned");
+
+enum SlotState { SLOT_FREE = 0, SLOT_OWNED, SLOT_ORPHANED, SLOT_LOST };
+enum Backing { BACKING_HUGETLB = 0, BACKING_THP, BACKING_COUNT };
+static const char* const backing_names[] = {"hugetlb", "thp"};
+
+struct Arena {
+    char* base;
+    uint32_t state;        // SlotState, atomic
+    uint32_t backing;      // Backing
+    uint64_t live;         // Blocks not freed yet, atomic
+    uint64_t live_bytes;   // Their requested sizes, atomic
+    // Owner thread only
+    uint32_t bump;         // End of the last block
+    uint32_t top;          // Header offset of the last block
+    pid_t tid;
+    // Counters, written by the owner and read relaxed by the metrics writer
+    uint64_t allocations;
+    uint64_t bytes;
+    uint64_t resets;
+    uint64_t full;         // Allocations that did not fit
+    uint64_t rotations;    // Times its thread moved on to a fresh arena
+    uint64_t peak;         // Highest bump
+};
+
+// How a thread allocates
+enum ThreadMode { MODE_GLIBC = 0, MODE_SELECTED, MODE_ACTIVE, MODE_DONE };
+
+#define TLS __thread __attribute__((tls_model("initial-exec")))
+static TLS int tl_mode = MODE_GLIBC;
+static TLS Arena* tl_arena = nullptr;
+static TLS bool tl_in_metrics = false;
+
+// Configuration and the reserved range, set in init() before threads exist
+static char site_rules[MAX_RULES][64];
+static char name_rules[MAX_RULES][16];
+static int site_rule_count = 0, name_rule_count = 0;
+static size_t arena_bytes = 0;
+static size_t min_bytes = 0;
+static size_t arena_count = 0;
+static uintptr_t region = 0;
+static size_t region_bytes = 0;
+static const char* metrics_path = nullptr;
+static pthread_key_t exit_key;
+
+static Arena arenas[MAX_ARENAS];
+static uint64_t arenas_created = 0;        // atomic
+static uint64_t no_arena_allocations = 0;  // Selected threads that could not get an arena, atomic
+static uint64_t metrics_written_ns = 0;     // atomic
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static size_t env_size(const char* name, size_t fallback) {
+    const char* env = getenv(name);
+    if (!env || !*env) {
+        return fallback;
+    }
+    char* end = nullptr;
+    unsigned long long v = strtoull(env, &end, 10);
+    return end != env && *end == '\0' ? (size_t)v : fallback;
+}
+
+static bool is_arena_pointer(const void* p) {
+    return (uintptr_t)p - region < region_bytes;
+}
+
+static Block* block_at(const Arena* a, uint32_t offset) {
+    return (Block*)(a->base + offset);
+}
+
+static Block* header_of(const void* p) {
+    return (Block*)p - 1;
+}
+
+static Arena* arena_of(const void* p) {
+    return &arenas[((uintptr_t)p - region) / arena_bytes];
+}
+
+// --- Metrics -----------------------------------------------------------------
+
+static void write_metrics() {
+    if (!metrics_path) {
+        return;
+    }
+    uint64_t arenas_by_backing[BACKING_COUNT] = {};
+    uint64_t allocations = 0, bytes = 0, resets = 0, full = 0, rotations = 0, peak = 0;
+    for (size_t i = 0; i < arena_count; i++) {
+        const Arena* a = &arenas[i];
+        uint32_t state = __atomic_load_n(&a->state, __ATOMIC_ACQUIRE);
+        if (state == SLOT_OWNED || state == SLOT_ORPHANED) {
+            arenas_by_backing[a->backing]++;
+        }
+        allocations += __atomic_load_n(&a->allocations, __ATOMIC_RELAXED);
+        bytes += __atomic_load_n(&a->bytes, __ATOMIC_RELAXED);
+        resets += __atomic_load_n(&a->resets, __ATOMIC_RELAXED);
+        full += __atomic_load_n(&a->full, __ATOMIC_RELAXED);
+        rotations += __atomic_load_n(&a->rotations, __ATOMIC_RELAXED);
+        peak = std::max(peak, (uint64_t)__atomic_load_n(&a->peak, __ATOMIC_RELAXED));
+    }
+
+    char tmp[1024];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", metrics_path);
+    FILE* f = fopen(tmp, "w");
+    if (!f) {
+        return;
+    }
+    fprintf(f, "# HELP hugepage_arena_arenas Staging arenas in use by backing memory\n");
+    fprintf(f, "# TYPE hugepage_arena_arenas gauge\n");
+    for (int i = 0; i < BACKING_COUNT; i++) {
+        fprintf(f, "hugepage_arena_arenas{backing=\"%s\"} %llu\n", backing_names[i],
+                (unsigned long long)arenas_by_backing[i]);
+    }
+    fprintf(f, "# HELP hugepage_arena_created_total Arenas mapped for selected threads\n");
+    fprintf(f, "# TYPE hugepage_arena_created_total counter\n");
+    fprintf(f, "hugepage_arena_created_total %llu\n",
+            (unsigned long long)__atomic_load_n(&arenas_created, __ATOMIC_RELAXED));
+    fprintf(f, "# HELP hugepage_arena_allocations_total Allocations served from arenas\n");
+    fprintf(f, "# TYPE hugepage_arena_allocations_total counter\n");
+    fprintf(f, "hugepage_arena_allocations_total %llu\n", (unsigned long long)allocations);
+    fprintf(f, "# HELP hugepage_arena_bytes_total Bytes served from arenas\n");
+    fprintf(f, "# TYPE hugepage_arena_bytes_total counter\n");
+    fprintf(f, "hugepage_arena_bytes_total %llu\n", (unsigned long long)bytes);
+    fprintf(f, "# HELP hugepage_arena_resets_total Times an arena emptied and started over\n");
+    fprintf(f, "# TYPE hugepage_arena_resets_total counter\n");
+    fprintf(f, "hugepage_arena_resets_total %llu\n", (unsigned long long)resets);
+    fprintf(f, "# HELP hugepage_arena_rotations_total Times a thread left an arena pinned by long-lived blocks\n");
+    fprintf(f, "# TYPE hugepage_arena_rotations_total counter\n");
+    fprintf(f, "hugepage_arena_rotations_total %llu\n", (unsigned long long)rotations);
+    fprintf(f, "# HELP hugepage_arena_fallbacks_total Allocations of selected threads passed to glibc\n");
+    fprintf(f, "# TYPE hugepage_arena_fallbacks_total counter\n");
+    fprintf(f, "hugepage_arena_fallbacks_total{reason=\"full\"} %llu\n", (unsigned long long)full);
+    fprintf(f, "hugepage_arena_fallbacks_total{reason=\"no_arena\"} %llu\n",
+            (unsigned long long)__atomic_load_n(&no_arena_allocations, __ATOMIC_RELAXED));
+    fprintf(f, "# HELP hugepage_arena_peak_bytes Most bytes one arena held at once\n");
+    fprintf(f, "# TYPE hugepage_arena_peak_bytes gauge\n");
+    fprintf(f, "hugepage_arena_peak_bytes %llu\n", (unsigned long long)peak);
+    fprintf(f, "# HELP hugepage_arena_size_bytes Size of each arena\n");
+    fprintf(f, "# TYPE hugepage_arena_size_bytes gauge\n");
+    fprintf(f, "hugepage_arena_size_bytes %zu\n", arena_bytes);
+    fclose(f);
+    rename(tmp, metrics_path);
+}
+
+static void maybe_write_metrics() {
+    if (!metrics_path || tl_in_metrics) {
+        return;
+    }
+    uint64_t now = now_ns();
+    uint64_t last = __atomic_load_n(&metrics_written_ns, __ATOMIC_RELAXED);
+    if (now - last < METRICS_INTERVAL_NS ||
+        !__atomic_compare_exchange_n(&metrics_written_ns, &last, now, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        return;
+    }
+    tl_in_metrics = true;
+    write_metrics();
+    tl_in_metrics = false;
+}
+
+// --- Arenas ------------------------------------------------------------------
+
+// Give the slot's memory back, keeping its address range reserved
+static void arena_release(Arena* a) {
+    real_munmap(a->base, arena_bytes);
+    void* p = real_mmap(a->base, arena_bytes, PROT_NONE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED_NOREPLACE, -1, 0);
+    if (p != a->base) {
+        // Something else was mapped into the gap; never use this slot again
+        if (p != MAP_FAILED) {
+            real_munmap(p, arena_bytes);
+        }
+        __atomic_store_n(&a->state, SLOT_LOST, __ATOMIC_RELEASE);
+        return;
+    }
+    __atomic_store_n(&a->state, SLOT_FREE, __ATOMIC_RELEASE);
+}
+
+// The arena's thread exited, or its last block was freed after that
+static void arena_orphan_done(Arena* a) {
+    uint32_t expected = SLOT_ORPHANED;
+    if (__atomic_load_n(&a->live, __ATOMIC_ACQUIRE) == 0 &&
+        __atomic_compare_exchange_n(&a->state, &expected, SLOT_LOST, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+        arena_release(a);
+    }
+}
+
+static void thread_exit(void* arg) {
+    Arena* a = (Arena*)arg;
+    tl_mode = MODE_DONE;
+    tl_arena = nullptr;
+    __atomic_store_n(&a->state, SLOT_ORPHANED, __ATOMIC_RELEASE);
+    arena_orphan_done(a);
+}
+
+// Claim a slot, back it with huge pages and fault it in
+static Arena* arena_create() {
+    Arena* a = nullptr;
+    for (size_t i = 0; i < arena_count && !a; i++) {
+        uint32_t expected = SLOT_FREE;
+        if (__atomic_compare_exchange_n(&arenas[i].state, &expected, SLOT_OWNED, false, __ATOMIC_ACQ_REL,
+                                        __ATOMIC_RELAXED)) {
+            a = &arenas[i];
+        }
+    }
+    if (!a) {
+        return nullptr;
+    }
+
+    a->backing = BACKING_HUGETLB;
+    void* p = real_mmap(a->base, arena_bytes, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_HUGETLB | ARENA_MAP_HUGE_2MB, -1, 0);
+    if (p == MAP_FAILED) {
+        // An empty pool: transparent huge pages where the kernel has them
+        a->backing = BACKING_THP;
+        p = real_mmap(a->base, arena_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+        if (p == MAP_FAILED) {
+            fprintf(stderr, "WARNING: hugepage_arena: Cannot map an arena: %s\n", strerror(errno));
+            arena_release(a);
+            return nullptr;
+        }
+        madvise(p, arena_bytes, MADV_HUGEPAGE);
+    }
+    // Fault the arena in now so requests never do
+    for (size_t off = 0; off < arena_bytes; off += 4096) {
+        ((volatile char*)p)[off] = 0;
+    }
+
+    a->bump = 0;
+    a->top = NO_BLOCK;
+    a->tid = (pid_t)syscall(SYS_gettid);
+    __atomic_store_n(&a->live, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&a->live_bytes, 0, __ATOMIC_RELAXED);
+    pthread_setspecific(exit_key, a);
+    __atomic_fetch_add(&arenas_created, 1, __ATOMIC_RELAXED);
+    fprintf(stderr, "hugepage_arena: Thread %d: %zu MB arena (%s)\n", a->tid, arena_bytes >> 20,
+            backing_names[a->backing]);
+    return a;
+}
+
+static void arena_reset(Arena* a) {
+    a->bump = 0;
+    a->top = NO_BLOCK;
+    __atomic_store_n(&a->resets, a->resets + 1, __ATOMIC_RELAXED);
+    maybe_write_metrics();
+}
+
+// Pop freed blocks off the top, or start over if nothing is live (owner only)
+static void arena_trim(Arena* a) {
+    if (__atomic_load_n(&a->live, __ATOMIC_ACQUIRE) == 0) {
+        if (a->bump != 0) {
+            arena_reset(a);
+        }
+        return;
+    }
+    while (a->top != NO_BLOCK) {
+        Block* b = block_at(a, a->top);
+        if (!__atomic_load_n(&b->freed, __ATOMIC_ACQUIRE)) {
+            break;
+        }
+        a->bump = b->start;
+        a->top = b->prev;
+    }
+}
+
+// Where a block would go above the bump; false if it does not fit
+static bool arena_fit(const Arena* a, size_t size, size_t align, size_t* user, size_t* end) {
+    *user = (a->bump + sizeof(Block) + align - 1) & ~(align - 1);
+    *end = (*user + size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    return size <= arena_bytes && *end <= arena_bytes;
+}
+
+// Move the calling thread to a fresh arena when the full one is mostly freed
+// space stranded under long-lived blocks; nullptr if it is not or no slot is
+// free. The old arena is released with its last block.
+static Arena* arena_rotate(Arena* a, size_t size) {
+    if ((__atomic_load_n(&a->live_bytes, __ATOMIC_ACQUIRE) + size) * 2 > arena_bytes) {
+        return nullptr;
+    }
+    Arena* fresh = arena_create();
+    if (!fresh) {
+        return nullptr;
+    }
+    __atomic_store_n(&a->rotations, a->rotations + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&a->state, SLOT_ORPHANED, __ATOMIC_RELEASE);
+    arena_orphan_done(a);
+    tl_arena = fresh;
+    return fresh;
+}
+
+// Block from the calling thread's arena, nullptr to use glibc
+static void* arena_alloc(size_t size, size_t align) {
+    if (tl_mode == MODE_SELECTED) {
+        tl_arena = arena_create();
+        tl_mode = tl_arena ? MODE_ACTIVE : MODE_DONE;
+        if (!tl_arena) {
+            __atomic_fetch_add(&no_arena_allocations, 1, __ATOMIC_RELAXED);
+            return nullptr;
+        }
+    }
+    Arena* a = tl_arena;
+    arena_trim(a);
+    size_t user, end;
+    if (!arena_fit(a, size, align, &user, &end)) {
+        Arena* fresh = arena_rotate(a, size);
+        if (!fresh || !arena_fit(fresh, size, align, &user, &end)) {
+            __atomic_store_n(&a->full, a->full + 1, __ATOMIC_RELAXED);
+            return nullptr;
+        }
+        a = fresh;
+    }
+    Block* b = (Block*)(a->base + user) - 1;
+    b->start = a->bump;
+    b->prev = a->top;
+    b->size = (uint32_t)size;
+    b->freed = 0;
+    a->top = (uint32_t)((char*)b - a->base);
+    a->bump = (uint32_t)end;
+    __atomic_fetch_add(&a->live, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&a->live_bytes, size, __ATOMIC_RELAXED);
+    __atomic_store_n(&a->allocations, a->allocations + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&a->bytes, a->bytes + size, __ATOMIC_RELAXED);
+    if (end > a->peak) {
+        __atomic_store_n(&a->peak, end, __ATOMIC_RELAXED);
+    }
+    return a->base + user;
+}
+
+static void arena_free(void* p) {
+    Arena* a = arena_of(p);
+    // The owner may reuse the block as soon as it is marked, so read its size first
+    __atomic_fetch_sub(&a->live_bytes, header_of(p)->size, __ATOMIC_RELAXED);
+    __atomic_store_n(&header_of(p)->freed, 1, __ATOMIC_RELEASE);
+    uint64_t live = __atomic_sub_fetch(&a->live, 1, __ATOMIC_ACQ_REL);
+    if (a == tl_arena) {
+        arena_trim(a);
+    } else if (live == 0) {
+        arena_orphan_done(a);
+    }
+}
+
+static bool wants_arena(size_t size) {
+    return tl_mode != MODE_GLIBC && tl_mode != MODE_DONE && size >= min_bytes;
+}
+
+// --- Thread selection --------------------------------------------------------
+
+struct ThreadStart {
+    void* (*start)(void*);
+    void* arg;
+    bool selected;
+};
+
+static void* thread_trampoline(void* arg) {
+    ThreadStart s = *(ThreadStart*)arg;
+    __libc_free(arg);
+    if (s.selected) {
+        tl_mode = MODE_SELECTED;
+    }
+    return s.start(s.arg);
+}
+
+static bool site_selected(const void* caller) {
+    Dl_info info;
+    if (site_rule_count == 0 || !dladdr(caller, &info) || !info.dli_fname) {
+        return false;
+    }
+    for (int i = 0; i < site_rule_count; i++) {
+        if (strstr(info.dli_fname, site_rules[i])) {
+            return true;
+        }
+    }
+    return false;
+}
+
+extern "C" int pthread_create(pthread_t* thread, const pthread_attr_t* attr, void* (*start)(void*), void* arg) {
+    if (!real_pthread_create) {
+        real_pthread_create = (pthread_create_fn)dlsym(RTLD_NEXT, "pthread_create");
+    }
+    if (arena_count == 0 || !site_selected(__builtin_return_address(0))) {
+        return real_pthread_create(thread, attr, start, arg);
+    }
+    ThreadStart* s = (ThreadStart*)__libc_malloc(sizeof(ThreadStart));
+    if (!s) {
+        return EAGAIN;
+    }
+    *s = {start, arg, true};
+    int rc = real_pthread_create(thread, attr, thread_trampoline, s);
+    if (rc != 0) {
+        __libc_free(s);
+    }
+    return rc;
+}
+
+extern "C" int pthread_setname_np(pthread_t thread, const char* name) {
+    if (!real_setname) {
+        real_setname = (setname_fn)dlsym(RTLD_NEXT, "pthread_setname_np");
+    }
+    // Another thread's mode cannot be set from here, so only self-naming counts
+    if (arena_count > 0 && tl_mode == MODE_GLIBC && pthread_equal(thread, pthread_self())) {
+        for (int i = 0; i < name_rule_count; i++) {
+            if (strncmp(name, name_rules[i], strlen(name_rules[i])) == 0) {
+                tl_mode = MODE_SELECTED;
+                break;
+            }
+        }
+    }
+    return real_setname ? real_setname(thread, name) : ENOSYS;
+}
+
+// --- Allocator ---------------------------------------------------------------
+
+extern "C" void* malloc(size_t size) {
+    if (wants_arena(size)) {
+        void* p = arena_alloc(size, ARENA_ALIGN);
+        if (p) return p;
+    }
+    return __libc_malloc(size);
+}
+
+extern "C" void free(void* p) {
+    if (is_arena_pointer(p)) {
+        arena_free(p);
+        return;
+    }
+    __libc_free(p);
+}
+
+extern "C" void* calloc(size_t count, size_t size) {
+    size_t total;
+    if (__builtin_mul_overflow(count, size, &total)) {
+        errno = ENOMEM;
+        return nullptr;
+    }
+    if (wants_arena(total)) {
+        void* p = arena_alloc(total, ARENA_ALIGN);
+        if (p) return memset(p, 0, total);
+    }
+    return __libc_calloc(count, size);
+}
+
+extern "C" void* realloc(void* p, size_t size) {
+    if (!is_arena_pointer(p)) {
+        return __libc_realloc(p, size);
+    }
+    if (size == 0) {
+        arena_free(p);
+        return nullptr;
+    }
+    Arena* a = arena_of(p);
+    Block* b = header_of(p);
+    size_t user = (char*)p - a->base;
+    size_t end = (user + size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    if (a == tl_arena && a->top == (uint32_t)((char*)b - a->base) && end <= arena_bytes) {
+        // The top block grows or shrinks in place
+        __atomic_fetch_add(&a->live_bytes, size - b->size, __ATOMIC_RELAXED);
+        b->size = (uint32_t)size;
+        a->bump = (uint32_t)end;
+        if (end > a->peak) {
+            __atomic_store_n(&a->peak, end, __ATOMIC_RELAXED);
+        }
+        return p;
+    }
+    if (size <= b->size) {
+        __atomic_fetch_sub(&a->live_bytes, b->size - size, __ATOMIC_RELAXED);
+        b->size = (uint32_t)size;
+        return p;
+    }
+    void* q = malloc(size);
+    if (q) {
+        memcpy(q, p, b->size);
+        arena_free(p);
+    }
+    return q;
+}
+
+extern "C" void* memalign(size_t align, size_t size) {
+    if (align <= ARENA_MAX_ALIGN && (align & (align - 1)) == 0 && wants_arena(size)) {
+        void* p = arena_alloc(size, std::max(align, (size_t)ARENA_ALIGN));
+        if (p) return p;
+    }
+    return __libc_memalign(align, size);
+}
+
+extern "C" int posix_memalign(void** out, size_t align, size_t size) {
+    if (align < sizeof(void*) || (align & (align - 1)) != 0) {
+        return EINVAL;
+    }
+    void* p = memalign(align, size);
+    if (!p) {
+        return ENOMEM;
+    }
+    *out = p;
+    return 0;
+}
+
+extern "C" void* aligned_alloc(size_t align, size_t size) {
+    return memalign(align, size);
+}
+
+// Whether p is an arena block, for the conformance suite and debugging
+extern "C" int hugepage_arena_owns(const void* p) {
+    return is_arena_pointer(p);
+}
+
+extern "C" size_t malloc_usable_size(void* p) {
+    if (is_arena_pointer(p)) {
+        return header_of(p)->size;
+    }
+    return p && real_usable_size ? real_usable_size(p) : 0;
+}
+
+// --- Setup -------------------------------------------------------------------
+
+static void parse_rules(const char* spec) {
+    char buf[512];
+    snprintf(buf, sizeof(buf), "%s", spec);
+    char* save = nullptr;
+    for (char* rule = strtok_r(buf, ",", &save); rule; rule = strtok_r(nullptr, ",", &save)) {
+        if (strncmp(rule, "site:", 5) == 0 && rule[5] && site_rule_count < MAX_RULES) {
+            snprintf(site_rules[site_rule_count++], sizeof(site_rules[0]), "%s", rule + 5);
+        } else if (strncmp(rule, "name:", 5) == 0 && rule[5] && name_rule_count < MAX_RULES) {
+            snprintf(name_rules[name_rule_count++], sizeof(name_rules[0]), "%s", rule + 5);
+        } else {
+            fprintf(stderr, "WARNING: hugepage_arena: Ignoring thread rule \"%s\" (site:LIBRARY or name:PREFIX)\n",
+                    rule);
+        }
+    }
+}
+
+__attribute__((constructor))
+static void init() {
+    real_mmap = (mmap_fn)dlsym(RTLD_NEXT, "mmap");
+    real_munmap = (munmap_fn)dlsym(RTLD_NEXT, "munmap");
+    real_usable_size = (usable_size_fn)dlsym(RTLD_NEXT, "malloc_usable_size");
+    real_pthread_create = (pthread_create_fn)dlsym(RTLD_NEXT, "pthread_create");
+    real_setname = (setname_fn)dlsym(RTLD_NEXT, "pthread_setname_np");
+    if (!real_mmap || !real_munmap || !real_pthread_create) {
+        fprintf(stderr, "WARNING: hugepage_arena: Cannot resolve mmap/pthread_create, arenas disabled\n");
+        return;
+    }
+
+    const char* threads = getenv("HUGEPAGE_ARENA_THREADS");
+    parse_rules(threads ? threads : DEFAULT_THREADS);
+    size_t mb = env_size("HUGEPAGE_ARENA_MB", DEFAULT_ARENA_MB);
+    size_t count = std::min(env_size("HUGEPAGE_ARENA_MAX", DEFAULT_ARENAS), (size_t)MAX_ARENAS);
+    if (site_rule_count + name_rule_count == 0 || mb == 0 || count == 0) {
+        return;
+    }
+    // Whole 2MB pages, and block offsets fit 32 bits
+    size_t bytes = (std::min(mb, (size_t)2048) * 1024 * 1024 + ARENA_PAGE - 1) & ~(ARENA_PAGE - 1);
+    min_bytes = std::max(env_size("HUGEPAGE_ARENA_MIN_KB", DEFAULT_MIN_KB) * 1024, (size_t)1);
+    const char* metrics = getenv("HUGEPAGE_ARENA_METRICS");
+    metrics_path = metrics && *metrics ? metrics : nullptr;
+
+    // One reserved range for all slots, aligned to the huge page size
+    size_t reserve = count * bytes + ARENA_PAGE;
+    void* p = real_mmap(nullptr, reserve, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (p == MAP_FAILED || pthread_key_create(&exit_key, thread_exit) != 0) {
+        fprintf(stderr, "WARNING: hugepage_arena: Cannot reserve %zu MB for arenas, disabled\n", reserve >> 20);
+        return;
+    }
+    uintptr_t start = ((uintptr_t)p + ARENA_PAGE - 1) & ~(ARENA_PAGE - 1);
+    if (start > (uintptr_t)p) {
+        real_munmap(p, start - (uintptr_t)p);
+    }
+    real_munmap((void*)(start + count * bytes), (uintptr_t)p + reserve - (start + count * bytes));
+    for (size_t i = 0; i < count; i++) {
+        arenas[i].base = (char*)start + i * bytes;
+    }
+    arena_bytes = bytes;
+    region = start;
+    region_bytes = count * bytes;
+    arena_count = count;  // Enables selection; set last
+}
+
+__attribute__((destructor))
+static void fini() {
+    uint64_t allocations = 0, bytes = 0, resets = 0, full = 0, rotations = 0;
+    for (size_t i = 0; i < arena_count; i++) {
+        allocations += arenas[i].allocations;
+        bytes += arenas[i].bytes;
+        resets += arenas[i].resets;
+        full += arenas[i].full;
+        rotations += arenas[i].rotations;
+    }
+    if (arenas_created) {
+        fprintf(stderr, "hugepage_arena: %llu arena(s) served %llu allocations (%.2f GB), %llu resets, "
+                "%llu rotations, %llu too large for the arena\n", (unsigned long long)arenas_created,
+                (unsigned long long)allocations, bytes / 1e9, (unsigned long long)resets,
+                (unsigned long long)rotations, (unsigned long long)full);
+        write_metrics();
+    }
+}
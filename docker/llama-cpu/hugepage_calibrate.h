@@ -0,0 +1,160 @@
+/*
+ * hugepage_calibrate.h
+ *
+ * Host measurements behind the huge page wrapper's startup calibration
+ * (HUGEPAGE_WRAPPER_CALIBRATE). The same image runs on hosts with different
+ * disks and pool configurations, so instead of one static policy the wrapper
+ * measures, once per process and within a time budget:
+ * 1. How much of the model is already in the page cache (mincore)
+ * 2. Read bandwidth of the model file through the page cache and with O_DIRECT
+ * 3. Per page size (base pages and every configured huge page size): the time
+ *    to allocate and fault a sample region, and the latency of dependent
+ *    random loads over it, which is dominated by TLB misses on base pages
+ *
+ * All functions take the deadline (CLOCK_MONOTONIC ns) of the whole
+ * calibration and stop early when it passes, reporting what they measured.
+ */
+
+#pragma once
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <vector>
+
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+
+#define CALIBRATE_BASE_PAGE 4096
+#define CALIBRATE_CHUNK (4ULL * 1024 * 1024)
+
+typedef void* (*calibrate_mmap_fn)(void*, size_t, int, int, int, off_t);
+typedef int (*calibrate_munmap_fn)(void*, size_t);
+
+static inline uint64_t calibrate_now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// MAP_HUGETLB flags selecting one huge page size
+static inline int hugetlb_flags(size_t page_size) {
+    return MAP_HUGETLB | (__builtin_ctzll(page_size) << MAP_HUGE_SHIFT);
+}
+
+// Huge page sizes with a pool directory in sysfs, ascending
+static inline std::vector<size_t> hugepage_sizes() {
+    std::vector<size_t> sizes;
+    DIR* dir = opendir("/sys/kernel/mm/hugepages");
+    if (!dir) {
+        return sizes;
+    }
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != nullptr) {
+        unsigned long long kb;
+        if (sscanf(entry->d_name, "hugepages-%llukB", &kb) == 1 && kb > 0) {
+            sizes.push_back((size_t)kb * 1024);
+        }
+    }
+    closedir(dir);
+    std::sort(sizes.begin(), sizes.end());
+    return sizes;
+}
+
+// Fraction of the file's pages resident in the page cache, or -1 if unknown
+static inline double page_cache_resident(int fd, size_t size, calibrate_mmap_fn map, calibrate_munmap_fn unmap) {
+    if (size == 0) {
+        return -1;
+    }
+    void* addr = map(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED) {
+        return -1;
+    }
+    size_t pages = (size + CALIBRATE_BASE_PAGE - 1) / CALIBRATE_BASE_PAGE;
+    std::vector<unsigned char> vec(pages);
+    double resident = -1;
+    if (mincore(addr, size, vec.data()) == 0) {
+        size_t count = 0;
+        for (unsigned char v : vec) {
+            count += v & 1;
+        }
+        resident = (double)count / pages;
+    }
+    unmap(addr, size);
+    return resident;
+}
+
+// Read `length` bytes at `offset` into buf in chunks; returns bytes per
+// second, or 0 if nothing could be read. buf, offset and length must be
+// aligned to CALIBRATE_BASE_PAGE for an O_DIRECT descriptor.
+static inline double read_bandwidth(int fd, char* buf, off_t offset, size_t length, uint64_t deadline) {
+    uint64_t start = calibrate_now_ns();
+    size_t done = 0;
+    while (done < length && calibrate_now_ns() < deadline) {
+        size_t want = std::min((size_t)CALIBRATE_CHUNK, length - done);
+        ssize_t n = pread(fd, buf + done, want, offset + (off_t)done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        done += n;
+    }
+    uint64_t elapsed = calibrate_now_ns() - start;
+    return done && elapsed ? done * 1e9 / elapsed : 0;
+}
+
+// Nanoseconds per page to map and fault `length` bytes with `flags`, leaving
+// the region mapped in *out; 0 with *out = MAP_FAILED if it cannot be mapped
+static inline double fault_in(size_t length, size_t page_size, int flags, calibrate_mmap_fn map,
+                              void** out) {
+    uint64_t start = calibrate_now_ns();
+    char* p = (char*)map(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | flags, -1, 0);
+    *out = p;
+    if (p == MAP_FAILED) {
+        return 0;
+    }
+    if (page_size == CALIBRATE_BASE_PAGE) {
+        madvise(p, length, MADV_NOHUGEPAGE); // Keep THP from backing the base page sample
+    }
+    for (size_t off = 0; off < length; off += page_size) {
+        p[off] = 1;
+    }
+    return (double)(calibrate_now_ns() - start) / (length / page_size);
+}
+
+// Nanoseconds per load of a chain of dependent 8-byte loads at pseudo-random
+// cache lines of [base, base + length). Each address depends on the value
+// loaded before it, so neither the prefetcher nor out-of-order execution
+// hides the cache and TLB misses.
+static inline double access_latency(const char* base, size_t length, size_t loads, uint64_t deadline) {
+    const size_t lines = length / 64;
+    if (lines == 0) {
+        return 0;
+    }
+    uint64_t x = 0x9e3779b97f4a7c15ULL;
+    uint64_t value = 0;
+    size_t done = 0;
+    uint64_t start = calibrate_now_ns();
+    while (done < loads) {
+        for (size_t i = 0; i < 4096; i++) {
+            x = x * 6364136223846793005ULL + 1442695040888963407ULL + (value & 1);
+            value = *(const volatile uint64_t*)(base + ((x >> 17) % lines) * 64);
+        }
+        done += 4096;
+        if (calibrate_now_ns() >= deadline) {
+            break;
+        }
+    }
+    return (double)(calibrate_now_ns() - start) / done;
+}
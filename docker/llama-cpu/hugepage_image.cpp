@@ -0,0 +1,402 @@
+/*
+ * hugepage_image.cpp
+ *
+ * Tool for the huge page wrapper's shared model images (hugepage_image.h).
+ *
+ * Commands:
+ * 1. digest MODEL...  writes "<model>.digests" next to each GGUF model, so
+ *    replicas comparing a new revision with the image do not read the file
+ *    twice; run it when a model is published
+ * 2. diff OLD NEW     shows what moving an image from OLD to NEW costs: pool
+ *    pages reused and written, bytes read from NEW and copied, and the
+ *    tensors that changed
+ * 3. status DIR       lists the images in an image directory with their
+ *    revisions, whether a replica maps them, and the pool's huge pages
+ * 4. gc DIR           retires the revisions no replica maps, except the
+ *    newest unless --all, and frees their pages (the wrapper does the same
+ *    whenever it publishes a revision)
+ *
+ * Exit codes: 0 success, 1 error.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/statfs.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "gguf_reader.h"
+#include "hugepage_image.h"
+
+#define EXIT_OK 0
+#define EXIT_ERROR 1
+
+#define PAGE_2M (2ULL * 1024 * 1024)
+#define PAGE_1G (1024ULL * 1024 * 1024)
+#define GiB (1024.0 * 1024.0 * 1024.0)
+#define HUGETLBFS_MAGIC 0x958458f6
+
+struct ImageOptions {
+    uint64_t page_size = 0; // 0 = system default huge page size
+    bool force = false;
+    bool verbose = false;
+    bool all = false;
+};
+
+// A model file cut into segments, with digests
+struct DigestedModel {
+    std::string path;
+    struct stat st;
+    std::vector<ImageSegment> segments;
+    std::vector<std::string> names;
+    bool from_sidecar;
+};
+
+static uint64_t meminfo_bytes(const char* field) {
+    FILE* f = fopen("/proc/meminfo", "r");
+    if (!f) return 0;
+    char line[256];
+    size_t len = strlen(field);
+    uint64_t value = 0;
+    while (fgets(line, sizeof(line), f)) {
+        if (strncmp(line, field, len) == 0 && line[len] == ':') {
+            value = strtoull(line + len + 1, nullptr, 10) * 1024;
+            break;
+        }
+    }
+    fclose(f);
+    return value;
+}
+
+static bool parse_size(const char* s, uint64_t* out) {
+    char* end;
+    uint64_t v = strtoull(s, &end, 10);
+    if (end == s) return false;
+    if (*end == 'K' || *end == 'k') v *= 1024;
+    else if (*end == 'M' || *end == 'm') v *= 1024 * 1024;
+    else if (*end == 'G' || *end == 'g') v *= 1024 * 1024 * 1024;
+    else if (*end) return false;
+    *out = v;
+    return true;
+}
+
+// Segment a GGUF model and digest it, from its sidecar when that is current
+// (unless `force`), else by reading the file
+static bool digest_model(const std::string& path, bool force, DigestedModel* m, std::string* error) {
+    m->path = path;
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0 || fstat(fd, &m->st) != 0) {
+        *error = strerror(errno);
+        if (fd >= 0) close(fd);
+        return false;
+    }
+    GGUFModel model;
+    bool ok = gguf_read(fd, &model, error) && image_segments(model, m->st.st_size, &m->segments, &m->names, error);
+    std::string sidecar_error;
+    m->from_sidecar = ok && !force && image_read_digests(image_digests_path(path), m->st, &m->segments,
+                                                         &sidecar_error);
+    if (ok && !m->from_sidecar) {
+        ok = image_digest_file(fd, &m->segments, error);
+    }
+    close(fd);
+    return ok;
+}
+
+// --- Commands -------------------------------------------------------------------
+
+static int cmd_digest(const std::vector<std::string>& models, const ImageOptions& o) {
+    int status = EXIT_OK;
+    for (const std::string& path : models) {
+        DigestedModel m;
+        std::string error;
+        if (!digest_model(path, o.force, &m, &error)) {
+            fprintf(stderr, "hugepage_image: %s: %s\n", path.c_str(), error.c_str());
+            status = EXIT_ERROR;
+            continue;
+        }
+        if (m.from_sidecar) {
+            printf("%s: digests are current (%zu segments)\n", path.c_str(), m.segments.size());
+            continue;
+        }
+        if (!image_write_digests(image_digests_path(path), m.st, m.segments, m.names, &error)) {
+            fprintf(stderr, "hugepage_image: %s\n", error.c_str());
+            status = EXIT_ERROR;
+            continue;
+        }
+        printf("%s: wrote %s (%zu segments, %.2f GB)\n", path.c_str(), image_digests_path(path).c_str(),
+               m.segments.size(), m.st.st_size / GiB);
+    }
+    return status;
+}
+
+static int cmd_diff(const std::string& old_path, const std::string& new_path, const ImageOptions& o) {
+    DigestedModel a, b;
+    std::string error;
+    if (!digest_model(old_path, o.force, &a, &error)) {
+        fprintf(stderr, "hugepage_image: %s: %s\n", old_path.c_str(), error.c_str());
+        return EXIT_ERROR;
+    }
+    if (!digest_model(new_path, o.force, &b, &error)) {
+        fprintf(stderr, "hugepage_image: %s: %s\n", new_path.c_str(), error.c_str());
+        return EXIT_ERROR;
+    }
+    uint64_t ps = o.page_size;
+    uint64_t old_pages = (a.st.st_size + ps - 1) / ps;
+    std::vector<bool> reused;
+    std::vector<ImagePiece> pieces;
+    image_plan(b.segments, b.st.st_size, a.segments.data(), a.segments.size(), a.st.st_size, old_pages, ps,
+               &reused, &pieces);
+
+    size_t reused_pages = std::count(reused.begin(), reused.end(), true);
+    uint64_t read_bytes = 0, copied_bytes = 0;
+    for (const ImagePiece& p : pieces) {
+        (p.base_offset >= 0 ? copied_bytes : read_bytes) += p.length;
+    }
+    printf("Old:      %s (%.2f GB, digests from %s)\n", old_path.c_str(), a.st.st_size / GiB,
+           a.from_sidecar ? "sidecar" : "file");
+    printf("New:      %s (%.2f GB, digests from %s)\n", new_path.c_str(), b.st.st_size / GiB,
+           b.from_sidecar ? "sidecar" : "file");
+
+    // Segments whose bytes are nowhere in the old file
+    std::vector<uint64_t> old_digests;
+    for (const ImageSegment& s : a.segments) old_digests.push_back(s.digest);
+    std::sort(old_digests.begin(), old_digests.end());
+    size_t changed = 0;
+    uint64_t changed_bytes = 0;
+    for (size_t i = 0; i < b.segments.size(); i++) {
+        if (!std::binary_search(old_digests.begin(), old_digests.end(), b.segments[i].digest)) {
+            changed++;
+            changed_bytes += b.segments[i].size;
+            if (o.verbose) {
+                printf("  changed %-48s %10.2f MB at %llu\n", b.names[i].c_str(), b.segments[i].size / 1048576.0,
+                       (unsigned long long)b.segments[i].offset);
+            }
+        }
+    }
+    printf("Segments: %zu of %zu changed (%.1f MB)\n", changed, b.segments.size(), changed_bytes / 1048576.0);
+    printf("Pages:    %zu x %llu KB: %zu reused, %zu written (%.1f%% of a full load)\n", reused.size(),
+           (unsigned long long)(ps / 1024), reused_pages, reused.size() - reused_pages,
+           reused.empty() ? 0.0 : 100.0 * (reused.size() - reused_pages) / reused.size());
+    printf("Bytes:    %.1f MB read from the new file, %.1f MB copied from the old revision\n",
+           read_bytes / 1048576.0, copied_bytes / 1048576.0);
+    return EXIT_OK;
+}
+
+// An image directory entry opened read-write with the builder lock held
+struct OpenImage {
+    std::string name;
+    int index_fd = -1;
+    int pool_fd = -1;
+    ImageIndex* index = nullptr;
+    size_t index_size = 0;
+};
+
+static void close_image(OpenImage* img) {
+    if (img->index) munmap(img->index, img->index_size);
+    if (img->pool_fd >= 0) close(img->pool_fd);
+    if (img->index_fd >= 0) close(img->index_fd);
+}
+
+static bool open_image(const std::string& dir, const std::string& name, OpenImage* img, std::string* error) {
+    img->name = name;
+    std::string base = dir + "/" + name;
+    struct stat st;
+    img->index_fd = open((base + ".index").c_str(), O_RDWR);
+    if (img->index_fd < 0 || !image_lock(img->index_fd, F_WRLCK, 0) || fstat(img->index_fd, &st) != 0) {
+        *error = base + ".index: " + strerror(errno);
+        return false;
+    }
+    img->index_size = st.st_size;
+    void* mem = img->index_size >= IMAGE_HEADER_BYTES
+                    ? mmap(nullptr, img->index_size, PROT_READ | PROT_WRITE, MAP_SHARED, img->index_fd, 0)
+                    : MAP_FAILED;
+    if (mem == MAP_FAILED) {
+        *error = base + ".index: " + (img->index_size < IMAGE_HEADER_BYTES ? "empty" : strerror(errno));
+        return false;
+    }
+    img->index = (ImageIndex*)mem;
+    if (img->index->magic != IMAGE_INDEX_MAGIC || img->index->version != IMAGE_INDEX_VERSION) {
+        *error = base + ".index is not a version " + std::to_string(IMAGE_INDEX_VERSION) + " image index";
+        return false;
+    }
+    img->pool_fd = open((base + ".pages").c_str(), O_RDWR);
+    if (img->pool_fd < 0) {
+        *error = base + ".pages: " + strerror(errno);
+        return false;
+    }
+    return true;
+}
+
+// Image names in a directory, from their index files
+static std::vector<std::string> list_images(const std::string& dir, std::string* error) {
+    std::vector<std::string> names;
+    DIR* d = opendir(dir.c_str());
+    if (!d) {
+        *error = dir + ": " + strerror(errno);
+        return names;
+    }
+    const char* suffix = ".index";
+    while (struct dirent* e = readdir(d)) {
+        size_t len = strlen(e->d_name);
+        if (len > strlen(suffix) && strcmp(e->d_name + len - strlen(suffix), suffix) == 0) {
+            names.push_back(std::string(e->d_name, len - strlen(suffix)));
+        }
+    }
+    closedir(d);
+    std::sort(names.begin(), names.end());
+    return names;
+}
+
+static void print_image(const OpenImage& img) {
+    ImageIndex* idx = img.index;
+    struct stat pool;
+    fstat(img.pool_fd, &pool);
+    std::vector<bool> used = image_used_pages(idx);
+    size_t live = std::count(used.begin(), used.end(), true);
+    printf("%s: %llu KB pages, pool %zu pages allocated (%.2f GB), %zu referenced\n", img.name.c_str(),
+           (unsigned long long)(idx->page_size / 1024), (size_t)(pool.st_blocks * 512 / idx->page_size),
+           pool.st_blocks * 512 / GiB, live);
+
+    std::vector<uint32_t> slots;
+    for (uint32_t s = 0; s < idx->slots; s++) {
+        if (image_revision(idx, s)->generation != 0) slots.push_back(s);
+    }
+    std::sort(slots.begin(), slots.end(), [idx](uint32_t a, uint32_t b) {
+        return image_revision(idx, a)->generation < image_revision(idx, b)->generation;
+    });
+    for (uint32_t s : slots) {
+        ImageRevision* r = image_revision(idx, s);
+        char built[32];
+        time_t t = (time_t)r->built_at;
+        strftime(built, sizeof(built), "%Y-%m-%d %H:%M:%S", localtime(&t));
+        printf("  revision %llu%s: %s\n", (unsigned long long)r->generation,
+               image_slot_in_use(img.index_fd, s) ? " (mapped)" : "", r->source_path);
+        printf("    %.2f GB, %u segments, built %s", r->file_size / GiB, r->segment_count, built);
+        if (r->base_generation) {
+            printf(" on revision %llu", (unsigned long long)r->base_generation);
+        }
+        printf("\n    %u pages written, %u reused; %.2f GB read, %.2f GB copied\n", r->written_pages,
+               r->reused_pages, r->read_bytes / GiB, r->copied_bytes / GiB);
+    }
+}
+
+static int cmd_images(const std::string& dir, bool collect, const ImageOptions& o) {
+    std::string error;
+    std::vector<std::string> names = list_images(dir, &error);
+    if (!error.empty()) {
+        fprintf(stderr, "hugepage_image: %s\n", error.c_str());
+        return EXIT_ERROR;
+    }
+    struct statfs fs;
+    if (statfs(dir.c_str(), &fs) == 0 && (unsigned long)fs.f_type != HUGETLBFS_MAGIC) {
+        printf("Note: %s is not a hugetlbfs mount; images there use regular pages\n", dir.c_str());
+    }
+    if (names.empty()) {
+        printf("No images in %s\n", dir.c_str());
+    }
+    int status = EXIT_OK;
+    for (const std::string& name : names) {
+        OpenImage img;
+        if (!open_image(dir, name, &img, &error)) {
+            fprintf(stderr, "hugepage_image: %s\n", error.c_str());
+            close_image(&img);
+            status = EXIT_ERROR;
+            continue;
+        }
+        if (collect) {
+            struct stat before, after;
+            fstat(img.pool_fd, &before);
+            // Keep the newest revision so restarted replicas can attach to it
+            unsigned keep = 0;
+            uint64_t newest = 0;
+            for (uint32_t s = 0; s < img.index->slots && !o.all; s++) {
+                if (image_revision(img.index, s)->generation > newest) {
+                    newest = image_revision(img.index, s)->generation;
+                    keep = 1u << s;
+                }
+            }
+            image_collect(img.index, img.index_fd, img.pool_fd, keep);
+            fstat(img.pool_fd, &after);
+            printf("%s: freed %.2f GB\n", name.c_str(), (before.st_blocks - after.st_blocks) * 512 / GiB);
+        }
+        print_image(img);
+        close_image(&img);
+    }
+    return status;
+}
+
+static void usage(const char* prog) {
+    fprintf(stderr,
+        "Usage: %s digest MODEL...\n"
+        "       %s diff OLD NEW\n"
+        "       %s status DIR\n"
+        "       %s gc DIR\n"
+        "\n"
+        "Manage the shared model images of the huge page wrapper (HUGEPAGE_WRAPPER_IMAGE_DIR).\n"
+        "\n"
+        "Options:\n"
+        "  --page-size 2M|1G    Pool page size for diff (default: system default huge page size)\n"
+        "  --force              Digest the files even when their sidecars are current\n"
+        "  --verbose            List the changed tensors (diff)\n"
+        "  --all                Retire the newest revision too if no replica maps it (gc)\n",
+        prog, prog, prog, prog);
+}
+
+int main(int argc, char** argv) {
+    enum { OPT_PAGE_SIZE = 1, OPT_FORCE, OPT_VERBOSE, OPT_ALL, OPT_HELP };
+    static const struct option long_options[] = {
+        {"page-size", required_argument, nullptr, OPT_PAGE_SIZE},
+        {"force", no_argument, nullptr, OPT_FORCE},
+        {"verbose", no_argument, nullptr, OPT_VERBOSE},
+        {"all", no_argument, nullptr, OPT_ALL},
+        {"help", no_argument, nullptr, OPT_HELP},
+        {nullptr, 0, nullptr, 0},
+    };
+
+    ImageOptions o;
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", long_options, nullptr)) != -1) {
+        switch (opt) {
+            case OPT_PAGE_SIZE:
+                if (!parse_size(optarg, &o.page_size) || (o.page_size != PAGE_2M && o.page_size != PAGE_1G)) {
+                    fprintf(stderr, "hugepage_image: --page-size must be 2M or 1G\n");
+                    return EXIT_ERROR;
+                }
+                break;
+            case OPT_FORCE: o.force = true; break;
+            case OPT_VERBOSE: o.verbose = true; break;
+            case OPT_ALL: o.all = true; break;
+            case OPT_HELP: usage(argv[0]); return EXIT_OK;
+            default: usage(argv[0]); return EXIT_ERROR;
+        }
+    }
+    if (o.page_size == 0) {
+        o.page_size = meminfo_bytes("Hugepagesize");
+        if (o.page_size == 0) o.page_size = PAGE_2M;
+    }
+
+    std::vector<std::string> args(argv + optind, argv + argc);
+    std::string command = args.empty() ? "" : args[0];
+    if (command == "digest" && args.size() >= 2) {
+        return cmd_digest(std::vector<std::string>(args.begin() + 1, args.end()), o);
+    }
+    if (command == "diff" && args.size() == 3) {
+        return cmd_diff(args[1], args[2], o);
+    }
+    if ((command == "status" || command == "gc") && args.size() == 2) {
+        return cmd_images(args[1], command == "gc", o);
+    }
+    usage(argv[0]);
+    return EXIT_ERROR;
+}
@@ -0,0 +1,518 @@
+/*
+ * hugepage_image.h
+ *
+ * Shared model images: layout and tensor digests, used by the huge page
+ * wrapper and the hugepage_image tool.
+ *
+ * With HUGEPAGE_WRAPPER_IMAGE_DIR pointing at a hugetlbfs mount shared by the
+ * replicas, the wrapper keeps a GGUF model's bytes in a page pool file there
+ * instead of a private copy per process:
+ *
+ *   <name>.pages   huge pages holding the bytes of every live revision
+ *   <name>.index   one huge page: up to IMAGE_MAX_REVISIONS revisions, each
+ *                  with its source file, segment digests and page table
+ *
+ * A revision maps file page p to a pool page. Replicas on the same revision
+ * map the same pool pages. A new revision of the model takes over every pool
+ * page whose bytes did not change and only writes the others, reading from
+ * the file just the segments whose digest changed (unchanged segments that
+ * moved are copied from the old revision in memory).
+ *
+ * Segments are the GGUF header (up to the first tensor) and each tensor
+ * including the alignment padding behind it, so they cover the file. Their
+ * digests (XXH64) come from a "<model>.digests" sidecar written by
+ * `hugepage_image digest` when the model is published, or from reading the
+ * file when there is none.
+ *
+ * Locking (OFD locks on the index file, released when the holder exits):
+ * - byte 0, exclusive: held while attaching to or building a revision
+ * - byte 1 + slot, shared: held by every process mapping that revision;
+ *   revisions nobody holds are retired and their unshared pages freed
+ */
+
+#pragma once
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "gguf_reader.h"
+
+#define IMAGE_INDEX_MAGIC 0x3158444e49574850ULL // "PHWINDX1"
+#define IMAGE_INDEX_VERSION 1
+#define IMAGE_MAX_REVISIONS 4
+#define IMAGE_HEADER_BYTES 4096
+#define IMAGE_DIGESTS_SUFFIX ".digests"
+#define IMAGE_DIGESTS_MAGIC "# hugepage-image digests v1 xxh64"
+
+// --- XXH64 -------------------------------------------------------------------
+
+#define XXH_PRIME64_1 0x9E3779B185EBCA87ULL
+#define XXH_PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME64_3 0x165667B19E3779F9ULL
+#define XXH_PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME64_5 0x27D4EB2F165667C5ULL
+
+static inline uint64_t xxh_rotl(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t xxh_read64(const uint8_t* p) {
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return v;
+}
+
+static inline uint64_t xxh_round(uint64_t acc, uint64_t input) {
+    acc += input * XXH_PRIME64_2;
+    return xxh_rotl(acc, 31) * XXH_PRIME64_1;
+}
+
+static inline uint64_t xxh_merge(uint64_t acc, uint64_t v) {
+    acc ^= xxh_round(0, v);
+    return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+// Streaming XXH64 (seed 0), for digests of data read in chunks
+struct XXH64State {
+    uint64_t v[4] = {XXH_PRIME64_1 + XXH_PRIME64_2, XXH_PRIME64_2, 0, 0 - XXH_PRIME64_1};
+    uint64_t total = 0;
+    uint8_t buf[32];
+    size_t buffered = 0;
+
+    void update(const void* data, size_t n) {
+        const uint8_t* p = (const uint8_t*)data;
+        total += n;
+        if (buffered + n < 32) {
+            memcpy(buf + buffered, p, n);
+            buffered += n;
+            return;
+        }
+        if (buffered) {
+            size_t fill = 32 - buffered;
+            memcpy(buf + buffered, p, fill);
+            for (int i = 0; i < 4; i++) v[i] = xxh_round(v[i], xxh_read64(buf + 8 * i));
+            p += fill;
+            n -= fill;
+            buffered = 0;
+        }
+        for (; n >= 32; p += 32, n -= 32) {
+            v[0] = xxh_round(v[0], xxh_read64(p));
+            v[1] = xxh_round(v[1], xxh_read64(p + 8));
+            v[2] = xxh_round(v[2], xxh_read64(p + 16));
+            v[3] = xxh_round(v[3], xxh_read64(p + 24));
+        }
+        memcpy(buf, p, n);
+        buffered = n;
+    }
+
+    uint64_t digest() const {
+        uint64_t h;
+        if (total >= 32) {
+            h = xxh_rotl(v[0], 1) + xxh_rotl(v[1], 7) + xxh_rotl(v[2], 12) + xxh_rotl(v[3], 18);
+            for (int i = 0; i < 4; i++) h = xxh_merge(h, v[i]);
+        } else {
+            h = XXH_PRIME64_5;
+        }
+        h += total;
+        const uint8_t* p = buf;
+        size_t n = buffered;
+        for (; n >= 8; p += 8, n -= 8) {
+            h ^= xxh_round(0, xxh_read64(p));
+            h = xxh_rotl(h, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+        }
+        if (n >= 4) {
+            uint32_t w;
+            memcpy(&w, p, 4);
+            h ^= (uint64_t)w * XXH_PRIME64_1;
+            h = xxh_rotl(h, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+            p += 4;
+            n -= 4;
+        }
+        for (; n > 0; p++, n--) {
+            h ^= *p * XXH_PRIME64_5;
+            h = xxh_rotl(h, 11) * XXH_PRIME64_1;
+        }
+        h ^= h >> 33;
+        h *= XXH_PRIME64_2;
+        h ^= h >> 29;
+        h *= XXH_PRIME64_3;
+        h ^= h >> 32;
+        return h;
+    }
+};
+
+static inline uint64_t xxh64(const void* data, size_t n) {
+    XXH64State s;
+    s.update(data, n);
+    return s.digest();
+}
+
+// --- Segments ------------------------------------------------------------------
+
+// A byte range of the model file with the digest of its contents
+struct ImageSegment {
+    uint64_t offset;
+    uint64_t size;
+    uint64_t digest;
+};
+
+// Cut a GGUF file into the header and one segment per tensor (with its
+// padding). `names` gets "<header>" and the tensor names, in segment order.
+static inline bool image_segments(const GGUFModel& m, uint64_t file_size, std::vector<ImageSegment>* segments,
+                                  std::vector<std::string>* names, std::string* error) {
+    std::vector<std::pair<uint64_t, size_t>> starts; // (absolute offset, tensor)
+    for (size_t i = 0; i < m.tensors.size(); i++) {
+        starts.push_back({m.data_offset + m.tensors[i].offset, i});
+    }
+    std::sort(starts.begin(), starts.end());
+    segments->clear();
+    if (names) names->clear();
+
+    uint64_t first = starts.empty() ? file_size : starts[0].first;
+    segments->push_back({0, first, 0});
+    if (names) names->push_back("<header>");
+    for (size_t i = 0; i < starts.size(); i++) {
+        const GGUFTensorInfo& t = m.tensors[starts[i].second];
+        uint64_t end = i + 1 < starts.size() ? starts[i + 1].first : file_size;
+        if (starts[i].first + t.size > end) {
+            *error = "tensor " + t.name + " overlaps the next tensor or the end of the file";
+            return false;
+        }
+        if (end > starts[i].first) {
+            segments->push_back({starts[i].first, end - starts[i].first, 0});
+            if (names) names->push_back(t.name);
+        }
+    }
+    return true;
+}
+
+// Digest every segment by reading the file, `buffer_size` bytes at a time
+static inline bool image_digest_file(int fd, std::vector<ImageSegment>* segments, std::string* error,
+                                     size_t buffer_size = 8ULL * 1024 * 1024) {
+    std::vector<uint8_t> buf(buffer_size);
+    for (ImageSegment& s : *segments) {
+        XXH64State h;
+        for (uint64_t done = 0; done < s.size;) {
+            size_t want = (size_t)std::min<uint64_t>(buf.size(), s.size - done);
+            ssize_t n = pread(fd, buf.data(), want, (off_t)(s.offset + done));
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) {
+                *error = n < 0 ? strerror(errno) : "unexpected end of file";
+                return false;
+            }
+            h.update(buf.data(), n);
+            done += n;
+        }
+        s.digest = h.digest();
+        posix_fadvise(fd, (off_t)s.offset, s.size, POSIX_FADV_DONTNEED);
+    }
+    return true;
+}
+
+static inline std::string image_digests_path(const std::string& model_path) {
+    return model_path + IMAGE_DIGESTS_SUFFIX;
+}
+
+// Image name of a model: `name` if set, or else the model file name without
+// ".gguf", reduced to [A-Za-z0-9._-]
+static inline std::string image_file_name(const char* path, const char* name) {
+    std::string result;
+    if (name && *name) {
+        result = name;
+    } else {
+        const char* slash = strrchr(path, '/');
+        result = slash ? slash + 1 : path;
+        if (result.size() > 5 && result.compare(result.size() - 5, 5, ".gguf") == 0) {
+            result.resize(result.size() - 5);
+        }
+    }
+    for (char& c : result) {
+        bool safe = (c >= '0' && c <= '9') || (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') ||
+                    c == '.' || c == '-' || c == '_';
+        if (!safe) c = '_';
+    }
+    return result.empty() || result[0] == '.' ? "model" + result : result;
+}
+
+// Sidecar: magic line, "size <bytes> mtime <seconds>", then
+// "<offset> <size> <digest> <name>" per segment
+static inline bool image_write_digests(const std::string& path, const struct stat& st,
+                                       const std::vector<ImageSegment>& segments,
+                                       const std::vector<std::string>& names, std::string* error) {
+    std::string tmp = path + ".tmp";
+    FILE* f = fopen(tmp.c_str(), "w");
+    if (!f) {
+        *error = "cannot write " + tmp + ": " + strerror(errno);
+        return false;
+    }
+    fprintf(f, "%s\nsize %llu mtime %lld\n", IMAGE_DIGESTS_MAGIC, (unsigned long long)st.st_size,
+            (long long)st.st_mtime);
+    for (size_t i = 0; i < segments.size(); i++) {
+        fprintf(f, "%llu %llu %016llx %s\n", (unsigned long long)segments[i].offset,
+                (unsigned long long)segments[i].size, (unsigned long long)segments[i].digest,
+                i < names.size() ? names[i].c_str() : "");
+    }
+    if (fclose(f) != 0 || rename(tmp.c_str(), path.c_str()) != 0) {
+        *error = "cannot write " + path + ": " + strerror(errno);
+        unlink(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+// Fill in segment digests from a sidecar. Fails unless the sidecar was
+// written for a file of this size and mtime with exactly these segments.
+static inline bool image_read_digests(const std::string& path, const struct stat& st,
+                                      std::vector<ImageSegment>* segments, std::string* error) {
+    FILE* f = fopen(path.c_str(), "r");
+    if (!f) {
+        *error = strerror(errno);
+        return false;
+    }
+    char line[1024];
+    unsigned long long size = 0;
+    long long mtime = 0;
+    bool ok = fgets(line, sizeof(line), f) && strncmp(line, IMAGE_DIGESTS_MAGIC, strlen(IMAGE_DIGESTS_MAGIC)) == 0 &&
+              fgets(line, sizeof(line), f) && sscanf(line, "size %llu mtime %lld", &size, &mtime) == 2;
+    if (!ok) {
+        *error = "not a digest file";
+    } else if (size != (unsigned long long)st.st_size || mtime != (long long)st.st_mtime) {
+        *error = "written for a different file (size or mtime differ)";
+        ok = false;
+    }
+    size_t i = 0;
+    while (ok && fgets(line, sizeof(line), f)) {
+        unsigned long long offset, length, digest;
+        if (sscanf(line, "%llu %llu %llx", &offset, &length, &digest) != 3) {
+            *error = "malformed line: " + std::string(line, strcspn(line, "\n"));
+            ok = false;
+        } else if (i >= segments->size() || (*segments)[i].offset != offset || (*segments)[i].size != length) {
+            *error = "segments do not match the file's tensor index";
+            ok = false;
+        } else {
+            (*segments)[i++].digest = digest;
+        }
+    }
+    if (ok && i != segments->size()) {
+        *error = "segments do not match the file's tensor index";
+        ok = false;
+    }
+    fclose(f);
+    return ok;
+}
+
+// --- Index file ---------------------------------------------------------------
+
+struct ImageIndex {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t slots;
+    uint64_t page_size;      // Pool page size
+    uint64_t slot_bytes;     // Bytes per revision slot after the header
+    uint64_t generation;     // Last generation handed out
+};
+
+// A revision slot: this record, then ImageSegment[segment_count], then
+// uint32_t pool page numbers [page_count]
+struct ImageRevision {
+    uint64_t generation;     // 0: empty, or being built
+    uint64_t file_size;
+    uint64_t source_dev;     // Identity of the file it was built from, so
+    uint64_t source_ino;     // replicas of the same file attach without
+    int64_t source_mtime_ns; // digesting it
+    uint32_t segment_count;
+    uint32_t page_count;
+    uint64_t built_at;       // Unix time
+    uint64_t read_bytes;     // Build cost: bytes read from the file,
+    uint64_t copied_bytes;   // copied from the previous revision,
+    uint32_t written_pages;  // and pages written (the rest were
+    uint32_t reused_pages;   // taken over from the previous revision)
+    uint64_t base_generation;
+    char source_path[256];
+};
+
+static inline size_t image_index_slot_bytes(size_t index_size) {
+    return (index_size - IMAGE_HEADER_BYTES) / IMAGE_MAX_REVISIONS / 64 * 64;
+}
+
+static inline ImageRevision* image_revision(ImageIndex* index, uint32_t slot) {
+    return (ImageRevision*)((char*)index + IMAGE_HEADER_BYTES + slot * index->slot_bytes);
+}
+
+static inline ImageSegment* image_revision_segments(ImageRevision* r) {
+    return (ImageSegment*)(r + 1);
+}
+
+static inline uint32_t* image_revision_pages(ImageRevision* r) {
+    return (uint32_t*)(image_revision_segments(r) + r->segment_count);
+}
+
+static inline size_t image_revision_bytes(size_t segments, size_t pages) {
+    return sizeof(ImageRevision) + segments * sizeof(ImageSegment) + pages * sizeof(uint32_t);
+}
+
+// Page p of a file is unchanged between two revisions when the segments
+// overlapping it are identical; past the end of both files it is zeros.
+static inline bool image_page_unchanged(const ImageSegment* a, size_t na, uint64_t size_a, const ImageSegment* b,
+                                        size_t nb, uint64_t size_b, uint64_t page_start, uint64_t page_end) {
+    if (std::min(page_end, size_a) != std::min(page_end, size_b)) {
+        return false;
+    }
+    auto first = [](const ImageSegment* s, size_t n, uint64_t offset) {
+        return std::upper_bound(s, s + n, offset,
+                                [](uint64_t o, const ImageSegment& seg) { return o < seg.offset + seg.size; }) - s;
+    };
+    size_t i = first(a, na, page_start), j = first(b, nb, page_start);
+    for (; i < na && a[i].offset < page_end; i++, j++) {
+        if (j >= nb || a[i].offset != b[j].offset || a[i].size != b[j].size || a[i].digest != b[j].digest) {
+            return false;
+        }
+    }
+    return j >= nb || b[j].offset >= page_end;
+}
+
+// --- Locking and pool pages ---------------------------------------------------
+
+// OFD lock on one byte of the index file, F_UNLCK to release
+static inline bool image_lock(int fd, short type, off_t byte) {
+    struct flock fl = {};
+    fl.l_type = type;
+    fl.l_whence = SEEK_SET;
+    fl.l_start = byte;
+    fl.l_len = 1;
+    while (fcntl(fd, F_OFD_SETLKW, &fl) != 0) {
+        if (errno != EINTR) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Whether another open index file description (any process, or another
+// mapping in this one) holds the read lock of `slot`
+static inline bool image_slot_in_use(int fd, uint32_t slot) {
+    struct flock fl = {};
+    fl.l_type = F_WRLCK;
+    fl.l_whence = SEEK_SET;
+    fl.l_start = 1 + slot;
+    fl.l_len = 1;
+    return fcntl(fd, F_OFD_GETLK, &fl) != 0 || fl.l_type != F_UNLCK;
+}
+
+// Pool pages referenced by published revisions
+static inline std::vector<bool> image_used_pages(ImageIndex* index) {
+    std::vector<bool> used;
+    for (uint32_t s = 0; s < index->slots; s++) {
+        ImageRevision* r = image_revision(index, s);
+        if (r->generation == 0) continue;
+        const uint32_t* pages = image_revision_pages(r);
+        for (uint32_t i = 0; i < r->page_count; i++) {
+            if (pages[i] >= used.size()) used.resize(pages[i] + 1, false);
+            used[pages[i]] = true;
+        }
+    }
+    return used;
+}
+
+// Retire the revisions nobody maps, except those in `keep`, and give the
+// pool pages no revision uses back to the huge page pool
+static inline void image_collect(ImageIndex* index, int index_fd, int pool_fd, unsigned keep) {
+    for (uint32_t s = 0; s < index->slots; s++) {
+        ImageRevision* r = image_revision(index, s);
+        if (r->generation != 0 && !(keep & (1u << s)) && !image_slot_in_use(index_fd, s)) {
+            r->generation = 0;
+        }
+    }
+    std::vector<bool> used = image_used_pages(index);
+    struct stat st;
+    if (fstat(pool_fd, &st) != 0) {
+        return;
+    }
+    size_t ps = index->page_size, pool_pages = st.st_size / ps;
+    for (size_t p = 0; p < pool_pages;) {
+        size_t q = p;
+        while (q < pool_pages && !(q < used.size() && used[q])) q++;
+        if (q > p) {
+            fallocate(pool_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, p * ps, (q - p) * ps);
+        }
+        p = q + 1;
+    }
+    if (used.size() < pool_pages) {
+        ftruncate(pool_fd, used.size() * ps);
+    }
+}
+
+// A byte range of a new revision's fresh pages and where its bytes come from
+struct ImagePiece {
+    uint64_t offset;
+    uint64_t length;
+    int64_t base_offset;     // Offset of the same bytes in the base revision, or -1 to read the file
+};
+
+// Plan a revision of a file of `size` bytes on top of `base` (null for the
+// first build). `reused[p]` is set for pages taken over from the base;
+// `pieces` cover the other pages' file bytes, copied from wherever the base
+// holds a segment with the same digest and size, else read.
+static inline void image_plan(const std::vector<ImageSegment>& segments, uint64_t size, const ImageSegment* base,
+                              size_t base_count, uint64_t base_size, uint64_t base_pages, size_t page_size,
+                              std::vector<bool>* reused, std::vector<ImagePiece>* pieces) {
+    uint64_t pages = (size + page_size - 1) / page_size;
+    reused->assign(pages, false);
+    pieces->clear();
+    std::vector<std::pair<uint64_t, const ImageSegment*>> by_digest;
+    for (size_t i = 0; base && i < base_count; i++) {
+        by_digest.push_back({base[i].digest, &base[i]});
+    }
+    std::sort(by_digest.begin(), by_digest.end(),
+              [](const std::pair<uint64_t, const ImageSegment*>& a, const std::pair<uint64_t, const ImageSegment*>& b) {
+                  return a.first < b.first;
+              });
+    for (uint64_t p = 0; base && p < pages && p < base_pages; p++) {
+        (*reused)[p] = image_page_unchanged(segments.data(), segments.size(), size, base, base_count, base_size,
+                                            p * page_size, (p + 1) * page_size);
+    }
+
+    size_t s = 0;
+    for (uint64_t p = 0; p < pages;) {
+        if ((*reused)[p]) {
+            p++;
+            continue;
+        }
+        uint64_t q = p;
+        while (q < pages && !(*reused)[q]) q++;
+        uint64_t start = p * page_size, end = std::min(q * page_size, size);
+        while (s < segments.size() && segments[s].offset + segments[s].size <= start) s++;
+        for (size_t i = s; i < segments.size() && segments[i].offset < end; i++) {
+            const ImageSegment& seg = segments[i];
+            uint64_t a = std::max(start, seg.offset), e = std::min(end, seg.offset + seg.size);
+            int64_t from = -1;
+            auto it = std::lower_bound(by_digest.begin(), by_digest.end(), seg.digest,
+                                       [](const std::pair<uint64_t, const ImageSegment*>& x, uint64_t d) {
+                                           return x.first < d;
+                                       });
+            for (; it != by_digest.end() && it->first == seg.digest && from < 0; ++it) {
+                if (it->second->size == seg.size) {
+                    from = (int64_t)(it->second->offset + (a - seg.offset));
+                }
+            }
+            ImagePiece* last = pieces->empty() ? nullptr : &pieces->back();
+            if (last && last->offset + last->length == a &&
+                (from < 0 ? last->base_offset < 0
+                          : last->base_offset >= 0 && last->base_offset + (int64_t)last->length == from)) {
+                last->length += e - a;
+            } else {
+                pieces->push_back({a, e - a, from});
+            }
+        }
+        p = q;
+    }
+}
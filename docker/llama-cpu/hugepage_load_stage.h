@@ -0,0 +1,122 @@
+/*
+ * hugepage_load_stage.h
+ *
+ * Stage ABI of the huge page wrapper's load pipeline.
+ *
+ * An intercepted model file is copied into its destination memory by a
+ * pipeline configured with HUGEPAGE_WRAPPER_PIPELINE, a comma-separated list
+ * of stages, each "name" or "name:options":
+ *
+ *   HUGEPAGE_WRAPPER_PIPELINE=numa:interleave,pread,checksum:expect=8f2e61d0
+ *
+ * - placement stages run once on the destination after the wrapper has
+ *   allocated it (huge pages, anonymous or stitched) and before any data is
+ *   written, so they govern first touch (NUMA policy, madvise, locking)
+ * - exactly one source stage fills each chunk from the file
+ * - transform stages then run on each chunk in list order, in place
+ *
+ * Transforms cannot change a chunk's size. The destination is what mmap
+ * returns to the application, which finds each tensor at its offset in the
+ * file header, so byte N of the file must stay byte N of the destination.
+ * Verification, decryption, and rewrites that keep each tensor's size and
+ * offset (e.g. reordering blocks within a tensor) fit; quantizing or
+ * repacking a tensor into a different size does not, and needs a converted
+ * file (or a source stage that reads one and fills the original layout).
+ * Chunks are cut by size, not at tensor boundaries, so a transform that works
+ * per tensor must handle tensors split across chunks.
+ *
+ * The file is cut into chunks (HUGEPAGE_WRAPPER_CHUNK_MB, default 4) that
+ * flow through source and transforms on the loader threads, so a transform
+ * overlaps with the reads of other chunks instead of being another pass
+ * over the whole file. Stages must therefore be thread-safe across chunks,
+ * and must not rely on chunk order: with HUGEPAGE_WRAPPER_READ_ORDER=physical
+ * a fragmented file is read in the order of its extents on the device.
+ *
+ * When a shared image is updated (hugepage_image.h) only the changed tensors
+ * are loaded: dest maps file offset 0, load_length is the total of the
+ * scattered ranges read, and placement runs on each run of fresh pages.
+ *
+ * Built-in stages: pread and direct (source), checksum (transform), numa
+ * (placement).
+ * Plugins listed in HUGEPAGE_WRAPPER_PLUGINS (colon-separated .so paths) are
+ * dlopen()ed at startup and export hpw_register_stages() to add their own.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define HPW_STAGE_ABI_VERSION 1
+
+enum hpw_stage_kind {
+    HPW_STAGE_SOURCE = 0,
+    HPW_STAGE_TRANSFORM = 1,
+    HPW_STAGE_PLACEMENT = 2,
+};
+
+// Returned by begin() to sit out this load
+#define HPW_STAGE_SKIP (-1)
+
+// One intercepted file, valid from begin() to end()
+struct hpw_load {
+    int fd;                  // Open file; read it with pread() only
+    const char* path;        // Resolved path, "" if unknown
+    uint64_t file_size;
+    uint64_t load_offset;    // File range loaded by the pipeline (the huge page
+    uint64_t load_length;    // part only, for the partial strategy)
+    const char* format;      // "gguf", "safetensors", "pytorch" or "unknown"
+    size_t tensor_count;
+    void* dest;              // Destination of file offset load_offset
+    size_t hugepage_size;
+    int hugetlb;             // Destination is MAP_HUGETLB memory
+    int threads;             // Loader threads
+    size_t chunk_size;
+};
+
+// A contiguous piece of the file and its place in the destination
+struct hpw_chunk {
+    uint64_t file_offset;
+    void* data;
+    size_t length;
+};
+
+struct hpw_stage {
+    uint32_t abi_version;    // HPW_STAGE_ABI_VERSION
+    uint32_t kind;           // enum hpw_stage_kind
+    const char* name;        // Referenced in HUGEPAGE_WRAPPER_PIPELINE
+
+    // Optional. Called once per load before any chunk with the stage's
+    // options ("" if none). Returns 0, HPW_STAGE_SKIP, or an errno value
+    // that fails the load. *state is passed to the other callbacks.
+    int (*begin)(const struct hpw_load* load, const char* options, void** state);
+
+    // Source and transform stages: fill (source) or rewrite in place
+    // (transform) one chunk; chunk->length is fixed and must be filled
+    // exactly. Called concurrently from loader threads.
+    // Returns 0 or an errno value.
+    int (*process)(void* state, struct hpw_chunk* chunk);
+
+    // Placement stages: prepare the destination before it is written.
+    // Returns 0 or an errno value.
+    int (*place)(void* state, void* addr, size_t length);
+
+    // Optional. Called once per load that begin() accepted; status is 0
+    // if every chunk succeeded. Returns 0 or an errno value that fails the
+    // load (e.g. a checksum mismatch).
+    int (*end)(void* state, int status);
+};
+
+typedef int (*hpw_register_fn)(const struct hpw_stage* stage);
+
+// Exported by plugins; call register_stage for each stage, return 0 on success.
+// Stage structs must stay valid for the life of the process.
+int hpw_register_stages(hpw_register_fn register_stage);
+
+#ifdef __cplusplus
+}
+#endif
@@ -3,99 +3,2489 @@
  * 
  * LD_PRELOAD library to transparently use huge pages for large file mmaps.
  * 
- * When an application mmaps a large file (>1GB), this wrapper:
- * 1. Allocates anonymous memory with MAP_HUGETLB
- * 2. Reads the file contents into that memory
- * 3. Returns the huge page memory to the application
+ * When an application mmaps a whole large model file (>1GB by default, see
+ * HUGEPAGE_WRAPPER_MIN_SIZE_MB), this wrapper:
+ * 1. Recognises the format (GGUF, safetensors, PyTorch zip) and reads its
+ *    tensor index; other files are left alone (HUGEPAGE_WRAPPER_FORMATS)
+ * 2. Allocates anonymous memory with MAP_HUGETLB
+ * 3. Reads the file contents into that memory on parallel loader threads
+ *    (HUGEPAGE_WRAPPER_LOAD_THREADS), split at tensor boundaries, through
+ *    the load pipeline of hugepage_load_stage.h (HUGEPAGE_WRAPPER_PIPELINE),
+ *    optionally in the order the file's extents sit on the device
+ *    (file_extents.h, HUGEPAGE_WRAPPER_READ_ORDER=physical)
+ * 4. Returns the huge page memory to the application
  * 
  * This provides huge page benefits without requiring special filesystems.
+ * Besides llama.cpp it covers the safetensors library (memmap2) and
+ * torch.load(mmap=True), which map whole files the same way.
+ *
+ * Before copying, the wrapper checks the budget of its cgroup. Huge pages are
+ * charged to the hugetlb controller (hugetlb.<size>.max), not memory.max, and
+ * exceeding that limit raises SIGBUS on fault rather than failing the mmap.
+ * Depending on the budget the model is placed with one of three strategies:
+ * - full:    the whole file is copied into huge pages
+ * - partial: the leading part is copied into huge pages and the rest is
+ *            stitched on as a file-backed mapping at the following address
+ * - file:    plain file-backed mapping, no copy
+ *
+ * At the first private model load the wrapper calibrates itself against the
+ * host (hugepage_calibrate.h, HUGEPAGE_WRAPPER_CALIBRATE): page cache state and
+ * read bandwidth pick the default source stage (pread or O_DIRECT reads), and
+ * allocation and access latency per page size pick the huge page size, or
+ * plain file mappings where huge pages measure no faster than base pages.
+ *
+ * The decision is logged and, if HUGEPAGE_WRAPPER_METRICS names a file,
+ * written there in Prometheus text format. Load progress (bytes loaded, stage,
+ * state) is kept live in the shared file HUGEPAGE_WRAPPER_PROGRESS names
+ * (hugepage_progress.h) for the container healthcheck and the router.
+ *
+ * Every intercepted model, whatever its strategy, gets a table from its
+ * tensor index that in-process tools query to attribute an address to a
+ * tensor and layer in constant time (hpw_tensor_lookup, tensor_lookup.h).
  */
 
+#ifndef _GNU_SOURCE
 #define _GNU_SOURCE
+#endif
 #include <dlfcn.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/statfs.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/syscall.h>
+#include <ctype.h>
+#include <algorithm>
+#include <vector>
+
+#include "file_extents.h"
+#include "gguf_reader.h"
+#include "hugepage_calibrate.h"
+#include "hugepage_image.h"
+#include "hugepage_load_stage.h"
+#include "hugepage_progress.h"
+#include "safetensors_reader.h"
+#include "tensor_lookup.h"
 
 // Function pointer to the real mmap
 typedef void* (*mmap_fn)(void*, size_t, int, int, int, off_t);
 static mmap_fn real_mmap = nullptr;
 
-// Function pointer to the real munmap
-typedef int (*munmap_fn)(void*, size_t);
-static munmap_fn real_munmap = nullptr;
+// Function pointer to the real munmap
+typedef int (*munmap_fn)(void*, size_t);
+static munmap_fn real_munmap = nullptr;
+
+// Track our anonymous huge page allocations
+struct HugePageAllocation {
+    void* addr;
+    size_t size;
+    int lock_fd;             // Shared image revision lock, closed on munmap; -1 if none
+    HugePageAllocation* next;
+};
+static HugePageAllocation* allocations = nullptr;
+
+// Guards the allocation list and metrics; llama.cpp may map files from several threads
+static pthread_mutex_t state_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Placement strategies, chosen per mapping from the cgroup budget
+enum LoadStrategy {
+    STRATEGY_FULL = 0,
+    STRATEGY_PARTIAL = 1,
+    STRATEGY_FILE = 2,
+    STRATEGY_IMAGE = 3,      // Shared image in HUGEPAGE_WRAPPER_IMAGE_DIR, not budgeted per process
+    STRATEGY_COUNT = 4,
+};
+static const char* strategy_names[STRATEGY_COUNT] = {"full", "partial", "file", "image"};
+
+// How a mapping got its shared image revision
+enum ImageResult {
+    IMAGE_ATTACHED = 0,      // A published revision with the same bytes
+    IMAGE_UPDATED = 1,       // A new revision on top of the previous one
+    IMAGE_BUILT = 2,         // The image's first revision
+    IMAGE_RESULT_COUNT = 3,
+};
+static const char* image_result_names[IMAGE_RESULT_COUNT] = {"attached", "updated", "built"};
+
+// Partial stitching is only worth it if huge pages cover at least this fraction
+static const double MIN_PARTIAL_FRACTION = 0.25;
+
+// Smallest file mapping placed on huge pages (HUGEPAGE_WRAPPER_MIN_SIZE_MB)
+static const size_t DEFAULT_MIN_SIZE_FOR_HUGEPAGES = 1ULL * 1024 * 1024 * 1024;
+
+// Regular memory kept free for KV cache and compute buffers (HUGEPAGE_WRAPPER_RESERVE_MB)
+static const size_t DEFAULT_MEMORY_RESERVE = 4ULL * 1024 * 1024 * 1024;
+
+// Memory available to this process, from the cgroup and the huge page pool.
+// Limits are SIZE_MAX when unlimited.
+struct MemoryBudget {
+    size_t hugepage_size;
+    size_t pool_free;        // Free minus reserved pages of the default size pool, in bytes
+    size_t hugetlb_limit;    // hugetlb.<size>.max
+    size_t hugetlb_usage;    // hugetlb.<size>.current
+    size_t memory_limit;     // memory.max
+    size_t memory_usage;     // memory.current
+    size_t memory_headroom;  // Smallest (max - current) along the cgroup path
+};
+
+// Cumulative decisions, exported through HUGEPAGE_WRAPPER_METRICS
+struct WrapperMetrics {
+    unsigned long mappings[STRATEGY_COUNT];
+    size_t hugetlb_bytes;
+    size_t anonymous_bytes;
+    size_t file_backed_bytes;
+    unsigned long image_loads[IMAGE_RESULT_COUNT];
+    size_t image_written_pages;
+    size_t image_reused_pages;
+    size_t image_read_bytes;
+    size_t image_copied_bytes;
+    unsigned long physical_loads; // Loads read in device order
+    size_t load_extents;
+    size_t load_extent_jumps;
+    MemoryBudget budget;     // Budget seen at the last decision
+};
+static WrapperMetrics metrics = {};
+
+// Model file formats recognised at interception
+enum ModelFormat {
+    FORMAT_GGUF = 0,
+    FORMAT_SAFETENSORS = 1,
+    FORMAT_PYTORCH = 2,
+    FORMAT_COUNT = 3,
+    FORMAT_UNKNOWN = 3,
+};
+static const char* format_names[FORMAT_COUNT + 1] = {"gguf", "safetensors", "pytorch", "unknown"};
+static unsigned long format_mappings[FORMAT_COUNT + 1] = {};
+
+// Tensor layout of an intercepted file, used to split the parallel load
+// and for address lookups once mapped
+struct ModelIndex {
+    ModelFormat format;
+    size_t tensor_count;
+    std::vector<uint64_t> tensor_starts; // Absolute file offsets, sorted
+    std::vector<TensorSpan> tensors;
+};
+
+// Lookup tables of mapped models (tensor_lookup.h). Tables are never freed,
+// so lookups take no lock. munmap retires a table by zeroing its base, and
+// the next model published takes the first retired slot; tensor_table_count
+// ends after the last live slot, so lookups scan at most the models mapped
+// at once plus the holes between them.
+static const size_t MAX_TENSOR_TABLES = 64;
+static TensorTable* tensor_tables[MAX_TENSOR_TABLES];   // atomic pointers
+static size_t tensor_table_count = 0;    // atomic
+
+// Loader threads never get less than this much of the file each
+static const size_t MIN_BYTES_PER_LOADER = 64ULL * 1024 * 1024;
+static const int DEFAULT_MAX_LOADERS = 8;
+
+// Read once at load; checked on every mmap
+static size_t min_size_for_hugepages = DEFAULT_MIN_SIZE_FOR_HUGEPAGES;
+static unsigned formats_enabled = (1u << FORMAT_GGUF) | (1u << FORMAT_SAFETENSORS) | (1u << FORMAT_PYTORCH);
+static bool any_format = false;
+static int load_threads = 1;
+static const char* image_dir = nullptr; // HUGEPAGE_WRAPPER_IMAGE_DIR
+
+// Load pipeline stages (hugepage_load_stage.h): registered at load, with
+// their cumulative processing time across loads
+static const size_t MAX_STAGES = 32;
+static const size_t DEFAULT_CHUNK_SIZE = 4ULL * 1024 * 1024;
+static const char* DEFAULT_PIPELINE = "pread";
+static const hpw_stage* stage_registry[MAX_STAGES];
+static uint64_t stage_ns[MAX_STAGES];
+static size_t stage_count = 0;
+static size_t chunk_size = DEFAULT_CHUNK_SIZE;
+static const char* stage_kind_names[] = {"source", "transform", "placement"};
+
+// Startup calibration (hugepage_calibrate.h), run once at the first private
+// model load within HUGEPAGE_WRAPPER_CALIBRATE_MS
+static const uint64_t DEFAULT_CALIBRATE_MS = 2000;
+static const size_t CALIBRATE_READ_BYTES = 64ULL * 1024 * 1024;   // Per read engine
+static const size_t CALIBRATE_MIN_READ = 1ULL * 1024 * 1024;
+static const size_t CALIBRATE_MAX_SAMPLE = 1ULL * 1024 * 1024 * 1024;
+static const size_t CALIBRATE_LOADS = 1ULL << 20;                 // Dependent loads per page size
+// Below this sample the base page comparison is reported but not acted on:
+// the TLB reach of huge pages only shows over large regions
+static const size_t CALIBRATE_MIN_TLB_SAMPLE = 256ULL * 1024 * 1024;
+static const double RESIDENT_FOR_PREAD = 0.5;   // Mostly cached: copy from the page cache
+static const double DIRECT_MIN_GAIN = 1.10;     // O_DIRECT must read 10% faster to be used
+static const double LARGER_PAGE_GAIN = 1.03;    // A larger page size must be 3% faster
+static const double MIN_TLB_GAIN = 0.05;        // Huge pages must cut latency 5%, else file-backed
+static const int CALIBRATE_TLB_ROUNDS = 5;      // ... in none of this many interleaved rounds
+static const int MAX_PAGE_SIZES = 4;            // Base pages and up to three huge page sizes
+
+// Where a part of the load policy came from
+enum PolicySource {
+    POLICY_DEFAULT = 0,
+    POLICY_CALIBRATED = 1,
+    POLICY_OVERRIDE = 2,
+};
+static const char* policy_source_names[] = {"default", "calibrated", "override"};
+
+struct PageSizeSample {
+    size_t page_size;
+    bool fits;               // Its usable pool holds the model
+    double fault_ns;         // Per page to map and fault; 0 if not measured
+    double access_ns;        // Per dependent load over the sample; 0 if not measured
+};
+
+struct Calibration {
+    bool done;
+    double seconds;
+    double resident;         // Share of the model in the page cache, -1 if unknown
+    double pread_bps;        // Read bandwidth by engine, 0 if not measured
+    double direct_bps;
+    size_t sample_bytes;     // Region of the page size measurements
+    PageSizeSample sizes[MAX_PAGE_SIZES];
+    int size_count;
+    // The policy: default source stage, huge page size (0 = the default
+    // size) and whether private loads stay file-backed
+    const char* engine;
+    size_t page_size;
+    bool file_policy;
+    int tlb_losses;          // Rounds in a row huge pages did not beat base pages
+    PolicySource engine_source;
+    PolicySource page_source;
+};
+static Calibration calibration = {false, 0, -1, 0, 0, 0, {}, 0, DEFAULT_PIPELINE, 0, false, 0,
+                                  POLICY_DEFAULT, POLICY_DEFAULT};
+static pthread_mutex_t calibration_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Live progress page (hugepage_progress.h), nullptr without
+// HUGEPAGE_WRAPPER_PROGRESS. Loads are numbered; chunks of a load that is no
+// longer the latest one started are not counted.
+static LoadProgress* progress = nullptr;
+static uint64_t progress_load = 0;
+static pthread_mutex_t progress_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Initialize function pointers to real functions
+static void init_functions() {
+    if (!real_mmap) {
+        real_mmap = (mmap_fn)dlsym(RTLD_NEXT, "mmap");
+        if (!real_mmap) {
+            fprintf(stderr, "ERROR: hugepage_wrapper: Failed to find real mmap: %s\n", dlerror());
+            exit(1);
+        }
+    }
+    if (!real_munmap) {
+        real_munmap = (munmap_fn)dlsym(RTLD_NEXT, "munmap");
+        if (!real_munmap) {
+            fprintf(stderr, "ERROR: hugepage_wrapper: Failed to find real munmap: %s\n", dlerror());
+            exit(1);
+        }
+    }
+}
+
+// Check if we should use huge pages for this file
+static bool should_use_hugepages(size_t length) {
+    // Use huge pages for any large file; HUGEPAGE_WRAPPER_MIN_SIZE_MB is lowered
+    // to also place a speculative decoding draft model next to the main model
+    return length >= min_size_for_hugepages;
+}
+
+static size_t align_up(size_t value, size_t alignment) {
+    return (value + alignment - 1) / alignment * alignment;
+}
+
+static size_t min_size(size_t a, size_t b) {
+    return a < b ? a : b;
+}
+
+// Identify a model file from its first bytes
+static ModelFormat detect_format(int fd) {
+    unsigned char head[64] = {0};
+    ssize_t n;
+    do {
+        n = pread(fd, head, sizeof(head), 0);
+    } while (n < 0 && errno == EINTR);
+    if (n < 16) {
+        return FORMAT_UNKNOWN;
+    }
+    uint32_t magic;
+    memcpy(&magic, head, sizeof(magic));
+    if (magic == GGUF_MAGIC) {
+        return FORMAT_GGUF;
+    }
+    // torch.save archives are zips whose first entry is "<archive>/data.pkl"
+    if (memcmp(head, "PK\x03\x04", 4) == 0) {
+        uint16_t name_len = head[26] | (head[27] << 8);
+        const char* name = (const char*)head + 30;
+        if (name_len >= 8 && 30 + name_len <= n && memcmp(name + name_len - 8, "data.pkl", 8) == 0) {
+            return FORMAT_PYTORCH;
+        }
+        return FORMAT_UNKNOWN;
+    }
+    // safetensors: u64 header length, then the JSON header
+    uint64_t header_size;
+    memcpy(&header_size, head, sizeof(header_size));
+    if (header_size >= 2 && header_size <= SAFETENSORS_MAX_HEADER && head[8] == '{') {
+        return FORMAT_SAFETENSORS;
+    }
+    return FORMAT_UNKNOWN;
+}
+
+// Recognise the file and read its tensor index. Returns false if the file
+// should not be intercepted: a disabled format, or a header that does not
+// describe the file (the application reports that itself on the real mapping).
+static bool index_model(int fd, size_t file_size, ModelIndex* index) {
+    index->format = detect_format(fd);
+    index->tensor_count = 0;
+    index->tensor_starts.clear();
+    index->tensors.clear();
+    if (index->format == FORMAT_UNKNOWN) {
+        return any_format;
+    }
+    if (!any_format && !(formats_enabled & (1u << index->format))) {
+        return false;
+    }
+
+    std::string error;
+    if (index->format == FORMAT_GGUF) {
+        GGUFModel m;
+        if (!gguf_read(fd, &m, &error)) {
+            fprintf(stderr, "WARNING: hugepage_wrapper: Invalid GGUF header (%s), not intercepting\n", error.c_str());
+            return false;
+        }
+        uint64_t data_end = m.data_offset;
+        for (const GGUFTensorInfo& t : m.tensors) {
+            index->tensor_starts.push_back(m.data_offset + t.offset);
+            index->tensors.push_back({m.data_offset + t.offset, t.size, t.name});
+            data_end = std::max(data_end, m.data_offset + t.offset + t.size);
+        }
+        if (data_end > file_size) {
+            fprintf(stderr, "WARNING: hugepage_wrapper: GGUF tensor data extends past the end of the file, "
+                    "not intercepting\n");
+            return false;
+        }
+        index->tensor_count = m.tensors.size();
+    } else if (index->format == FORMAT_SAFETENSORS) {
+        SafetensorsModel m;
+        if (!safetensors_read(fd, &m, &error)) {
+            fprintf(stderr, "WARNING: hugepage_wrapper: Invalid safetensors header (%s), not intercepting\n",
+                    error.c_str());
+            return false;
+        }
+        for (const SafetensorsTensorInfo& t : m.tensors) {
+            index->tensor_starts.push_back(m.data_offset + t.begin);
+            index->tensors.push_back({m.data_offset + t.begin, t.end - t.begin, t.name});
+        }
+        index->tensor_count = m.tensors.size();
+    }
+    // PyTorch archives are loaded without an index: storages are zip entries
+    // whose offsets live in the central directory at the end of the file
+    std::sort(index->tensor_starts.begin(), index->tensor_starts.end());
+    return true;
+}
+
+// Read a byte count from a cgroup/sysfs file; "max" and missing files are unlimited
+static size_t read_limit_file(const char* path) {
+    FILE* f = fopen(path, "r");
+    if (!f) {
+        return SIZE_MAX;
+    }
+    char buf[64] = {0};
+    size_t value = SIZE_MAX;
+    if (fgets(buf, sizeof(buf), f) && strncmp(buf, "max", 3) != 0) {
+        value = strtoull(buf, nullptr, 10);
+        // cgroup v1 reports "unlimited" as a page-rounded LONG_MAX
+        if (value >= (1ULL << 62)) {
+            value = SIZE_MAX;
+        }
+    }
+    fclose(f);
+    return value;
+}
+
+// Value of a /proc/meminfo field in bytes, 0 if absent
+static size_t meminfo_bytes(const char* field) {
+    FILE* f = fopen("/proc/meminfo", "r");
+    if (!f) {
+        return 0;
+    }
+    char line[256];
+    size_t len = strlen(field);
+    size_t value = 0;
+    while (fgets(line, sizeof(line), f)) {
+        if (strncmp(line, field, len) == 0 && line[len] == ':') {
+            value = strtoull(line + len + 1, nullptr, 10) * 1024;
+            break;
+        }
+    }
+    fclose(f);
+    return value;
+}
+
+// Path of this process in a cgroup hierarchy from /proc/self/cgroup.
+// controller is nullptr for the unified (v2) hierarchy.
+static bool read_cgroup_path(const char* controller, char* out, size_t out_size) {
+    FILE* f = fopen("/proc/self/cgroup", "r");
+    if (!f) {
+        return false;
+    }
+    char line[1024];
+    bool found = false;
+    while (!found && fgets(line, sizeof(line), f)) {
+        // Format: hierarchy-id:controller-list:path
+        char* controllers = strchr(line, ':');
+        char* path = controllers ? strchr(controllers + 1, ':') : nullptr;
+        if (!path) {
+            continue;
+        }
+        *controllers++ = '\0';
+        *path++ = '\0';
+        path[strcspn(path, "\n")] = '\0';
+        if (controller == nullptr) {
+            found = strcmp(line, "0") == 0 && *controllers == '\0';
+        } else {
+            for (char* tok = strtok(controllers, ","); tok && !found; tok = strtok(nullptr, ",")) {
+                found = strcmp(tok, controller) == 0;
+            }
+        }
+        if (found) {
+            snprintf(out, out_size, "%s", path);
+        }
+    }
+    fclose(f);
+    return found;
+}
+
+// Walk from the cgroup up to the hierarchy root. A child can be limited by any
+// ancestor, so the effective limit and headroom are the smallest seen.
+static void walk_cgroup_limits(const char* root, const char* cgroup, const char* max_file,
+                               const char* usage_file, size_t* limit, size_t* usage, size_t* headroom) {
+    char dir[1024], path[1280];
+    snprintf(dir, sizeof(dir), "%s%s", root, strcmp(cgroup, "/") == 0 ? "" : cgroup);
+    *limit = SIZE_MAX;
+    *usage = 0;
+    *headroom = SIZE_MAX;
+    bool leaf = true;
+    for (;;) {
+        snprintf(path, sizeof(path), "%s/%s", dir, max_file);
+        size_t max = read_limit_file(path);
+        snprintf(path, sizeof(path), "%s/%s", dir, usage_file);
+        size_t current = read_limit_file(path);
+        if (current == SIZE_MAX) {
+            current = 0;
+        }
+        if (leaf) {
+            *usage = current;
+            leaf = false;
+        }
+        if (max != SIZE_MAX) {
+            *limit = min_size(*limit, max);
+            *headroom = min_size(*headroom, max > current ? max - current : 0);
+        }
+        char* slash = strrchr(dir, '/');
+        if (strlen(dir) <= strlen(root) || !slash) {
+            break;
+        }
+        *slash = '\0';
+    }
+}
+
+// Budget for huge pages of `page_size` bytes, 0 for the default size
+static void read_memory_budget(MemoryBudget* b, size_t page_size) {
+    b->hugepage_size = page_size ? page_size : meminfo_bytes("Hugepagesize");
+    if (b->hugepage_size == 0) {
+        b->hugepage_size = 2ULL * 1024 * 1024;
+    }
+
+    // Pool state of that huge page size
+    char path[256];
+    snprintf(path, sizeof(path), "/sys/kernel/mm/hugepages/hugepages-%zukB/free_hugepages",
+             b->hugepage_size / 1024);
+    size_t free_pages = read_limit_file(path);
+    snprintf(path, sizeof(path), "/sys/kernel/mm/hugepages/hugepages-%zukB/resv_hugepages",
+             b->hugepage_size / 1024);
+    size_t resv_pages = read_limit_file(path);
+    if (free_pages == SIZE_MAX) free_pages = 0;
+    if (resv_pages == SIZE_MAX) resv_pages = 0;
+    b->pool_free = free_pages > resv_pages ? (free_pages - resv_pages) * b->hugepage_size : 0;
+
+    // hugetlb controller files are named by page size: 2MB, 1GB, 64KB, ...
+    char size_label[24];
+    if (b->hugepage_size >= 1024ULL * 1024 * 1024) {
+        snprintf(size_label, sizeof(size_label), "%zuGB", b->hugepage_size >> 30);
+    } else if (b->hugepage_size >= 1024ULL * 1024) {
+        snprintf(size_label, sizeof(size_label), "%zuMB", b->hugepage_size >> 20);
+    } else {
+        snprintf(size_label, sizeof(size_label), "%zuKB", b->hugepage_size >> 10);
+    }
+
+    char cgroup[512], max_file[64], usage_file[64];
+    size_t hugetlb_headroom;
+    if (access("/sys/fs/cgroup/cgroup.controllers", F_OK) == 0 &&
+        read_cgroup_path(nullptr, cgroup, sizeof(cgroup))) {
+        // cgroup v2: one unified hierarchy
+        walk_cgroup_limits("/sys/fs/cgroup", cgroup, "memory.max", "memory.current",
+                           &b->memory_limit, &b->memory_usage, &b->memory_headroom);
+        snprintf(max_file, sizeof(max_file), "hugetlb.%s.max", size_label);
+        snprintf(usage_file, sizeof(usage_file), "hugetlb.%s.current", size_label);
+        walk_cgroup_limits("/sys/fs/cgroup", cgroup, max_file, usage_file,
+                           &b->hugetlb_limit, &b->hugetlb_usage, &hugetlb_headroom);
+    } else {
+        // cgroup v1 (or hybrid): one hierarchy per controller
+        b->memory_limit = b->hugetlb_limit = b->memory_headroom = hugetlb_headroom = SIZE_MAX;
+        b->memory_usage = b->hugetlb_usage = 0;
+        if (read_cgroup_path("memory", cgroup, sizeof(cgroup))) {
+            walk_cgroup_limits("/sys/fs/cgroup/memory", cgroup, "memory.limit_in_bytes",
+                               "memory.usage_in_bytes", &b->memory_limit, &b->memory_usage,
+                               &b->memory_headroom);
+        }
+        if (read_cgroup_path("hugetlb", cgroup, sizeof(cgroup))) {
+            snprintf(max_file, sizeof(max_file), "hugetlb.%s.limit_in_bytes", size_label);
+            snprintf(usage_file, sizeof(usage_file), "hugetlb.%s.usage_in_bytes", size_label);
+            walk_cgroup_limits("/sys/fs/cgroup/hugetlb", cgroup, max_file, usage_file,
+                               &b->hugetlb_limit, &b->hugetlb_usage, &hugetlb_headroom);
+        }
+    }
+
+    // Huge pages we can actually fault in: the pool and the cgroup must both allow it
+    b->pool_free = min_size(b->pool_free, hugetlb_headroom);
+}
+
+// Regular memory to leave free for the KV cache and compute buffers
+static size_t memory_reserve() {
+    const char* env = getenv("HUGEPAGE_WRAPPER_RESERVE_MB");
+    if (env && *env) {
+        return strtoull(env, nullptr, 10) * 1024 * 1024;
+    }
+    return DEFAULT_MEMORY_RESERVE;
+}
+
+// Path of an open file for logs and progress, "" if unknown
+static void fd_path(int fd, char* out, size_t out_size) {
+    char link[64];
+    snprintf(link, sizeof(link), "/proc/self/fd/%d", fd);
+    ssize_t n = readlink(link, out, out_size - 1);
+    out[n > 0 ? n : 0] = '\0';
+}
+
+// Map the progress file, resetting what a previous process left in it
+static void progress_open(const char* path) {
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0 || ftruncate(fd, PROGRESS_FILE_BYTES) != 0) {
+        fprintf(stderr, "WARNING: hugepage_wrapper: Cannot open progress file %s: %s\n", path, strerror(errno));
+        if (fd >= 0) close(fd);
+        return;
+    }
+    void* mem = real_mmap(nullptr, PROGRESS_FILE_BYTES, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mem == MAP_FAILED) {
+        fprintf(stderr, "WARNING: hugepage_wrapper: Cannot map progress file %s: %s\n", path, strerror(errno));
+        return;
+    }
+    LoadProgress* p = (LoadProgress*)mem;
+    uint64_t seq = (__atomic_load_n(&p->seq, __ATOMIC_RELAXED) | 1) + 2; // Odd, and not one a reader saw
+    __atomic_store_n(&p->seq, seq, __ATOMIC_RELEASE);
+    p->magic = PROGRESS_MAGIC;
+    p->version = PROGRESS_VERSION;
+    p->pid = getpid();
+    p->state = LOAD_STARTING;
+    p->models = 0;
+    p->started_ns = p->updated_ns = progress_now_ns();
+    p->total_bytes = p->loaded_bytes = 0;
+    p->stage[0] = '\0';
+    p->path[0] = '\0';
+    __atomic_store_n(&p->seq, seq + 1, __ATOMIC_RELEASE);
+    progress = p;
+}
+
+// Publish a new state; LOAD_LOADING starts a load of `total` bytes and
+// restarts the counters. A null stage or path keeps the current one. Returns
+// the load's number for progress_add().
+static uint64_t progress_set(LoadState state, const char* stage, const char* path, uint64_t total) {
+    if (!progress) {
+        return 0;
+    }
+    pthread_mutex_lock(&progress_lock);
+    uint64_t seq = __atomic_load_n(&progress->seq, __ATOMIC_RELAXED);
+    __atomic_store_n(&progress->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    uint64_t now = progress_now_ns();
+    if (state == LOAD_LOADING) {
+        progress_load++;
+        progress->started_ns = now;
+        progress->total_bytes = total;
+        __atomic_store_n(&progress->loaded_bytes, 0, __ATOMIC_RELAXED);
+    }
+    if (state == LOAD_LOADED) {
+        progress->models++;
+    }
+    progress->state = state;
+    if (stage) {
+        snprintf(progress->stage, sizeof(progress->stage), "%s", stage);
+    }
+    if (path) {
+        snprintf(progress->path, sizeof(progress->path), "%s", path);
+    }
+    __atomic_store_n(&progress->updated_ns, now, __ATOMIC_RELAXED);
+    __atomic_store_n(&progress->seq, seq + 2, __ATOMIC_RELEASE);
+    uint64_t load = progress_load;
+    pthread_mutex_unlock(&progress_lock);
+    return load;
+}
+
+static void progress_add(uint64_t load, size_t bytes) {
+    if (progress && __atomic_load_n(&progress_load, __ATOMIC_RELAXED) == load) {
+        __atomic_fetch_add(&progress->loaded_bytes, bytes, __ATOMIC_RELAXED);
+        __atomic_store_n(&progress->updated_ns, progress_now_ns(), __ATOMIC_RELAXED);
+    }
+}
+
+// Pick a strategy for a mapping of `length` bytes; *huge_bytes gets the huge page part
+static LoadStrategy choose_strategy(size_t length, const MemoryBudget* b, size_t* huge_bytes) {
+    size_t aligned = align_up(length, b->hugepage_size);
+    size_t usable = b->pool_free / b->hugepage_size * b->hugepage_size;
+    LoadStrategy strategy;
+
+    const char* forced = getenv("HUGEPAGE_WRAPPER_STRATEGY");
+    if (forced && strcmp(forced, "full") == 0) {
+        strategy = STRATEGY_FULL;
+    } else if (forced && strcmp(forced, "file") == 0) {
+        strategy = STRATEGY_FILE;
+    } else if (forced && strcmp(forced, "partial") == 0) {
+        strategy = usable >= aligned ? STRATEGY_FULL : STRATEGY_PARTIAL;
+    } else if (calibration.file_policy) {
+        strategy = STRATEGY_FILE;
+    } else if (usable >= aligned) {
+        strategy = STRATEGY_FULL;
+    } else if (usable >= length * MIN_PARTIAL_FRACTION) {
+        strategy = STRATEGY_PARTIAL;
+    } else {
+        strategy = STRATEGY_FILE;
+    }
+
+    if (strategy == STRATEGY_PARTIAL && usable == 0) {
+        strategy = STRATEGY_FILE;
+    }
+    *huge_bytes = strategy == STRATEGY_FULL ? aligned : strategy == STRATEGY_PARTIAL ? usable : 0;
+    return strategy;
+}
+
+// Page size label for logs and metrics: "4K", "2M", "1G"
+static void format_page_size(size_t page_size, char* out, size_t out_size) {
+    if (page_size >= 1024ULL * 1024 * 1024) {
+        snprintf(out, out_size, "%zuG", page_size >> 30);
+    } else if (page_size >= 1024ULL * 1024) {
+        snprintf(out, out_size, "%zuM", page_size >> 20);
+    } else {
+        snprintf(out, out_size, "%zuK", page_size >> 10);
+    }
+}
+
+// Write the metrics file atomically (temp file + rename) so scrapers never see a partial file
+static void write_metrics() {
+    const char* path = getenv("HUGEPAGE_WRAPPER_METRICS");
+    if (!path || !*path) {
+        return;
+    }
+    char tmp[1024];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    FILE* f = fopen(tmp, "w");
+    if (!f) {
+        fprintf(stderr, "WARNING: hugepage_wrapper: Cannot write metrics to %s: %s\n", tmp, strerror(errno));
+        return;
+    }
+
+    const MemoryBudget* b = &metrics.budget;
+    fprintf(f, "# HELP hugepage_wrapper_mappings_total Model mappings by placement strategy\n");
+    fprintf(f, "# TYPE hugepage_wrapper_mappings_total counter\n");
+    for (int i = 0; i < STRATEGY_COUNT; i++) {
+        fprintf(f, "hugepage_wrapper_mappings_total{strategy=\"%s\"} %lu\n", strategy_names[i], metrics.mappings[i]);
+    }
+    fprintf(f, "# HELP hugepage_wrapper_model_files_total Intercepted model mappings by file format\n");
+    fprintf(f, "# TYPE hugepage_wrapper_model_files_total counter\n");
+    for (int i = 0; i <= FORMAT_COUNT; i++) {
+        fprintf(f, "hugepage_wrapper_model_files_total{format=\"%s\"} %lu\n", format_names[i], format_mappings[i]);
+    }
+    fprintf(f, "# HELP hugepage_wrapper_stage_seconds_total Time spent in each load pipeline stage, summed over threads\n");
+    fprintf(f, "# TYPE hugepage_wrapper_stage_seconds_total counter\n");
+    for (size_t i = 0; i < stage_count; i++) {
+        fprintf(f, "hugepage_wrapper_stage_seconds_total{stage=\"%s\",kind=\"%s\"} %.3f\n", stage_registry[i]->name,
+                stage_kind_names[stage_registry[i]->kind], stage_ns[i] / 1e9);
+    }
+    fprintf(f, "# HELP hugepage_wrapper_physical_order_loads_total Loads of fragmented files read in device order\n");
+    fprintf(f, "# TYPE hugepage_wrapper_physical_order_loads_total counter\n");
+    fprintf(f, "hugepage_wrapper_physical_order_loads_total %lu\n", metrics.physical_loads);
+    fprintf(f, "# HELP hugepage_wrapper_load_extents_total Extents of the files read in device order\n");
+    fprintf(f, "# TYPE hugepage_wrapper_load_extents_total counter\n");
+    fprintf(f, "hugepage_wrapper_load_extents_total %zu\n", metrics.load_extents);
+    fprintf(f, "# HELP hugepage_wrapper_load_extent_jumps_total Device seeks a file-order read of those files would make\n");
+    fprintf(f, "# TYPE hugepage_wrapper_load_extent_jumps_total counter\n");
+    fprintf(f, "hugepage_wrapper_load_extent_jumps_total %zu\n", metrics.load_extent_jumps);
+    fprintf(f, "# HELP hugepage_wrapper_bytes Model bytes by backing memory\n");
+    fprintf(f, "# TYPE hugepage_wrapper_bytes gauge\n");
+    fprintf(f, "hugepage_wrapper_bytes{backing=\"hugetlb\"} %zu\n", metrics.hugetlb_bytes);
+    fprintf(f, "hugepage_wrapper_bytes{backing=\"anonymous\"} %zu\n", metrics.anonymous_bytes);
+    fprintf(f, "hugepage_wrapper_bytes{backing=\"file\"} %zu\n", metrics.file_backed_bytes);
+    if (image_dir) {
+        fprintf(f, "# HELP hugepage_wrapper_image_loads_total Shared image mappings by how the revision was obtained\n");
+        fprintf(f, "# TYPE hugepage_wrapper_image_loads_total counter\n");
+        for (int i = 0; i < IMAGE_RESULT_COUNT; i++) {
+            fprintf(f, "hugepage_wrapper_image_loads_total{result=\"%s\"} %lu\n", image_result_names[i],
+                    metrics.image_loads[i]);
+        }
+        fprintf(f, "# HELP hugepage_wrapper_image_pages_total Pool pages of new image revisions\n");
+        fprintf(f, "# TYPE hugepage_wrapper_image_pages_total counter\n");
+        fprintf(f, "hugepage_wrapper_image_pages_total{result=\"written\"} %zu\n", metrics.image_written_pages);
+        fprintf(f, "hugepage_wrapper_image_pages_total{result=\"reused\"} %zu\n", metrics.image_reused_pages);
+        fprintf(f, "# HELP hugepage_wrapper_image_bytes_total Bytes written into new image revisions by source\n");
+        fprintf(f, "# TYPE hugepage_wrapper_image_bytes_total counter\n");
+        fprintf(f, "hugepage_wrapper_image_bytes_total{source=\"file\"} %zu\n", metrics.image_read_bytes);
+        fprintf(f, "hugepage_wrapper_image_bytes_total{source=\"copied\"} %zu\n", metrics.image_copied_bytes);
+    }
+
+    const Calibration* c = &calibration;
+    char label[16];
+    if (c->page_size) {
+        format_page_size(c->page_size, label, sizeof(label));
+    } else {
+        format_page_size(b->hugepage_size, label, sizeof(label));
+    }
+    fprintf(f, "# HELP hugepage_wrapper_policy Load policy in effect and where each part came from\n");
+    fprintf(f, "# TYPE hugepage_wrapper_policy gauge\n");
+    fprintf(f, "hugepage_wrapper_policy{engine=\"%s\",page_size=\"%s\",placement=\"%s\",engine_source=\"%s\","
+            "page_size_source=\"%s\"} 1\n", c->engine, label, c->file_policy ? "file" : "hugetlb",
+            policy_source_names[c->engine_source], policy_source_names[c->page_source]);
+    if (c->seconds > 0) {
+        fprintf(f, "# HELP hugepage_wrapper_calibration_seconds Time spent measuring the host at startup\n");
+        fprintf(f, "# TYPE hugepage_wrapper_calibration_seconds gauge\n");
+        fprintf(f, "hugepage_wrapper_calibration_seconds %.3f\n", c->seconds);
+        fprintf(f, "# HELP hugepage_wrapper_calibration_page_cache_ratio Share of the model in the page cache\n");
+        fprintf(f, "# TYPE hugepage_wrapper_calibration_page_cache_ratio gauge\n");
+        fprintf(f, "hugepage_wrapper_calibration_page_cache_ratio %.3f\n", c->resident < 0 ? 0 : c->resident);
+        fprintf(f, "# HELP hugepage_wrapper_calibration_read_bytes_per_second Model read bandwidth by engine\n");
+        fprintf(f, "# TYPE hugepage_wrapper_calibration_read_bytes_per_second gauge\n");
+        fprintf(f, "hugepage_wrapper_calibration_read_bytes_per_second{engine=\"pread\"} %.0f\n", c->pread_bps);
+        fprintf(f, "hugepage_wrapper_calibration_read_bytes_per_second{engine=\"direct\"} %.0f\n", c->direct_bps);
+        fprintf(f, "# HELP hugepage_wrapper_calibration_fault_seconds_per_gb Time to allocate and fault 1 GB by page size\n");
+        fprintf(f, "# TYPE hugepage_wrapper_calibration_fault_seconds_per_gb gauge\n");
+        for (int i = 0; i < c->size_count; i++) {
+            if (c->sizes[i].fault_ns > 0) {
+                format_page_size(c->sizes[i].page_size, label, sizeof(label));
+                fprintf(f, "hugepage_wrapper_calibration_fault_seconds_per_gb{page_size=\"%s\"} %.4f\n", label,
+                        c->sizes[i].fault_ns * (1024.0 * 1024.0 * 1024.0 / c->sizes[i].page_size) / 1e9);
+            }
+        }
+        fprintf(f, "# HELP hugepage_wrapper_calibration_tlb_losses Rounds in a row huge pages did not beat base pages\n");
+        fprintf(f, "# TYPE hugepage_wrapper_calibration_tlb_losses gauge\n");
+        fprintf(f, "hugepage_wrapper_calibration_tlb_losses %d\n", c->tlb_losses);
+        fprintf(f, "# HELP hugepage_wrapper_calibration_access_ns Latency of a dependent random load over the sample by page size\n");
+        fprintf(f, "# TYPE hugepage_wrapper_calibration_access_ns gauge\n");
+        for (int i = 0; i < c->size_count; i++) {
+            if (c->sizes[i].access_ns > 0) {
+                format_page_size(c->sizes[i].page_size, label, sizeof(label));
+                fprintf(f, "hugepage_wrapper_calibration_access_ns{page_size=\"%s\"} %.2f\n", label,
+                        c->sizes[i].access_ns);
+            }
+        }
+    }
+
+    // Budget at the last decision; unlimited values are reported as +Inf
+    const char* names[] = {"hugepage_size", "hugepage_pool_free", "hugetlb_limit", "hugetlb_usage",
+                           "memory_limit", "memory_usage", "memory_headroom"};
+    size_t values[] = {b->hugepage_size, b->pool_free, b->hugetlb_limit, b->hugetlb_usage,
+                       b->memory_limit, b->memory_usage, b->memory_headroom};
+    for (size_t i = 0; i < sizeof(values) / sizeof(values[0]); i++) {
+        fprintf(f, "# TYPE hugepage_wrapper_%s_bytes gauge\n", names[i]);
+        if (values[i] == SIZE_MAX) {
+            fprintf(f, "hugepage_wrapper_%s_bytes +Inf\n", names[i]);
+        } else {
+            fprintf(f, "hugepage_wrapper_%s_bytes %zu\n", names[i], values[i]);
+        }
+    }
+
+    if (fclose(f) != 0 || rename(tmp, path) != 0) {
+        fprintf(stderr, "WARNING: hugepage_wrapper: Cannot write metrics to %s: %s\n", path, strerror(errno));
+        unlink(tmp);
+    }
+}
+
+static void log_budget(const MemoryBudget* b) {
+    char limit[32], headroom[32];
+    if (b->memory_limit == SIZE_MAX) {
+        snprintf(limit, sizeof(limit), "unlimited");
+    } else {
+        snprintf(limit, sizeof(limit), "%.2f GB", b->memory_limit / (1024.0 * 1024.0 * 1024.0));
+    }
+    if (b->memory_headroom == SIZE_MAX) {
+        snprintf(headroom, sizeof(headroom), "unlimited");
+    } else {
+        snprintf(headroom, sizeof(headroom), "%.2f GB", b->memory_headroom / (1024.0 * 1024.0 * 1024.0));
+    }
+    fprintf(stderr, "hugepage_wrapper: Budget: %.2f GB huge pages usable (%zu KB pages), "
+            "memory.max %s, headroom %s\n",
+            b->pool_free / (1024.0 * 1024.0 * 1024.0), b->hugepage_size / 1024, limit, headroom);
+}
+
+// Page size from HUGEPAGE_WRAPPER_PAGE_SIZE: "2M", "2MB", "1G", "2048kB" or bytes
+static size_t parse_page_size(const char* value) {
+    char* end;
+    unsigned long long n = strtoull(value, &end, 10);
+    switch (*end) {
+        case 'k': case 'K': n <<= 10; break;
+        case 'm': case 'M': n <<= 20; break;
+        case 'g': case 'G': n <<= 30; break;
+        default: break;
+    }
+    return n && (n & (n - 1)) == 0 ? (size_t)n : 0;
+}
+
+// Source stage named in HUGEPAGE_WRAPPER_PIPELINE, which then decides the
+// read engine instead of calibration; nullptr if it names none
+static const char* pipeline_source() {
+    const char* spec = getenv("HUGEPAGE_WRAPPER_PIPELINE");
+    if (!spec || !*spec) {
+        return nullptr;
+    }
+    std::string list = spec;
+    size_t pos = 0;
+    while (pos <= list.size()) {
+        size_t comma = list.find(',', pos);
+        std::string item = list.substr(pos, comma == std::string::npos ? std::string::npos : comma - pos);
+        item = item.substr(0, item.find(':'));
+        for (size_t i = 0; i < stage_count; i++) {
+            if (item == stage_registry[i]->name && stage_registry[i]->kind == HPW_STAGE_SOURCE) {
+                return stage_registry[i]->name;
+            }
+        }
+        if (comma == std::string::npos) {
+            break;
+        }
+        pos = comma + 1;
+    }
+    return nullptr;
+}
+
+// Rounds in a row, up to CALIBRATE_TLB_ROUNDS and counting the first
+// measurement, in which huge pages of `huge` fail to cut the latency of
+// dependent loads over the base page region by MIN_TLB_GAIN. The two regions
+// are measured alternately so drift on the host hits both; stops at the first
+// round huge pages win or at the deadline.
+static int tlb_losses(const PageSizeSample& huge, const char* base_region, size_t bytes, uint64_t deadline) {
+    void* region;
+    fault_in(bytes, huge.page_size, hugetlb_flags(huge.page_size), real_mmap, &region);
+    if (region == MAP_FAILED) {
+        return 1;
+    }
+    int losses = 1;
+    while (losses < CALIBRATE_TLB_ROUNDS) {
+        double huge_ns = access_latency((const char*)region, bytes, CALIBRATE_LOADS, deadline);
+        double base_ns = access_latency(base_region, bytes, CALIBRATE_LOADS, deadline);
+        if (calibrate_now_ns() >= deadline || huge_ns <= base_ns * (1 - MIN_TLB_GAIN)) {
+            break;
+        }
+        losses++;
+    }
+    real_munmap(region, bytes);
+    return losses;
+}
+
+// Measure this host once and pick the read engine, the huge page size and
+// whether private loads stay file-backed. Explicit settings win over the
+// measurements; HUGEPAGE_WRAPPER_CALIBRATE=off keeps the static defaults.
+static void calibrate(int fd, size_t length) {
+    pthread_mutex_lock(&calibration_lock);
+    if (calibration.done) {
+        pthread_mutex_unlock(&calibration_lock);
+        return;
+    }
+    calibration.done = true;
+    Calibration& c = calibration;
+
+    const char* env = getenv("HUGEPAGE_WRAPPER_PAGE_SIZE");
+    if (env && *env && strcmp(env, "auto") != 0) {
+        c.page_size = parse_page_size(env);
+        if (c.page_size) {
+            c.page_source = POLICY_OVERRIDE;
+        } else {
+            fprintf(stderr, "WARNING: hugepage_wrapper: Invalid HUGEPAGE_WRAPPER_PAGE_SIZE '%s', ignoring\n", env);
+        }
+    }
+    const char* source = pipeline_source();
+    if (source) {
+        c.engine = source;
+        c.engine_source = POLICY_OVERRIDE;
+    }
+    env = getenv("HUGEPAGE_WRAPPER_CALIBRATE");
+    if (env && (strcmp(env, "off") == 0 || strcmp(env, "0") == 0)) {
+        pthread_mutex_unlock(&calibration_lock);
+        return;
+    }
+    env = getenv("HUGEPAGE_WRAPPER_CALIBRATE_MS");
+    uint64_t budget_ms = env && *env ? strtoull(env, nullptr, 10) : DEFAULT_CALIBRATE_MS;
+    progress_set(LOAD_CALIBRATING, "calibrate", nullptr, 0);
+    uint64_t start = calibrate_now_ns();
+    uint64_t deadline = start + budget_ms * 1000000ULL;
+
+    // Read engines, on parts of the model the load will read again anyway
+    c.resident = page_cache_resident(fd, length, real_mmap, real_munmap);
+    size_t read_bytes = std::max(CALIBRATE_MIN_READ, min_size(CALIBRATE_READ_BYTES, length / 4) /
+                                                         CALIBRATE_BASE_PAGE * CALIBRATE_BASE_PAGE);
+    void* buf = real_mmap(nullptr, read_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buf != MAP_FAILED && length >= 2 * read_bytes) {
+        off_t at = (off_t)(length / 4 / CALIBRATE_BASE_PAGE * CALIBRATE_BASE_PAGE);
+        c.pread_bps = read_bandwidth(fd, (char*)buf, at, read_bytes, deadline);
+        posix_fadvise(fd, at, read_bytes, POSIX_FADV_DONTNEED);
+        char link[64];
+        snprintf(link, sizeof(link), "/proc/self/fd/%d", fd);
+        int direct = open(link, O_RDONLY | O_DIRECT | O_CLOEXEC);
+        if (direct >= 0) {
+            at = (off_t)(length / 2 / CALIBRATE_BASE_PAGE * CALIBRATE_BASE_PAGE);
+            c.direct_bps = read_bandwidth(direct, (char*)buf, at, read_bytes, deadline);
+            close(direct);
+        }
+    }
+    if (buf != MAP_FAILED) {
+        real_munmap(buf, read_bytes);
+    }
+
+    // Page sizes: fault a sample region and time dependent loads over it
+    std::vector<size_t> sizes = hugepage_sizes();
+    size_t largest = 0;
+    size_t pools[MAX_PAGE_SIZES] = {};
+    c.size_count = 0;
+    for (size_t size : sizes) {
+        if (c.size_count == MAX_PAGE_SIZES - 1) {
+            break;
+        }
+        MemoryBudget b;
+        read_memory_budget(&b, size);
+        PageSizeSample& s = c.sizes[c.size_count];
+        s = {size, b.pool_free >= align_up(length, size), 0, 0};
+        pools[c.size_count++] = b.pool_free;
+        if (s.fits) {
+            largest = size;
+        }
+    }
+    c.sample_bytes = align_up(std::min(std::max(length, largest), CALIBRATE_MAX_SAMPLE),
+                              std::max(largest, (size_t)CALIBRATE_BASE_PAGE));
+    for (int i = c.size_count - 1; i >= 0 && calibrate_now_ns() < deadline; i--) {
+        PageSizeSample& s = c.sizes[i];
+        if (!s.fits || pools[i] < c.sample_bytes) {
+            continue;
+        }
+        void* region;
+        s.fault_ns = fault_in(c.sample_bytes, s.page_size, hugetlb_flags(s.page_size), real_mmap, &region);
+        if (region != MAP_FAILED) {
+            s.access_ns = access_latency((const char*)region, c.sample_bytes, CALIBRATE_LOADS, deadline);
+            real_munmap(region, c.sample_bytes);
+        }
+    }
+    MemoryBudget base_budget;
+    read_memory_budget(&base_budget, 0);
+    PageSizeSample& base = c.sizes[c.size_count++];
+    base = {CALIBRATE_BASE_PAGE, true, 0, 0};
+    // Kept mapped until the placement decision, which may measure it again
+    void* base_region = MAP_FAILED;
+    if (calibrate_now_ns() < deadline && (base_budget.memory_headroom == SIZE_MAX ||
+                                          base_budget.memory_headroom >= c.sample_bytes + memory_reserve())) {
+        base.fault_ns = fault_in(c.sample_bytes, CALIBRATE_BASE_PAGE, 0, real_mmap, &base_region);
+        if (base_region != MAP_FAILED) {
+            base.access_ns = access_latency((const char*)base_region, c.sample_bytes, CALIBRATE_LOADS, deadline);
+        }
+    }
+
+    // Engine: a cached model is copied fastest from the page cache; a cold one
+    // with O_DIRECT if the device delivers more that way
+    if (c.engine_source != POLICY_OVERRIDE && (c.pread_bps > 0 || c.direct_bps > 0)) {
+        c.engine = c.resident < RESIDENT_FOR_PREAD && c.direct_bps > c.pread_bps * DIRECT_MIN_GAIN ? "direct"
+                                                                                                  : "pread";
+        c.engine_source = POLICY_CALIBRATED;
+    }
+    // Page size: the fastest measured one that holds the model; ties go to
+    // the smaller size, which fragments the pool less
+    const PageSizeSample* best = nullptr;
+    for (int i = 0; i < c.size_count - 1; i++) {
+        const PageSizeSample& s = c.sizes[i];
+        if (s.fits && s.access_ns > 0 && (!best || s.access_ns * LARGER_PAGE_GAIN < best->access_ns)) {
+            best = &s;
+        }
+    }
+    if (best && c.page_source != POLICY_OVERRIDE) {
+        c.page_size = best->page_size;
+        c.page_source = POLICY_CALIBRATED;
+    }
+    // Placement: huge pages cost a copy of the model; keep the page cache
+    // mapping when they do not beat base pages over a region large enough to
+    // show TLB reach. One sample is too noisy to move every load off huge
+    // pages, so a loss is re-measured and must hold in every round.
+    const char* forced = getenv("HUGEPAGE_WRAPPER_STRATEGY");
+    if (best && base.access_ns > 0 && c.sample_bytes >= CALIBRATE_MIN_TLB_SAMPLE && !(forced && *forced) &&
+        best->access_ns > base.access_ns * (1 - MIN_TLB_GAIN)) {
+        c.tlb_losses = tlb_losses(*best, (const char*)base_region, c.sample_bytes, deadline);
+        c.file_policy = c.tlb_losses == CALIBRATE_TLB_ROUNDS;
+    }
+    if (base_region != MAP_FAILED) {
+        real_munmap(base_region, c.sample_bytes);
+    }
+    c.seconds = (calibrate_now_ns() - start) / 1e9;
+
+    char line[512];
+    int n = snprintf(line, sizeof(line), "hugepage_wrapper: Calibrated in %.2f s: %.0f%% cached, read %.0f MB/s "
+                     "pread, %.0f MB/s direct; dependent loads:", c.seconds, c.resident < 0 ? 0 : c.resident * 100,
+                     c.pread_bps / 1e6, c.direct_bps / 1e6);
+    for (int i = 0; i < c.size_count && n < (int)sizeof(line); i++) {
+        char label[16];
+        format_page_size(c.sizes[i].page_size, label, sizeof(label));
+        if (c.sizes[i].access_ns > 0) {
+            n += snprintf(line + n, sizeof(line) - n, "%s %s %.1f ns", i ? "," : "", label, c.sizes[i].access_ns);
+        } else {
+            n += snprintf(line + n, sizeof(line) - n, "%s %s %s", i ? "," : "", label,
+                          c.sizes[i].fits ? "unmeasured" : "no pool");
+        }
+    }
+    fprintf(stderr, "%s\n", line);
+    char label[16];
+    if (c.page_size) {
+        format_page_size(c.page_size, label, sizeof(label));
+    } else {
+        snprintf(label, sizeof(label), "default");
+    }
+    fprintf(stderr, "hugepage_wrapper: Policy: engine %s (%s), page size %s (%s), placement %s\n", c.engine,
+            policy_source_names[c.engine_source], label, policy_source_names[c.page_source],
+            c.file_policy ? "file" : "hugetlb");
+    if (c.tlb_losses > 0) {
+        fprintf(stderr, "hugepage_wrapper: Huge pages did not cut access latency by %.0f%% in %d of %d rounds%s\n",
+                MIN_TLB_GAIN * 100, c.tlb_losses, CALIBRATE_TLB_ROUNDS,
+                c.file_policy ? "; loading file-backed (HUGEPAGE_WRAPPER_STRATEGY overrides)"
+                              : "; keeping huge pages");
+    }
+    pthread_mutex_unlock(&calibration_lock);
+}
+
+// --- Load pipeline (stage ABI in hugepage_load_stage.h) ---------------------
+
+static int register_stage(const hpw_stage* s) {
+    if (!s || s->abi_version != HPW_STAGE_ABI_VERSION || !s->name || s->kind > HPW_STAGE_PLACEMENT ||
+        (s->kind == HPW_STAGE_PLACEMENT ? !s->place : !s->process)) {
+        return EINVAL;
+    }
+    for (size_t i = 0; i < stage_count; i++) {
+        if (strcmp(stage_registry[i]->name, s->name) == 0) {
+            return EEXIST;
+        }
+    }
+    if (stage_count == MAX_STAGES) {
+        return ENOSPC;
+    }
+    stage_registry[stage_count++] = s;
+    return 0;
+}
+
+static uint64_t monotonic_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// A configured stage taking part in one load
+struct ActiveStage {
+    const hpw_stage* stage;
+    size_t slot;             // Index in stage_registry
+    std::string options;
+    void* state;
+    uint64_t ns;             // Time spent in process()/place() during this load
+};
+
+struct LoadPipeline {
+    hpw_load load;
+    uint64_t progress_load;  // Number of this load in the progress page
+    std::vector<ActiveStage> placements;
+    std::vector<ActiveStage> chunk_stages; // Source first, then transforms in order
+};
+
+// Build the pipeline from HUGEPAGE_WRAPPER_PIPELINE. Unknown stages are
+// skipped; without a source the calibrated engine (pread by default) is used.
+static void build_pipeline(LoadPipeline* p) {
+    const char* spec = getenv("HUGEPAGE_WRAPPER_PIPELINE");
+    std::string list = spec && *spec ? spec : calibration.engine;
+    bool have_source = false;
+    std::vector<ActiveStage> transforms;
+    size_t start = 0;
+    while (start <= list.size()) {
+        size_t end = list.find(',', start);
+        if (end == std::string::npos) end = list.size();
+        std::string entry = list.substr(start, end - start);
+        start = end + 1;
+        if (entry.empty()) continue;
+
+        size_t colon = entry.find(':');
+        std::string name = entry.substr(0, colon);
+        ActiveStage a = {nullptr, 0, colon == std::string::npos ? "" : entry.substr(colon + 1), nullptr, 0};
+        for (size_t i = 0; i < stage_count && !a.stage; i++) {
+            if (name == stage_registry[i]->name) {
+                a.stage = stage_registry[i];
+                a.slot = i;
+            }
+        }
+        if (!a.stage) {
+            fprintf(stderr, "WARNING: hugepage_wrapper: Unknown load stage '%s', skipped\n", name.c_str());
+        } else if (a.stage->kind == HPW_STAGE_PLACEMENT) {
+            p->placements.push_back(a);
+        } else if (a.stage->kind == HPW_STAGE_TRANSFORM) {
+            transforms.push_back(a);
+        } else if (have_source) {
+            fprintf(stderr, "WARNING: hugepage_wrapper: Only one source stage per load; '%s' skipped\n",
+                    name.c_str());
+        } else {
+            p->chunk_stages.insert(p->chunk_stages.begin(), a);
+            have_source = true;
+        }
+    }
+    if (!have_source) {
+        for (size_t i = 0; i < stage_count; i++) {
+            if (strcmp(stage_registry[i]->name, calibration.engine) == 0) {
+                p->chunk_stages.insert(p->chunk_stages.begin(), ActiveStage{stage_registry[i], i, "", nullptr, 0});
+            }
+        }
+    }
+    p->chunk_stages.insert(p->chunk_stages.end(), transforms.begin(), transforms.end());
+}
+
+// Call begin() on every stage, dropping those that skip this load.
+// Returns 0 or the errno of a stage that refused it.
+static int begin_stages(LoadPipeline* p, std::vector<ActiveStage>* stages, std::vector<ActiveStage>* begun) {
+    std::vector<ActiveStage> kept;
+    for (ActiveStage& a : *stages) {
+        int rc = a.stage->begin ? a.stage->begin(&p->load, a.options.c_str(), &a.state) : 0;
+        if (rc == HPW_STAGE_SKIP) {
+            continue;
+        }
+        if (rc != 0) {
+            fprintf(stderr, "ERROR: hugepage_wrapper: Load stage %s refused %s: %s\n", a.stage->name,
+                    p->load.path, strerror(rc));
+            return rc;
+        }
+        kept.push_back(a);
+        begun->push_back(a);
+    }
+    stages->swap(kept);
+    return 0;
+}
+
+// A file range and where it goes in the destination
+struct LoadSpan {
+    char* dst;
+    off_t offset;
+    size_t length;
+};
+
+// One loader thread's share of a load
+struct LoadRange {
+    LoadPipeline* pipeline;
+    std::vector<LoadSpan> spans;
+    size_t* loaded;         // Bytes loaded by all threads
+    volatile int* failed;   // Set by the first thread that fails; the others stop
+    int error;
+    std::vector<uint64_t> ns; // Per chunk stage, summed into the pipeline after the join
+};
+
+// Run the chunks of one range through the source and transforms
+static void* load_range(void* arg) {
+    LoadRange* r = (LoadRange*)arg;
+    std::vector<ActiveStage>& stages = r->pipeline->chunk_stages;
+    const size_t gb = 1024ULL * 1024 * 1024;
+
+    for (const LoadSpan& span : r->spans) {
+        size_t total_read = 0;
+        while (total_read < span.length && !*r->failed) {
+            hpw_chunk chunk = {(uint64_t)span.offset + total_read, span.dst + total_read,
+                               min_size(span.length - total_read, chunk_size)};
+            for (size_t i = 0; i < stages.size(); i++) {
+                uint64_t start = monotonic_ns();
+                int rc = stages[i].stage->process(stages[i].state, &chunk);
+                r->ns[i] += monotonic_ns() - start;
+                if (rc != 0) {
+                    r->error = rc;
+                    fprintf(stderr, "ERROR: hugepage_wrapper: Load stage %s failed at offset %llu: %s\n",
+                            stages[i].stage->name, (unsigned long long)chunk.file_offset, strerror(rc));
+                    *r->failed = 1;
+                    break;
+                }
+            }
+            if (r->error) {
+                return nullptr;
+            }
+            total_read += chunk.length;
+
+            // Progress indicator for large files, once per GB loaded across all threads
+            progress_add(r->pipeline->progress_load, chunk.length);
+            size_t before = __atomic_fetch_add(r->loaded, chunk.length, __ATOMIC_RELAXED);
+            if ((before + chunk.length) / gb > before / gb) {
+                fprintf(stderr, "hugepage_wrapper: Loaded %.1f GB / %.1f GB\n",
+                        (before + chunk.length) / (1024.0 * 1024.0 * 1024.0),
+                        r->pipeline->load.load_length / (1024.0 * 1024.0 * 1024.0));
+            }
+        }
+    }
+    return nullptr;
+}
+
+// Split [0, length) into `parts` ranges. Boundaries move forward to the next
+// tensor start, so each thread reads whole tensors, or else to a huge page
+// boundary, so no two threads fault the same huge page.
+static std::vector<size_t> split_load(size_t length, off_t offset, int parts, size_t hugepage_size,
+                                      const ModelIndex* index) {
+    std::vector<size_t> bounds = {0};
+    for (int i = 1; i < parts; i++) {
+        size_t ideal = length / parts * i;
+        size_t bound = align_up(ideal, hugepage_size);
+        if (index) {
+            auto next = std::lower_bound(index->tensor_starts.begin(), index->tensor_starts.end(),
+                                         (uint64_t)offset + ideal);
+            if (next != index->tensor_starts.end() && *next - offset < bound) {
+                bound = *next - offset;
+            }
+        }
+        if (bound > bounds.back() && bound < length) {
+            bounds.push_back(bound);
+        }
+    }
+    bounds.push_back(length);
+    return bounds;
+}
+
+// Cut scattered spans into at most `parts` ranges of about equal bytes. Cuts
+// inside a span go to the next tensor start or destination huge page
+// boundary, as in split_load.
+static std::vector<std::vector<LoadSpan>> split_spans(const std::vector<LoadSpan>& spans, int parts,
+                                                      size_t hugepage_size, const ModelIndex* index) {
+    size_t total = 0;
+    for (const LoadSpan& s : spans) total += s.length;
+    size_t share = std::max((size_t)1, total / parts);
+    std::vector<std::vector<LoadSpan>> ranges(1);
+    size_t filled = 0;
+    for (LoadSpan s : spans) {
+        while (s.length > 0) {
+            if (filled >= share && ranges.size() < (size_t)parts) {
+                ranges.emplace_back();
+                filled = 0;
+            }
+            size_t cut = s.length;
+            if (ranges.size() < (size_t)parts && s.length > share - filled) {
+                size_t ideal = share - filled;
+                cut = align_up((size_t)s.dst + ideal, hugepage_size) - (size_t)s.dst;
+                if (index) {
+                    auto next = std::lower_bound(index->tensor_starts.begin(), index->tensor_starts.end(),
+                                                 (uint64_t)s.offset + ideal);
+                    if (next != index->tensor_starts.end() && *next - s.offset < cut) {
+                        cut = *next - s.offset;
+                    }
+                }
+                cut = min_size(cut, s.length);
+            }
+            ranges.back().push_back({s.dst, s.offset, cut});
+            filled += cut;
+            s.dst += cut;
+            s.offset += cut;
+            s.length -= cut;
+        }
+    }
+    return ranges;
+}
+
+// Reorder the spans by the device address of the file's extents, holes
+// first. Returns false, leaving file order, if the filesystem cannot report
+// extents or file order already reads the device sequentially.
+static bool physical_order(LoadPipeline* p, const std::vector<LoadSpan>& spans, std::vector<LoadSpan>* ordered) {
+    struct Piece {
+        uint64_t physical;
+        LoadSpan span;
+    };
+    std::vector<Piece> pieces;
+    std::vector<FileExtent> extents, all;
+    for (const LoadSpan& s : spans) {
+        if (!file_extents(p->load.fd, s.offset, s.length, &extents)) {
+            if (errno != EOPNOTSUPP) {
+                fprintf(stderr, "WARNING: hugepage_wrapper: Cannot read the extents of %s (%s), reading in file "
+                        "order\n", p->load.path, strerror(errno));
+            }
+            return false;
+        }
+        uint64_t pos = s.offset;
+        for (const FileExtent& e : extents) {
+            if (e.logical > pos) {
+                pieces.push_back({0, {s.dst + (pos - s.offset), (off_t)pos, e.logical - pos}});
+            }
+            pieces.push_back({e.physical, {s.dst + (e.logical - s.offset), (off_t)e.logical, e.length}});
+            pos = e.logical + e.length;
+        }
+        if (pos < s.offset + s.length) {
+            pieces.push_back({0, {s.dst + (pos - s.offset), (off_t)pos, s.offset + s.length - pos}});
+        }
+        all.insert(all.end(), extents.begin(), extents.end());
+    }
+    size_t jumps = extent_jumps(all);
+    if (jumps == 0) {
+        return false;
+    }
+
+    std::stable_sort(pieces.begin(), pieces.end(),
+                     [](const Piece& a, const Piece& b) { return a.physical < b.physical; });
+    for (const Piece& piece : pieces) {
+        ordered->push_back(piece.span);
+    }
+    fprintf(stderr, "hugepage_wrapper: Reading %zu extents of %s in device order (%zu seeks in file order)\n",
+            all.size(), p->load.path, jumps);
+    pthread_mutex_lock(&state_lock);
+    metrics.physical_loads++;
+    metrics.load_extents += all.size();
+    metrics.load_extent_jumps += jumps;
+    pthread_mutex_unlock(&state_lock);
+    return true;
+}
+
+// Run the chunks of the spans on the loader threads
+static int run_chunks(LoadPipeline* p, const std::vector<LoadSpan>& spans, const ModelIndex* index) {
+    std::vector<std::vector<LoadSpan>> parts;
+    // HUGEPAGE_WRAPPER_READ_ORDER: "file" (default) follows the offsets, "physical" the extents on the device
+    const char* order = getenv("HUGEPAGE_WRAPPER_READ_ORDER");
+    std::vector<LoadSpan> ordered;
+    bool physical = order && strcmp(order, "physical") == 0 && physical_order(p, spans, &ordered);
+    if (physical) {
+        // Each thread streams its own stretch of the device. Readahead follows
+        // file order, which would fetch blocks from the other stretches.
+        parts = split_spans(ordered, p->load.threads, p->load.hugepage_size, index);
+        posix_fadvise(p->load.fd, 0, 0, POSIX_FADV_RANDOM);
+    } else if (spans.size() == 1) {
+        const LoadSpan& s = spans[0];
+        std::vector<size_t> bounds = split_load(s.length, s.offset, p->load.threads, p->load.hugepage_size, index);
+        for (size_t i = 0; i + 1 < bounds.size(); i++) {
+            parts.push_back({{s.dst + bounds[i], (off_t)(s.offset + bounds[i]), bounds[i + 1] - bounds[i]}});
+        }
+    } else {
+        parts = split_spans(spans, p->load.threads, p->load.hugepage_size, index);
+    }
+    size_t loaded = 0;
+    volatile int failed = 0;
+
+    std::vector<LoadRange> ranges(parts.size());
+    std::vector<pthread_t> threads(ranges.size());
+    std::vector<bool> started(ranges.size(), false);
+    for (size_t i = 0; i < ranges.size(); i++) {
+        ranges[i] = {p, parts[i], &loaded, &failed, 0, std::vector<uint64_t>(p->chunk_stages.size(), 0)};
+    }
+    if (ranges.size() > 1) {
+        fprintf(stderr, "hugepage_wrapper: Loading on %zu threads\n", ranges.size());
+    }
+    // The calling thread takes the first range; a thread that cannot be started
+    // leaves its range to the calling thread too
+    for (size_t i = 1; i < ranges.size(); i++) {
+        started[i] = pthread_create(&threads[i], nullptr, load_range, &ranges[i]) == 0;
+    }
+    load_range(&ranges[0]);
+    for (size_t i = 1; i < ranges.size(); i++) {
+        if (started[i]) {
+            pthread_join(threads[i], nullptr);
+        } else {
+            load_range(&ranges[i]);
+        }
+    }
+    if (physical) {
+        posix_fadvise(p->load.fd, 0, 0, POSIX_FADV_NORMAL);
+    }
+    int error = 0;
+    for (const LoadRange& r : ranges) {
+        for (size_t i = 0; i < r.ns.size(); i++) {
+            p->chunk_stages[i].ns += r.ns[i];
+        }
+        if (r.error && !error) {
+            error = r.error;
+        }
+    }
+    return error;
+}
+
+// Load the file ranges of `spans` through the load pipeline. The pipeline
+// sees a load of `load_length` bytes from `load_offset` into `dest`; placement
+// stages prepare the `place` regions before anything is written.
+static bool load_spans(int fd, const std::vector<LoadSpan>& spans, char* dest, off_t load_offset,
+                       size_t load_length, const std::vector<std::pair<char*, size_t>>& place,
+                       size_t hugepage_size, bool hugetlb, const ModelIndex* index) {
+    char path[1024];
+    fd_path(fd, path, sizeof(path));
+    struct stat st;
+    uint64_t file_size = fstat(fd, &st) == 0 ? (uint64_t)st.st_size : 0;
+
+    LoadPipeline p;
+    int parts = (int)std::min((size_t)load_threads, std::max((size_t)1, load_length / MIN_BYTES_PER_LOADER));
+    p.load = {fd, path, file_size, (uint64_t)load_offset, load_length, format_names[index->format],
+              index->tensor_count, dest, hugepage_size, hugetlb ? 1 : 0, parts, chunk_size};
+    build_pipeline(&p);
+    p.progress_load = progress_set(LOAD_LOADING, p.chunk_stages.empty() ? "" : p.chunk_stages[0].stage->name,
+                                   path, load_length);
+
+    std::vector<ActiveStage> begun;
+    int error = begin_stages(&p, &p.placements, &begun);
+    if (!error) {
+        error = begin_stages(&p, &p.chunk_stages, &begun);
+    }
+    if (!error && (p.chunk_stages.empty() || p.chunk_stages[0].stage->kind != HPW_STAGE_SOURCE)) {
+        fprintf(stderr, "ERROR: hugepage_wrapper: Load pipeline has no source stage\n");
+        error = EINVAL;
+    }
+    for (size_t i = 0; i < p.placements.size() && !error; i++) {
+        ActiveStage& a = p.placements[i];
+        uint64_t start = monotonic_ns();
+        for (size_t j = 0; j < place.size() && !error; j++) {
+            error = a.stage->place(a.state, place[j].first, place[j].second);
+        }
+        a.ns += monotonic_ns() - start;
+        if (error) {
+            fprintf(stderr, "ERROR: hugepage_wrapper: Load stage %s failed: %s\n", a.stage->name, strerror(error));
+        }
+    }
+    if (!error) {
+        error = run_chunks(&p, spans, index);
+    }
+
+    // Every stage that began gets its end(), which may still fail the load
+    for (const ActiveStage& b : begun) {
+        if (b.stage->end) {
+            int rc = b.stage->end(b.state, error);
+            if (rc != 0 && !error) {
+                fprintf(stderr, "ERROR: hugepage_wrapper: Load stage %s rejected %s: %s\n", b.stage->name,
+                        path, strerror(rc));
+                error = rc;
+            }
+        }
+    }
+    pthread_mutex_lock(&state_lock);
+    for (const std::vector<ActiveStage>* stages : {&p.placements, &p.chunk_stages}) {
+        for (const ActiveStage& a : *stages) {
+            stage_ns[a.slot] += a.ns;
+        }
+    }
+    pthread_mutex_unlock(&state_lock);
+
+    if (error) {
+        errno = error;
+        return false;
+    }
+    return true;
+}
+
+// Copy `length` bytes of the file at `offset` into `dst` through the load pipeline
+static bool load_file(int fd, char* dst, off_t offset, size_t length, size_t hugepage_size, bool hugetlb,
+                      const ModelIndex* index) {
+    return load_spans(fd, {{dst, offset, length}}, dst, offset, length, {{dst, length}}, hugepage_size, hugetlb,
+                      index);
+}
+
+// --- Built-in stages ----------------------------------------------------------
+
+// pread: read the chunk from the file, dropping the page cache behind the
+// copy so it is not charged against memory.max on top of the copy
+static int pread_begin(const hpw_load* load, const char*, void** state) {
+    *state = (void*)load;
+    return 0;
+}
+
+// Read exactly `length` bytes at `offset`, retrying short reads and EINTR.
+// Returns 0 or an errno value; EIO at an unexpected EOF.
+static int pread_full(int fd, char* buf, size_t length, off_t offset) {
+    size_t done = 0;
+    while (done < length) {
+        ssize_t n = pread(fd, buf + done, length - done, offset + (off_t)done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            return errno;
+        }
+        if (n == 0) {
+            return EIO;
+        }
+        done += n;
+    }
+    return 0;
+}
+
+static int pread_process(void* state, hpw_chunk* chunk) {
+    const hpw_load* load = (const hpw_load*)state;
+    int rc = pread_full(load->fd, (char*)chunk->data, chunk->length, (off_t)chunk->file_offset);
+    if (rc == 0) {
+        posix_fadvise(load->fd, (off_t)chunk->file_offset, chunk->length, POSIX_FADV_DONTNEED);
+    }
+    return rc;
+}
+
+static const hpw_stage pread_stage = {
+    HPW_STAGE_ABI_VERSION, HPW_STAGE_SOURCE, "pread", pread_begin, pread_process, nullptr, nullptr,
+};
+
+// direct: O_DIRECT reads from the device straight into the destination,
+// skipping the page cache copy. Chunks start at tensor boundaries, so their
+// unaligned edges are read through a block-sized bounce buffer. Files on
+// filesystems without O_DIRECT, and chunks whose destination is not aligned
+// like their file offset, fall back to pread.
+static const size_t DIRECT_ALIGN = 4096;
+
+struct DirectState {
+    const hpw_load* load;
+    int fd;                  // O_DIRECT descriptor, -1 to use pread
+};
+
+static int direct_begin(const hpw_load* load, const char*, void** state) {
+    char link[64];
+    snprintf(link, sizeof(link), "/proc/self/fd/%d", load->fd);
+    DirectState* d = new DirectState{load, open(link, O_RDONLY | O_DIRECT | O_CLOEXEC)};
+    if (d->fd < 0) {
+        fprintf(stderr, "hugepage_wrapper: O_DIRECT unavailable for %s (%s), reading with pread\n", load->path,
+                strerror(errno));
+    }
+    *state = d;
+    return 0;
+}
 
-// Track our anonymous huge page allocations
-struct HugePageAllocation {
-    void* addr;
-    size_t size;
-    HugePageAllocation* next;
+// Copy [offset, offset + length) out of the aligned block containing it
+static int direct_edge(int fd, char* dst, uint64_t offset, size_t length) {
+    void* block = nullptr;
+    if (posix_memalign(&block, DIRECT_ALIGN, DIRECT_ALIGN) != 0) {
+        return ENOMEM;
+    }
+    uint64_t start = offset / DIRECT_ALIGN * DIRECT_ALIGN;
+    size_t done = 0;
+    int rc = 0;
+    // The last block of the file reads short; only the bytes wanted must be there
+    while (start + done < offset + length) {
+        ssize_t n = pread(fd, (char*)block + done, DIRECT_ALIGN - done, (off_t)(start + done));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            rc = n < 0 ? errno : EIO;
+            break;
+        }
+        done += n;
+    }
+    if (rc == 0) {
+        memcpy(dst, (char*)block + (offset - start), length);
+    }
+    free(block);
+    return rc;
+}
+
+static int direct_process(void* state, hpw_chunk* chunk) {
+    DirectState* d = (DirectState*)state;
+    char* dst = (char*)chunk->data;
+    uint64_t offset = chunk->file_offset;
+    size_t length = chunk->length;
+    if (d->fd < 0 || (uintptr_t)dst % DIRECT_ALIGN != offset % DIRECT_ALIGN) {
+        return pread_process((void*)d->load, chunk);
+    }
+    size_t head = min_size(length, (DIRECT_ALIGN - offset % DIRECT_ALIGN) % DIRECT_ALIGN);
+    int rc = head ? direct_edge(d->fd, dst, offset, head) : 0;
+    size_t middle = (length - head) / DIRECT_ALIGN * DIRECT_ALIGN;
+    if (rc == 0 && middle) {
+        rc = pread_full(d->fd, dst + head, middle, (off_t)(offset + head));
+    }
+    size_t tail = length - head - middle;
+    if (rc == 0 && tail) {
+        rc = direct_edge(d->fd, dst + head + middle, offset + head + middle, tail);
+    }
+    return rc;
+}
+
+static int direct_end(void* state, int) {
+    DirectState* d = (DirectState*)state;
+    if (d->fd >= 0) {
+        close(d->fd);
+    }
+    delete d;
+    return 0;
+}
+
+static const hpw_stage direct_stage = {
+    HPW_STAGE_ABI_VERSION, HPW_STAGE_SOURCE, "direct", direct_begin, direct_process, nullptr, direct_end,
 };
-static HugePageAllocation* allocations = nullptr;
 
-// Initialize function pointers to real functions
-static void init_functions() {
-    if (!real_mmap) {
-        real_mmap = (mmap_fn)dlsym(RTLD_NEXT, "mmap");
-        if (!real_mmap) {
-            fprintf(stderr, "ERROR: hugepage_wrapper: Failed to find real mmap: %s\n", dlerror());
-            exit(1);
+// checksum: CRC-32C (Castagnoli) of the loaded range, computed per chunk on
+// the loader threads and combined in file order at the end. Logged, and with
+// "expect=<hex>" a mismatch fails the load.
+static uint32_t crc32c_table[256];
+
+static void crc32c_init_table() {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) {
+            c = c & 1 ? (c >> 1) ^ 0x82F63B78u : c >> 1;
         }
+        crc32c_table[i] = c;
     }
-    if (!real_munmap) {
-        real_munmap = (munmap_fn)dlsym(RTLD_NEXT, "munmap");
-        if (!real_munmap) {
-            fprintf(stderr, "ERROR: hugepage_wrapper: Failed to find real munmap: %s\n", dlerror());
-            exit(1);
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const uint8_t* p, size_t n) {
+    uint64_t c = crc;
+    for (; n >= 8; n -= 8, p += 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        c = __builtin_ia32_crc32di(c, v);
+    }
+    uint32_t c32 = (uint32_t)c;
+    for (; n > 0; n--, p++) {
+        c32 = __builtin_ia32_crc32qi(c32, *p);
+    }
+    return c32;
+}
+#endif
+
+static uint32_t crc32c(uint32_t crc, const void* data, size_t n) {
+    const uint8_t* p = (const uint8_t*)data;
+    crc = ~crc;
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2")) {
+        return ~crc32c_hw(crc, p, n);
+    }
+#endif
+    for (; n > 0; n--, p++) {
+        crc = crc32c_table[(crc ^ *p) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+// GF(2) matrix helpers for combining CRCs of adjacent blocks (as zlib's crc32_combine)
+static uint32_t gf2_times(const uint32_t* mat, uint32_t vec) {
+    uint32_t sum = 0;
+    for (; vec; vec >>= 1, mat++) {
+        if (vec & 1) sum ^= *mat;
+    }
+    return sum;
+}
+
+static void gf2_square(uint32_t* square, const uint32_t* mat) {
+    for (int n = 0; n < 32; n++) {
+        square[n] = gf2_times(mat, mat[n]);
+    }
+}
+
+// CRC of A||B from crc(A), crc(B) and len(B)
+static uint32_t crc32c_combine(uint32_t crc1, uint32_t crc2, uint64_t len2) {
+    if (len2 == 0) {
+        return crc1;
+    }
+    uint32_t even[32], odd[32];
+    odd[0] = 0x82F63B78u;
+    for (int n = 1; n < 32; n++) {
+        odd[n] = 1u << (n - 1);
+    }
+    gf2_square(even, odd); // 2 zero bits
+    gf2_square(odd, even); // 4 zero bits
+    do {
+        gf2_square(even, odd);
+        if (len2 & 1) crc1 = gf2_times(even, crc1);
+        len2 >>= 1;
+        if (len2 == 0) break;
+        gf2_square(odd, even);
+        if (len2 & 1) crc1 = gf2_times(odd, crc1);
+        len2 >>= 1;
+    } while (len2 != 0);
+    return crc1 ^ crc2;
+}
+
+struct ChecksumPart {
+    uint64_t offset;
+    uint64_t length;
+    uint32_t crc;
+};
+
+struct ChecksumState {
+    const hpw_load* load;
+    bool has_expect;
+    uint32_t expect;
+    pthread_mutex_t lock;
+    std::vector<ChecksumPart> parts;
+};
+
+static int checksum_begin(const hpw_load* load, const char* options, void** state) {
+    ChecksumState* s = new ChecksumState();
+    s->load = load;
+    const char* expect = strstr(options, "expect=");
+    s->has_expect = expect != nullptr;
+    s->expect = expect ? (uint32_t)strtoul(expect + 7, nullptr, 16) : 0;
+    if (s->has_expect && (load->load_offset != 0 || load->load_length != load->file_size)) {
+        // Partial placement loads only the huge page part; the digest would not be the file's
+        fprintf(stderr, "WARNING: hugepage_wrapper: checksum expects the whole file, but only %.2f GB "
+                "is loaded; not verifying\n", load->load_length / (1024.0 * 1024.0 * 1024.0));
+        delete s;
+        return HPW_STAGE_SKIP;
+    }
+    pthread_mutex_init(&s->lock, nullptr);
+    *state = s;
+    return 0;
+}
+
+static int checksum_process(void* state, hpw_chunk* chunk) {
+    ChecksumState* s = (ChecksumState*)state;
+    ChecksumPart part = {chunk->file_offset, chunk->length, crc32c(0, chunk->data, chunk->length)};
+    pthread_mutex_lock(&s->lock);
+    s->parts.push_back(part);
+    pthread_mutex_unlock(&s->lock);
+    return 0;
+}
+
+static int checksum_end(void* state, int status) {
+    ChecksumState* s = (ChecksumState*)state;
+    int rc = 0;
+    if (status == 0) {
+        std::sort(s->parts.begin(), s->parts.end(),
+                  [](const ChecksumPart& a, const ChecksumPart& b) { return a.offset < b.offset; });
+        uint32_t crc = 0;
+        for (const ChecksumPart& part : s->parts) {
+            crc = crc32c_combine(crc, part.crc, part.length);
+        }
+        fprintf(stderr, "hugepage_wrapper: crc32c %08x for %s\n", crc, s->load->path);
+        if (s->has_expect && crc != s->expect) {
+            fprintf(stderr, "ERROR: hugepage_wrapper: Checksum mismatch for %s: expected %08x, got %08x\n",
+                    s->load->path, s->expect, crc);
+            rc = EIO;
         }
     }
+    pthread_mutex_destroy(&s->lock);
+    delete s;
+    return rc;
 }
 
-// Check if we should use huge pages for this file
-static bool should_use_hugepages(int fd, size_t length) {
-    // Use huge pages for any large file (> 1GB)
-    const size_t MIN_SIZE_FOR_HUGEPAGES = 1ULL * 1024 * 1024 * 1024; // 1GB
-    return length >= MIN_SIZE_FOR_HUGEPAGES;
+static const hpw_stage checksum_stage = {
+    HPW_STAGE_ABI_VERSION, HPW_STAGE_TRANSFORM, "checksum", checksum_begin, checksum_process, nullptr,
+    checksum_end,
+};
+
+// numa: memory policy for the destination before it is faulted in.
+// "interleave" (default) spreads pages over the online nodes, "bind=<nodes>"
+// and "preferred=<node>" place them; a no-op on single-node machines.
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED 1
+#define MPOL_BIND 2
+#define MPOL_INTERLEAVE 3
+#endif
+
+// Parse a node list such as "0-3,6" into a bitmask
+static unsigned long parse_node_list(const char* list) {
+    unsigned long mask = 0;
+    while (list && *list) {
+        char* end;
+        unsigned long first = strtoul(list, &end, 10);
+        unsigned long last = first;
+        if (*end == '-') {
+            last = strtoul(end + 1, &end, 10);
+        }
+        for (unsigned long n = first; n <= last && n < 8 * sizeof(mask); n++) {
+            mask |= 1UL << n;
+        }
+        if (end == list) break;
+        list = *end == ',' ? end + 1 : end;
+        if (*list == '\n') break;
+    }
+    return mask;
+}
+
+struct NumaState {
+    int mode;
+    unsigned long nodes;
+};
+
+static int numa_begin(const hpw_load*, const char* options, void** state) {
+    char online[256] = "0";
+    FILE* f = fopen("/sys/devices/system/node/online", "r");
+    if (f) {
+        if (!fgets(online, sizeof(online), f)) online[0] = '\0';
+        fclose(f);
+    }
+    unsigned long online_mask = parse_node_list(online);
+    if (__builtin_popcountl(online_mask) < 2) {
+        return HPW_STAGE_SKIP;
+    }
+    NumaState* s = new NumaState{MPOL_INTERLEAVE, online_mask};
+    if (strncmp(options, "bind=", 5) == 0) {
+        s->mode = MPOL_BIND;
+        s->nodes = parse_node_list(options + 5) & online_mask;
+    } else if (strncmp(options, "preferred=", 10) == 0) {
+        s->mode = MPOL_PREFERRED;
+        s->nodes = parse_node_list(options + 10) & online_mask;
+    }
+    if (s->nodes == 0) {
+        fprintf(stderr, "WARNING: hugepage_wrapper: numa:%s names no online node; skipped\n", options);
+        delete s;
+        return HPW_STAGE_SKIP;
+    }
+    *state = s;
+    return 0;
+}
+
+static int numa_place(void* state, void* addr, size_t length) {
+    NumaState* s = (NumaState*)state;
+    if (syscall(SYS_mbind, addr, length, s->mode, &s->nodes, 8 * sizeof(s->nodes), 0) != 0) {
+        // Policy is advisory; a failed mbind leaves the default first-touch placement
+        fprintf(stderr, "WARNING: hugepage_wrapper: mbind failed: %s\n", strerror(errno));
+    }
+    return 0;
+}
+
+static int numa_end(void* state, int) {
+    delete (NumaState*)state;
+    return 0;
+}
+
+static const hpw_stage numa_stage = {
+    HPW_STAGE_ABI_VERSION, HPW_STAGE_PLACEMENT, "numa", numa_begin, nullptr, numa_place, numa_end,
+};
+
+// Register the built-in stages, then those of HUGEPAGE_WRAPPER_PLUGINS
+static void init_stages() {
+    crc32c_init_table();
+    register_stage(&pread_stage);
+    register_stage(&direct_stage);
+    register_stage(&checksum_stage);
+    register_stage(&numa_stage);
+
+    const char* env = getenv("HUGEPAGE_WRAPPER_CHUNK_MB");
+    if (env && *env && strtoull(env, nullptr, 10) > 0) {
+        chunk_size = strtoull(env, nullptr, 10) * 1024 * 1024;
+    }
+
+    env = getenv("HUGEPAGE_WRAPPER_PLUGINS");
+    std::string plugins = env ? env : "";
+    size_t start = 0;
+    while (start < plugins.size()) {
+        size_t end = plugins.find(':', start);
+        if (end == std::string::npos) end = plugins.size();
+        std::string path = plugins.substr(start, end - start);
+        start = end + 1;
+        if (path.empty()) continue;
+
+        void* handle = dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL);
+        if (!handle) {
+            fprintf(stderr, "WARNING: hugepage_wrapper: Cannot load plugin %s: %s\n", path.c_str(), dlerror());
+            continue;
+        }
+        typedef int (*register_stages_fn)(hpw_register_fn);
+        register_stages_fn fn = (register_stages_fn)dlsym(handle, "hpw_register_stages");
+        size_t before = stage_count;
+        int rc = fn ? fn(register_stage) : ENOENT;
+        if (rc != 0) {
+            fprintf(stderr, "WARNING: hugepage_wrapper: Plugin %s failed to register stages: %s\n",
+                    path.c_str(), strerror(rc));
+            continue;
+        }
+        for (size_t i = before; i < stage_count; i++) {
+            fprintf(stderr, "hugepage_wrapper: Plugin %s: %s stage %s\n", path.c_str(),
+                    stage_kind_names[stage_registry[i]->kind], stage_registry[i]->name);
+        }
+    }
+}
+
+// Map the leading `huge_bytes` of the file into huge pages and the remainder
+// file-backed directly behind it, so the caller sees one contiguous mapping
+static void* map_stitched(size_t length, size_t huge_bytes, size_t hugepage_size,
+                          int prot, int flags, int fd, const ModelIndex* index) {
+    // Reserve address space with room to align the start to a huge page
+    size_t span = length + hugepage_size;
+    char* reserved = (char*)real_mmap(nullptr, span, PROT_NONE,
+                                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (reserved == MAP_FAILED) {
+        return MAP_FAILED;
+    }
+    char* base = (char*)align_up((size_t)reserved, hugepage_size);
+    size_t mapped_end = align_up(length, 4096);
+    if (base > reserved) {
+        real_munmap(reserved, base - reserved);
+    }
+    if (reserved + span > base + mapped_end) {
+        real_munmap(base + mapped_end, reserved + span - (base + mapped_end));
+    }
+
+    void* huge = real_mmap(base, huge_bytes, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS | hugetlb_flags(hugepage_size) | MAP_FIXED, -1, 0);
+    if (huge == MAP_FAILED) {
+        fprintf(stderr, "WARNING: hugepage_wrapper: MAP_HUGETLB failed for partial mapping: %s\n", strerror(errno));
+        real_munmap(base, mapped_end);
+        return MAP_FAILED;
+    }
+    void* tail = real_mmap(base + huge_bytes, length - huge_bytes, prot,
+                           flags | MAP_FIXED, fd, huge_bytes);
+    if (tail == MAP_FAILED) {
+        fprintf(stderr, "WARNING: hugepage_wrapper: File-backed remainder mapping failed: %s\n", strerror(errno));
+        real_munmap(base, mapped_end);
+        return MAP_FAILED;
+    }
+
+    fprintf(stderr, "hugepage_wrapper: Loading first %.2f GB into huge pages memory...\n",
+            huge_bytes / (1024.0 * 1024.0 * 1024.0));
+    if (!load_file(fd, base, 0, huge_bytes, hugepage_size, true, index)) {
+        int saved_errno = errno;
+        real_munmap(base, mapped_end);
+        errno = saved_errno;
+        return MAP_FAILED;
+    }
+    if (!(prot & PROT_WRITE)) {
+        mprotect(base, huge_bytes, prot); // Often EINVAL on huge pages; non-fatal
+    }
+    return base;
+}
+
+// --- Shared model images (hugepage_image.h) -----------------------------------
+
+#ifndef HUGETLBFS_MAGIC
+#define HUGETLBFS_MAGIC 0x958458f6
+#endif
+
+// An image opened for attaching or building, with the index page mapped and
+// the builder lock (byte 0) held through index_fd
+struct Image {
+    int index_fd;
+    int pool_fd;             // Read-write: building revisions only
+    int read_fd;             // Read-only: what callers map, so they cannot write the pool
+    ImageIndex* index;
+    size_t page_size;
+    bool hugetlb;            // image_dir is a hugetlbfs mount
+};
+
+// A mapping made from an image, and what it took
+struct ImageMapping {
+    size_t mapped;           // Whole pool pages
+    int lock_fd;             // Holds the revision's read lock until munmap
+    ImageResult result;
+    uint64_t generation;
+    uint64_t read_bytes;
+    uint64_t copied_bytes;
+    uint32_t written_pages;
+    uint32_t reused_pages;
+    bool hugetlb;
+};
+
+// HUGEPAGE_WRAPPER_IMAGE_NAME, or else the model file name without ".gguf",
+// so revisions published under the same file name update one image
+static std::string image_name(const char* path) {
+    return image_file_name(path, getenv("HUGEPAGE_WRAPPER_IMAGE_NAME"));
+}
+
+static void image_close(Image* img) {
+    if (img->index) real_munmap(img->index, img->page_size);
+    if (img->read_fd >= 0) close(img->read_fd);
+    if (img->pool_fd >= 0) close(img->pool_fd);
+    if (img->index_fd >= 0) close(img->index_fd);
+    img->index = nullptr;
+    img->read_fd = img->pool_fd = img->index_fd = -1;
+}
+
+// Open the image files, creating them on first use, and take the builder lock
+static bool image_open(const std::string& name, Image* img, std::string* error) {
+    *img = {-1, -1, -1, nullptr, 0, false};
+    struct statfs fs;
+    if (statfs(image_dir, &fs) != 0) {
+        *error = std::string(image_dir) + ": " + strerror(errno);
+        return false;
+    }
+    // Without hugetlbfs (tmpfs for tests) the pool has no huge pages, but
+    // keeps the same layout
+    img->hugetlb = (unsigned long)fs.f_type == HUGETLBFS_MAGIC;
+    img->page_size = img->hugetlb ? (size_t)fs.f_bsize : meminfo_bytes("Hugepagesize");
+    if (img->page_size == 0) {
+        img->page_size = 2ULL * 1024 * 1024;
+    }
+
+    std::string base = std::string(image_dir) + "/" + name;
+    img->index_fd = open((base + ".index").c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0660);
+    if (img->index_fd < 0 || !image_lock(img->index_fd, F_WRLCK, 0)) {
+        *error = base + ".index: " + strerror(errno);
+        image_close(img);
+        return false;
+    }
+    // fallocate rather than ftruncate, so an exhausted pool fails here instead
+    // of raising SIGBUS on the first write
+    struct stat st;
+    if (fstat(img->index_fd, &st) != 0 ||
+        (st.st_size == 0 && fallocate(img->index_fd, 0, 0, img->page_size) != 0)) {
+        *error = base + ".index: " + strerror(errno);
+        image_close(img);
+        return false;
+    }
+    if (st.st_size != 0 && (size_t)st.st_size != img->page_size) {
+        *error = base + ".index was created for another page size";
+        image_close(img);
+        return false;
+    }
+    void* index = real_mmap(nullptr, img->page_size, PROT_READ | PROT_WRITE, MAP_SHARED, img->index_fd, 0);
+    if (index == MAP_FAILED) {
+        *error = base + ".index: " + strerror(errno);
+        image_close(img);
+        return false;
+    }
+    img->index = (ImageIndex*)index;
+    if (img->index->magic == 0) {
+        *img->index = {IMAGE_INDEX_MAGIC, IMAGE_INDEX_VERSION, IMAGE_MAX_REVISIONS, img->page_size,
+                       image_index_slot_bytes(img->page_size), 0};
+    } else if (img->index->magic != IMAGE_INDEX_MAGIC || img->index->version != IMAGE_INDEX_VERSION ||
+               img->index->page_size != img->page_size) {
+        *error = base + ".index is not a version " + std::to_string(IMAGE_INDEX_VERSION) + " image index";
+        image_close(img);
+        return false;
+    }
+    img->pool_fd = open((base + ".pages").c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0660);
+    if (img->pool_fd >= 0) {
+        img->read_fd = open((base + ".pages").c_str(), O_RDONLY | O_CLOEXEC);
+    }
+    if (img->pool_fd < 0 || img->read_fd < 0) {
+        *error = base + ".pages: " + strerror(errno);
+        image_close(img);
+        return false;
+    }
+    return true;
+}
+
+// Map pool pages pages[0..count) of pool descriptor fd back to back at a huge
+// page aligned address
+static char* image_map(const Image* img, int fd, const uint32_t* pages, size_t count, int prot) {
+    size_t ps = img->page_size, length = count * ps;
+    char* reserved = (char*)real_mmap(nullptr, length + ps, PROT_NONE,
+                                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (reserved == MAP_FAILED) {
+        return (char*)MAP_FAILED;
+    }
+    char* base = (char*)align_up((size_t)reserved, ps);
+    if (base > reserved) {
+        real_munmap(reserved, base - reserved);
+    }
+    real_munmap(base + length, reserved + ps - base);
+    for (size_t i = 0; i < count;) {
+        size_t j = i + 1;
+        while (j < count && pages[j] == pages[j - 1] + 1) j++;
+        if (real_mmap(base + i * ps, (j - i) * ps, prot, MAP_SHARED | MAP_FIXED, fd,
+                      (off_t)pages[i] * ps) == MAP_FAILED) {
+            int saved_errno = errno;
+            real_munmap(base, length);
+            errno = saved_errno;
+            return (char*)MAP_FAILED;
+        }
+        i = j;
+    }
+    return base;
+}
+
+static bool image_same_source(const ImageRevision* r, const struct stat& st) {
+    return r->source_dev == (uint64_t)st.st_dev && r->source_ino == (uint64_t)st.st_ino &&
+           r->file_size == (uint64_t)st.st_size &&
+           r->source_mtime_ns == (int64_t)st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+}
+
+static bool image_same_bytes(ImageRevision* r, const std::vector<ImageSegment>& segments, uint64_t size) {
+    if (r->file_size != size || r->segment_count != segments.size()) {
+        return false;
+    }
+    const ImageSegment* s = image_revision_segments(r);
+    for (size_t i = 0; i < segments.size(); i++) {
+        if (s[i].offset != segments[i].offset || s[i].size != segments[i].size ||
+            s[i].digest != segments[i].digest) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Map a published revision for the caller and hold its read lock
+static char* image_attach(Image* img, uint32_t slot, int prot, ImageMapping* out) {
+    ImageRevision* r = image_revision(img->index, slot);
+    char* mem = image_map(img, img->read_fd, image_revision_pages(r), r->page_count, prot);
+    if (mem != MAP_FAILED && !image_lock(img->index_fd, F_RDLCK, 1 + slot)) {
+        real_munmap(mem, (size_t)r->page_count * img->page_size);
+        mem = (char*)MAP_FAILED;
+    }
+    if (mem == MAP_FAILED) {
+        return mem;
+    }
+    out->mapped = (size_t)r->page_count * img->page_size;
+    out->result = IMAGE_ATTACHED;
+    out->generation = r->generation;
+    return mem;
+}
+
+// Build a revision of the file in a free slot on top of revision `base`
+// (-1 for none): pages whose segments did not change are the base's own pool
+// pages, the others are fresh, filled by copying segments the base holds
+// elsewhere and reading the rest of the file through the load pipeline
+static char* image_build(Image* img, int fd, const struct stat& st, const char* path,
+                         const std::vector<ImageSegment>& segments, bool have_digests, int base, int prot,
+                         const ModelIndex* index, ImageMapping* out, std::string* error) {
+    ImageIndex* idx = img->index;
+    size_t ps = img->page_size;
+    uint64_t size = st.st_size;
+    size_t page_count = (size + ps - 1) / ps;
+    image_collect(img->index, img->index_fd, img->pool_fd, base >= 0 ? 1u << base : 0);
+
+    int slot = -1;
+    for (uint32_t s = 0; s < idx->slots && slot < 0; s++) {
+        if (image_revision(idx, s)->generation == 0) slot = s;
+    }
+    if (slot < 0) {
+        *error = "all " + std::to_string(idx->slots) + " revisions are in use";
+        return (char*)MAP_FAILED;
+    }
+    if (image_revision_bytes(segments.size(), page_count) > idx->slot_bytes) {
+        *error = "too many tensors for the index page";
+        return (char*)MAP_FAILED;
+    }
+
+    ImageRevision* b = base >= 0 ? image_revision(idx, base) : nullptr;
+    std::vector<bool> reused;
+    std::vector<ImagePiece> pieces;
+    image_plan(segments, size, b ? image_revision_segments(b) : nullptr, b ? b->segment_count : 0,
+               b ? b->file_size : 0, b ? b->page_count : 0, ps, &reused, &pieces);
+
+    // Page table: the base's pages where unchanged, else free pool pages,
+    // holes left by retired revisions first
+    std::vector<bool> used = image_used_pages(img->index);
+    std::vector<uint32_t> pages(page_count);
+    uint32_t next_free = 0;
+    for (size_t p = 0; p < page_count; p++) {
+        if (reused[p]) {
+            pages[p] = image_revision_pages(b)[p];
+            out->reused_pages++;
+            continue;
+        }
+        while (next_free < used.size() && used[next_free]) next_free++;
+        pages[p] = next_free++;
+        out->written_pages++;
+    }
+    for (size_t p = 0; p < page_count;) {
+        size_t q = p + 1;
+        while (q < page_count && !reused[p] && !reused[q] && pages[q] == pages[q - 1] + 1) q++;
+        if (!reused[p] && fallocate(img->pool_fd, 0, (off_t)pages[p] * ps, (q - p) * ps) != 0) {
+            *error = std::string("cannot reserve huge pages for the image: ") + strerror(errno);
+            image_collect(img->index, img->index_fd, img->pool_fd, base >= 0 ? 1u << base : 0);
+            return (char*)MAP_FAILED;
+        }
+        p = q;
+    }
+
+    char* view = image_map(img, img->pool_fd, pages.data(), page_count, PROT_READ | PROT_WRITE);
+    char* base_view = (char*)MAP_FAILED;
+    if (view != MAP_FAILED && b) {
+        base_view = image_map(img, img->read_fd, image_revision_pages(b), b->page_count, PROT_READ);
+    }
+    if (view == MAP_FAILED || (b && base_view == MAP_FAILED)) {
+        *error = std::string("cannot map the image pool: ") + strerror(errno);
+        if (view != MAP_FAILED) real_munmap(view, page_count * ps);
+        image_collect(img->index, img->index_fd, img->pool_fd, base >= 0 ? 1u << base : 0);
+        return (char*)MAP_FAILED;
+    }
+
+    // Unchanged segments that moved are copied; the rest is read, with
+    // placement stages run on every fresh page
+    std::vector<LoadSpan> spans;
+    std::vector<std::pair<char*, size_t>> place;
+    for (const ImagePiece& piece : pieces) {
+        if (piece.base_offset >= 0) {
+            memcpy(view + piece.offset, base_view + piece.base_offset, piece.length);
+            out->copied_bytes += piece.length;
+        } else {
+            spans.push_back({view + piece.offset, (off_t)piece.offset, (size_t)piece.length});
+            out->read_bytes += piece.length;
+        }
+    }
+    for (size_t p = 0; p < page_count; p++) {
+        if (reused[p]) continue;
+        if (!place.empty() && place.back().first + place.back().second == view + p * ps) {
+            place.back().second += ps;
+        } else {
+            place.push_back({view + p * ps, ps});
+        }
+    }
+    if (base_view != MAP_FAILED) {
+        real_munmap(base_view, (size_t)b->page_count * ps);
+    }
+    if (!spans.empty() &&
+        !load_spans(fd, spans, view, 0, out->read_bytes, place, ps, img->hugetlb, index)) {
+        *error = std::string("load failed: ") + strerror(errno);
+        real_munmap(view, page_count * ps);
+        image_collect(img->index, img->index_fd, img->pool_fd, base >= 0 ? 1u << base : 0);
+        return (char*)MAP_FAILED;
+    }
+
+    // Publish: record first, generation last
+    ImageRevision* r = image_revision(idx, slot);
+    memset(r, 0, sizeof(*r));
+    r->file_size = size;
+    r->source_dev = st.st_dev;
+    r->source_ino = st.st_ino;
+    r->source_mtime_ns = (int64_t)st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+    r->segment_count = segments.size();
+    r->page_count = page_count;
+    r->built_at = time(nullptr);
+    r->read_bytes = out->read_bytes;
+    r->copied_bytes = out->copied_bytes;
+    r->written_pages = out->written_pages;
+    r->reused_pages = out->reused_pages;
+    r->base_generation = b ? b->generation : 0;
+    snprintf(r->source_path, sizeof(r->source_path), "%s", path);
+    ImageSegment* s = image_revision_segments(r);
+    memcpy(s, segments.data(), segments.size() * sizeof(ImageSegment));
+    if (!have_digests) {
+        // A first build without a sidecar digests what it just loaded
+        for (uint32_t i = 0; i < r->segment_count; i++) {
+            s[i].digest = xxh64(view + s[i].offset, s[i].size);
+        }
+    }
+    memcpy(image_revision_pages(r), pages.data(), pages.size() * sizeof(uint32_t));
+    __atomic_store_n(&r->generation, ++idx->generation, __ATOMIC_RELEASE);
+
+    // The caller gets the revision like any attacher, through the read-only
+    // descriptor; the writable view goes
+    char* mem = image_map(img, img->read_fd, pages.data(), page_count, prot);
+    real_munmap(view, page_count * ps);
+    if (mem == MAP_FAILED) {
+        *error = std::string("cannot map the image pool: ") + strerror(errno);
+        return (char*)MAP_FAILED;
+    }
+    image_lock(img->index_fd, F_RDLCK, 1 + slot);
+    image_collect(img->index, img->index_fd, img->pool_fd, 1u << slot);
+    out->mapped = page_count * ps;
+    out->result = b ? IMAGE_UPDATED : IMAGE_BUILT;
+    out->generation = r->generation;
+    return mem;
+}
+
+// Map a GGUF model from the shared image in image_dir: attach to a revision
+// of the same bytes, or else publish a new one. Returns MAP_FAILED with
+// *error set when the caller should load the model privately instead.
+static void* map_image(int fd, const struct stat& st, int prot, const ModelIndex* index, ImageMapping* out,
+                       std::string* error) {
+    char path[1024];
+    fd_path(fd, path, sizeof(path));
+
+    GGUFModel m;
+    std::vector<ImageSegment> segments;
+    if (!gguf_read(fd, &m, error) || !image_segments(m, st.st_size, &segments, nullptr, error)) {
+        return MAP_FAILED;
+    }
+    std::string name = image_name(path);
+    Image img;
+    if (!image_open(name, &img, error)) {
+        return MAP_FAILED;
+    }
+    *out = {};
+    out->lock_fd = -1;
+    out->hugetlb = img.hugetlb;
+
+    // Replicas of the same file attach without digesting it
+    ImageIndex* idx = img.index;
+    int base = -1;
+    char* mem = (char*)MAP_FAILED;
+    for (uint32_t s = 0; s < idx->slots; s++) {
+        ImageRevision* r = image_revision(idx, s);
+        if (r->generation != 0 && (base < 0 || r->generation > image_revision(idx, base)->generation)) {
+            base = s;
+        }
+    }
+    for (uint32_t s = 0; s < idx->slots && mem == MAP_FAILED; s++) {
+        ImageRevision* r = image_revision(idx, s);
+        if (r->generation != 0 && image_same_source(r, st)) {
+            mem = image_attach(&img, s, prot, out);
+        }
+    }
+
+    // Otherwise compare digests: from the sidecar, or by reading the file
+    // when there is a revision to compare with
+    if (mem == MAP_FAILED) {
+        std::string sidecar_error;
+        bool have_digests = image_read_digests(image_digests_path(path), st, &segments, &sidecar_error);
+        if (!have_digests && base >= 0) {
+            fprintf(stderr, "hugepage_wrapper: Image %s: no digests for %s (%s); reading the file to compare "
+                    "(hugepage_image digest writes them)\n", name.c_str(), path, sidecar_error.c_str());
+            have_digests = image_digest_file(fd, &segments, error);
+            if (!have_digests) {
+                image_close(&img);
+                return MAP_FAILED;
+            }
+        }
+        for (uint32_t s = 0; s < idx->slots && have_digests && mem == MAP_FAILED; s++) {
+            ImageRevision* r = image_revision(idx, s);
+            if (r->generation != 0 && image_same_bytes(r, segments, st.st_size)) {
+                mem = image_attach(&img, s, prot, out);
+            }
+        }
+        if (mem == MAP_FAILED) {
+            mem = image_build(&img, fd, st, path, segments, have_digests, base, prot, index, out, error);
+        }
+    }
+
+    if (out->result == IMAGE_ATTACHED && mem != MAP_FAILED) {
+        fprintf(stderr, "hugepage_wrapper: Image %s: attached to revision %llu\n", name.c_str(),
+                (unsigned long long)out->generation);
+    } else if (mem != MAP_FAILED) {
+        fprintf(stderr, "hugepage_wrapper: Image %s: %s revision %llu: %u pages reused, %u written "
+                "(%.2f GB read, %.2f GB copied)\n", name.c_str(), image_result_names[out->result],
+                (unsigned long long)out->generation, out->reused_pages, out->written_pages,
+                out->read_bytes / (1024.0 * 1024.0 * 1024.0), out->copied_bytes / (1024.0 * 1024.0 * 1024.0));
+    }
+
+    // Keep index_fd: closing it drops the revision's read lock
+    if (mem != MAP_FAILED) {
+        image_lock(img.index_fd, F_UNLCK, 0);
+        out->lock_fd = img.index_fd;
+        img.index_fd = -1;
+    } else if (error->empty()) {
+        *error = strerror(errno);
+    }
+    image_close(&img);
+    return mem;
 }
 
 // Track an allocation so we can handle munmap properly
-static void track_allocation(void* addr, size_t size) {
+static void track_allocation(void* addr, size_t size, int lock_fd) {
     HugePageAllocation* alloc = (HugePageAllocation*)malloc(sizeof(HugePageAllocation));
     alloc->addr = addr;
     alloc->size = size;
+    alloc->lock_fd = lock_fd;
+    pthread_mutex_lock(&state_lock);
     alloc->next = allocations;
-    allocations = alloc;
+    __atomic_store_n(&allocations, alloc, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&state_lock);
 }
 
-// Find and remove a tracked allocation
-static size_t untrack_allocation(void* addr) {
+// Find and remove a tracked allocation; *lock_fd gets its image lock fd
+static size_t untrack_allocation(void* addr, int* lock_fd) {
+    // Fast path for the common case: no huge page mappings, so every munmap is the application's
+    if (__atomic_load_n(&allocations, __ATOMIC_ACQUIRE) == nullptr) {
+        return 0;
+    }
+    pthread_mutex_lock(&state_lock);
     HugePageAllocation** prev = &allocations;
     HugePageAllocation* curr = allocations;
     
     while (curr) {
         if (curr->addr == addr) {
             size_t size = curr->size;
+            *lock_fd = curr->lock_fd;
             *prev = curr->next;
+            pthread_mutex_unlock(&state_lock);
             free(curr);
             return size;
         }
         prev = &curr->next;
         curr = curr->next;
     }
+    pthread_mutex_unlock(&state_lock);
     return 0;
 }
 
+// --- Tensor lookup -----------------------------------------------------------
+
+// Publish the lookup table of a model mapped at mem
+static void register_tensors(void* mem, size_t length, const char* path, const ModelIndex* index) {
+    if (index->tensors.empty()) {
+        return;  // PyTorch archives and unknown formats have no index
+    }
+    TensorTable* t = new TensorTable();
+    tensor_table_build(index->tensors, length, t);
+    t->model = path;
+    t->base = (uintptr_t)mem;
+    pthread_mutex_lock(&state_lock);
+    size_t slot = 0;
+    while (slot < tensor_table_count && __atomic_load_n(&tensor_tables[slot]->base, __ATOMIC_RELAXED) != 0) {
+        slot++;
+    }
+    bool published = slot < MAX_TENSOR_TABLES;
+    if (published) {
+        // A lookup still holding the retired table sees base 0 and skips it
+        __atomic_store_n(&tensor_tables[slot], t, __ATOMIC_RELEASE);
+        if (slot == tensor_table_count) {
+            __atomic_store_n(&tensor_table_count, slot + 1, __ATOMIC_RELEASE);
+        }
+    }
+    pthread_mutex_unlock(&state_lock);
+    if (!published) {
+        fprintf(stderr, "WARNING: hugepage_wrapper: %zu models mapped at once, no tensor lookup for %s\n",
+                MAX_TENSOR_TABLES, path);
+        delete t;
+        return;
+    }
+    fprintf(stderr, "hugepage_wrapper: Tensor lookup over %zu tensors, %zu pages\n",
+            t->starts.size(), t->pages.size() - 1);
+}
+
+// Stop matching addresses of a model being unmapped, and free its slot.
+// Every munmap of the process comes through here, so only a match writes.
+static void unregister_tensors(void* addr) {
+    size_t count = __atomic_load_n(&tensor_table_count, __ATOMIC_ACQUIRE);
+    size_t i = 0;
+    while (i < count &&
+           __atomic_load_n(&__atomic_load_n(&tensor_tables[i], __ATOMIC_ACQUIRE)->base, __ATOMIC_RELAXED) !=
+               (uintptr_t)addr) {
+        i++;
+    }
+    if (i == count) {
+        return;
+    }
+    pthread_mutex_lock(&state_lock);
+    uintptr_t base = (uintptr_t)addr;
+    __atomic_compare_exchange_n(&tensor_tables[i]->base, &base, 0, false, __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+    count = tensor_table_count;
+    while (count > 0 && __atomic_load_n(&tensor_tables[count - 1]->base, __ATOMIC_RELAXED) == 0) {
+        count--;
+    }
+    __atomic_store_n(&tensor_table_count, count, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&state_lock);
+}
+
+// Table holding addr, with *tensor its index and *base the mapping it
+// matched (read once: an munmap may zero the table's base meanwhile)
+static const TensorTable* find_tensor(const void* addr, int64_t* tensor, uintptr_t* base) {
+    size_t count = __atomic_load_n(&tensor_table_count, __ATOMIC_ACQUIRE);
+    for (size_t i = 0; i < count; i++) {
+        const TensorTable* t = __atomic_load_n(&tensor_tables[i], __ATOMIC_ACQUIRE);
+        uintptr_t b = __atomic_load_n(&t->base, __ATOMIC_ACQUIRE);
+        if (b && (uintptr_t)addr >= b && (uintptr_t)addr - b < t->length) {
+            *tensor = tensor_table_find(*t, (uintptr_t)addr - b);
+            *base = b;
+            return *tensor >= 0 ? t : nullptr;
+        }
+    }
+    return nullptr;
+}
+
+extern "C" int hpw_tensor_lookup(const void* addr, struct hpw_tensor* out) {
+    int64_t i;
+    uintptr_t base;
+    const TensorTable* t = find_tensor(addr, &i, &base);
+    if (!t) {
+        return 0;
+    }
+    out->name = t->names[i].c_str();
+    out->layer = t->layers[i];
+    out->index = (uint32_t)i;
+    out->data = (const void*)(base + t->starts[i]);
+    out->size = t->ends[i] - t->starts[i];
+    out->file_offset = t->starts[i];
+    out->model = t->model.c_str();
+    return 1;
+}
+
+extern "C" int32_t hpw_tensor_layer(const void* addr) {
+    int64_t i;
+    uintptr_t base;
+    const TensorTable* t = find_tensor(addr, &i, &base);
+    return t ? t->layers[i] : -2;
+}
+
 // Our intercepted mmap function
 extern "C" void* mmap(void* addr, size_t length, int prot, int flags, int fd, off_t offset) {
     init_functions();
     
-    // Check if this is a file-backed mmap that could benefit from huge pages
-    if (fd >= 0 && should_use_hugepages(fd, length)) {
+    // Check if this is a file-backed mmap that could benefit from huge pages.
+    // Writes to a shared writable mapping must reach the file, so those stay file-backed.
+    if (fd >= 0 && should_use_hugepages(length) && !((flags & MAP_SHARED) && (prot & PROT_WRITE))) {
         // Get file size to verify we're mapping the whole file
         struct stat st;
         if (fstat(fd, &st) != 0) {
@@ -104,82 +2494,152 @@ extern "C" void* mmap(void* addr, size_t length, int prot, int flags, int fd, of
         }
         
         // Only intercept if mapping the whole file from offset 0 (typical for model loading)
-        if (offset == 0 && length == (size_t)st.st_size) {
-            fprintf(stderr, "INFO: hugepage_wrapper: Intercepting mmap for %.2f GB file (using huge pages)\n", 
-                    length / (1024.0 * 1024.0 * 1024.0));
-            
-            // Allocate anonymous huge pages memory
-            void* huge_mem = real_mmap(nullptr, length, 
-                                       PROT_READ | PROT_WRITE,
-                                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB,
-                                       -1, 0);
-            
-            if (huge_mem == MAP_FAILED) {
-                // Try without MAP_HUGETLB as fallback
-                fprintf(stderr, "WARNING: hugepage_wrapper: MAP_HUGETLB failed, trying regular anonymous mmap\n");
-                huge_mem = real_mmap(nullptr, length,
-                                    PROT_READ | PROT_WRITE,
-                                    MAP_PRIVATE | MAP_ANONYMOUS,
-                                    -1, 0);
-                
-                if (huge_mem == MAP_FAILED) {
-                    fprintf(stderr, "ERROR: hugepage_wrapper: Anonymous mmap failed: %s\n", strerror(errno));
-                    return MAP_FAILED;
+        ModelIndex index;
+        if (offset == 0 && length == (size_t)st.st_size && index_model(fd, length, &index)) {
+            fprintf(stderr, "INFO: hugepage_wrapper: Intercepting mmap for %.2f GB %s file (%zu tensors)\n",
+                    length / (1024.0 * 1024.0 * 1024.0), format_names[index.format], index.tensor_count);
+            char path[1024];
+            fd_path(fd, path, sizeof(path));
+            progress_set(LOAD_LOADING, "placing", path, length);
+
+            // One shared copy for every replica; the image keeps its own pages
+            // (and builds new revisions), so no per-process budget applies
+            if (image_dir && index.format == FORMAT_GGUF && !(prot & PROT_WRITE)) {
+                ImageMapping image;
+                std::string error;
+                void* mem = map_image(fd, st, prot, &index, &image, &error);
+                if (mem != MAP_FAILED) {
+                    pthread_mutex_lock(&state_lock);
+                    metrics.mappings[STRATEGY_IMAGE]++;
+                    format_mappings[index.format]++;
+                    if (image.hugetlb) {
+                        metrics.hugetlb_bytes += length;
+                    } else {
+                        metrics.anonymous_bytes += length;
+                    }
+                    metrics.image_loads[image.result]++;
+                    metrics.image_written_pages += image.written_pages;
+                    metrics.image_reused_pages += image.reused_pages;
+                    metrics.image_read_bytes += image.read_bytes;
+                    metrics.image_copied_bytes += image.copied_bytes;
+                    write_metrics();
+                    pthread_mutex_unlock(&state_lock);
+                    track_allocation(mem, image.mapped, image.lock_fd);
+                    register_tensors(mem, length, path, &index);
+                    progress_set(LOAD_LOADED, "image", path, 0);
+                    return mem;
                 }
-            } else {
-                fprintf(stderr, "hugepage_wrapper: Allocated %.2f GB with MAP_HUGETLB\n",
-                        length / (1024.0 * 1024.0 * 1024.0));
-            }
-            
-            // Read the file contents into huge pages memory
-            // Use pread to read from the file descriptor
-            fprintf(stderr, "hugepage_wrapper: Loading file contents into huge pages memory...\n");
-            
-            size_t total_read = 0;
-            const size_t chunk_size = 256 * 1024 * 1024; // 256MB chunks
-            
-            while (total_read < length) {
-                size_t to_read = (length - total_read < chunk_size) ? (length - total_read) : chunk_size;
-                ssize_t bytes_read = pread(fd, (char*)huge_mem + total_read, to_read, offset + total_read);
-                
-                if (bytes_read < 0) {
-                    fprintf(stderr, "ERROR: hugepage_wrapper: Failed to read file: %s\n", strerror(errno));
-                    real_munmap(huge_mem, length);
-                    return MAP_FAILED;
+                fprintf(stderr, "WARNING: hugepage_wrapper: Shared image unavailable (%s), loading privately\n",
+                        error.c_str());
+            } else if (image_dir) {
+                fprintf(stderr, "hugepage_wrapper: Only read-only GGUF mappings use the shared image, "
+                        "loading privately\n");
+            }
+
+            calibrate(fd, length);
+            MemoryBudget budget;
+            read_memory_budget(&budget, calibration.page_size);
+            log_budget(&budget);
+            size_t huge_bytes = 0;
+            LoadStrategy strategy = choose_strategy(length, &budget, &huge_bytes);
+            fprintf(stderr, "hugepage_wrapper: Strategy: %s (%.2f GB huge pages, %.2f GB file-backed)\n",
+                    strategy_names[strategy], min_size(huge_bytes, length) / (1024.0 * 1024.0 * 1024.0),
+                    (length - min_size(huge_bytes, length)) / (1024.0 * 1024.0 * 1024.0));
+
+            void* mem = MAP_FAILED;
+            // Bytes to unmap later; hugetlb mappings can only be unmapped in whole huge pages
+            size_t mapped_size = length;
+            bool hugetlb = false;
+            if (strategy == STRATEGY_FULL) {
+                mem = real_mmap(nullptr, length, PROT_READ | PROT_WRITE,
+                                MAP_PRIVATE | MAP_ANONYMOUS | hugetlb_flags(budget.hugepage_size), -1, 0);
+                hugetlb = mem != MAP_FAILED;
+                if (hugetlb) {
+                    mapped_size = align_up(length, budget.hugepage_size);
+                    fprintf(stderr, "hugepage_wrapper: Allocated %.2f GB with MAP_HUGETLB\n",
+                            length / (1024.0 * 1024.0 * 1024.0));
+                } else if (budget.memory_headroom == SIZE_MAX ||
+                           budget.memory_headroom >= length + memory_reserve()) {
+                    // A regular anonymous copy is charged to memory.max, so only
+                    // take it when the cgroup can hold it next to the KV cache
+                    fprintf(stderr, "WARNING: hugepage_wrapper: MAP_HUGETLB failed, trying regular anonymous mmap\n");
+                    mem = real_mmap(nullptr, length, PROT_READ | PROT_WRITE,
+                                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+                } else {
+                    fprintf(stderr, "WARNING: hugepage_wrapper: MAP_HUGETLB failed and memory headroom is too "
+                            "small for an anonymous copy\n");
+                }
+
+                if (mem != MAP_FAILED) {
+                    fprintf(stderr, "hugepage_wrapper: Loading file contents into %s memory...\n",
+                            hugetlb ? "huge pages" : "anonymous");
+                    if (!load_file(fd, (char*)mem, offset, length, budget.hugepage_size, hugetlb, &index)) {
+                        int saved_errno = errno;
+                        real_munmap(mem, mapped_size);
+                        progress_set(LOAD_FAILED, nullptr, nullptr, 0);
+                        errno = saved_errno;
+                        return MAP_FAILED;
+                    }
+                    fprintf(stderr, "hugepage_wrapper: Successfully loaded %.2f GB file into %s memory\n",
+                            length / (1024.0 * 1024.0 * 1024.0), hugetlb ? "huge pages" : "anonymous");
+
+                    // Set memory protection to match requested (usually PROT_READ for model files)
+                    // Note: mprotect on huge pages often fails with EINVAL, but this is non-fatal
+                    if (!(prot & PROT_WRITE)) {
+                        mprotect(mem, length, prot);
+                    }
+                } else {
+                    strategy = STRATEGY_FILE;
                 }
-                
-                if (bytes_read == 0) {
-                    fprintf(stderr, "ERROR: hugepage_wrapper: Unexpected EOF at offset %zu\n", total_read);
-                    real_munmap(huge_mem, length);
-                    return MAP_FAILED;
+            } else if (strategy == STRATEGY_PARTIAL) {
+                mem = map_stitched(length, huge_bytes, budget.hugepage_size, prot, flags, fd, &index);
+                if (mem != MAP_FAILED) {
+                    fprintf(stderr, "hugepage_wrapper: Stitched %.2f GB huge pages + %.2f GB file-backed\n",
+                            huge_bytes / (1024.0 * 1024.0 * 1024.0),
+                            (length - huge_bytes) / (1024.0 * 1024.0 * 1024.0));
+                } else {
+                    strategy = STRATEGY_FILE;
                 }
-                
-                total_read += bytes_read;
-                
-                // Progress indicator for large files
-                if (total_read % (1024 * 1024 * 1024) == 0) {
-                    fprintf(stderr, "hugepage_wrapper: Loaded %.1f GB / %.1f GB\n",
-                            total_read / (1024.0 * 1024.0 * 1024.0),
-                            length / (1024.0 * 1024.0 * 1024.0));
+            }
+
+            if (strategy == STRATEGY_FILE) {
+                // Page cache is reclaimable, but --mlock pins it and charges it to memory.max
+                if (budget.memory_headroom != SIZE_MAX && budget.memory_headroom < length + memory_reserve()) {
+                    fprintf(stderr, "WARNING: hugepage_wrapper: %.2f GB model exceeds cgroup memory headroom "
+                            "(%.2f GB) minus reserve; loading may trigger the OOM killer\n",
+                            length / (1024.0 * 1024.0 * 1024.0),
+                            budget.memory_headroom / (1024.0 * 1024.0 * 1024.0));
                 }
+                mem = real_mmap(addr, length, prot, flags, fd, offset);
             }
-            
-            fprintf(stderr, "hugepage_wrapper: Successfully loaded %.2f GB file into huge pages memory\n",
-                    length / (1024.0 * 1024.0 * 1024.0));
-            
-            // Set memory protection to match requested (usually PROT_READ for model files)
-            // Note: mprotect on huge pages often fails with EINVAL, but this is non-fatal
-            if (!(prot & PROT_WRITE)) {
-                if (mprotect(huge_mem, length, prot) != 0) {
-                    // Silently ignore - this is expected with huge pages
-                    // fprintf(stderr, "WARNING: hugepage_wrapper: mprotect failed: %s\n", strerror(errno));
+
+            if (mem != MAP_FAILED) {
+                pthread_mutex_lock(&state_lock);
+                metrics.budget = budget;
+                metrics.mappings[strategy]++;
+                format_mappings[index.format]++;
+                if (strategy == STRATEGY_FULL && hugetlb) {
+                    metrics.hugetlb_bytes += length;
+                } else if (strategy == STRATEGY_FULL) {
+                    metrics.anonymous_bytes += length;
+                } else if (strategy == STRATEGY_PARTIAL) {
+                    metrics.hugetlb_bytes += huge_bytes;
+                    metrics.file_backed_bytes += length - huge_bytes;
+                } else {
+                    metrics.file_backed_bytes += length;
                 }
+                write_metrics();
+                pthread_mutex_unlock(&state_lock);
+                // File-backed mappings are the application's own and unmapped normally
+                if (strategy != STRATEGY_FILE) {
+                    track_allocation(mem, mapped_size, -1);
+                }
+                register_tensors(mem, length, path, &index);
+                progress_set(LOAD_LOADED, strategy_names[strategy], path, 0);
+            } else {
+                progress_set(LOAD_FAILED, nullptr, path, 0);
             }
-            
-            // Track this allocation so we can handle munmap properly
-            track_allocation(huge_mem, length);
-            
-            return huge_mem;
+            return mem;
         }
     }
     
@@ -190,14 +2650,20 @@ extern "C" void* mmap(void* addr, size_t length, int prot, int flags, int fd, of
 // Our intercepted munmap function
 extern "C" int munmap(void* addr, size_t length) {
     init_functions();
+    unregister_tensors(addr);
     
     // Check if this is one of our tracked allocations
-    size_t tracked_size = untrack_allocation(addr);
+    int lock_fd = -1;
+    size_t tracked_size = untrack_allocation(addr, &lock_fd);
     if (tracked_size > 0) {
         fprintf(stderr, "INFO: hugepage_wrapper: Unmapping %.2f GB huge pages allocation\n",
                 tracked_size / (1024.0 * 1024.0 * 1024.0));
         // Use the tracked size, not the provided length (which might be wrong)
-        return real_munmap(addr, tracked_size);
+        int rc = real_munmap(addr, tracked_size);
+        if (lock_fd >= 0) {
+            close(lock_fd); // The revision may be retired once no replica maps it
+        }
+        return rc;
     }
     
     // Regular munmap
@@ -209,6 +2675,45 @@ __attribute__((constructor))
 static void init() {
     fprintf(stderr, "hugepage_mmap_wrapper loaded (PID: %d)\n", getpid());
     init_functions();
+    init_stages();
+    const char* env = getenv("HUGEPAGE_WRAPPER_MIN_SIZE_MB");
+    if (env && *env) {
+        min_size_for_hugepages = strtoull(env, nullptr, 10) * 1024 * 1024;
+    }
+
+    // Comma-separated formats to intercept, or "any" for every large file as before
+    env = getenv("HUGEPAGE_WRAPPER_FORMATS");
+    if (env && *env) {
+        formats_enabled = 0;
+        any_format = strstr(env, "any") != nullptr;
+        for (int i = 0; i < FORMAT_COUNT; i++) {
+            if (strstr(env, format_names[i])) {
+                formats_enabled |= 1u << i;
+            }
+        }
+    }
+
+    // Loader threads: the CPUs this process may run on, capped; more only queue on the device
+    env = getenv("HUGEPAGE_WRAPPER_LOAD_THREADS");
+    if (env && *env) {
+        load_threads = std::max(1, atoi(env));
+    } else {
+        cpu_set_t cpus;
+        int available = sched_getaffinity(0, sizeof(cpus), &cpus) == 0 ? CPU_COUNT(&cpus) : 1;
+        load_threads = std::max(1, std::min(available, DEFAULT_MAX_LOADERS));
+    }
+
+    // Shared model images (hugepage_image.h), normally on a hugetlbfs mount
+    env = getenv("HUGEPAGE_WRAPPER_IMAGE_DIR");
+    if (env && *env) {
+        image_dir = env;
+    }
+
+    // Live load progress for the healthcheck (hugepage_progress.h)
+    env = getenv("HUGEPAGE_WRAPPER_PROGRESS");
+    if (env && *env) {
+        progress_open(env);
+    }
 }
 
 // Destructor - cleanup when library is unloaded
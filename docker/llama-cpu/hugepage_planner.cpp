@@ -0,0 +1,618 @@
+/*
+ * hugepage_planner.cpp
+ *
+ * Huge page pool planner and pre-flight reservation tool.
+ *
+ * Sizes the huge page pool a llama-server deployment needs before the
+ * containers start:
+ * 1. Reads the model's GGUF header (weights size, layers, KV head dims)
+ * 2. Takes the entrypoint's CTX_SIZE / BATCH_SIZE / UBATCH_SIZE settings
+ *    and the replica count
+ * 3. Computes the 2MB and 1GB page counts for weights, KV cache and compute
+ *    buffers and compares them with /sys/kernel/mm/hugepages
+ * 4. Optionally grows the pool, compacting memory between attempts
+ *
+ * The wrapper allocates the weights from the pool its startup calibration
+ * finds fastest among those that hold the model, or the one set with
+ * HUGEPAGE_WRAPPER_PAGE_SIZE (the default size with calibration off), and
+ * may keep them file-backed if huge pages consistently fail to beat base
+ * pages; plan the pool it should use with --page-size. The KV cache and
+ * compute buffers are regular memory unless --kv-hugepages is given, in
+ * which case they are planned into the pool as well. With
+ * --image-dir (a hugetlbfs mount for the wrapper's shared model images,
+ * hugepage_image.h) the weights are one image in the mount's pool for all
+ * replicas instead of a copy each; pages an existing image of the model
+ * already holds are not planned again.
+ *
+ * Exit codes: 0 pool sufficient, 1 error, 2 pool insufficient.
+ */
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <sys/stat.h>
+#include <sys/statfs.h>
+#include <dirent.h>
+#include <string>
+
+#include "gguf_reader.h"
+#include "hugepage_image.h"
+
+#define EXIT_OK 0
+#define EXIT_ERROR 1
+#define EXIT_INSUFFICIENT 2
+
+#define PAGE_2M (2ULL * 1024 * 1024)
+#define PAGE_1G (1024ULL * 1024 * 1024)
+#define GiB (1024.0 * 1024.0 * 1024.0)
+
+// Defaults of docker/llama-cpu/entrypoint.sh
+#define DEFAULT_CTX_SIZE 32768
+#define DEFAULT_BATCH_SIZE 2048
+#define DEFAULT_UBATCH_SIZE 2048
+#define DEFAULT_ENTRYPOINT "/app/entrypoint.sh"
+
+#define HUGEPAGES_SYSFS "/sys/kernel/mm/hugepages"
+#define HUGETLBFS_MAGIC 0x958458f6
+
+struct PlannerOptions {
+    std::string model_path;
+    std::string entrypoint = DEFAULT_ENTRYPOINT;
+    uint64_t ctx_size = 0;
+    uint64_t batch_size = 0;
+    uint64_t ubatch_size = 0;
+    uint64_t replicas = 1;
+    uint64_t page_size = 0; // 0 = system default huge page size
+    double cache_bytes_per_elem = 2.0; // f16 KV cache
+    uint64_t buffer_bytes = 0; // 0 = estimate from the model
+    bool kv_hugepages = false;
+    std::string image_dir;       // Shared images on this hugetlbfs mount; "" = private copies
+    std::string image_name;      // Default: from the model file name, as the wrapper does
+    bool check = false;
+    bool reserve = false;
+    bool drop_caches = false;
+    int compact_retries = 3;
+    bool json = false;
+};
+
+// Bytes one replica needs, split by consumer
+struct MemoryPlan {
+    uint64_t weights;
+    uint64_t kv_cache;
+    uint64_t buffers;
+};
+
+// The model's shared image, with --image-dir
+struct ImagePlan {
+    bool enabled;
+    uint64_t page_size;      // Of the hugetlbfs mount
+    uint64_t pages;          // One revision of the weights plus the index page
+    uint64_t present;        // Pages an existing image of the model holds already
+    uint64_t other;          // Pages other images in the mount hold
+    std::string name;
+};
+
+struct PoolState {
+    uint64_t page_size;
+    bool present; // sysfs directory exists for this size
+    uint64_t nr;
+    uint64_t free;
+    uint64_t resv;
+    uint64_t surplus;
+};
+
+static uint64_t pages_for(uint64_t bytes, uint64_t page_size) {
+    return (bytes + page_size - 1) / page_size;
+}
+
+static bool read_u64_file(const char* path, uint64_t* out) {
+    FILE* f = fopen(path, "r");
+    if (!f) {
+        return false;
+    }
+    unsigned long long v = 0;
+    bool ok = fscanf(f, "%llu", &v) == 1;
+    fclose(f);
+    if (ok) *out = v;
+    return ok;
+}
+
+static bool write_u64_file(const char* path, uint64_t value) {
+    FILE* f = fopen(path, "w");
+    if (!f) {
+        fprintf(stderr, "hugepage_planner: Cannot open %s: %s\n", path, strerror(errno));
+        return false;
+    }
+    bool ok = fprintf(f, "%llu\n", (unsigned long long)value) > 0;
+    ok = (fclose(f) == 0) && ok;
+    if (!ok) {
+        fprintf(stderr, "hugepage_planner: Write to %s failed: %s\n", path, strerror(errno));
+    }
+    return ok;
+}
+
+// Value of a /proc/meminfo field in bytes, 0 if absent
+static uint64_t meminfo_bytes(const char* field) {
+    FILE* f = fopen("/proc/meminfo", "r");
+    if (!f) {
+        return 0;
+    }
+    char line[256];
+    size_t len = strlen(field);
+    uint64_t value = 0;
+    while (fgets(line, sizeof(line), f)) {
+        if (strncmp(line, field, len) == 0 && line[len] == ':') {
+            value = strtoull(line + len + 1, nullptr, 10) * 1024;
+            break;
+        }
+    }
+    fclose(f);
+    return value;
+}
+
+static PoolState read_pool(uint64_t page_size) {
+    PoolState p = {};
+    p.page_size = page_size;
+    char dir[256], path[320];
+    snprintf(dir, sizeof(dir), HUGEPAGES_SYSFS "/hugepages-%llukB", (unsigned long long)(page_size / 1024));
+    snprintf(path, sizeof(path), "%s/nr_hugepages", dir);
+    p.present = read_u64_file(path, &p.nr);
+    snprintf(path, sizeof(path), "%s/free_hugepages", dir);
+    read_u64_file(path, &p.free);
+    snprintf(path, sizeof(path), "%s/resv_hugepages", dir);
+    read_u64_file(path, &p.resv);
+    snprintf(path, sizeof(path), "%s/surplus_hugepages", dir);
+    read_u64_file(path, &p.surplus);
+    return p;
+}
+
+// Pages that a new MAP_HUGETLB mapping can still obtain
+static uint64_t pool_available(const PoolState& p) {
+    return p.free > p.resv ? p.free - p.resv : 0;
+}
+
+// Parse "VAR=${VAR:-value}" defaults out of the entrypoint script
+static uint64_t entrypoint_default(const std::string& path, const char* var) {
+    FILE* f = fopen(path.c_str(), "r");
+    if (!f) {
+        return 0;
+    }
+    char line[512], prefix[64];
+    snprintf(prefix, sizeof(prefix), "%s=${%s:-", var, var);
+    size_t len = strlen(prefix);
+    uint64_t value = 0;
+    while (fgets(line, sizeof(line), f)) {
+        if (strncmp(line, prefix, len) == 0) {
+            value = strtoull(line + len, nullptr, 10);
+            break;
+        }
+    }
+    fclose(f);
+    return value;
+}
+
+// Setting precedence: command line, then environment, then entrypoint default, then built-in
+static uint64_t resolve_setting(uint64_t cli, const char* var, const std::string& entrypoint, uint64_t fallback) {
+    if (cli) return cli;
+    const char* env = getenv(var);
+    if (env && *env) {
+        uint64_t v = strtoull(env, nullptr, 10);
+        if (v) return v;
+    }
+    uint64_t v = entrypoint_default(entrypoint, var);
+    return v ? v : fallback;
+}
+
+static bool parse_size(const char* s, uint64_t* out) {
+    char* end = nullptr;
+    uint64_t v = strtoull(s, &end, 10);
+    if (end == s) return false;
+    switch (*end) {
+        case 'G': case 'g': v *= 1024ULL * 1024 * 1024; end++; break;
+        case 'M': case 'm': v *= 1024ULL * 1024; end++; break;
+        case 'K': case 'k': v *= 1024ULL; end++; break;
+        case '\0': break;
+        default: return false;
+    }
+    if (*end == 'B' || *end == 'b') end++;
+    *out = v;
+    return *end == '\0' && v > 0;
+}
+
+static bool parse_cache_type(const char* s, double* bytes_per_elem) {
+    if (strcmp(s, "f32") == 0) *bytes_per_elem = 4.0;
+    else if (strcmp(s, "f16") == 0 || strcmp(s, "bf16") == 0) *bytes_per_elem = 2.0;
+    else if (strcmp(s, "q8_0") == 0) *bytes_per_elem = 34.0 / 32.0;
+    else if (strcmp(s, "q5_1") == 0) *bytes_per_elem = 24.0 / 32.0;
+    else if (strcmp(s, "q5_0") == 0) *bytes_per_elem = 22.0 / 32.0;
+    else if (strcmp(s, "q4_1") == 0) *bytes_per_elem = 20.0 / 32.0;
+    else if (strcmp(s, "q4_0") == 0 || strcmp(s, "iq4_nl") == 0) *bytes_per_elem = 18.0 / 32.0;
+    else return false;
+    return true;
+}
+
+static MemoryPlan plan_memory(const GGUFModel& m, const PlannerOptions& o) {
+    MemoryPlan plan;
+    // The wrapper copies the whole file, header included, into one mapping
+    plan.weights = m.file_size;
+
+    uint64_t kv_elems_per_token = m.n_layer * m.n_head_kv * (m.key_length + m.value_length);
+    plan.kv_cache = (uint64_t)(o.ctx_size * kv_elems_per_token * o.cache_bytes_per_elem);
+
+    if (o.buffer_bytes) {
+        plan.buffers = o.buffer_bytes;
+    } else {
+        // Rough estimate of the CPU compute buffer for one ubatch with flash
+        // attention: residual/attention activations plus the active FFN width,
+        // and the output logits of the default four slots
+        uint64_t n_ff = m.n_expert_used ? m.n_ff_expert * m.n_expert_used : m.n_ff;
+        plan.buffers = o.ubatch_size * sizeof(float) * (6 * m.n_embd + 3 * n_ff)
+                     + 4 * m.n_vocab * sizeof(float);
+    }
+    return plan;
+}
+
+// Pool pages held by a hugetlbfs file
+static uint64_t file_pages(const std::string& path, uint64_t page_size) {
+    struct stat st;
+    return stat(path.c_str(), &st) == 0 ? pages_for((uint64_t)st.st_blocks * 512, page_size) : 0;
+}
+
+static bool plan_image(const PlannerOptions& o, const MemoryPlan& plan, ImagePlan* image) {
+    *image = ImagePlan();
+    if (o.image_dir.empty()) {
+        return true;
+    }
+    struct statfs fs;
+    if (statfs(o.image_dir.c_str(), &fs) != 0) {
+        fprintf(stderr, "hugepage_planner: Cannot stat %s: %s\n", o.image_dir.c_str(), strerror(errno));
+        return false;
+    }
+    image->enabled = true;
+    if ((unsigned long)fs.f_type != HUGETLBFS_MAGIC) {
+        // The wrapper still shares the image, in regular memory
+        fprintf(stderr, "hugepage_planner: %s is not a hugetlbfs mount (make image-mount); the shared image "
+                "will not use the pool\n", o.image_dir.c_str());
+        return true;
+    }
+    image->page_size = fs.f_bsize;
+    image->name = image_file_name(o.model_path.c_str(), o.image_name.c_str());
+    image->pages = pages_for(plan.weights, image->page_size) + 1;
+    std::string base = o.image_dir + "/" + image->name;
+    image->present = file_pages(base + ".pages", image->page_size) + file_pages(base + ".index", image->page_size);
+    DIR* dir = opendir(o.image_dir.c_str());
+    while (dirent* e = dir ? readdir(dir) : nullptr) {
+        std::string file = e->d_name;
+        if (file == "." || file == ".." || file == image->name + ".pages" || file == image->name + ".index") {
+            continue;
+        }
+        image->other += file_pages(o.image_dir + "/" + file, image->page_size);
+    }
+    if (dir) closedir(dir);
+    return true;
+}
+
+// Bytes of one replica that the huge page pool must hold
+static uint64_t pooled_bytes(const MemoryPlan& plan, const PlannerOptions& o, const ImagePlan& image) {
+    return (image.enabled ? 0 : plan.weights) + (o.kv_hugepages ? plan.kv_cache + plan.buffers : 0);
+}
+
+// Pages still to be taken from the pool: each replica's private mappings,
+// plus what the shared image lacks of one revision
+static uint64_t pooled_pages(const MemoryPlan& plan, const PlannerOptions& o, const ImagePlan& image,
+                             uint64_t page_size) {
+    // Each component is a separate mapping rounded up to whole pages
+    uint64_t pages = image.enabled ? 0 : pages_for(plan.weights, page_size);
+    if (o.kv_hugepages) {
+        pages += pages_for(plan.kv_cache, page_size) + pages_for(plan.buffers, page_size);
+    }
+    pages *= o.replicas;
+    if (image.enabled && image.page_size == page_size && image.pages > image.present) {
+        pages += image.pages - image.present;
+    }
+    return pages;
+}
+
+// Grow the pool to cover `needed` additional pages. Returns the pages still missing.
+static uint64_t reserve_pages(uint64_t page_size, uint64_t needed, const PlannerOptions& o) {
+    char path[256];
+    snprintf(path, sizeof(path), HUGEPAGES_SYSFS "/hugepages-%llukB/nr_hugepages",
+             (unsigned long long)(page_size / 1024));
+
+    if (o.drop_caches) {
+        sync();
+        write_u64_file("/proc/sys/vm/drop_caches", 3);
+    }
+
+    PoolState before = read_pool(page_size);
+    uint64_t target = before.nr + needed;
+    for (int attempt = 0; attempt <= o.compact_retries; attempt++) {
+        if (attempt > 0) {
+            // Free pages exist but not as contiguous runs: ask the kernel to compact
+            fprintf(stderr, "hugepage_planner: Compacting memory (attempt %d/%d)\n", attempt, o.compact_retries);
+            write_u64_file("/proc/sys/vm/compact_memory", 1);
+        }
+        if (!write_u64_file(path, target)) {
+            break;
+        }
+        PoolState now = read_pool(page_size);
+        fprintf(stderr, "hugepage_planner: nr_hugepages %llu -> %llu (target %llu)\n",
+                (unsigned long long)before.nr, (unsigned long long)now.nr, (unsigned long long)target);
+        if (now.nr >= target) {
+            return 0;
+        }
+    }
+    PoolState after = read_pool(page_size);
+    return after.nr >= target ? 0 : target - after.nr;
+}
+
+static void print_text(const GGUFModel& m, const PlannerOptions& o, const MemoryPlan& plan,
+                       const ImagePlan& image, const PoolState& pool_2m, const PoolState& pool_1g, uint64_t default_size) {
+    printf("Model: %s\n", o.model_path.c_str());
+    printf("  Architecture: %s, %llu layers, %llu KV heads x (%llu + %llu) dims, %zu tensors\n",
+           m.architecture.c_str(), (unsigned long long)m.n_layer, (unsigned long long)m.n_head_kv,
+           (unsigned long long)m.key_length, (unsigned long long)m.value_length, m.tensors.size());
+    printf("Settings: ctx-size %llu, batch %llu, ubatch %llu, %llu replica(s)\n",
+           (unsigned long long)o.ctx_size, (unsigned long long)o.batch_size,
+           (unsigned long long)o.ubatch_size, (unsigned long long)o.replicas);
+
+    printf("\nPer replica:            %10s %10s %10s\n", "GB", "2MB pages", "1GB pages");
+    const char* names[] = {"Weights (wrapper)", "KV cache", "Compute buffers"};
+    uint64_t sizes[] = {plan.weights, plan.kv_cache, plan.buffers};
+    for (int i = 0; i < 3; i++) {
+        const char* note = i == 0 ? (image.enabled ? "  (shared image, below)" : "")
+                                  : (o.kv_hugepages ? "" : "  (regular memory)");
+        printf("  %-21s %10.2f %10llu %10llu%s\n", names[i], sizes[i] / GiB,
+               (unsigned long long)pages_for(sizes[i], PAGE_2M),
+               (unsigned long long)pages_for(sizes[i], PAGE_1G), note);
+    }
+    if (image.enabled && image.page_size) {
+        printf("\nShared image %s/%s (all replicas): %llu %lluMB pages with the index, %llu held already; "
+               "other images hold %llu\n", o.image_dir.c_str(), image.name.c_str(),
+               (unsigned long long)image.pages, (unsigned long long)(image.page_size >> 20),
+               (unsigned long long)image.present, (unsigned long long)image.other);
+        printf("  Note: publishing a new revision takes free pages for its changed tensors while the old one "
+               "is mapped\n");
+    } else if (image.enabled) {
+        printf("\nShared image %s/%s (all replicas): not on hugetlbfs, regular memory\n", o.image_dir.c_str(),
+               image.name.c_str());
+    }
+
+    printf("\nHuge page pool (%s%s):\n", image.enabled ? "image" : "weights",
+           o.kv_hugepages ? " + KV + buffers" : "");
+    const PoolState* pools[] = {&pool_2m, &pool_1g};
+    for (int i = 0; i < 2; i++) {
+        const PoolState& p = *pools[i];
+        uint64_t required = pooled_pages(plan, o, image, p.page_size);
+        const char* label = p.page_size == PAGE_1G ? "1GB" : "2MB";
+        if (!p.present) {
+            printf("  %s: required %llu, not supported by this kernel\n", label, (unsigned long long)required);
+            continue;
+        }
+        uint64_t avail = pool_available(p);
+        printf("  %s%s: required %llu, available %llu (total %llu, free %llu, reserved %llu) - %s\n",
+               label, p.page_size == o.page_size ? " [selected]" : "",
+               (unsigned long long)required, (unsigned long long)avail, (unsigned long long)p.nr,
+               (unsigned long long)p.free, (unsigned long long)p.resv,
+               avail >= required ? "OK" : "INSUFFICIENT");
+    }
+    if (o.page_size != default_size) {
+        printf("  Note: calibration picks the fastest pool that holds the model; set "
+               "HUGEPAGE_WRAPPER_PAGE_SIZE=%lluM to pin the selected one\n", (unsigned long long)(o.page_size >> 20));
+    }
+
+    uint64_t regular = o.kv_hugepages ? 0 : (plan.kv_cache + plan.buffers) * o.replicas;
+    printf("\nRegular memory: %.2f GB for KV cache and buffers, %.2f GB available\n",
+           regular / GiB, meminfo_bytes("MemAvailable") / GiB);
+}
+
+static void print_json(const GGUFModel& m, const PlannerOptions& o, const MemoryPlan& plan,
+                       const ImagePlan& image, const PoolState& pool_2m, const PoolState& pool_1g) {
+    printf("{\n");
+    printf("  \"model\": {\"path\": \"%s\", \"architecture\": \"%s\", \"file_size\": %llu, "
+           "\"n_layer\": %llu, \"n_head_kv\": %llu, \"key_length\": %llu, \"value_length\": %llu, "
+           "\"n_tensors\": %zu},\n",
+           o.model_path.c_str(), m.architecture.c_str(), (unsigned long long)m.file_size,
+           (unsigned long long)m.n_layer, (unsigned long long)m.n_head_kv,
+           (unsigned long long)m.key_length, (unsigned long long)m.value_length, m.tensors.size());
+    printf("  \"settings\": {\"ctx_size\": %llu, \"batch_size\": %llu, \"ubatch_size\": %llu, "
+           "\"replicas\": %llu, \"kv_hugepages\": %s},\n",
+           (unsigned long long)o.ctx_size, (unsigned long long)o.batch_size,
+           (unsigned long long)o.ubatch_size, (unsigned long long)o.replicas, o.kv_hugepages ? "true" : "false");
+    printf("  \"per_replica_bytes\": {\"weights\": %llu, \"kv_cache\": %llu, \"buffers\": %llu, \"pooled\": %llu},\n",
+           (unsigned long long)plan.weights, (unsigned long long)plan.kv_cache,
+           (unsigned long long)plan.buffers, (unsigned long long)pooled_bytes(plan, o, image));
+    if (image.enabled) {
+        printf("  \"image\": {\"dir\": \"%s\", \"name\": \"%s\", \"page_size\": %llu, \"pages\": %llu, "
+               "\"present\": %llu, \"other\": %llu},\n", o.image_dir.c_str(), image.name.c_str(),
+               (unsigned long long)image.page_size, (unsigned long long)image.pages,
+               (unsigned long long)image.present, (unsigned long long)image.other);
+    }
+    printf("  \"pools\": [\n");
+    const PoolState* pools[] = {&pool_2m, &pool_1g};
+    for (int i = 0; i < 2; i++) {
+        const PoolState& p = *pools[i];
+        printf("    {\"page_size\": %llu, \"selected\": %s, \"present\": %s, \"required\": %llu, "
+               "\"available\": %llu, \"total\": %llu, \"free\": %llu, \"reserved\": %llu, \"surplus\": %llu}%s\n",
+               (unsigned long long)p.page_size, p.page_size == o.page_size ? "true" : "false",
+               p.present ? "true" : "false", (unsigned long long)pooled_pages(plan, o, image, p.page_size),
+               (unsigned long long)pool_available(p), (unsigned long long)p.nr,
+               (unsigned long long)p.free, (unsigned long long)p.resv, (unsigned long long)p.surplus,
+               i == 0 ? "," : "");
+    }
+    printf("  ]\n}\n");
+}
+
+static void usage(const char* prog) {
+    fprintf(stderr,
+        "Usage: %s --model PATH [options]\n"
+        "\n"
+        "Plan (and optionally reserve) the huge page pool for llama-server replicas.\n"
+        "\n"
+        "Options:\n"
+        "  --model PATH         GGUF model file (default: $MODEL_PATH)\n"
+        "  --ctx-size N         Context size (default: $CTX_SIZE, entrypoint default, 32768)\n"
+        "  --batch-size N       Logical batch size (default: $BATCH_SIZE, entrypoint default, 2048)\n"
+        "  --ubatch-size N      Physical batch size (default: $UBATCH_SIZE, entrypoint default, 2048)\n"
+        "  --entrypoint PATH    Entrypoint script to read defaults from (default: %s)\n"
+        "  --replicas N         Replicas sharing the host pool (default: 1)\n"
+        "  --page-size 2M|1G    Pool to check/reserve (default: system default huge page size)\n"
+        "  --cache-type TYPE    KV cache type: f32, f16, bf16, q8_0, q5_1, q5_0, q4_1, q4_0 (default: f16)\n"
+        "  --buffer-mb N        Override the compute buffer estimate per replica\n"
+        "  --kv-hugepages       Plan KV cache and buffers into the pool as well\n"
+        "  --image-dir DIR      Weights are one shared image on this hugetlbfs mount (the host side of\n"
+        "                       the replicas' HUGEPAGE_WRAPPER_IMAGE_DIR)\n"
+        "  --image-name NAME    Image name (default: $HUGEPAGE_WRAPPER_IMAGE_NAME, model file name)\n"
+        "  --check              Exit 2 if the selected pool cannot hold the plan\n"
+        "  --reserve            Grow the selected pool to fit the plan (root)\n"
+        "  --drop-caches        Drop the page cache before reserving\n"
+        "  --compact-retries N  Compaction attempts when reservation falls short (default: 3)\n"
+        "  --json               Print the plan as JSON\n",
+        prog, DEFAULT_ENTRYPOINT);
+}
+
+int main(int argc, char** argv) {
+    enum {
+        OPT_MODEL = 1, OPT_CTX, OPT_BATCH, OPT_UBATCH, OPT_ENTRYPOINT, OPT_REPLICAS, OPT_PAGE_SIZE,
+        OPT_CACHE_TYPE, OPT_BUFFER_MB, OPT_KV_HUGEPAGES, OPT_IMAGE_DIR, OPT_IMAGE_NAME, OPT_CHECK, OPT_RESERVE,
+        OPT_DROP_CACHES, OPT_COMPACT_RETRIES, OPT_JSON, OPT_HELP,
+    };
+    static const struct option long_options[] = {
+        {"model", required_argument, nullptr, OPT_MODEL},
+        {"ctx-size", required_argument, nullptr, OPT_CTX},
+        {"batch-size", required_argument, nullptr, OPT_BATCH},
+        {"ubatch-size", required_argument, nullptr, OPT_UBATCH},
+        {"entrypoint", required_argument, nullptr, OPT_ENTRYPOINT},
+        {"replicas", required_argument, nullptr, OPT_REPLICAS},
+        {"page-size", required_argument, nullptr, OPT_PAGE_SIZE},
+        {"cache-type", required_argument, nullptr, OPT_CACHE_TYPE},
+        {"buffer-mb", required_argument, nullptr, OPT_BUFFER_MB},
+        {"kv-hugepages", no_argument, nullptr, OPT_KV_HUGEPAGES},
+        {"image-dir", required_argument, nullptr, OPT_IMAGE_DIR},
+        {"image-name", required_argument, nullptr, OPT_IMAGE_NAME},
+        {"check", no_argument, nullptr, OPT_CHECK},
+        {"reserve", no_argument, nullptr, OPT_RESERVE},
+        {"drop-caches", no_argument, nullptr, OPT_DROP_CACHES},
+        {"compact-retries", required_argument, nullptr, OPT_COMPACT_RETRIES},
+        {"json", no_argument, nullptr, OPT_JSON},
+        {"help", no_argument, nullptr, OPT_HELP},
+        {nullptr, 0, nullptr, 0},
+    };
+
+    PlannerOptions o;
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", long_options, nullptr)) != -1) {
+        switch (opt) {
+            case OPT_MODEL: o.model_path = optarg; break;
+            case OPT_CTX: o.ctx_size = strtoull(optarg, nullptr, 10); break;
+            case OPT_BATCH: o.batch_size = strtoull(optarg, nullptr, 10); break;
+            case OPT_UBATCH: o.ubatch_size = strtoull(optarg, nullptr, 10); break;
+            case OPT_ENTRYPOINT: o.entrypoint = optarg; break;
+            case OPT_REPLICAS: o.replicas = strtoull(optarg, nullptr, 10); break;
+            case OPT_PAGE_SIZE:
+                if (!parse_size(optarg, &o.page_size) || (o.page_size != PAGE_2M && o.page_size != PAGE_1G)) {
+                    fprintf(stderr, "hugepage_planner: --page-size must be 2M or 1G\n");
+                    return EXIT_ERROR;
+                }
+                break;
+            case OPT_CACHE_TYPE:
+                if (!parse_cache_type(optarg, &o.cache_bytes_per_elem)) {
+                    fprintf(stderr, "hugepage_planner: Unknown cache type: %s\n", optarg);
+                    return EXIT_ERROR;
+                }
+                break;
+            case OPT_BUFFER_MB: o.buffer_bytes = strtoull(optarg, nullptr, 10) * 1024 * 1024; break;
+            case OPT_KV_HUGEPAGES: o.kv_hugepages = true; break;
+            case OPT_IMAGE_DIR: o.image_dir = optarg; break;
+            case OPT_IMAGE_NAME: o.image_name = optarg; break;
+            case OPT_CHECK: o.check = true; break;
+            case OPT_RESERVE: o.reserve = true; break;
+            case OPT_DROP_CACHES: o.drop_caches = true; break;
+            case OPT_COMPACT_RETRIES: o.compact_retries = atoi(optarg); break;
+            case OPT_JSON: o.json = true; break;
+            case OPT_HELP: usage(argv[0]); return EXIT_OK;
+            default: usage(argv[0]); return EXIT_ERROR;
+        }
+    }
+
+    if (o.model_path.empty() && getenv("MODEL_PATH")) {
+        o.model_path = getenv("MODEL_PATH");
+    }
+    if (o.image_name.empty() && getenv("HUGEPAGE_WRAPPER_IMAGE_NAME")) {
+        o.image_name = getenv("HUGEPAGE_WRAPPER_IMAGE_NAME");
+    }
+    if (o.model_path.empty() || o.replicas == 0) {
+        usage(argv[0]);
+        return EXIT_ERROR;
+    }
+    o.ctx_size = resolve_setting(o.ctx_size, "CTX_SIZE", o.entrypoint, DEFAULT_CTX_SIZE);
+    o.batch_size = resolve_setting(o.batch_size, "BATCH_SIZE", o.entrypoint, DEFAULT_BATCH_SIZE);
+    o.ubatch_size = resolve_setting(o.ubatch_size, "UBATCH_SIZE", o.entrypoint, DEFAULT_UBATCH_SIZE);
+    // llama.cpp clamps the physical batch to the logical one
+    if (o.ubatch_size > o.batch_size) o.ubatch_size = o.batch_size;
+
+    uint64_t default_size = meminfo_bytes("Hugepagesize");
+    if (default_size == 0) default_size = PAGE_2M;
+    if (o.page_size == 0) o.page_size = default_size;
+
+    int fd = open(o.model_path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "hugepage_planner: Cannot open %s: %s\n", o.model_path.c_str(), strerror(errno));
+        return EXIT_ERROR;
+    }
+    GGUFModel model;
+    std::string error;
+    bool parsed = gguf_read(fd, &model, &error);
+    close(fd);
+    if (!parsed) {
+        fprintf(stderr, "hugepage_planner: %s: %s\n", o.model_path.c_str(), error.c_str());
+        return EXIT_ERROR;
+    }
+
+    MemoryPlan plan = plan_memory(model, o);
+    ImagePlan image;
+    if (!plan_image(o, plan, &image)) {
+        return EXIT_ERROR;
+    }
+    PoolState pool_2m = read_pool(PAGE_2M);
+    PoolState pool_1g = read_pool(PAGE_1G);
+
+    if (o.reserve) {
+        PoolState& selected = o.page_size == PAGE_1G ? pool_1g : pool_2m;
+        uint64_t required = pooled_pages(plan, o, image, o.page_size);
+        uint64_t avail = pool_available(selected);
+        if (!selected.present) {
+            fprintf(stderr, "hugepage_planner: Kernel has no %lluMB huge page pool\n",
+                    (unsigned long long)(o.page_size >> 20));
+            return EXIT_ERROR;
+        }
+        if (avail < required) {
+            uint64_t missing = reserve_pages(o.page_size, required - avail, o);
+            if (missing) {
+                fprintf(stderr, "hugepage_planner: Reserved %llu of %llu additional pages\n",
+                        (unsigned long long)(required - avail - missing), (unsigned long long)(required - avail));
+            }
+            pool_2m = read_pool(PAGE_2M);
+            pool_1g = read_pool(PAGE_1G);
+        }
+    }
+
+    if (o.json) {
+        print_json(model, o, plan, image, pool_2m, pool_1g);
+    } else {
+        print_text(model, o, plan, image, pool_2m, pool_1g, default_size);
+    }
+
+    if (o.check || o.reserve) {
+        const PoolState& selected = o.page_size == PAGE_1G ? pool_1g : pool_2m;
+        if (pool_available(selected) < pooled_pages(plan, o, image, o.page_size)) {
+            return EXIT_INSUFFICIENT;
+        }
+    }
+    return EXIT_OK;
+}
@@ -0,0 +1,238 @@
+/*
+ * hugepage_progress.cpp
+ *
+ * Reports the model load progress the huge page wrapper keeps in
+ * HUGEPAGE_WRAPPER_PROGRESS (hugepage_progress.h) and whether the server is
+ * ready, for the container healthcheck and for watching a load:
+ *
+ *   loading: 12.30 / 16.00 GB (76.9%), 2.10 GB/s, ETA 2 s, stage pread, /app/models/model.gguf
+ *
+ * With --health-url the server is ready when that URL answers 200 (the
+ * wrapper only knows the model is mapped, not that the server has warmed
+ * up); without it, when the wrapper has mapped a model. A load whose
+ * progress has not moved for --stall-s seconds is reported as stalled.
+ *
+ * Exit codes: 0 ready, 1 not ready (still loading, stalled, failed) or error.
+ * Docker reserves 2 for healthchecks, so there are no others.
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <string>
+
+#include "hugepage_progress.h"
+
+#define EXIT_READY 0
+#define EXIT_NOT_READY 1
+
+#define DEFAULT_PROGRESS_FILE "/app/logs/hugepage_wrapper.progress"
+#define DEFAULT_STALL_S 60
+#define HTTP_TIMEOUT_S 5
+#define GB (1024.0 * 1024.0 * 1024.0)
+
+struct ProgressOptions {
+    const char* file = nullptr;
+    const char* health_url = nullptr;
+    double stall_s = DEFAULT_STALL_S;
+    bool json = false;
+    bool watch = false;
+};
+
+// HTTP status of a GET of an http:// URL, or 0 if it cannot be fetched
+static int http_status(const char* url) {
+    if (strncmp(url, "http://", 7) != 0) {
+        return 0;
+    }
+    std::string rest = url + 7;
+    size_t slash = rest.find('/');
+    std::string authority = rest.substr(0, slash);
+    std::string path = slash == std::string::npos ? "/" : rest.substr(slash);
+    size_t colon = authority.rfind(':');
+    std::string host = authority.substr(0, colon);
+    std::string port = colon == std::string::npos ? "80" : authority.substr(colon + 1);
+
+    struct addrinfo hints = {}, *addrs = nullptr;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host.c_str(), port.c_str(), &hints, &addrs) != 0) {
+        return 0;
+    }
+    int status = 0;
+    for (struct addrinfo* a = addrs; a && status == 0; a = a->ai_next) {
+        int fd = socket(a->ai_family, a->ai_socktype | SOCK_CLOEXEC, a->ai_protocol);
+        if (fd < 0) {
+            continue;
+        }
+        struct timeval tv = {HTTP_TIMEOUT_S, 0};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        if (connect(fd, a->ai_addr, a->ai_addrlen) == 0) {
+            std::string request = "GET " + path + " HTTP/1.0\r\nHost: " + authority + "\r\n\r\n";
+            char reply[64] = "";
+            if (write(fd, request.data(), request.size()) == (ssize_t)request.size() &&
+                read(fd, reply, sizeof(reply) - 1) > 0) {
+                sscanf(reply, "HTTP/%*s %d", &status);
+            }
+        }
+        close(fd);
+    }
+    freeaddrinfo(addrs);
+    return status;
+}
+
+struct Report {
+    bool have_progress;
+    LoadProgress p;
+    double age_s;            // Since the last update
+    double elapsed_s;        // Of the current load
+    double rate;             // Bytes per second
+    double eta_s;            // -1 if unknown
+    bool stalled;
+    int http;                // Status of --health-url, 0 if unreachable or not asked
+    bool ready;
+    std::string summary;
+};
+
+static Report inspect(const ProgressOptions& o) {
+    Report r = {};
+    r.eta_s = -1;
+    r.have_progress = progress_read(o.file, &r.p);
+    char line[4096];
+    if (r.have_progress) {
+        const LoadProgress& p = r.p;
+        uint64_t now = progress_now_ns();
+        r.age_s = now > p.updated_ns ? (now - p.updated_ns) / 1e9 : 0;
+        r.elapsed_s = p.updated_ns > p.started_ns ? (p.updated_ns - p.started_ns) / 1e9 : 0;
+        r.rate = r.elapsed_s > 0 ? p.loaded_bytes / r.elapsed_s : 0;
+        bool active = p.state == LOAD_LOADING || p.state == LOAD_CALIBRATING;
+        if (p.state == LOAD_LOADING && r.rate > 0) {
+            r.eta_s = (p.total_bytes - std::min(p.loaded_bytes, p.total_bytes)) / r.rate;
+        }
+        r.stalled = active && r.age_s > o.stall_s;
+        if (p.state == LOAD_LOADING) {
+            snprintf(line, sizeof(line), "%s: %.2f / %.2f GB (%.1f%%), %.2f GB/s, ETA %.0f s, stage %s, %s",
+                     r.stalled ? "stalled" : "loading", p.loaded_bytes / GB, p.total_bytes / GB,
+                     p.total_bytes ? 100.0 * p.loaded_bytes / p.total_bytes : 0, r.rate / GB,
+                     r.eta_s < 0 ? 0 : r.eta_s, p.stage, p.path);
+        } else if (p.state == LOAD_CALIBRATING) {
+            snprintf(line, sizeof(line), "%s: measuring the host for %.0f s, %s", r.stalled ? "stalled" : "calibrating",
+                     r.age_s, p.path);
+        } else if (p.state == LOAD_LOADED) {
+            snprintf(line, sizeof(line), "loaded: %u model(s), last %s (%s, %.2f GB in %.1f s)", p.models, p.path,
+                     p.stage, p.loaded_bytes / GB, r.elapsed_s);
+        } else if (p.state == LOAD_FAILED) {
+            snprintf(line, sizeof(line), "failed: loading %s (stage %s) after %.2f GB", p.path, p.stage,
+                     p.loaded_bytes / GB);
+        } else {
+            snprintf(line, sizeof(line), "starting: no model mapped yet (pid %u)", p.pid);
+        }
+    } else {
+        snprintf(line, sizeof(line), "no load progress in %s", o.file);
+    }
+    r.summary = line;
+
+    // The server decides when it is ready; the wrapper only knows the model is mapped
+    if (o.health_url) {
+        r.http = http_status(o.health_url);
+        r.ready = r.http == 200;
+        if (r.ready) {
+            r.summary = "ready: " + r.summary;
+        } else if (r.have_progress && r.p.state == LOAD_LOADED) {
+            r.summary += r.http ? ", server answers " + std::to_string(r.http) : ", server not answering";
+        }
+    } else {
+        r.ready = r.have_progress && r.p.state == LOAD_LOADED;
+    }
+    return r;
+}
+
+static void print_json(const Report& r) {
+    if (!r.have_progress) {
+        printf("{\"ready\": %s, \"http_status\": %d, \"state\": null}\n", r.ready ? "true" : "false", r.http);
+        return;
+    }
+    const LoadProgress& p = r.p;
+    std::string path;
+    for (const char* c = p.path; *c; c++) {
+        if (*c == '"' || *c == '\\') path += '\\';
+        path += *c;
+    }
+    printf("{\"ready\": %s, \"http_status\": %d, \"state\": \"%s\", \"stage\": \"%s\", \"path\": \"%s\", "
+           "\"pid\": %u, \"models\": %u, \"total_bytes\": %llu, \"loaded_bytes\": %llu, \"bytes_per_second\": %.0f, "
+           "\"eta_seconds\": %.1f, \"elapsed_seconds\": %.1f, \"seconds_since_update\": %.1f, \"stalled\": %s}\n",
+           r.ready ? "true" : "false", r.http, load_state_names[p.state], p.stage, path.c_str(), p.pid, p.models,
+           (unsigned long long)p.total_bytes, (unsigned long long)p.loaded_bytes, r.rate, r.eta_s, r.elapsed_s,
+           r.age_s, r.stalled ? "true" : "false");
+}
+
+static void usage(const char* prog) {
+    fprintf(stderr,
+        "Usage: %s [options]\n"
+        "\n"
+        "Report the huge page wrapper's model load progress and whether the server is ready.\n"
+        "\n"
+        "Options:\n"
+        "  --file PATH          Progress file (default: $HUGEPAGE_WRAPPER_PROGRESS or " DEFAULT_PROGRESS_FILE ")\n"
+        "  --health-url URL     Ready only when this URL answers 200 (e.g. http://localhost:8001/v1/health)\n"
+        "  --stall-s N          Report a load without progress for N seconds as stalled (default: %d)\n"
+        "  --json               Print the report as JSON\n"
+        "  --watch              Report every second until ready or failed\n",
+        prog, DEFAULT_STALL_S);
+}
+
+int main(int argc, char** argv) {
+    enum { OPT_FILE = 1, OPT_HEALTH_URL, OPT_STALL, OPT_JSON, OPT_WATCH, OPT_HELP };
+    static const struct option long_options[] = {
+        {"file", required_argument, nullptr, OPT_FILE},
+        {"health-url", required_argument, nullptr, OPT_HEALTH_URL},
+        {"stall-s", required_argument, nullptr, OPT_STALL},
+        {"json", no_argument, nullptr, OPT_JSON},
+        {"watch", no_argument, nullptr, OPT_WATCH},
+        {"help", no_argument, nullptr, OPT_HELP},
+        {nullptr, 0, nullptr, 0},
+    };
+
+    ProgressOptions o;
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", long_options, nullptr)) != -1) {
+        switch (opt) {
+            case OPT_FILE: o.file = optarg; break;
+            case OPT_HEALTH_URL: o.health_url = optarg; break;
+            case OPT_STALL: o.stall_s = atof(optarg); break;
+            case OPT_JSON: o.json = true; break;
+            case OPT_WATCH: o.watch = true; break;
+            case OPT_HELP: usage(argv[0]); return EXIT_READY;
+            default: usage(argv[0]); return EXIT_NOT_READY;
+        }
+    }
+    if (optind != argc) {
+        usage(argv[0]);
+        return EXIT_NOT_READY;
+    }
+    if (!o.file) {
+        const char* env = getenv("HUGEPAGE_WRAPPER_PROGRESS");
+        o.file = env && *env ? env : DEFAULT_PROGRESS_FILE;
+    }
+
+    for (;;) {
+        Report r = inspect(o);
+        if (o.json) {
+            print_json(r);
+        } else {
+            printf("%s\n", r.summary.c_str());
+        }
+        bool failed = r.have_progress && r.p.state == LOAD_FAILED;
+        if (!o.watch || r.ready || failed) {
+            return r.ready ? EXIT_READY : EXIT_NOT_READY;
+        }
+        fflush(stdout);
+        sleep(1);
+    }
+}
@@ -0,0 +1,97 @@
+/*
+ * hugepage_progress.h
+ *
+ * Live model load progress: layout of the file the huge page wrapper updates
+ * while it loads (HUGEPAGE_WRAPPER_PROGRESS), read by the hugepage_progress
+ * tool in the container healthcheck and by the router on the host.
+ *
+ * The file is one page the wrapper maps MAP_SHARED, so readers see every
+ * update without the wrapper making a system call per chunk. Counters are
+ * written with atomic stores; the start and end of a load (state, stage,
+ * path, totals) are written under a sequence counter that is odd meanwhile,
+ * and readers retry until they copy the struct with the same even sequence
+ * before and after.
+ *
+ * Times are CLOCK_MONOTONIC nanoseconds, which containers share with the
+ * host, so readers outside the container can compute the rate and the age of
+ * the last update. The layout is fixed little-endian; readers check the
+ * magic and version (scripts/router/readiness.py mirrors it).
+ */
+
+#pragma once
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define PROGRESS_MAGIC 0x50474f5250575048ULL // "HPWPROGP"
+#define PROGRESS_VERSION 1
+#define PROGRESS_FILE_BYTES 4096
+
+// What the wrapper in the process is doing
+enum LoadState {
+    LOAD_STARTING = 0,    // Library loaded, no model mapped yet
+    LOAD_CALIBRATING = 1, // Measuring the host before the first load
+    LOAD_LOADING = 2,     // Copying a model
+    LOAD_LOADED = 3,      // Last model mapped; the server may still be warming up
+    LOAD_FAILED = 4,      // Last load failed; the mmap returned an error
+    LOAD_STATE_COUNT
+};
+static const char* const load_state_names[] = {"starting", "calibrating", "loading", "loaded", "failed"};
+
+struct LoadProgress {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t pid;            // In the wrapper's PID namespace
+    uint64_t seq;            // Odd while a load starts or ends
+    uint32_t state;          // LoadState
+    uint32_t models;         // Models mapped so far
+    uint64_t started_ns;     // Start of the current load
+    uint64_t updated_ns;     // Last change, including each chunk loaded
+    uint64_t total_bytes;    // Bytes the current load reads
+    uint64_t loaded_bytes;   // Of those, read so far
+    char stage[32];          // Source stage, "calibrate", "image" or the strategy when loaded
+    char path[256];          // Model file of the current load
+};
+
+static_assert(sizeof(LoadProgress) <= PROGRESS_FILE_BYTES, "progress must fit its file");
+
+static inline uint64_t progress_now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline bool progress_valid(LoadProgress* p) {
+    p->stage[sizeof(p->stage) - 1] = '\0';
+    p->path[sizeof(p->path) - 1] = '\0';
+    return p->magic == PROGRESS_MAGIC && p->version == PROGRESS_VERSION && p->state < LOAD_STATE_COUNT;
+}
+
+// Consistent copy of a progress file; false if it is not one (yet). The copy
+// is consistent if the sequence was even and unchanged after reading it.
+static inline bool progress_read(const char* path, LoadProgress* out) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    bool ok = false;
+    for (int attempt = 0; attempt < 1000; attempt++) {
+        uint64_t seq;
+        if (pread(fd, out, sizeof(*out), 0) != (ssize_t)sizeof(*out) ||
+            pread(fd, &seq, sizeof(seq), offsetof(LoadProgress, seq)) != (ssize_t)sizeof(seq)) {
+            break;
+        }
+        if (!(seq & 1) && seq == out->seq) {
+            ok = progress_valid(out);
+            break;
+        }
+        usleep(100);
+    }
+    close(fd);
+    return ok;
+}
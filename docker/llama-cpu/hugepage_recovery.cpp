@@ -0,0 +1,718 @@
+/*
+ * hugepage_recovery.cpp
+ *
+ * Host daemon keeping the huge page pools at their target size across
+ * container restarts, and free memory compact enough to grow them.
+ *
+ * The pools are sized once (boot, make hugepage-reserve), but every restart
+ * of a replica, every GPU container that comes and goes, and the page cache
+ * of model loads break free memory into smaller runs. Once no 2MB (or 1GB)
+ * run is left, writes to nr_hugepages come up short. The planner's
+ * --reserve then fails and the wrapper falls back to regular pages,
+ * although the memory is free. This daemon:
+ * 1. Every --interval seconds reads the pools
+ *    (/sys/kernel/mm/hugepages), the free blocks per order and zone
+ *    (/proc/buddyinfo), the kernel's fragmentation index for 2MB
+ *    allocations (debugfs extfrag_index, if mounted) and the compaction
+ *    and huge page allocation counters (/proc/vmstat)
+ * 2. Computes each zone's unusable free index for 2MB pages: the share of
+ *    free memory in runs too small for one
+ * 3. When the host has been idle (CPU busy below --idle-pct for --idle-s)
+ *    and a pool is below its target, grows it toward the target. If the
+ *    kernel comes up short, it compacts memory and retries. Pools it
+ *    cannot grow are retried with exponential backoff. A pool never grows
+ *    past what leaves --keep-free of MemAvailable, and never shrinks
+ * 4. When the pools are at target but the unusable index is above
+ *    --frag-threshold, compacts proactively while idle, at most once per
+ *    --compact-interval, so the next restart finds 2MB runs
+ * 5. Writes pool health, fragmentation and its own actions in Prometheus
+ *    text format (--metrics)
+ *
+ * Targets default to the pool sizes at startup (the daemon then keeps what
+ * the boot reserved); --target 2M=PAGES sets them explicitly (make
+ * hugepage-plan gives the count). With --once it makes one pass without
+ * waiting for the host to be idle and exits.
+ *
+ * Exit codes: 0 pools at target, 1 error, 2 a pool is below target (--once).
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#define EXIT_OK 0
+#define EXIT_ERROR 1
+#define EXIT_BELOW_TARGET 2
+
+#define PAGE_2M (2ULL * 1024 * 1024)
+#define PAGE_1G (1024ULL * 1024 * 1024)
+#define GiB (1024.0 * 1024.0 * 1024.0)
+#define BASE_PAGE 4096ULL
+#define ORDER_2M 9            // Buddy order of a 2MB run of 4KB pages
+#define MAX_ORDERS 16
+#define MAX_BACKOFF_S 1800.0
+
+#define HUGEPAGES_SYSFS "/sys/kernel/mm/hugepages"
+#define EXTFRAG_INDEX "/sys/kernel/debug/extfrag/extfrag_index"
+
+struct RecoveryOptions {
+    std::string root;                   // Prefix of /proc and /sys (testing)
+    std::vector<std::pair<uint64_t, uint64_t>> targets;  // Page size, pages
+    double interval_s = 30;
+    double idle_pct = 25;
+    double idle_s = 60;
+    double frag_threshold = 0.5;
+    double compact_interval_s = 600;
+    int compact_retries = 3;
+    uint64_t keep_free = 4ULL << 30;
+    std::string metrics_path;
+    bool once = false;
+    bool dry_run = false;
+    bool verbose = false;
+};
+
+// One huge page pool and the daemon's bookkeeping for it
+struct Pool {
+    uint64_t page_size;
+    uint64_t target;
+    uint64_t nr, free, resv, surplus;
+    bool present;
+    // Recovery state
+    double next_attempt;                // Monotonic time of the next grow attempt
+    double backoff_s;
+    uint64_t attempts, grown_pages, failures;
+    double last_at_target;              // Wall clock, 0 = never
+};
+
+// Free blocks of one zone
+struct Zone {
+    int node;
+    std::string name;
+    uint64_t blocks[MAX_ORDERS];
+    int orders;
+    double extfrag;                     // Kernel index for ORDER_2M, -2 if unknown
+};
+
+struct HostState {
+    std::vector<Zone> zones;
+    uint64_t mem_available;
+    uint64_t compact_stall, compact_fail, compact_success;
+    uint64_t htlb_alloc_success, htlb_alloc_fail;
+    uint64_t thp_fault_alloc, thp_fault_fallback;
+};
+
+static volatile sig_atomic_t stop_requested = 0;
+
+static std::string path_of(const RecoveryOptions& o, const std::string& path) {
+    return o.root + path;
+}
+
+static double monotonic_s() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static bool read_u64_file(const std::string& path, uint64_t* out) {
+    FILE* f = fopen(path.c_str(), "r");
+    if (!f) {
+        return false;
+    }
+    unsigned long long v = 0;
+    bool ok = fscanf(f, "%llu", &v) == 1;
+    fclose(f);
+    if (ok) *out = v;
+    return ok;
+}
+
+static bool write_u64_file(const std::string& path, uint64_t value) {
+    FILE* f = fopen(path.c_str(), "w");
+    if (!f) {
+        fprintf(stderr, "hugepage_recovery: Cannot open %s: %s\n", path.c_str(), strerror(errno));
+        return false;
+    }
+    bool ok = fprintf(f, "%llu\n", (unsigned long long)value) > 0;
+    ok = (fclose(f) == 0) && ok;
+    if (!ok) {
+        fprintf(stderr, "hugepage_recovery: Write to %s failed: %s\n", path.c_str(), strerror(errno));
+    }
+    return ok;
+}
+
+static std::string pool_dir(const RecoveryOptions& o, uint64_t page_size) {
+    return path_of(o, HUGEPAGES_SYSFS "/hugepages-" + std::to_string(page_size / 1024) + "kB");
+}
+
+static const char* size_label(uint64_t page_size) {
+    return page_size == PAGE_1G ? "1G" : page_size == PAGE_2M ? "2M" : "other";
+}
+
+static void read_pool(const RecoveryOptions& o, Pool* p) {
+    std::string dir = pool_dir(o, p->page_size);
+    p->present = read_u64_file(dir + "/nr_hugepages", &p->nr);
+    read_u64_file(dir + "/free_hugepages", &p->free);
+    read_u64_file(dir + "/resv_hugepages", &p->resv);
+    read_u64_file(dir + "/surplus_hugepages", &p->surplus);
+}
+
+// "Node 0, zone   Normal   3194    349 ..." lines of buddyinfo and extfrag_index
+static bool parse_zone_line(const char* line, int* node, std::string* zone, const char** rest) {
+    char name[32];
+    int n = 0;
+    if (sscanf(line, "Node %d, zone %31s%n", node, name, &n) != 2) {
+        return false;
+    }
+    *zone = name;
+    *rest = line + n;
+    return true;
+}
+
+static void read_host(const RecoveryOptions& o, HostState* h) {
+    h->zones.clear();
+    char line[1024];
+    if (FILE* f = fopen(path_of(o, "/proc/buddyinfo").c_str(), "r")) {
+        while (fgets(line, sizeof(line), f)) {
+            Zone z = {};
+            const char* rest;
+            if (!parse_zone_line(line, &z.node, &z.name, &rest)) continue;
+            char* end;
+            for (z.orders = 0; z.orders < MAX_ORDERS; z.orders++) {
+                unsigned long long v = strtoull(rest, &end, 10);
+                if (end == rest) break;
+                z.blocks[z.orders] = v;
+                rest = end;
+            }
+            z.extfrag = -2;
+            h->zones.push_back(z);
+        }
+        fclose(f);
+    }
+    // Kernel fragmentation index (debugfs, root): -1 when an allocation of
+    // the order would succeed, towards 0 when it fails for lack of memory,
+    // towards 1 when it fails because free memory is fragmented
+    if (FILE* f = fopen(path_of(o, EXTFRAG_INDEX).c_str(), "r")) {
+        while (fgets(line, sizeof(line), f)) {
+            int node;
+            std::string name;
+            const char* rest;
+            if (!parse_zone_line(line, &node, &name, &rest)) continue;
+            char* end;
+            for (int order = 0; order <= ORDER_2M; order++) {
+                double v = strtod(rest, &end);
+                if (end == rest) break;
+                rest = end;
+                if (order < ORDER_2M) continue;
+                for (Zone& z : h->zones) {
+                    if (z.node == node && z.name == name) z.extfrag = v;
+                }
+            }
+        }
+        fclose(f);
+    }
+
+    h->mem_available = 0;
+    if (FILE* f = fopen(path_of(o, "/proc/meminfo").c_str(), "r")) {
+        while (fgets(line, sizeof(line), f)) {
+            if (strncmp(line, "MemAvailable:", 13) == 0) {
+                h->mem_available = strtoull(line + 13, nullptr, 10) * 1024;
+            }
+        }
+        fclose(f);
+    }
+
+    struct { const char* name; uint64_t* value; } counters[] = {
+        {"compact_stall", &h->compact_stall}, {"compact_fail", &h->compact_fail},
+        {"compact_success", &h->compact_success}, {"htlb_buddy_alloc_success", &h->htlb_alloc_success},
+        {"htlb_buddy_alloc_fail", &h->htlb_alloc_fail}, {"thp_fault_alloc", &h->thp_fault_alloc},
+        {"thp_fault_fallback", &h->thp_fault_fallback},
+    };
+    for (auto& c : counters) *c.value = 0;
+    if (FILE* f = fopen(path_of(o, "/proc/vmstat").c_str(), "r")) {
+        char name[64];
+        unsigned long long v;
+        while (fscanf(f, "%63s %llu", name, &v) == 2) {
+            for (auto& c : counters) {
+                if (strcmp(name, c.name) == 0) *c.value = v;
+            }
+        }
+        fclose(f);
+    }
+}
+
+static uint64_t zone_free_pages(const Zone& z) {
+    uint64_t pages = 0;
+    for (int order = 0; order < z.orders; order++) pages += z.blocks[order] << order;
+    return pages;
+}
+
+// Share of the zone's free memory in runs too small for a 2MB page
+// (the kernel's unusable free index)
+static double zone_unusable(const Zone& z) {
+    uint64_t free_pages = zone_free_pages(z);
+    if (free_pages == 0) {
+        return 0;
+    }
+    uint64_t usable = 0;
+    for (int order = ORDER_2M; order < z.orders; order++) usable += z.blocks[order] << order;
+    return (double)(free_pages - usable) / free_pages;
+}
+
+// Unusable index over the zones huge pages come from (Normal, Movable);
+// DMA zones hold too little memory to matter
+static double host_unusable(const HostState& h) {
+    uint64_t free_pages = 0, unusable = 0;
+    for (const Zone& z : h.zones) {
+        if (z.name.compare(0, 3, "DMA") == 0) continue;
+        uint64_t zone_free = zone_free_pages(z);
+        free_pages += zone_free;
+        unusable += (uint64_t)(zone_unusable(z) * zone_free);
+    }
+    return free_pages ? (double)unusable / free_pages : 0;
+}
+
+// CPU busy share since the previous call, from the aggregate line of /proc/stat
+static double cpu_busy_pct(const RecoveryOptions& o) {
+    static unsigned long long last_total = 0, last_idle = 0;
+    FILE* f = fopen(path_of(o, "/proc/stat").c_str(), "r");
+    if (!f) {
+        return 0;
+    }
+    unsigned long long v[8] = {};
+    int n = fscanf(f, "cpu %llu %llu %llu %llu %llu %llu %llu %llu", &v[0], &v[1], &v[2], &v[3], &v[4], &v[5],
+                   &v[6], &v[7]);
+    fclose(f);
+    if (n < 4) {
+        return 0;
+    }
+    unsigned long long total = 0;
+    for (unsigned long long x : v) total += x;
+    unsigned long long idle = v[3] + v[4];  // idle + iowait
+    double busy = 0;
+    if (total > last_total) {
+        busy = 100.0 * (1.0 - (double)(idle - last_idle) / (total - last_total));
+    }
+    last_total = total;
+    last_idle = idle;
+    return busy;
+}
+
+static void compact(const RecoveryOptions& o) {
+    if (!o.dry_run) write_u64_file(path_of(o, "/proc/sys/vm/compact_memory"), 1);
+}
+
+// Grows one pool toward its target: writes the target, and compacts and
+// retries when the kernel finds fewer free runs than asked for
+static void grow_pool(const RecoveryOptions& o, Pool* p, const HostState& h) {
+    // The pool may have changed since the pass read it (make hugepage-reserve,
+    // another host tool): a target computed from a stale count could shrink it
+    read_pool(o, p);
+    if (p->nr >= p->target) {
+        return;
+    }
+    uint64_t keep = std::min(h.mem_available, o.keep_free);
+    uint64_t affordable = (h.mem_available - keep) / p->page_size;
+    uint64_t want = std::min(p->target, p->nr + affordable);
+    if (want <= p->nr) {
+        if (o.verbose) {
+            fprintf(stderr, "hugepage_recovery: %s pool %llu of %llu pages, but only %.1f GB available\n",
+                    size_label(p->page_size), (unsigned long long)p->nr, (unsigned long long)p->target,
+                    h.mem_available / GiB);
+        }
+        return;
+    }
+    uint64_t before = p->nr;
+    p->attempts++;
+    std::string path = pool_dir(o, p->page_size) + "/nr_hugepages";
+    for (int attempt = 0; attempt <= o.compact_retries && p->nr < want; attempt++) {
+        if (attempt > 0) {
+            compact(o);
+        }
+        if (o.dry_run || !write_u64_file(path, want)) {
+            break;
+        }
+        read_pool(o, p);
+    }
+    if (p->nr > before) {
+        p->grown_pages += p->nr - before;
+    }
+    fprintf(stderr, "hugepage_recovery: %s pool %llu -> %llu pages (target %llu)%s\n", size_label(p->page_size),
+            (unsigned long long)before, (unsigned long long)p->nr, (unsigned long long)p->target,
+            o.dry_run ? " [dry run]" : "");
+    if (p->nr > before) {
+        p->backoff_s = o.interval_s;
+    } else {
+        p->failures++;
+        p->backoff_s = std::min(std::max(p->backoff_s, o.interval_s) * 2, MAX_BACKOFF_S);
+    }
+    p->next_attempt = monotonic_s() + (p->nr >= p->target ? 0 : p->backoff_s);
+}
+
+struct DaemonState {
+    std::vector<Pool> pools;
+    HostState host;
+    double idle_since;                  // Monotonic, 0 = busy
+    double last_compaction;             // Monotonic, 0 = never
+    uint64_t proactive_compactions;
+};
+
+static void write_metrics(const RecoveryOptions& o, const DaemonState& s) {
+    if (o.metrics_path.empty()) {
+        return;
+    }
+    std::string tmp = o.metrics_path + ".tmp";
+    FILE* f = fopen(tmp.c_str(), "w");
+    if (!f) {
+        return;
+    }
+    fprintf(f, "# HELP hugepage_pool_pages Huge pages in the pool by state\n");
+    fprintf(f, "# TYPE hugepage_pool_pages gauge\n");
+    for (const Pool& p : s.pools) {
+        const char* l = size_label(p.page_size);
+        fprintf(f, "hugepage_pool_pages{size=\"%s\",state=\"total\"} %llu\n", l, (unsigned long long)p.nr);
+        fprintf(f, "hugepage_pool_pages{size=\"%s\",state=\"free\"} %llu\n", l, (unsigned long long)p.free);
+        fprintf(f, "hugepage_pool_pages{size=\"%s\",state=\"reserved\"} %llu\n", l, (unsigned long long)p.resv);
+        fprintf(f, "hugepage_pool_pages{size=\"%s\",state=\"surplus\"} %llu\n", l, (unsigned long long)p.surplus);
+    }
+    fprintf(f, "# HELP hugepage_pool_target_pages Pool size the daemon recovers toward\n");
+    fprintf(f, "# TYPE hugepage_pool_target_pages gauge\n");
+    for (const Pool& p : s.pools) {
+        fprintf(f, "hugepage_pool_target_pages{size=\"%s\"} %llu\n", size_label(p.page_size),
+                (unsigned long long)p.target);
+    }
+    fprintf(f, "# HELP hugepage_pool_deficit_pages Pages the pool is below its target\n");
+    fprintf(f, "# TYPE hugepage_pool_deficit_pages gauge\n");
+    for (const Pool& p : s.pools) {
+        fprintf(f, "hugepage_pool_deficit_pages{size=\"%s\"} %llu\n", size_label(p.page_size),
+                (unsigned long long)(p.nr < p.target ? p.target - p.nr : 0));
+    }
+    fprintf(f, "# HELP hugepage_pool_at_target_timestamp_seconds Last time the pool was at its target\n");
+    fprintf(f, "# TYPE hugepage_pool_at_target_timestamp_seconds gauge\n");
+    for (const Pool& p : s.pools) {
+        fprintf(f, "hugepage_pool_at_target_timestamp_seconds{size=\"%s\"} %.0f\n", size_label(p.page_size),
+                p.last_at_target);
+    }
+    fprintf(f, "# HELP hugepage_recovery_attempts_total Grow attempts for pools below target\n");
+    fprintf(f, "# TYPE hugepage_recovery_attempts_total counter\n");
+    for (const Pool& p : s.pools) {
+        fprintf(f, "hugepage_recovery_attempts_total{size=\"%s\"} %llu\n", size_label(p.page_size),
+                (unsigned long long)p.attempts);
+    }
+    fprintf(f, "# HELP hugepage_recovery_failures_total Grow attempts that added no pages\n");
+    fprintf(f, "# TYPE hugepage_recovery_failures_total counter\n");
+    for (const Pool& p : s.pools) {
+        fprintf(f, "hugepage_recovery_failures_total{size=\"%s\"} %llu\n", size_label(p.page_size),
+                (unsigned long long)p.failures);
+    }
+    fprintf(f, "# HELP hugepage_recovery_grown_pages_total Pages added to the pool by the daemon\n");
+    fprintf(f, "# TYPE hugepage_recovery_grown_pages_total counter\n");
+    for (const Pool& p : s.pools) {
+        fprintf(f, "hugepage_recovery_grown_pages_total{size=\"%s\"} %llu\n", size_label(p.page_size),
+                (unsigned long long)p.grown_pages);
+    }
+    fprintf(f, "# HELP hugepage_recovery_proactive_compactions_total Compactions run for fragmentation alone\n");
+    fprintf(f, "# TYPE hugepage_recovery_proactive_compactions_total counter\n");
+    fprintf(f, "hugepage_recovery_proactive_compactions_total %llu\n", (unsigned long long)s.proactive_compactions);
+
+    fprintf(f, "# HELP hugepage_buddy_free_blocks Free blocks of 2^order base pages (/proc/buddyinfo)\n");
+    fprintf(f, "# TYPE hugepage_buddy_free_blocks gauge\n");
+    for (const Zone& z : s.host.zones) {
+        for (int order = 0; order < z.orders; order++) {
+            fprintf(f, "hugepage_buddy_free_blocks{node=\"%d\",zone=\"%s\",order=\"%d\"} %llu\n", z.node,
+                    z.name.c_str(), order, (unsigned long long)z.blocks[order]);
+        }
+    }
+    fprintf(f, "# HELP hugepage_unusable_free_ratio Share of free memory in runs smaller than 2MB\n");
+    fprintf(f, "# TYPE hugepage_unusable_free_ratio gauge\n");
+    for (const Zone& z : s.host.zones) {
+        fprintf(f, "hugepage_unusable_free_ratio{node=\"%d\",zone=\"%s\"} %.4f\n", z.node, z.name.c_str(),
+                zone_unusable(z));
+    }
+    bool extfrag = false;
+    for (const Zone& z : s.host.zones) extfrag = extfrag || z.extfrag > -2;
+    if (extfrag) {
+        fprintf(f, "# HELP hugepage_extfrag_index Kernel fragmentation index for 2MB allocations "
+                "(-1 succeeds, toward 1 fails from fragmentation)\n");
+        fprintf(f, "# TYPE hugepage_extfrag_index gauge\n");
+        for (const Zone& z : s.host.zones) {
+            if (z.extfrag > -2) {
+                fprintf(f, "hugepage_extfrag_index{node=\"%d\",zone=\"%s\"} %.3f\n", z.node, z.name.c_str(),
+                        z.extfrag);
+            }
+        }
+    }
+    fprintf(f, "# HELP hugepage_host_idle Whether the host counts as idle for recovery work\n");
+    fprintf(f, "# TYPE hugepage_host_idle gauge\n");
+    fprintf(f, "hugepage_host_idle %d\n", s.idle_since > 0 && monotonic_s() - s.idle_since >= o.idle_s);
+    fprintf(f, "# HELP hugepage_mem_available_bytes MemAvailable of /proc/meminfo\n");
+    fprintf(f, "# TYPE hugepage_mem_available_bytes gauge\n");
+    fprintf(f, "hugepage_mem_available_bytes %llu\n", (unsigned long long)s.host.mem_available);
+
+    struct { const char* name; const char* help; uint64_t value; } counters[] = {
+        {"hugepage_kernel_compact_stall_total", "Direct compactions stalling an allocation (compact_stall)",
+         s.host.compact_stall},
+        {"hugepage_kernel_compact_fail_total", "Compactions that freed no run (compact_fail)", s.host.compact_fail},
+        {"hugepage_kernel_compact_success_total", "Compactions that freed a run (compact_success)",
+         s.host.compact_success},
+        {"hugepage_kernel_pool_alloc_success_total", "Huge pages the pools got from the buddy allocator "
+         "(htlb_buddy_alloc_success)", s.host.htlb_alloc_success},
+        {"hugepage_kernel_pool_alloc_fail_total", "Huge page pool allocations that failed (htlb_buddy_alloc_fail)",
+         s.host.htlb_alloc_fail},
+        {"hugepage_kernel_thp_fault_alloc_total", "Transparent huge pages allocated on fault (thp_fault_alloc)",
+         s.host.thp_fault_alloc},
+        {"hugepage_kernel_thp_fault_fallback_total", "Faults that fell back to base pages (thp_fault_fallback)",
+         s.host.thp_fault_fallback},
+    };
+    for (auto& c : counters) {
+        fprintf(f, "# HELP %s %s\n# TYPE %s counter\n%s %llu\n", c.name, c.help, c.name, c.name,
+                (unsigned long long)c.value);
+    }
+    fclose(f);
+    rename(tmp.c_str(), o.metrics_path.c_str());
+}
+
+static void print_status(const DaemonState& s) {
+    for (const Pool& p : s.pools) {
+        printf("%s pool: %llu pages (free %llu, reserved %llu), target %llu - %s\n", size_label(p.page_size),
+               (unsigned long long)p.nr, (unsigned long long)p.free, (unsigned long long)p.resv,
+               (unsigned long long)p.target, p.nr >= p.target ? "OK" : "BELOW TARGET");
+    }
+    for (const Zone& z : s.host.zones) {
+        uint64_t free_pages = zone_free_pages(z);
+        printf("Node %d %-8s %8.2f GB free, %5.1f%% in runs below 2MB", z.node, z.name.c_str(),
+               free_pages * BASE_PAGE / GiB, 100 * zone_unusable(z));
+        if (z.extfrag > -2) printf(", extfrag index %.3f", z.extfrag);
+        printf("\n");
+    }
+    printf("MemAvailable %.2f GB, pool allocation failures %llu, compactions %llu (%llu failed)\n",
+           s.host.mem_available / GiB, (unsigned long long)s.host.htlb_alloc_fail,
+           (unsigned long long)(s.host.compact_success + s.host.compact_fail), (unsigned long long)s.host.compact_fail);
+}
+
+// One pass: refresh state, recover pools below target, compact proactively
+static void run_pass(const RecoveryOptions& o, DaemonState* s) {
+    double now = monotonic_s();
+    if (cpu_busy_pct(o) < o.idle_pct) {
+        if (s->idle_since == 0) s->idle_since = now;
+    } else {
+        s->idle_since = 0;
+    }
+    bool idle = o.once || (s->idle_since > 0 && now - s->idle_since >= o.idle_s);
+    read_host(o, &s->host);
+
+    bool below = false;
+    for (Pool& p : s->pools) {
+        read_pool(o, &p);
+        if (p.present && p.nr < p.target) {
+            below = true;
+            if (idle && now >= p.next_attempt) {
+                grow_pool(o, &p, s->host);
+                read_host(o, &s->host);
+            }
+        }
+        if (p.nr >= p.target) {
+            p.last_at_target = (double)time(nullptr);
+        }
+    }
+
+    double unusable = host_unusable(s->host);
+    bool due = s->last_compaction == 0 || now - s->last_compaction >= o.compact_interval_s;
+    if (!below && idle && due && unusable > o.frag_threshold) {
+        fprintf(stderr, "hugepage_recovery: %.0f%% of free memory in runs below 2MB, compacting%s\n",
+                100 * unusable, o.dry_run ? " [dry run]" : "");
+        compact(o);
+        s->last_compaction = now;
+        s->proactive_compactions++;
+        read_host(o, &s->host);
+        if (o.verbose) {
+            fprintf(stderr, "hugepage_recovery: %.0f%% after compaction\n", 100 * host_unusable(s->host));
+        }
+    }
+    write_metrics(o, *s);
+}
+
+static void on_signal(int) {
+    stop_requested = 1;
+}
+
+static bool parse_size(const char* s, uint64_t* out) {
+    char* end = nullptr;
+    uint64_t v = strtoull(s, &end, 10);
+    if (end == s) return false;
+    switch (*end) {
+        case 'G': case 'g': v *= 1024ULL * 1024 * 1024; end++; break;
+        case 'M': case 'm': v *= 1024ULL * 1024; end++; break;
+        case 'K': case 'k': v *= 1024ULL; end++; break;
+        case '\0': break;
+        default: return false;
+    }
+    if (*end == 'B' || *end == 'b') end++;
+    *out = v;
+    return *end == '\0';
+}
+
+// "2M=15360"
+static bool parse_target(const char* s, std::pair<uint64_t, uint64_t>* out) {
+    const char* eq = strchr(s, '=');
+    if (!eq) return false;
+    std::string size(s, eq - s);
+    char* end;
+    unsigned long long pages = strtoull(eq + 1, &end, 10);
+    if (end == eq + 1 || *end || !parse_size(size.c_str(), &out->first)) return false;
+    if (out->first != PAGE_2M && out->first != PAGE_1G) return false;
+    out->second = pages;
+    return true;
+}
+
+static void usage(const char* prog) {
+    fprintf(stderr,
+        "Usage: %s [OPTIONS]\n"
+        "\n"
+        "Keep the huge page pools at their target size: monitor fragmentation, and when\n"
+        "the host is idle compact memory and grow pools that fell short (root).\n"
+        "\n"
+        "Options:\n"
+        "  --target SIZE=PAGES  Pool target, SIZE 2M or 1G, repeatable (default: the pool\n"
+        "                       sizes at startup)\n"
+        "  --interval S         Seconds between passes (default: 30)\n"
+        "  --idle-pct P         CPU busy percentage below which the host is idle (default: 25)\n"
+        "  --idle-s S           Seconds the host must be idle before acting (default: 60)\n"
+        "  --frag-threshold X   Share of free memory in runs below 2MB that triggers a\n"
+        "                       proactive compaction (default: 0.5)\n"
+        "  --compact-interval S Minimum seconds between proactive compactions (default: 600)\n"
+        "  --compact-retries N  Compactions per grow attempt that comes up short (default: 3)\n"
+        "  --keep-free SIZE     MemAvailable a pool may not grow into (default: 4G)\n"
+        "  --metrics PATH       Prometheus text file for pool health and fragmentation\n"
+        "  --once               One pass without waiting for idleness, print the status, exit\n"
+        "  --dry-run            Monitor and log only, change nothing\n"
+        "  --root DIR           Read and write /proc and /sys under DIR (testing)\n"
+        "  --verbose            Log skipped attempts and compaction results\n",
+        prog);
+}
+
+int main(int argc, char** argv) {
+    enum {
+        OPT_TARGET = 1, OPT_INTERVAL, OPT_IDLE_PCT, OPT_IDLE_S, OPT_FRAG_THRESHOLD, OPT_COMPACT_INTERVAL,
+        OPT_COMPACT_RETRIES, OPT_KEEP_FREE, OPT_METRICS, OPT_ONCE, OPT_DRY_RUN, OPT_ROOT, OPT_VERBOSE, OPT_HELP,
+    };
+    static const struct option long_options[] = {
+        {"target", required_argument, nullptr, OPT_TARGET},
+        {"interval", required_argument, nullptr, OPT_INTERVAL},
+        {"idle-pct", required_argument, nullptr, OPT_IDLE_PCT},
+        {"idle-s", required_argument, nullptr, OPT_IDLE_S},
+        {"frag-threshold", required_argument, nullptr, OPT_FRAG_THRESHOLD},
+        {"compact-interval", required_argument, nullptr, OPT_COMPACT_INTERVAL},
+        {"compact-retries", required_argument, nullptr, OPT_COMPACT_RETRIES},
+        {"keep-free", required_argument, nullptr, OPT_KEEP_FREE},
+        {"metrics", required_argument, nullptr, OPT_METRICS},
+        {"once", no_argument, nullptr, OPT_ONCE},
+        {"dry-run", no_argument, nullptr, OPT_DRY_RUN},
+        {"root", required_argument, nullptr, OPT_ROOT},
+        {"verbose", no_argument, nullptr, OPT_VERBOSE},
+        {"help", no_argument, nullptr, OPT_HELP},
+        {nullptr, 0, nullptr, 0},
+    };
+
+    RecoveryOptions o;
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", long_options, nullptr)) != -1) {
+        switch (opt) {
+            case OPT_TARGET: {
+                std::pair<uint64_t, uint64_t> target;
+                if (!parse_target(optarg, &target)) {
+                    fprintf(stderr, "hugepage_recovery: invalid --target '%s' (2M=PAGES or 1G=PAGES)\n", optarg);
+                    return EXIT_ERROR;
+                }
+                o.targets.push_back(target);
+                break;
+            }
+            case OPT_INTERVAL: o.interval_s = atof(optarg); break;
+            case OPT_IDLE_PCT: o.idle_pct = atof(optarg); break;
+            case OPT_IDLE_S: o.idle_s = atof(optarg); break;
+            case OPT_FRAG_THRESHOLD: o.frag_threshold = atof(optarg); break;
+            case OPT_COMPACT_INTERVAL: o.compact_interval_s = atof(optarg); break;
+            case OPT_COMPACT_RETRIES: o.compact_retries = atoi(optarg); break;
+            case OPT_KEEP_FREE:
+                if (!parse_size(optarg, &o.keep_free)) {
+                    fprintf(stderr, "hugepage_recovery: invalid --keep-free '%s'\n", optarg);
+                    return EXIT_ERROR;
+                }
+                break;
+            case OPT_METRICS: o.metrics_path = optarg; break;
+            case OPT_ONCE: o.once = true; break;
+            case OPT_DRY_RUN: o.dry_run = true; break;
+            case OPT_ROOT: o.root = optarg; break;
+            case OPT_VERBOSE: o.verbose = true; break;
+            case OPT_HELP: usage(argv[0]); return EXIT_OK;
+            default: usage(argv[0]); return EXIT_ERROR;
+        }
+    }
+    if (o.interval_s <= 0) {
+        fprintf(stderr, "hugepage_recovery: --interval must be positive\n");
+        return EXIT_ERROR;
+    }
+
+    DaemonState s = {};
+    for (uint64_t page_size : {PAGE_2M, PAGE_1G}) {
+        Pool p = {};
+        p.page_size = page_size;
+        read_pool(o, &p);
+        if (!p.present) continue;
+        p.target = p.nr;
+        bool explicit_target = false;
+        for (const auto& t : o.targets) {
+            if (t.first == page_size) {
+                p.target = t.second;
+                explicit_target = true;
+            }
+        }
+        // Pools without pages and without a target are not ours to grow
+        if (p.target == 0 && !explicit_target) continue;
+        s.pools.push_back(p);
+    }
+    for (const auto& t : o.targets) {
+        bool found = false;
+        for (const Pool& p : s.pools) found = found || p.page_size == t.first;
+        if (!found && t.second > 0) {
+            fprintf(stderr, "hugepage_recovery: Kernel has no %s huge page pool\n", size_label(t.first));
+            return EXIT_ERROR;
+        }
+    }
+    if (s.pools.empty()) {
+        fprintf(stderr, "hugepage_recovery: No huge page pools to keep (give --target)\n");
+        return EXIT_ERROR;
+    }
+
+    if (o.once) {
+        run_pass(o, &s);
+        print_status(s);
+        for (const Pool& p : s.pools) {
+            if (p.nr < p.target) return EXIT_BELOW_TARGET;
+        }
+        return EXIT_OK;
+    }
+
+    signal(SIGTERM, on_signal);
+    signal(SIGINT, on_signal);
+    for (const Pool& p : s.pools) {
+        fprintf(stderr, "hugepage_recovery: Keeping the %s pool at %llu pages (now %llu)%s\n",
+                size_label(p.page_size), (unsigned long long)p.target, (unsigned long long)p.nr,
+                o.dry_run ? " [dry run]" : "");
+    }
+    cpu_busy_pct(o);  // Baseline for the first interval
+    while (!stop_requested) {
+        struct timespec ts = {(time_t)o.interval_s, (long)((o.interval_s - (time_t)o.interval_s) * 1e9)};
+        while (nanosleep(&ts, &ts) != 0 && errno == EINTR && !stop_requested) {}
+        if (stop_requested) break;
+        run_pass(o, &s);
+    }
+    return EXIT_OK;
+}
@@ -0,0 +1,404 @@
+/*
+ * model_extents.cpp
+ *
+ * Reports how fragmented model files are on their data volume and rewrites
+ * the badly fragmented ones contiguously (file_extents.h).
+ *
+ * The huge page wrapper can read a fragmented model in device order
+ * (HUGEPAGE_WRAPPER_READ_ORDER=physical), but a file in thousands of small
+ * extents still costs a seek per extent on every cold load, and the page
+ * cache path of llama.cpp (no wrapper) reads it in file order. Models
+ * fetched by parallel downloaders are the usual case. This tool:
+ * 1. Walks the given files and directories (default /mnt/ai-data/models)
+ *    for model files (.gguf, .safetensors, .bin, .pt, .pth, .ckpt) of at
+ *    least --min-size
+ * 2. Reads their extents with FIEMAP and reports the seeks a file-order read
+ *    makes and the average contiguous run; a file whose average run is
+ *    below --min-run is fragmented
+ * 3. With --defrag, copies each fragmented file into a preallocated
+ *    temporary file in the same directory (reading the source in device
+ *    order), keeps its mode, owner and times (so the .digests sidecar of
+ *    hugepage_image stays valid), and renames it over the original if the
+ *    copy is more contiguous. Processes that have the old file open keep
+ *    reading the old blocks until they reopen it.
+ *
+ * Exit codes: 0 no fragmented files left, 1 error, 2 fragmented files found
+ * (without --defrag, or files that could not be improved).
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "file_extents.h"
+
+#define EXIT_OK 0
+#define EXIT_ERROR 1
+#define EXIT_FRAGMENTED 2
+
+#define MiB (1024.0 * 1024.0)
+#define GiB (1024.0 * 1024.0 * 1024.0)
+#define DEFAULT_MODELS_DIR "/mnt/ai-data/models"
+#define COPY_CHUNK (16ULL * 1024 * 1024)
+
+struct ExtentOptions {
+    uint64_t min_size = 1ULL << 30;  // The wrapper's default HUGEPAGE_WRAPPER_MIN_SIZE_MB
+    uint64_t min_run = 64ULL << 20;  // Runs this long already read at sequential speed
+    bool defrag = false;
+    bool verbose = false;
+};
+
+// Layout of one model file
+struct FileLayout {
+    uint64_t size;
+    size_t extents;
+    size_t seeks;
+    uint64_t largest_run;
+    bool unknown;         // Some extents have no device address yet (delayed allocation)
+};
+
+static bool parse_size(const char* s, uint64_t* out) {
+    char* end;
+    uint64_t v = strtoull(s, &end, 10);
+    if (end == s) return false;
+    if (*end == 'K' || *end == 'k') v *= 1024;
+    else if (*end == 'M' || *end == 'm') v *= 1024 * 1024;
+    else if (*end == 'G' || *end == 'g') v *= 1024 * 1024 * 1024;
+    else if (*end) return false;
+    *out = v;
+    return true;
+}
+
+static bool is_model_file(const std::string& name) {
+    static const char* suffixes[] = {".gguf", ".safetensors", ".bin", ".pt", ".pth", ".ckpt"};
+    for (const char* suffix : suffixes) {
+        size_t n = strlen(suffix);
+        if (name.size() > n && name.compare(name.size() - n, n, suffix) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Model files under `path` (a file is taken as is), sorted
+static void find_models(const std::string& path, std::vector<std::string>* out) {
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0) {
+        fprintf(stderr, "model_extents: %s: %s\n", path.c_str(), strerror(errno));
+        return;
+    }
+    if (!S_ISDIR(st.st_mode)) {
+        out->push_back(path);
+        return;
+    }
+    DIR* d = opendir(path.c_str());
+    if (!d) {
+        fprintf(stderr, "model_extents: %s: %s\n", path.c_str(), strerror(errno));
+        return;
+    }
+    std::vector<std::string> entries;
+    while (struct dirent* e = readdir(d)) {
+        if (e->d_name[0] != '.') {
+            entries.push_back(e->d_name);
+        }
+    }
+    closedir(d);
+    std::sort(entries.begin(), entries.end());
+    for (const std::string& name : entries) {
+        std::string child = path + (path.back() == '/' ? "" : "/") + name;
+        if (stat(child.c_str(), &st) != 0) continue;
+        if (S_ISDIR(st.st_mode)) {
+            find_models(child, out);
+        } else if (S_ISREG(st.st_mode) && is_model_file(name)) {
+            out->push_back(child);
+        }
+    }
+}
+
+static bool read_layout(int fd, uint64_t size, FileLayout* l, std::vector<FileExtent>* extents) {
+    if (!file_extents(fd, 0, size, extents)) {
+        return false;
+    }
+    *l = {size, extents->size(), extent_jumps(*extents), 0, false};
+    for (const FileExtent& e : *extents) {
+        l->largest_run = std::max(l->largest_run, e.length);
+        l->unknown = l->unknown || e.physical == 0;
+    }
+    return true;
+}
+
+static uint64_t average_run(const FileLayout& l) {
+    return l.size / (l.seeks + 1);
+}
+
+static bool fragmented(const FileLayout& l, const ExtentOptions& o) {
+    return !l.unknown && average_run(l) < std::min(o.min_run, l.size);
+}
+
+// Copy `src` into `dst` extent by extent in device order
+static bool copy_device_order(int src, int dst, const std::vector<FileExtent>& extents, uint64_t size,
+                              std::string* error) {
+    std::vector<FileExtent> order = extents;
+    std::stable_sort(order.begin(), order.end(),
+                     [](const FileExtent& a, const FileExtent& b) { return a.physical < b.physical; });
+    std::vector<char> buf(COPY_CHUNK);
+    for (const FileExtent& e : order) {
+        for (uint64_t done = 0; done < e.length;) {
+            size_t want = (size_t)std::min<uint64_t>(COPY_CHUNK, e.length - done);
+            off_t at = (off_t)(e.logical + done);
+            ssize_t n = pread(src, buf.data(), want, at);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) {
+                *error = n == 0 ? "unexpected end of file" : strerror(errno);
+                return false;
+            }
+            for (ssize_t w = 0; w < n;) {
+                ssize_t m = pwrite(dst, buf.data() + w, n - w, at + w);
+                if (m < 0 && errno == EINTR) continue;
+                if (m < 0) {
+                    *error = strerror(errno);
+                    return false;
+                }
+                w += m;
+            }
+            posix_fadvise(src, at, n, POSIX_FADV_DONTNEED);
+            done += n;
+        }
+    }
+    // Holes need no copy; the destination already has the full size
+    if (fdatasync(dst) != 0) {
+        *error = strerror(errno);
+        return false;
+    }
+    posix_fadvise(dst, 0, size, POSIX_FADV_DONTNEED);
+    return true;
+}
+
+// Rewrite `path` contiguously. Returns false with `error` if it could not be
+// done; *kept is set if the copy was made but was not more contiguous.
+static bool defrag_file(const std::string& path, int fd, const struct stat& st, const FileLayout& before,
+                        const std::vector<FileExtent>& extents, FileLayout* after, bool* kept, std::string* error) {
+    *kept = false;
+    if (st.st_nlink > 1) {
+        *error = "has other hard links, which a rewrite would split";
+        return false;
+    }
+    std::string dir = path.substr(0, path.find_last_of('/') + 1);
+    if (dir.empty()) dir = "./";
+    struct statvfs vfs;
+    if (statvfs(dir.c_str(), &vfs) == 0 && (uint64_t)vfs.f_bavail * vfs.f_frsize < (uint64_t)st.st_size) {
+        *error = "not enough free space for a copy";
+        return false;
+    }
+
+    std::string name = path.substr(dir.size());
+    std::string tmp = dir + "." + name + ".defrag.XXXXXX";
+    int out = mkstemp(&tmp[0]);
+    if (out < 0) {
+        *error = std::string("cannot create a temporary file: ") + strerror(errno);
+        return false;
+    }
+    // One allocation for the whole size lets the filesystem pick the largest free runs
+    int rc = posix_fallocate(out, 0, st.st_size);
+    bool ok = rc == 0 || rc == EOPNOTSUPP;
+    if (!ok) {
+        *error = std::string("cannot allocate the copy: ") + strerror(rc);
+    } else if (rc == EOPNOTSUPP && ftruncate(out, st.st_size) != 0) {
+        *error = strerror(errno);
+        ok = false;
+    }
+    ok = ok && copy_device_order(fd, out, extents, st.st_size, error);
+
+    std::vector<FileExtent> copied;
+    if (ok && !read_layout(out, st.st_size, after, &copied)) {
+        *error = std::string("cannot read the extents of the copy: ") + strerror(errno);
+        ok = false;
+    }
+    if (ok && after->seeks >= before.seeks) {
+        *kept = true;
+        ok = false;
+    }
+
+    // The source must not have changed while it was copied
+    struct stat now;
+    if (ok && (fstat(fd, &now) != 0 || now.st_size != st.st_size || now.st_mtim.tv_sec != st.st_mtim.tv_sec ||
+               now.st_mtim.tv_nsec != st.st_mtim.tv_nsec)) {
+        *error = "changed while it was copied";
+        ok = false;
+    }
+    if (ok) {
+        struct timespec times[2] = {st.st_atim, st.st_mtim};
+        if (fchown(out, st.st_uid, st.st_gid) != 0 && errno != EPERM) {
+            *error = strerror(errno);
+            ok = false;
+        }
+        ok = ok && fchmod(out, st.st_mode & 07777) == 0 && futimens(out, times) == 0 && fsync(out) == 0;
+        if (ok && rename(tmp.c_str(), path.c_str()) != 0) {
+            ok = false;
+        }
+        if (!ok && error->empty()) {
+            *error = strerror(errno);
+        }
+    }
+    close(out);
+    if (!ok) {
+        unlink(tmp.c_str());
+    }
+    return ok;
+}
+
+static void print_layout(const std::string& path, const FileLayout& l, const char* status) {
+    printf("%-56s %8.2f GB %8zu %7zu %8.0f MB %9.0f MB  %s\n", path.c_str(), l.size / GiB, l.extents, l.seeks,
+           average_run(l) / MiB, l.largest_run / MiB, status);
+}
+
+static int run(const std::vector<std::string>& paths, const ExtentOptions& o) {
+    std::vector<std::string> files;
+    for (const std::string& p : paths) {
+        find_models(p, &files);
+    }
+
+    int status = EXIT_OK;
+    size_t checked = 0, found = 0, rewritten = 0;
+    bool header = false;
+    for (const std::string& path : files) {
+        int fd = open(path.c_str(), O_RDONLY);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) != 0) {
+            fprintf(stderr, "model_extents: %s: %s\n", path.c_str(), strerror(errno));
+            if (fd >= 0) close(fd);
+            status = EXIT_ERROR;
+            continue;
+        }
+        if ((uint64_t)st.st_size < o.min_size) {
+            close(fd);
+            continue;
+        }
+        FileLayout l;
+        std::vector<FileExtent> extents;
+        if (!read_layout(fd, st.st_size, &l, &extents)) {
+            fprintf(stderr, "model_extents: %s: cannot read extents: %s\n", path.c_str(),
+                    errno == EOPNOTSUPP ? "filesystem does not support FIEMAP" : strerror(errno));
+            close(fd);
+            status = EXIT_ERROR;
+            continue;
+        }
+        if (!header) {
+            printf("%-56s %11s %8s %7s %11s %12s  %s\n", "FILE", "SIZE", "EXTENTS", "SEEKS", "AVG RUN",
+                   "LARGEST RUN", "STATUS");
+            header = true;
+        }
+        checked++;
+        bool bad = fragmented(l, o);
+        if (!bad) {
+            if (o.verbose || !l.unknown) {
+                print_layout(path, l, l.unknown ? "unallocated (sync first)" : "ok");
+            }
+            close(fd);
+            continue;
+        }
+        found++;
+        print_layout(path, l, "fragmented");
+        if (o.defrag) {
+            FileLayout after;
+            bool kept;
+            std::string error;
+            if (defrag_file(path, fd, st, l, extents, &after, &kept, &error)) {
+                printf("  rewritten: %zu -> %zu extents, %zu -> %zu seeks\n", l.extents, after.extents, l.seeks,
+                       after.seeks);
+                rewritten++;
+                if (fragmented(after, o) && status == EXIT_OK) {
+                    status = EXIT_FRAGMENTED;
+                }
+            } else if (kept) {
+                printf("  kept: the copy was no more contiguous (%zu seeks); free space is fragmented\n",
+                       after.seeks);
+                if (status == EXIT_OK) status = EXIT_FRAGMENTED;
+            } else {
+                fprintf(stderr, "model_extents: %s: %s\n", path.c_str(), error.c_str());
+                status = EXIT_ERROR;
+            }
+        } else if (status == EXIT_OK) {
+            status = EXIT_FRAGMENTED;
+        }
+        close(fd);
+    }
+
+    if (checked == 0) {
+        printf("No model files of at least %.2f GB found\n", o.min_size / GiB);
+    } else if (o.defrag) {
+        printf("\n%zu of %zu files fragmented, %zu rewritten\n", found, checked, rewritten);
+    } else {
+        printf("\n%zu of %zu files fragmented (average run below %.0f MB)%s\n", found, checked, o.min_run / MiB,
+               found ? "; rewrite them with --defrag" : "");
+    }
+    return status;
+}
+
+static void usage(const char* prog) {
+    fprintf(stderr,
+        "Usage: %s [OPTIONS] [PATH...]\n"
+        "\n"
+        "Report the fragmentation of model files under PATH (default: " DEFAULT_MODELS_DIR ")\n"
+        "and optionally rewrite the fragmented ones contiguously.\n"
+        "\n"
+        "Options:\n"
+        "  --defrag             Rewrite fragmented files (needs free space for one copy)\n"
+        "  --min-run SIZE       Average contiguous run below which a file is fragmented\n"
+        "                       (default: 64M)\n"
+        "  --min-size SIZE      Skip smaller files (default: 1G, as the huge page wrapper)\n"
+        "  --verbose            Also list files whose blocks are not allocated yet\n",
+        prog);
+}
+
+int main(int argc, char** argv) {
+    enum { OPT_DEFRAG = 1, OPT_MIN_RUN, OPT_MIN_SIZE, OPT_VERBOSE, OPT_HELP };
+    static const struct option long_options[] = {
+        {"defrag", no_argument, nullptr, OPT_DEFRAG},
+        {"min-run", required_argument, nullptr, OPT_MIN_RUN},
+        {"min-size", required_argument, nullptr, OPT_MIN_SIZE},
+        {"verbose", no_argument, nullptr, OPT_VERBOSE},
+        {"help", no_argument, nullptr, OPT_HELP},
+        {nullptr, 0, nullptr, 0},
+    };
+
+    ExtentOptions o;
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", long_options, nullptr)) != -1) {
+        switch (opt) {
+            case OPT_DEFRAG: o.defrag = true; break;
+            case OPT_MIN_RUN:
+                if (!parse_size(optarg, &o.min_run) || o.min_run == 0) {
+                    fprintf(stderr, "model_extents: invalid --min-run '%s'\n", optarg);
+                    return EXIT_ERROR;
+                }
+                break;
+            case OPT_MIN_SIZE:
+                if (!parse_size(optarg, &o.min_size)) {
+                    fprintf(stderr, "model_extents: invalid --min-size '%s'\n", optarg);
+                    return EXIT_ERROR;
+                }
+                break;
+            case OPT_VERBOSE: o.verbose = true; break;
+            case OPT_HELP: usage(argv[0]); return EXIT_OK;
+            default: usage(argv[0]); return EXIT_ERROR;
+        }
+    }
+
+    std::vector<std::string> paths(argv + optind, argv + argc);
+    if (paths.empty()) {
+        paths.push_back(DEFAULT_MODELS_DIR);
+    }
+    return run(paths, o);
+}
@@ -0,0 +1,246 @@
+/*
+ * safetensors_reader.h
+ *
+ * Minimal safetensors header parser for the huge page wrapper.
+ *
+ * A safetensors file is an 8-byte little-endian header length, a JSON
+ * object mapping tensor names to {"dtype", "shape", "data_offsets"} (plus an
+ * optional "__metadata__" object of strings), then the tensor data. Only the
+ * header is read, with pread(), like gguf_reader.h.
+ */
+
+#pragma once
+
+#include <errno.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <string>
+#include <vector>
+
+// The safetensors library rejects headers above 100MB
+#define SAFETENSORS_MAX_HEADER (100ULL * 1024 * 1024)
+
+struct SafetensorsTensorInfo {
+    std::string name;
+    std::string dtype;
+    uint64_t begin; // Relative to the start of the data section
+    uint64_t end;
+};
+
+struct SafetensorsModel {
+    uint64_t header_size = 0;
+    uint64_t data_offset = 0; // Absolute file offset of the tensor data section
+    uint64_t file_size = 0;
+    std::vector<SafetensorsTensorInfo> tensors;
+};
+
+// Cursor over the JSON header text
+struct SafetensorsJson {
+    const char* p;
+    const char* end;
+    bool failed;
+};
+
+static inline void st_json_space(SafetensorsJson* j) {
+    while (j->p < j->end && (*j->p == ' ' || *j->p == '\t' || *j->p == '\n' || *j->p == '\r')) {
+        j->p++;
+    }
+}
+
+static inline bool st_json_expect(SafetensorsJson* j, char c) {
+    st_json_space(j);
+    if (j->p < j->end && *j->p == c) {
+        j->p++;
+        return true;
+    }
+    j->failed = true;
+    return false;
+}
+
+// Next non-space character without consuming it, 0 at the end
+static inline char st_json_peek(SafetensorsJson* j) {
+    st_json_space(j);
+    return j->p < j->end ? *j->p : 0;
+}
+
+// Tensor names and dtypes are plain ASCII; escapes are kept verbatim, which
+// is fine for names that are only logged
+static inline bool st_json_string(SafetensorsJson* j, std::string* out) {
+    if (!st_json_expect(j, '"')) {
+        return false;
+    }
+    const char* start = j->p;
+    while (j->p < j->end && *j->p != '"') {
+        j->p += (*j->p == '\\' && j->p + 1 < j->end) ? 2 : 1;
+    }
+    if (j->p >= j->end) {
+        j->failed = true;
+        return false;
+    }
+    if (out) {
+        out->assign(start, j->p - start);
+    }
+    j->p++;
+    return true;
+}
+
+static inline bool st_json_uint(SafetensorsJson* j, uint64_t* out) {
+    st_json_space(j);
+    char* num_end = nullptr;
+    if (j->p >= j->end || *j->p < '0' || *j->p > '9') {
+        j->failed = true;
+        return false;
+    }
+    *out = strtoull(j->p, &num_end, 10);
+    j->p = num_end;
+    return true;
+}
+
+// Skip any JSON value (string, number, literal, array or object)
+static inline void st_json_skip(SafetensorsJson* j) {
+    char c = st_json_peek(j);
+    if (c == '"') {
+        st_json_string(j, nullptr);
+    } else if (c == '{' || c == '[') {
+        char close = c == '{' ? '}' : ']';
+        j->p++;
+        if (st_json_peek(j) == close) {
+            j->p++;
+            return;
+        }
+        while (!j->failed) {
+            if (close == '}') {
+                st_json_string(j, nullptr);
+                st_json_expect(j, ':');
+            }
+            st_json_skip(j);
+            if (st_json_peek(j) == ',') {
+                j->p++;
+                continue;
+            }
+            st_json_expect(j, close);
+            break;
+        }
+    } else if (c != 0 && c != ',' && c != '}' && c != ']' && c != ':') {
+        while (j->p < j->end && *j->p != ',' && *j->p != '}' && *j->p != ']' &&
+               *j->p != ' ' && *j->p != '\n') {
+            j->p++;
+        }
+    } else {
+        j->failed = true;
+    }
+}
+
+// {"dtype": "...", "shape": [...], "data_offsets": [begin, end]}
+static inline bool st_json_tensor(SafetensorsJson* j, SafetensorsTensorInfo* t) {
+    bool has_offsets = false;
+    if (!st_json_expect(j, '{')) {
+        return false;
+    }
+    std::string key;
+    while (!j->failed && st_json_peek(j) != '}') {
+        st_json_string(j, &key);
+        st_json_expect(j, ':');
+        if (key == "dtype") {
+            st_json_string(j, &t->dtype);
+        } else if (key == "data_offsets") {
+            st_json_expect(j, '[');
+            st_json_uint(j, &t->begin);
+            st_json_expect(j, ',');
+            st_json_uint(j, &t->end);
+            st_json_expect(j, ']');
+            has_offsets = true;
+        } else {
+            st_json_skip(j);
+        }
+        if (st_json_peek(j) == ',') {
+            j->p++;
+        }
+    }
+    st_json_expect(j, '}');
+    return !j->failed && has_offsets && t->end >= t->begin;
+}
+
+// Parse the safetensors header of an open file. On failure returns false and sets *error.
+static inline bool safetensors_read(int fd, SafetensorsModel* m, std::string* error) {
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        *error = "fstat failed";
+        return false;
+    }
+    m->file_size = (uint64_t)st.st_size;
+
+    uint64_t header_size = 0;
+    ssize_t n;
+    do {
+        n = pread(fd, &header_size, sizeof(header_size), 0);
+    } while (n < 0 && errno == EINTR);
+    if (m->file_size < 10 || n != sizeof(header_size)) {
+        *error = "not a safetensors file";
+        return false;
+    }
+    if (header_size < 2 || header_size > SAFETENSORS_MAX_HEADER || 8 + header_size > m->file_size) {
+        *error = "not a safetensors file";
+        return false;
+    }
+    m->header_size = header_size;
+    m->data_offset = 8 + header_size;
+
+    std::string text(header_size, '\0');
+    size_t got = 0;
+    while (got < header_size) {
+        n = pread(fd, &text[got], header_size - got, 8 + got);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            *error = "truncated header";
+            return false;
+        }
+        got += n;
+    }
+
+    SafetensorsJson j = {text.data(), text.data() + text.size(), false};
+    if (st_json_peek(&j) != '{') {
+        *error = "not a safetensors file";
+        return false;
+    }
+    j.p++;
+    std::string name;
+    while (!j.failed && st_json_peek(&j) != '}') {
+        st_json_string(&j, &name);
+        st_json_expect(&j, ':');
+        if (name == "__metadata__") {
+            st_json_skip(&j);
+        } else {
+            SafetensorsTensorInfo t;
+            t.name = name;
+            if (!st_json_tensor(&j, &t)) {
+                j.failed = true;
+                break;
+            }
+            m->tensors.push_back(t);
+        }
+        if (st_json_peek(&j) == ',') {
+            j.p++;
+        }
+    }
+    if (j.failed) {
+        *error = "malformed header";
+        return false;
+    }
+
+    // Like the safetensors library, require the index to cover the data exactly
+    uint64_t data_end = 0;
+    for (const SafetensorsTensorInfo& t : m->tensors) {
+        if (t.end > data_end) data_end = t.end;
+    }
+    if (m->data_offset + data_end != m->file_size) {
+        *error = "tensor index does not match the file size";
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,158 @@
+/*
+ * tensor_lookup.h
+ *
+ * Address-to-tensor lookup for the models the huge page wrapper maps.
+ *
+ * Diagnostics and prefetch hooks attribute sampled addresses, page faults and
+ * prefetch targets to tensors and layers, millions of times a second; a scan
+ * over a model's ~600 tensors per sample costs more than the sampling. The
+ * wrapper builds a TensorTable for every model file it intercepts (whatever
+ * the placement strategy, from the tensor index it already reads) and answers
+ * through the C API below, which in-process tools resolve with dlsym so they
+ * also run without the wrapper:
+ *
+ *   hpw_tensor_lookup_fn lookup = (hpw_tensor_lookup_fn)dlsym(RTLD_DEFAULT, "hpw_tensor_lookup");
+ *   struct hpw_tensor t;
+ *   if (lookup && lookup(addr, &t)) count(t.layer, t.name);
+ *
+ * Layout: the tensor starts, relative to the mapping, in one sorted array,
+ * and a radix over the mapping's 2MB pages holding, for each page, how many
+ * tensors start at or before its first byte. Two adjacent radix entries give
+ * the tensors starting within an address's page; a page rarely holds more
+ * than a few starts (norms and biases next to a large weight), so they are
+ * scanned, and binary searched when there are more than TENSOR_SCAN_MAX.
+ * Most lookups are thus four loads, whatever the tensor count, and the radix
+ * costs 4 bytes per 2MB (60KB for a 30GB model).
+ *
+ * Tables are never freed, so a lookup racing an munmap reads valid memory;
+ * the unmapped model's table just stops matching, and its slot goes to the
+ * next model mapped.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// The tensor holding an address
+struct hpw_tensor {
+    const char* name;        // From the model header
+    int32_t layer;           // Block number from the name ("blk.12.", "layers.12."), -1 if none
+    uint32_t index;          // Position in the model, by file offset
+    const void* data;        // First byte of the tensor in the mapping
+    uint64_t size;           // Bytes
+    uint64_t file_offset;
+    const char* model;       // Path of the model file, "" if unknown
+};
+
+// 1 with *out filled if addr lies in a tensor of a mapped model; 0 for
+// addresses in headers, padding, other memory or unmapped models
+int hpw_tensor_lookup(const void* addr, struct hpw_tensor* out);
+
+// Layer of the tensor holding addr: -1 for tensors outside the blocks
+// (embeddings, output), -2 if addr lies in no tensor
+int32_t hpw_tensor_layer(const void* addr);
+
+typedef int (*hpw_tensor_lookup_fn)(const void* addr, struct hpw_tensor* out);
+typedef int32_t (*hpw_tensor_layer_fn)(const void* addr);
+
+#ifdef __cplusplus
+}
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#define TENSOR_PAGE_SHIFT 21     // Radix granularity: 2MB
+#define TENSOR_SCAN_MAX 8        // Starts within a page scanned rather than searched
+
+// A tensor of a model file, as the format readers give it
+struct TensorSpan {
+    uint64_t offset;             // Absolute file offset
+    uint64_t size;
+    std::string name;
+};
+
+struct TensorTable {
+    uintptr_t base;              // Mapping address of file offset 0; 0 once unmapped (atomic)
+    uint64_t length;
+    std::string model;
+    std::vector<uint64_t> starts;     // Sorted
+    std::vector<uint64_t> ends;
+    std::vector<uint32_t> pages;      // Tensors starting at or before each page; one past the last page
+    std::vector<std::string> names;
+    std::vector<int32_t> layers;
+};
+
+// Block number of a tensor: the first all-digit component of its dotted
+// name ("blk.12.attn_q.weight", "model.layers.12.mlp.up_proj.weight"), -1 if none
+static inline int32_t tensor_layer(const std::string& name) {
+    size_t begin = 0;
+    while (begin < name.size()) {
+        size_t end = name.find('.', begin);
+        if (end == std::string::npos) end = name.size();
+        bool digits = end > begin && end - begin < 9;
+        for (size_t i = begin; digits && i < end; i++) {
+            digits = name[i] >= '0' && name[i] <= '9';
+        }
+        if (digits) {
+            return (int32_t)atoi(name.c_str() + begin);
+        }
+        begin = end + 1;
+    }
+    return -1;
+}
+
+static inline void tensor_table_build(std::vector<TensorSpan> tensors, uint64_t length, TensorTable* t) {
+    std::sort(tensors.begin(), tensors.end(),
+              [](const TensorSpan& a, const TensorSpan& b) { return a.offset < b.offset; });
+    t->length = length;
+    t->starts.clear();
+    t->ends.clear();
+    t->names.clear();
+    t->layers.clear();
+    for (const TensorSpan& s : tensors) {
+        if (s.offset >= length) continue;
+        t->starts.push_back(s.offset);
+        t->ends.push_back(std::min(s.offset + s.size, length));
+        t->names.push_back(s.name);
+        t->layers.push_back(tensor_layer(s.name));
+    }
+    size_t page_count = (length + (1ULL << TENSOR_PAGE_SHIFT) - 1) >> TENSOR_PAGE_SHIFT;
+    t->pages.assign(page_count + 1, 0);
+    size_t next = 0;
+    for (size_t p = 0; p <= page_count; p++) {
+        uint64_t page_start = (uint64_t)p << TENSOR_PAGE_SHIFT;
+        while (next < t->starts.size() && t->starts[next] <= page_start) next++;
+        t->pages[p] = (uint32_t)next;
+    }
+    t->pages[page_count] = (uint32_t)t->starts.size();
+}
+
+// Index of the tensor holding offset, -1 if none
+static inline int64_t tensor_table_find(const TensorTable& t, uint64_t offset) {
+    if (offset >= t.length) {
+        return -1;
+    }
+    size_t page = offset >> TENSOR_PAGE_SHIFT;
+    uint32_t i = t.pages[page];
+    uint32_t end = t.pages[page + 1];
+    const uint64_t* starts = t.starts.data();
+    if (end - i <= TENSOR_SCAN_MAX) {
+        while (i < end && starts[i] <= offset) i++;
+    } else {
+        i = (uint32_t)(std::upper_bound(starts + i, starts + end, offset) - starts);
+    }
+    // i tensors start at or before offset; the last of them may hold it
+    if (i == 0 || offset >= t.ends[i - 1]) {
+        return -1;
+    }
+    return i - 1;
+}
+
+#endif
@@ -0,0 +1,473 @@
+/*
+ * thread_governor.cpp
+ *
+ * LD_PRELOAD OpenMP interposer choosing how many worker threads each
+ * llama-server compute step runs with, separately for prompt processing and
+ * generation.
+ *
+ * ggml's CPU backend computes a whole graph (one llama_decode ubatch) in one
+ * `#pragma omp parallel num_threads(n)` region, which GCC compiles to a call
+ * of libgomp's GOMP_parallel, with n from --threads for single-token
+ * generation steps and from --threads-batch for all others. Generation reads
+ * every weight once per token and saturates DRAM bandwidth before it runs out
+ * of cores, so threads past that point only add barrier waits; prompt
+ * processing is compute-bound and wants every core. Neither optimum is fixed:
+ * both move with the context length and with what the other replicas on the
+ * same memory channels are doing. The governor wraps llama_decode and
+ * GOMP_parallel:
+ * 1. llama_decode records the batch's token count and ubatch size, and each
+ *    region it runs takes the next ubatch of tokens. A region asking for
+ *    THREAD_GOVERNOR_DECODE or THREAD_GOVERNOR_PROMPT threads is a
+ *    generation step if its ubatch has at most THREAD_GOVERNOR_DECODE_TOKENS
+ *    tokens and a prompt step otherwise; other regions pass through
+ *    untouched. Without llama_decode (llama.cpp linked statically) the count
+ *    asked for decides, so the two ceilings must differ
+ * 2. Each phase times its steps and searches its thread count between
+ *    THREAD_GOVERNOR_MIN and the count asked for: it runs windows of steps at
+ *    the current count and one span above and below it, interleaved, moves
+ *    to a neighbour whose median step time beats the current one by
+ *    THREAD_GOVERNOR_MARGIN_PCT, and halves the span when none does. At span
+ *    1 the phase is settled. Prompt step times are scaled to a full ubatch, and
+ *    steps of less than half a ubatch are governed but not timed, so the
+ *    prompt lengths of the traffic do not move the medians
+ * 3. A settled phase checks its neighbours again every
+ *    THREAD_GOVERNOR_RESCAN_S seconds, and searches afresh when its median
+ *    step time moves by more than a fifth (the load on the memory system or
+ *    the traffic changed)
+ *
+ * ggml reads the team size a region actually got (omp_get_num_threads), so
+ * running a region with fewer threads than it asked for is safe; the count
+ * asked for is never exceeded. Without THREAD_GOVERNOR_DECODE and
+ * THREAD_GOVERNOR_PROMPT the library does nothing. Programs that compute
+ * steps without llama_decode (the benchmark) report each batch with
+ * thread_governor_batch().
+ *
+ * Settled counts are logged, and if THREAD_GOVERNOR_METRICS names a file,
+ * written there in Prometheus text format at most once a second. With
+ * THREAD_GOVERNOR_STEP_BYTES (the bytes a generation step reads, about the
+ * model size) the generation phase also reports its effective bandwidth.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <dlfcn.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <algorithm>
+
+#define MAX_CANDIDATES 3
+#define MAX_SAMPLES 8
+#define DRIFT_SAMPLES 16
+#define DRIFT 0.2
+#define DEFAULT_DECODE_TOKENS 8
+#define DEFAULT_MARGIN_PCT 3
+#define DEFAULT_RESCAN_S 30
+#define METRICS_INTERVAL_NS 1000000000ULL
+
+typedef void (*omp_body_fn)(void*);
+typedef void (*gomp_parallel_fn)(omp_body_fn, void*, unsigned, unsigned);
+static gomp_parallel_fn real_gomp_parallel = nullptr;
+
+// llama_batch of llama.h, which llama_decode takes by value
+struct llama_batch {
+    int32_t n_tokens;
+    int32_t* token;
+    float* embd;
+    int32_t* pos;
+    int32_t* n_seq_id;
+    int32_t** seq_id;
+    int8_t* logits;
+};
+typedef int32_t (*llama_decode_fn)(void*, llama_batch);
+typedef uint32_t (*llama_n_ubatch_fn)(const void*);
+static llama_decode_fn real_llama_decode = nullptr;
+static llama_n_ubatch_fn real_llama_n_ubatch = nullptr;
+
+// Batch being decoded on this thread: tokens whose regions have not run yet
+// (-1 outside a batch) and the ubatch size they are cut into
+static __thread int32_t tl_tokens = -1;
+static __thread uint32_t tl_ubatch = 0;
+
+enum PhaseState { PHASE_SEARCHING = 0, PHASE_SETTLED };
+
+// Search state of one phase. Generation steps are short and uniform, so
+// windows are several steps (the first after a change of team size is not
+// timed); prompt steps are long and vary with the batch, so windows are
+// single steps and more rounds are compared.
+struct Phase {
+    const char* name;
+    unsigned ceiling;        // Threads the server asks for; 0 = not governed
+    unsigned floor;
+    unsigned window;         // Timed steps per visit to a candidate
+    unsigned rounds;         // Visits to each candidate per decision
+    int state;
+    unsigned current;        // Best count found so far
+    unsigned span;           // Distance of the neighbours searched
+    unsigned candidates[MAX_CANDIDATES];
+    unsigned ncandidates;
+    unsigned visit;          // Windows done in this decision
+    unsigned window_steps;   // Steps done in the current window
+    double samples[MAX_CANDIDATES][MAX_SAMPLES];
+    unsigned nsamples[MAX_CANDIDATES];
+    double step_s;           // Median step time at the settled count
+    double recent[DRIFT_SAMPLES];
+    unsigned nrecent;
+    uint64_t search_started_ns;
+    uint64_t rescan_ns;
+    unsigned logged;         // Count last logged as settled
+    uint64_t steps;
+    uint64_t searches;
+    uint64_t moves;
+    double busy_s;           // Time spent in the phase's steps
+};
+
+enum { PHASE_GENERATION = 0, PHASE_PROMPT, PHASE_COUNT };
+static Phase phases[PHASE_COUNT];      // Set up by init()
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static double margin = DEFAULT_MARGIN_PCT / 100.0;
+static uint64_t rescan_ns = DEFAULT_RESCAN_S * 1000000000ULL;
+static uint64_t step_bytes = 0;
+static unsigned decode_tokens = DEFAULT_DECODE_TOKENS;
+static bool warned_ambiguous = false;
+static const char* metrics_path = nullptr;
+static uint64_t metrics_written_ns = 0;
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t env_u64(const char* name, uint64_t fallback) {
+    const char* env = getenv(name);
+    if (!env || !*env) {
+        return fallback;
+    }
+    char* end = nullptr;
+    unsigned long long v = strtoull(env, &end, 10);
+    return end != env && *end == '\0' ? (uint64_t)v : fallback;
+}
+
+static double median(const double* values, unsigned n) {
+    double sorted[DRIFT_SAMPLES > MAX_SAMPLES ? DRIFT_SAMPLES : MAX_SAMPLES];
+    std::copy(values, values + n, sorted);
+    std::sort(sorted, sorted + n);
+    return n % 2 ? sorted[n / 2] : (sorted[n / 2 - 1] + sorted[n / 2]) / 2;
+}
+
+// --- Search ------------------------------------------------------------------
+
+static void start_decision(Phase* p) {
+    p->ncandidates = 0;
+    if (p->current >= p->floor + p->span) {
+        p->candidates[p->ncandidates++] = p->current - p->span;
+    }
+    p->candidates[p->ncandidates++] = p->current;
+    if (p->current + p->span <= p->ceiling) {
+        p->candidates[p->ncandidates++] = p->current + p->span;
+    }
+    p->visit = 0;
+    p->window_steps = 0;
+    memset(p->nsamples, 0, sizeof(p->nsamples));
+}
+
+static void start_search(Phase* p, unsigned span, uint64_t now) {
+    p->state = PHASE_SEARCHING;
+    p->span = std::max(span, 1u);
+    p->search_started_ns = now;
+    p->searches++;
+    start_decision(p);
+}
+
+static void settle(Phase* p, double step_s, uint64_t now) {
+    p->state = PHASE_SETTLED;
+    p->step_s = step_s;
+    p->nrecent = 0;
+    p->rescan_ns = now + rescan_ns;
+    if (p->current == p->logged) {
+        return;
+    }
+    p->logged = p->current;
+    char bandwidth[64] = "";
+    if (step_bytes && p == &phases[PHASE_GENERATION]) {
+        snprintf(bandwidth, sizeof(bandwidth), ", %.1f GB/s", step_bytes / step_s / 1e9);
+    }
+    fprintf(stderr, "thread_governor: %s: %u of %u threads, %.1f ms/step%s (searched %.1f s)\n", p->name,
+            p->current, p->ceiling, step_s * 1e3, bandwidth, (now - p->search_started_ns) / 1e9);
+}
+
+// Candidate the current window runs with; each round visits them in a
+// rotated order so no candidate always follows the same one
+static unsigned scheduled(const Phase* p) {
+    unsigned round = p->visit / p->ncandidates;
+    return (p->visit + round) % p->ncandidates;
+}
+
+static void decide(Phase* p, uint64_t now) {
+    double medians[MAX_CANDIDATES];
+    unsigned current = 0, fastest = 0;
+    for (unsigned i = 0; i < p->ncandidates; i++) {
+        medians[i] = median(p->samples[i], p->nsamples[i]);
+        if (p->candidates[i] == p->current) current = i;
+        if (medians[i] < medians[fastest]) fastest = i;
+    }
+    if (fastest != current && medians[fastest] < medians[current] * (1 - margin)) {
+        p->current = p->candidates[fastest];
+        p->moves++;
+    } else if (p->span > 1) {
+        p->span /= 2;
+    } else {
+        settle(p, medians[current], now);
+        return;
+    }
+    start_decision(p);
+}
+
+static unsigned choose(Phase* p, uint64_t now) {
+    if (p->state == PHASE_SETTLED && now >= p->rescan_ns) {
+        start_search(p, 1, now);
+    }
+    if (p->state == PHASE_SETTLED || p->ncandidates == 1) {
+        return p->current;
+    }
+    return p->candidates[scheduled(p)];
+}
+
+// `seconds` is the step's wall time, `sample` its time for the comparisons
+// (scaled to a full ubatch for prompt steps), negative if not comparable
+static void record(Phase* p, unsigned threads, double seconds, double sample, uint64_t now) {
+    p->steps++;
+    p->busy_s += seconds;
+    if (sample < 0) {
+        return;
+    }
+    seconds = sample;
+    if (p->state == PHASE_SETTLED) {
+        p->recent[p->nrecent++] = seconds;
+        if (p->nrecent == DRIFT_SAMPLES) {
+            double m = median(p->recent, p->nrecent);
+            p->nrecent = 0;
+            if (m > p->step_s * (1 + DRIFT) || m < p->step_s * (1 - DRIFT)) {
+                start_search(p, std::max(p->ceiling / 4, 1u), now);
+            }
+        }
+        return;
+    }
+    if (p->ncandidates == 1) {
+        settle(p, seconds, now);
+        return;
+    }
+    unsigned slot = scheduled(p);
+    if (threads != p->candidates[slot]) {
+        return;  // Another caller's step that started before the last switch
+    }
+    // The first step after a change of team size wakes or starts threads
+    bool warmup = p->window > 1 && p->window_steps == 0;
+    if (!warmup && p->nsamples[slot] < MAX_SAMPLES) {
+        p->samples[slot][p->nsamples[slot]++] = seconds;
+    }
+    if (++p->window_steps < p->window + (p->window > 1)) {
+        return;
+    }
+    p->window_steps = 0;
+    if (++p->visit == p->ncandidates * p->rounds) {
+        decide(p, now);
+    }
+}
+
+// --- Metrics -----------------------------------------------------------------
+
+static void write_metrics() {
+    char tmp[1024];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", metrics_path);
+    FILE* f = fopen(tmp, "w");
+    if (!f) {
+        return;
+    }
+    fprintf(f, "# HELP thread_governor_threads Worker threads the phase's steps run with\n");
+    fprintf(f, "# TYPE thread_governor_threads gauge\n");
+    for (const Phase& p : phases) {
+        if (p.ceiling) fprintf(f, "thread_governor_threads{phase=\"%s\"} %u\n", p.name, p.current);
+    }
+    fprintf(f, "# HELP thread_governor_ceiling_threads Worker threads the server asks for\n");
+    fprintf(f, "# TYPE thread_governor_ceiling_threads gauge\n");
+    for (const Phase& p : phases) {
+        if (p.ceiling) fprintf(f, "thread_governor_ceiling_threads{phase=\"%s\"} %u\n", p.name, p.ceiling);
+    }
+    fprintf(f, "# HELP thread_governor_searching Whether the phase is searching its thread count\n");
+    fprintf(f, "# TYPE thread_governor_searching gauge\n");
+    for (const Phase& p : phases) {
+        if (p.ceiling) fprintf(f, "thread_governor_searching{phase=\"%s\"} %d\n", p.name, p.state == PHASE_SEARCHING);
+    }
+    fprintf(f, "# HELP thread_governor_step_seconds Median step time at the settled thread count\n");
+    fprintf(f, "# TYPE thread_governor_step_seconds gauge\n");
+    for (const Phase& p : phases) {
+        if (p.ceiling) fprintf(f, "thread_governor_step_seconds{phase=\"%s\"} %.6f\n", p.name, p.step_s);
+    }
+    fprintf(f, "# HELP thread_governor_steps_total Compute steps governed\n");
+    fprintf(f, "# TYPE thread_governor_steps_total counter\n");
+    for (const Phase& p : phases) {
+        if (p.ceiling) fprintf(f, "thread_governor_steps_total{phase=\"%s\"} %llu\n", p.name,
+                               (unsigned long long)p.steps);
+    }
+    fprintf(f, "# HELP thread_governor_step_seconds_total Time spent in governed steps\n");
+    fprintf(f, "# TYPE thread_governor_step_seconds_total counter\n");
+    for (const Phase& p : phases) {
+        if (p.ceiling) fprintf(f, "thread_governor_step_seconds_total{phase=\"%s\"} %.3f\n", p.name, p.busy_s);
+    }
+    fprintf(f, "# HELP thread_governor_searches_total Searches started (startup, rescans, drift)\n");
+    fprintf(f, "# TYPE thread_governor_searches_total counter\n");
+    for (const Phase& p : phases) {
+        if (p.ceiling) fprintf(f, "thread_governor_searches_total{phase=\"%s\"} %llu\n", p.name,
+                               (unsigned long long)p.searches);
+    }
+    fprintf(f, "# HELP thread_governor_moves_total Changes of the best thread count\n");
+    fprintf(f, "# TYPE thread_governor_moves_total counter\n");
+    for (const Phase& p : phases) {
+        if (p.ceiling) fprintf(f, "thread_governor_moves_total{phase=\"%s\"} %llu\n", p.name,
+                               (unsigned long long)p.moves);
+    }
+    const Phase& g = phases[PHASE_GENERATION];
+    if (step_bytes && g.ceiling && g.step_s > 0) {
+        fprintf(f, "# HELP thread_governor_bandwidth_bytes_per_second Bytes a generation step reads over its "
+                "settled step time\n");
+        fprintf(f, "# TYPE thread_governor_bandwidth_bytes_per_second gauge\n");
+        fprintf(f, "thread_governor_bandwidth_bytes_per_second{phase=\"%s\"} %.0f\n", g.name, step_bytes / g.step_s);
+    }
+    fclose(f);
+    rename(tmp, metrics_path);
+}
+
+// --- Interposed entry points -------------------------------------------------
+
+// Report the batch the calling thread computes next, for programs that run
+// steps without llama_decode; n_ubatch 0 means one region for the batch
+extern "C" void thread_governor_batch(int32_t n_tokens, uint32_t n_ubatch) {
+    tl_tokens = n_tokens;
+    tl_ubatch = n_ubatch;
+}
+
+extern "C" int32_t llama_decode(void* ctx, llama_batch batch) {
+    if (!real_llama_decode) {
+        real_llama_decode = (llama_decode_fn)dlsym(RTLD_NEXT, "llama_decode");
+        if (!real_llama_decode) {
+            return -1;
+        }
+    }
+    thread_governor_batch(batch.n_tokens, real_llama_n_ubatch ? real_llama_n_ubatch(ctx) : 0);
+    int32_t result = real_llama_decode(ctx, batch);
+    tl_tokens = -1;
+    return result;
+}
+
+// Phase of a region asking for num_threads threads with `tokens` tokens (-1
+// if unknown), nullptr to pass it through
+static Phase* phase_of(unsigned num_threads, int32_t tokens) {
+    Phase& generation = phases[PHASE_GENERATION];
+    Phase& prompt = phases[PHASE_PROMPT];
+    if (num_threads == 0 || (num_threads != generation.ceiling && num_threads != prompt.ceiling)) {
+        return nullptr;
+    }
+    if (tokens > 0) {
+        Phase* p = (unsigned)tokens <= decode_tokens ? &generation : &prompt;
+        return p->ceiling ? p : nullptr;
+    }
+    if (generation.ceiling == prompt.ceiling && !warned_ambiguous) {
+        warned_ambiguous = true;
+        fprintf(stderr, "WARNING: thread_governor: A step asking for %u threads ran outside llama_decode, so its "
+                "phase is unknown; such steps are timed as generation\n", num_threads);
+    }
+    return num_threads == generation.ceiling ? &generation : &prompt;
+}
+
+extern "C" void GOMP_parallel(omp_body_fn fn, void* data, unsigned num_threads, unsigned flags) {
+    if (!real_gomp_parallel) {
+        real_gomp_parallel = (gomp_parallel_fn)dlsym(RTLD_NEXT, "GOMP_parallel");
+    }
+    // Each graph of a batch computes the next ubatch of its tokens
+    int32_t tokens = -1;
+    if (tl_tokens > 0) {
+        tokens = tl_ubatch ? std::min(tl_tokens, (int32_t)tl_ubatch) : tl_tokens;
+        tl_tokens -= tokens;
+    }
+    pthread_mutex_lock(&lock);
+    Phase* p = phase_of(num_threads, tokens);
+    unsigned threads = p ? std::min(choose(p, now_ns()), num_threads) : num_threads;
+    pthread_mutex_unlock(&lock);
+    if (!p) {
+        real_gomp_parallel(fn, data, num_threads, flags);
+        return;
+    }
+
+    uint64_t start = now_ns();
+    real_gomp_parallel(fn, data, threads, flags);
+    uint64_t end = now_ns();
+
+    double seconds = (end - start) / 1e9;
+    double sample = seconds;
+    if (p == &phases[PHASE_PROMPT] && tokens > 0 && tl_ubatch) {
+        // Per-token cost rises steeply for small batches, so those are not compared
+        sample = (uint32_t)tokens * 2 >= tl_ubatch ? seconds * tl_ubatch / tokens : -1;
+    }
+    pthread_mutex_lock(&lock);
+    record(p, threads, seconds, sample, end);
+    if (metrics_path && end - metrics_written_ns >= METRICS_INTERVAL_NS) {
+        metrics_written_ns = end;
+        write_metrics();
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+__attribute__((constructor))
+static void init() {
+    real_gomp_parallel = (gomp_parallel_fn)dlsym(RTLD_NEXT, "GOMP_parallel");
+    real_llama_decode = (llama_decode_fn)dlsym(RTLD_NEXT, "llama_decode");
+    real_llama_n_ubatch = (llama_n_ubatch_fn)dlsym(RTLD_DEFAULT, "llama_n_ubatch");
+    phases[PHASE_GENERATION].name = "generation";
+    phases[PHASE_GENERATION].window = 4;
+    phases[PHASE_GENERATION].rounds = 2;
+    phases[PHASE_PROMPT].name = "prompt";
+    phases[PHASE_PROMPT].window = 1;
+    phases[PHASE_PROMPT].rounds = 6;
+    phases[PHASE_GENERATION].ceiling = (unsigned)env_u64("THREAD_GOVERNOR_DECODE", 0);
+    phases[PHASE_PROMPT].ceiling = (unsigned)env_u64("THREAD_GOVERNOR_PROMPT", 0);
+    decode_tokens = (unsigned)std::max(env_u64("THREAD_GOVERNOR_DECODE_TOKENS", DEFAULT_DECODE_TOKENS), (uint64_t)1);
+    unsigned floor = (unsigned)std::max(env_u64("THREAD_GOVERNOR_MIN", 1), (uint64_t)1);
+    margin = env_u64("THREAD_GOVERNOR_MARGIN_PCT", DEFAULT_MARGIN_PCT) / 100.0;
+    rescan_ns = env_u64("THREAD_GOVERNOR_RESCAN_S", DEFAULT_RESCAN_S) * 1000000000ULL;
+    step_bytes = env_u64("THREAD_GOVERNOR_STEP_BYTES", 0);
+    const char* metrics = getenv("THREAD_GOVERNOR_METRICS");
+    metrics_path = metrics && *metrics ? metrics : nullptr;
+
+    uint64_t now = now_ns();
+    for (Phase& p : phases) {
+        p.floor = floor;
+        if (p.ceiling <= floor) {
+            p.ceiling = 0;  // Nothing to choose from
+            continue;
+        }
+        // Start from what the server asked for, which is where it would run anyway
+        p.current = p.ceiling;
+        start_search(&p, std::max(p.ceiling / 4, 1u), now);
+    }
+}
+
+__attribute__((destructor))
+static void fini() {
+    for (const Phase& p : phases) {
+        if (p.ceiling && p.steps) {
+            fprintf(stderr, "thread_governor: %s: %llu steps in %.1f s, %u of %u threads, %llu searches, "
+                    "%llu moves\n", p.name, (unsigned long long)p.steps, p.busy_s, p.current, p.ceiling,
+                    (unsigned long long)p.searches, (unsigned long long)p.moves);
+        }
+    }
+    if (metrics_path && (phases[PHASE_GENERATION].ceiling || phases[PHASE_PROMPT].ceiling)) {
+        write_metrics();
+    }
+}
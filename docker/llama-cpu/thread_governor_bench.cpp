@@ -0,0 +1,438 @@
+/*
+ * thread_governor_bench.cpp
+ *
+ * Mixed-traffic benchmark for the compute thread governor
+ * (thread_governor.cpp).
+ *
+ * Replays a trace of compute steps shaped like ggml's: each step is one
+ * OpenMP parallel region of layers separated by barriers, asking for
+ * --threads threads if it is a generation step and --threads-batch threads if
+ * it is a prompt step, like llama.cpp. Generation steps stream a weight set
+ * larger than the last level cache once (bandwidth-bound); prompt steps run
+ * FMA chains on registers (compute-bound), in proportion to their tokens.
+ * Prompts have log-uniform lengths up to --prompt-max tokens and are cut
+ * into --ubatch steps, so most prompt steps are shorter than a ubatch. The
+ * trace alternates quiet periods with busy ones in which --neighbors threads
+ * stream a buffer of their own, like other replicas decoding on the same
+ * memory channels.
+ *
+ * It then:
+ * 1. Times both kinds of step at every thread count, quiet and busy
+ * 2. Picks the static --threads/--threads-batch pair the timings predict to
+ *    be fastest over the whole trace
+ * 3. Replays the trace with that pair, and with the governor preloaded
+ *    (asking for every thread in both phases and reporting each step's
+ *    tokens with thread_governor_batch(), as llama_decode does in the
+ *    server), each in a fresh process, and reports both
+ *
+ * Exit codes: 0 success, 1 error.
+ */
+
+#include <dlfcn.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <getopt.h>
+#include <math.h>
+#include <time.h>
+#include <omp.h>
+#include <algorithm>
+#include <atomic>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define EXIT_OK 0
+#define EXIT_ERROR 1
+
+#define FMA_CHAINS 16
+#define PROMPT_MIN_TOKENS 16
+
+struct BenchOptions {
+    int max_threads = 0;          // 0 = CPUs available
+    uint64_t size_mb = 256;       // Weights a generation step reads
+    int layers = 32;
+    int neighbors = -1;           // -1 = half of max_threads
+    int steps = 1200;
+    int period = 300;
+    int prompt_pct = 5;
+    int ubatch = 512;             // Most tokens a prompt step stands for
+    int prompt_max = 0;           // Longest prompt in tokens; 0 = 4 ubatches
+    int prompt_ms = 400;          // Single-thread prompt step time
+    int sweep_steps = 8;
+    uint64_t seed = 1;
+    std::string governor;
+    // Replay child
+    bool replay = false;
+    int threads = 0;
+    int threads_batch = 0;
+    uint64_t prompt_iterations = 0;  // Per layer; 0 = calibrate
+};
+
+typedef void (*governor_batch_fn)(int32_t, uint32_t);
+static governor_batch_fn governor_batch = nullptr;
+
+static std::vector<uint64_t> weights;
+static std::vector<uint64_t> neighbor_buffer;
+static size_t layer_words = 0;
+static std::atomic<bool> busy{false};
+static std::atomic<bool> stopping{false};
+static volatile uint64_t sink[64 * 8];
+
+static double now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// --- Steps -------------------------------------------------------------------
+
+static void generation_step(const BenchOptions& o, int threads) {
+    #pragma omp parallel num_threads(threads)
+    {
+        // Split by the team size actually granted, as ggml does
+        size_t t = omp_get_thread_num(), nt = omp_get_num_threads();
+        size_t begin = layer_words * t / nt, end = layer_words * (t + 1) / nt;
+        uint64_t acc = 0;
+        for (int l = 0; l < o.layers; l++) {
+            const uint64_t* w = weights.data() + l * layer_words;
+            for (size_t i = begin; i < end; i++) {
+                acc += w[i];
+            }
+            #pragma omp barrier
+        }
+        sink[(t % 64) * 8] = acc;
+    }
+}
+
+static void prompt_step(const BenchOptions& o, int threads, int tokens) {
+    uint64_t iterations = o.prompt_iterations * tokens / o.ubatch;
+    #pragma omp parallel num_threads(threads)
+    {
+        uint64_t t = omp_get_thread_num(), nt = omp_get_num_threads();
+        uint64_t count = iterations * (t + 1) / nt - iterations * t / nt;
+        float x[FMA_CHAINS];
+        for (int k = 0; k < FMA_CHAINS; k++) {
+            x[k] = 1.0f + k;
+        }
+        for (int l = 0; l < o.layers; l++) {
+            for (uint64_t i = 0; i < count; i++) {
+                for (int k = 0; k < FMA_CHAINS; k++) {
+                    x[k] = x[k] * 0.9999f + 0.0001f;
+                }
+            }
+            #pragma omp barrier
+        }
+        float s = 0;
+        for (int k = 0; k < FMA_CHAINS; k++) {
+            s += x[k];
+        }
+        sink[(t % 64) * 8] = (uint64_t)s;
+    }
+}
+
+static void neighbor(int index, int count) {
+    size_t words = neighbor_buffer.size();
+    size_t offset = words * index / count;
+    uint64_t acc = 0;
+    while (!stopping.load(std::memory_order_relaxed)) {
+        if (!busy.load(std::memory_order_relaxed)) {
+            usleep(200);
+            continue;
+        }
+        for (size_t n = 0; n < words && busy.load(std::memory_order_relaxed); n += 4096) {
+            const uint64_t* p = neighbor_buffer.data() + (offset + n) % words;
+            size_t len = std::min((size_t)4096, words - (offset + n) % words);
+            for (size_t i = 0; i < len; i++) {
+                acc += p[i];
+            }
+        }
+    }
+    sink[(index % 64) * 8 + 1] = acc;
+}
+
+// Per-layer FMA iterations making a single-thread prompt step take prompt_ms
+static uint64_t calibrate_prompt(BenchOptions o) {
+    o.prompt_iterations = 1024;
+    for (;;) {
+        double start = now_seconds();
+        prompt_step(o, 1, o.ubatch);
+        double elapsed = now_seconds() - start;
+        if (elapsed > 0.05) {
+            return std::max((uint64_t)1, (uint64_t)(o.prompt_iterations * (o.prompt_ms / 1e3) / elapsed));
+        }
+        o.prompt_iterations *= 4;
+    }
+}
+
+static double median(std::vector<double> v) {
+    std::sort(v.begin(), v.end());
+    size_t n = v.size();
+    return n % 2 ? v[n / 2] : (v[n / 2 - 1] + v[n / 2]) / 2;
+}
+
+static double time_step(const BenchOptions& o, bool prompt, int threads, int samples) {
+    std::vector<double> times;
+    // One untimed step starts the team
+    for (int i = 0; i <= samples; i++) {
+        double start = now_seconds();
+        prompt ? prompt_step(o, threads, o.ubatch) : generation_step(o, threads);
+        if (i > 0) times.push_back(now_seconds() - start);
+    }
+    return median(times);
+}
+
+// --- Trace -------------------------------------------------------------------
+
+struct Trace {
+    std::vector<int> tokens;        // Per step; 1 for generation
+    double work[2][2] = {};         // [busy][prompt]: steps, prompt steps in full ubatches
+    uint64_t prompts = 0;
+    uint64_t short_steps = 0;       // Prompt steps shorter than a ubatch
+    uint64_t total_tokens = 0;
+};
+
+static Trace make_trace(const BenchOptions& o) {
+    Trace trace;
+    std::mt19937_64 rng(o.seed);
+    std::uniform_int_distribution<int> percent(0, 99);
+    std::uniform_real_distribution<double> log_length(log(PROMPT_MIN_TOKENS), log(o.prompt_max));
+    int pending = 0;  // Tokens of the current prompt not cut into steps yet
+    for (int i = 0; i < o.steps; i++) {
+        if (pending == 0 && percent(rng) < o.prompt_pct) {
+            pending = (int)exp(log_length(rng));
+            trace.prompts++;
+        }
+        int tokens = 1;
+        if (pending > 0) {
+            tokens = std::min(pending, o.ubatch);
+            pending -= tokens;
+            trace.short_steps += tokens < o.ubatch;
+        }
+        bool prompt = tokens > 1;
+        bool is_busy = (i / o.period) % 2 == 1;
+        trace.tokens.push_back(tokens);
+        trace.work[is_busy][prompt] += prompt ? (double)tokens / o.ubatch : 1;
+        trace.total_tokens += tokens;
+    }
+    return trace;
+}
+
+static double replay(const BenchOptions& o, const Trace& trace) {
+    double start = now_seconds();
+    for (size_t i = 0; i < trace.tokens.size(); i++) {
+        busy.store((i / o.period) % 2 == 1, std::memory_order_relaxed);
+        int tokens = trace.tokens[i];
+        if (governor_batch) {
+            governor_batch(tokens, o.ubatch);
+        }
+        tokens > 1 ? prompt_step(o, o.threads_batch, tokens) : generation_step(o, o.threads);
+    }
+    double elapsed = now_seconds() - start;
+    busy.store(false);
+    return elapsed;
+}
+
+// Replays the trace in a fresh process (libgomp's pool and the governor start
+// cold) and returns its time, or a negative value on failure
+static double replay_child(const BenchOptions& o, int threads, int threads_batch, const char* environment) {
+    char command[4096];
+    snprintf(command, sizeof(command),
+             "%s /proc/%d/exe --replay --threads %d --threads-batch %d --prompt-iterations %llu --max-threads %d "
+             "--size-mb %llu --layers %d --neighbors %d --steps %d --period %d --prompt-pct %d --ubatch %d "
+             "--prompt-max %d --seed %llu",
+             environment, (int)getpid(), threads, threads_batch, (unsigned long long)o.prompt_iterations,
+             o.max_threads, (unsigned long long)o.size_mb, o.layers, o.neighbors, o.steps, o.period,
+             o.prompt_pct, o.ubatch, o.prompt_max, (unsigned long long)o.seed);
+    FILE* child = popen(command, "r");
+    if (!child) {
+        return -1;
+    }
+    double seconds = -1;
+    char line[256];
+    while (fgets(line, sizeof(line), child)) {
+        sscanf(line, "replay %lf", &seconds);
+    }
+    return pclose(child) == 0 ? seconds : -1;
+}
+
+static void usage(const char* prog) {
+    fprintf(stderr,
+        "Usage: %s [options]\n"
+        "\n"
+        "Compare the compute thread governor with the best static thread counts under mixed traffic.\n"
+        "\n"
+        "Options:\n"
+        "  --governor PATH       thread_governor.so to replay the trace with (default: static sweep only)\n"
+        "  --max-threads N       Most threads a step asks for (default: CPUs available)\n"
+        "  --size-mb N           Weights a generation step reads (default: 256)\n"
+        "  --layers N            Barriers per step (default: 32)\n"
+        "  --neighbors N         Threads streaming memory in busy periods (default: half of --max-threads)\n"
+        "  --steps N             Steps in the trace (default: 1200)\n"
+        "  --period N            Steps per quiet or busy period (default: 300)\n"
+        "  --prompt-pct N        Share of steps that start a prompt (default: 5)\n"
+        "  --ubatch N            Most tokens a prompt step stands for (default: 512)\n"
+        "  --prompt-max N        Longest prompt in tokens, lengths log-uniform from 16 (default: 4 x --ubatch)\n"
+        "  --prompt-ms N         Single-thread prompt step time (default: 400)\n"
+        "  --sweep-steps N       Timed steps per thread count in the sweep (default: 8)\n"
+        "  --seed N              Trace seed (default: 1)\n",
+        prog);
+}
+
+int main(int argc, char** argv) {
+    enum {
+        OPT_GOVERNOR = 1, OPT_MAX_THREADS, OPT_SIZE, OPT_LAYERS, OPT_NEIGHBORS, OPT_STEPS, OPT_PERIOD,
+        OPT_PROMPT_PCT, OPT_UBATCH, OPT_PROMPT_MAX, OPT_PROMPT_MS, OPT_SWEEP_STEPS, OPT_SEED, OPT_REPLAY, OPT_THREADS,
+        OPT_THREADS_BATCH, OPT_PROMPT_ITERATIONS, OPT_HELP,
+    };
+    static const struct option long_options[] = {
+        {"governor", required_argument, nullptr, OPT_GOVERNOR},
+        {"max-threads", required_argument, nullptr, OPT_MAX_THREADS},
+        {"size-mb", required_argument, nullptr, OPT_SIZE},
+        {"layers", required_argument, nullptr, OPT_LAYERS},
+        {"neighbors", required_argument, nullptr, OPT_NEIGHBORS},
+        {"steps", required_argument, nullptr, OPT_STEPS},
+        {"period", required_argument, nullptr, OPT_PERIOD},
+        {"prompt-pct", required_argument, nullptr, OPT_PROMPT_PCT},
+        {"ubatch", required_argument, nullptr, OPT_UBATCH},
+        {"prompt-max", required_argument, nullptr, OPT_PROMPT_MAX},
+        {"prompt-ms", required_argument, nullptr, OPT_PROMPT_MS},
+        {"sweep-steps", required_argument, nullptr, OPT_SWEEP_STEPS},
+        {"seed", required_argument, nullptr, OPT_SEED},
+        // Internal: one replay in a child process
+        {"replay", no_argument, nullptr, OPT_REPLAY},
+        {"threads", required_argument, nullptr, OPT_THREADS},
+        {"threads-batch", required_argument, nullptr, OPT_THREADS_BATCH},
+        {"prompt-iterations", required_argument, nullptr, OPT_PROMPT_ITERATIONS},
+        {"help", no_argument, nullptr, OPT_HELP},
+        {nullptr, 0, nullptr, 0},
+    };
+
+    BenchOptions o;
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", long_options, nullptr)) != -1) {
+        switch (opt) {
+            case OPT_GOVERNOR: o.governor = optarg; break;
+            case OPT_MAX_THREADS: o.max_threads = atoi(optarg); break;
+            case OPT_SIZE: o.size_mb = strtoull(optarg, nullptr, 10); break;
+            case OPT_LAYERS: o.layers = atoi(optarg); break;
+            case OPT_NEIGHBORS: o.neighbors = atoi(optarg); break;
+            case OPT_STEPS: o.steps = atoi(optarg); break;
+            case OPT_PERIOD: o.period = atoi(optarg); break;
+            case OPT_PROMPT_PCT: o.prompt_pct = atoi(optarg); break;
+            case OPT_UBATCH: o.ubatch = atoi(optarg); break;
+            case OPT_PROMPT_MAX: o.prompt_max = atoi(optarg); break;
+            case OPT_PROMPT_MS: o.prompt_ms = atoi(optarg); break;
+            case OPT_SWEEP_STEPS: o.sweep_steps = atoi(optarg); break;
+            case OPT_SEED: o.seed = strtoull(optarg, nullptr, 10); break;
+            case OPT_REPLAY: o.replay = true; break;
+            case OPT_THREADS: o.threads = atoi(optarg); break;
+            case OPT_THREADS_BATCH: o.threads_batch = atoi(optarg); break;
+            case OPT_PROMPT_ITERATIONS: o.prompt_iterations = strtoull(optarg, nullptr, 10); break;
+            case OPT_HELP: usage(argv[0]); return EXIT_OK;
+            default: usage(argv[0]); return EXIT_ERROR;
+        }
+    }
+    if (o.max_threads <= 0) o.max_threads = omp_get_num_procs();
+    if (o.neighbors < 0) o.neighbors = o.max_threads / 2;
+    if (o.prompt_max <= 0) o.prompt_max = 4 * o.ubatch;
+    if (optind != argc || o.size_mb == 0 || o.layers <= 0 || o.steps <= 0 || o.period <= 0 ||
+        o.prompt_pct < 0 || o.prompt_pct > 100 || o.sweep_steps <= 0 || o.prompt_ms <= 0 || o.ubatch <= 1 ||
+        o.prompt_max < PROMPT_MIN_TOKENS) {
+        usage(argv[0]);
+        return EXIT_ERROR;
+    }
+
+    size_t words = o.size_mb * 1024 * 1024 / sizeof(uint64_t);
+    layer_words = words / o.layers;
+    weights.assign(layer_words * o.layers, 1);
+    neighbor_buffer.assign(o.neighbors ? words : 0, 1);
+    std::vector<std::thread> neighbors;
+    for (int i = 0; i < o.neighbors; i++) {
+        neighbors.emplace_back(neighbor, i, o.neighbors);
+    }
+    auto stop_neighbors = [&]() {
+        stopping = true;
+        for (std::thread& t : neighbors) t.join();
+    };
+    Trace trace = make_trace(o);
+
+    if (o.replay) {
+        // Set when the governor is preloaded
+        governor_batch = (governor_batch_fn)dlsym(RTLD_DEFAULT, "thread_governor_batch");
+        printf("replay %.6f\n", replay(o, trace));
+        stop_neighbors();
+        return o.threads > 0 && o.threads_batch > 0 ? EXIT_OK : EXIT_ERROR;
+    }
+
+    o.prompt_iterations = calibrate_prompt(o);
+    printf("Steps: %d layers, generation reads %llu MB, prompt %d ms on one thread; %d neighbor threads\n\n",
+           o.layers, (unsigned long long)o.size_mb, o.prompt_ms, o.neighbors);
+
+    // 1. Step times by thread count, [busy][prompt][threads]
+    std::vector<double> times[2][2];
+    printf("%-8s %14s %14s %14s %14s\n", "threads", "gen quiet ms", "gen busy ms", "prompt quiet ms",
+           "prompt busy ms");
+    for (int n = 1; n <= o.max_threads; n++) {
+        double row[2][2];
+        for (int b = 0; b < 2; b++) {
+            busy = b == 1;
+            row[b][0] = time_step(o, false, n, o.sweep_steps);
+            row[b][1] = time_step(o, true, n, std::max(3, o.sweep_steps / 2));
+            times[b][0].push_back(row[b][0]);
+            times[b][1].push_back(row[b][1]);
+        }
+        busy = false;
+        printf("%-8d %14.2f %14.2f %14.2f %14.2f\n", n, row[0][0] * 1e3, row[1][0] * 1e3, row[0][1] * 1e3,
+               row[1][1] * 1e3);
+    }
+
+    // 2. Static pair the sweep predicts fastest over the trace
+    int best_threads = 1, best_batch = 1;
+    double best_generation = 1e300, best_prompt = 1e300;
+    for (int n = 1; n <= o.max_threads; n++) {
+        double generation = trace.work[0][0] * times[0][0][n - 1] + trace.work[1][0] * times[1][0][n - 1];
+        double prompt = trace.work[0][1] * times[0][1][n - 1] + trace.work[1][1] * times[1][1][n - 1];
+        if (generation < best_generation) best_generation = generation, best_threads = n;
+        if (prompt < best_prompt) best_prompt = prompt, best_batch = n;
+    }
+    printf("\nTrace: %d steps, %llu prompts of %d-%d tokens (%llu steps shorter than a ubatch), neighbors busy "
+           "every other %d steps, %llu tokens\n", o.steps, (unsigned long long)trace.prompts, PROMPT_MIN_TOKENS,
+           o.prompt_max, (unsigned long long)trace.short_steps, o.period, (unsigned long long)trace.total_tokens);
+    printf("Best static pair: --threads %d --threads-batch %d (predicted %.1f s)\n", best_threads, best_batch,
+           best_generation + best_prompt);
+
+    // 3. Replays
+    stop_neighbors();
+    double static_s = replay_child(o, best_threads, best_batch, "");
+    if (static_s < 0) {
+        fprintf(stderr, "thread_governor_bench: Static replay failed\n");
+        return EXIT_ERROR;
+    }
+    char label[64];
+    snprintf(label, sizeof(label), "static --threads %d --threads-batch %d", best_threads, best_batch);
+    printf("\n  %-40s %8.2f s %10.1f tok/s\n", label, static_s, trace.total_tokens / static_s);
+    if (o.governor.empty()) {
+        return EXIT_OK;
+    }
+    // The server's default: both phases ask for every thread
+    int decode_ceiling = o.max_threads;
+    char environment[2048];
+    snprintf(environment, sizeof(environment),
+             "LD_PRELOAD='%s' THREAD_GOVERNOR_DECODE=%d THREAD_GOVERNOR_PROMPT=%d THREAD_GOVERNOR_STEP_BYTES=%llu",
+             o.governor.c_str(), decode_ceiling, o.max_threads,
+             (unsigned long long)(layer_words * o.layers * sizeof(uint64_t)));
+    fflush(stdout);
+    double governed_s = replay_child(o, decode_ceiling, o.max_threads, environment);
+    if (governed_s < 0) {
+        fprintf(stderr, "thread_governor_bench: Governed replay failed\n");
+        return EXIT_ERROR;
+    }
+    snprintf(label, sizeof(label), "governor (asking %d/%d)", decode_ceiling, o.max_threads);
+    printf("  %-40s %8.2f s %10.1f tok/s (%+.1f%%)\n", label, governed_s, trace.total_tokens / governed_s,
+           100.0 * (static_s - governed_s) / static_s);
+    return EXIT_OK;
+}
@@ -0,0 +1,205 @@
+/*
+ * thread_placement.cpp
+ *
+ * LD_PRELOAD library placing llama-server's threads on the SMT topology of
+ * its cpuset: one OpenMP compute worker per physical core, every other
+ * thread on the cores' SMT siblings.
+ *
+ * ggml's matmul workers run in lockstep between barriers, so a worker sharing
+ * its core (and L1/L2) with another worker or with a busy helper thread slows
+ * every step. Without placement the scheduler is free to do both: put two
+ * workers on the siblings of one core while another core idles, or run an
+ * HTTP thread or one of the huge page wrapper's loader threads on a worker's
+ * core. The siblings of the compute cores are otherwise unused, and the
+ * helpers are latency-tolerant, so they are the natural place for them:
+ * 1. On the first thread created or the first parallel region, the library
+ *    groups the CPUs the process may use into physical cores from sysfs
+ *    (cpu_topology.h). Each core's lowest CPU is a compute CPU, the others
+ *    are auxiliary
+ * 2. Every thread created with pthread_create (HTTP, the wrapper's loaders,
+ *    logging, libgomp's pool) starts confined to the auxiliary CPUs
+ * 3. GOMP_parallel is wrapped so each member of a top-level team pins itself
+ *    to the compute CPU of its team index (one core each, alternating between
+ *    L3 domains) before running the region; a thread keeps its CPU between
+ *    regions, so this costs a system call only when its index changes
+ *
+ * A team larger than the number of cores puts its extra members on the
+ * siblings, with a warning. Without SMT siblings in the cpuset auxiliary
+ * threads are left unpinned, also with a warning: see make cpu-topology for
+ * a cpuset of whole cores. The cpu_topology tool checks a running server's
+ * placement against sysfs (make placement-check).
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <dlfcn.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+#include "cpu_topology.h"
+
+typedef void (*omp_body_fn)(void*);
+typedef void (*gomp_parallel_fn)(omp_body_fn, void*, unsigned, unsigned);
+typedef int (*omp_query_fn)(void);
+typedef int (*pthread_create_fn)(pthread_t*, const pthread_attr_t*, void* (*)(void*), void*);
+
+static gomp_parallel_fn real_gomp_parallel = nullptr;
+static omp_query_fn omp_thread_num = nullptr;
+static omp_query_fn omp_level = nullptr;
+static pthread_create_fn real_pthread_create = nullptr;
+
+// Placement plan, built once from the process's CPUs
+static pthread_once_t plan_once = PTHREAD_ONCE_INIT;
+static std::vector<int> compute;       // CPU of team member i
+static std::vector<int> overflow;      // CPUs of members past the last core
+static cpu_set_t auxiliary_set;
+static bool have_auxiliary = false;
+static bool enabled = false;
+static bool reported = false;          // atomic
+static bool overflow_warned = false;   // atomic
+
+#define TLS __thread __attribute__((tls_model("initial-exec")))
+static TLS int tl_cpu = -1;            // Compute CPU the thread is pinned to
+
+static void build_plan() {
+    const char* env = getenv("THREAD_PLACEMENT");
+    if (env && strcmp(env, "off") == 0) {
+        return;
+    }
+    CpuTopology topology;
+    if (!cpu_topology(allowed_cpus(), &topology) || topology.cores.empty()) {
+        fprintf(stderr, "WARNING: thread_placement: No CPU topology in sysfs, threads not placed\n");
+        return;
+    }
+    compute = compute_cpus(topology);
+    overflow = auxiliary_cpus(topology);
+    CPU_ZERO(&auxiliary_set);
+    for (int cpu : overflow) {
+        CPU_SET(cpu, &auxiliary_set);
+    }
+    have_auxiliary = !overflow.empty();
+    enabled = true;
+}
+
+// Logged once, by the first parallel region, so the short-lived commands
+// of the entrypoint that inherit LD_PRELOAD stay quiet
+static void report_plan() {
+    if (__atomic_exchange_n(&reported, true, __ATOMIC_RELAXED)) {
+        return;
+    }
+    if (have_auxiliary) {
+        fprintf(stderr, "thread_placement: Compute workers on %zu cores (CPUs %s), other threads on their "
+                "siblings (CPUs %s)\n", compute.size(), format_cpu_list(compute).c_str(),
+                format_cpu_list(overflow).c_str());
+    } else {
+        fprintf(stderr, "WARNING: thread_placement: No SMT siblings in the cpuset; compute workers on %zu cores "
+                "(CPUs %s), other threads unpinned (see make cpu-topology)\n", compute.size(),
+                format_cpu_list(compute).c_str());
+    }
+}
+
+static bool pin(int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return sched_setaffinity(0, sizeof(set), &set) == 0;
+}
+
+// --- Compute workers ---------------------------------------------------------
+
+struct Region {
+    omp_body_fn fn;
+    void* data;
+    unsigned requested;
+};
+
+static void place_member(const Region* r) {
+    if (omp_level() != 1) {
+        return;  // Nested teams run where their parent member runs
+    }
+    size_t index = (size_t)omp_thread_num();
+    int cpu;
+    if (index < compute.size()) {
+        cpu = compute[index];
+    } else if (index - compute.size() < overflow.size()) {
+        cpu = overflow[index - compute.size()];
+    } else {
+        cpu = compute[index % compute.size()];
+    }
+    if (cpu == tl_cpu) {
+        return;
+    }
+    if (index >= compute.size() && !__atomic_exchange_n(&overflow_warned, true, __ATOMIC_RELAXED)) {
+        fprintf(stderr, "WARNING: thread_placement: Team of %u threads for %zu cores; members from %zu on share "
+                "cores\n", r->requested, compute.size(), compute.size());
+    }
+    if (pin(cpu)) {
+        tl_cpu = cpu;
+    }
+}
+
+static void placed_region(void* arg) {
+    const Region* r = (const Region*)arg;
+    place_member(r);
+    r->fn(r->data);
+}
+
+extern "C" void GOMP_parallel(omp_body_fn fn, void* data, unsigned num_threads, unsigned flags) {
+    if (!real_gomp_parallel) {
+        real_gomp_parallel = (gomp_parallel_fn)dlsym(RTLD_NEXT, "GOMP_parallel");
+        omp_thread_num = (omp_query_fn)dlsym(RTLD_DEFAULT, "omp_get_thread_num");
+        omp_level = (omp_query_fn)dlsym(RTLD_DEFAULT, "omp_get_level");
+    }
+    pthread_once(&plan_once, build_plan);
+    if (!enabled || !omp_thread_num || !omp_level) {
+        real_gomp_parallel(fn, data, num_threads, flags);
+        return;
+    }
+    report_plan();
+    Region r = {fn, data, num_threads};
+    real_gomp_parallel(placed_region, &r, num_threads, flags);
+}
+
+// --- Other threads -----------------------------------------------------------
+
+struct Start {
+    void* (*routine)(void*);
+    void* arg;
+};
+
+static void* auxiliary_start(void* arg) {
+    Start start = *(Start*)arg;
+    free(arg);
+    sched_setaffinity(0, sizeof(auxiliary_set), &auxiliary_set);
+    return start.routine(start.arg);
+}
+
+extern "C" int pthread_create(pthread_t* thread, const pthread_attr_t* attr, void* (*routine)(void*), void* arg) {
+    if (!real_pthread_create) {
+        real_pthread_create = (pthread_create_fn)dlsym(RTLD_NEXT, "pthread_create");
+    }
+    pthread_once(&plan_once, build_plan);
+    Start* start = enabled && have_auxiliary ? (Start*)malloc(sizeof(Start)) : nullptr;
+    if (!start) {
+        return real_pthread_create(thread, attr, routine, arg);
+    }
+    *start = {routine, arg};
+    int result = real_pthread_create(thread, attr, auxiliary_start, start);
+    if (result != 0) {
+        free(start);
+    }
+    return result;
+}
+
+__attribute__((constructor))
+static void init() {
+    real_pthread_create = (pthread_create_fn)dlsym(RTLD_NEXT, "pthread_create");
+    real_gomp_parallel = (gomp_parallel_fn)dlsym(RTLD_NEXT, "GOMP_parallel");
+    omp_thread_num = (omp_query_fn)dlsym(RTLD_DEFAULT, "omp_get_thread_num");
+    omp_level = (omp_query_fn)dlsym(RTLD_DEFAULT, "omp_get_level");
+}
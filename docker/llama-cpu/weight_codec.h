@@ -0,0 +1,546 @@
+/*
+ * weight_codec.h
+ *
+ * Lossless secondary encoding of quantized weight blocks, decoded on use.
+ *
+ * Decode on a bandwidth-bound CPU is limited by how many weight bytes reach
+ * the cores per token, not by arithmetic. This codec stores the quant bytes
+ * of ggml Q8_0 and Q4_0 blocks entropy coded (order-0 rANS with a per-tensor
+ * frequency table, 64 interleaved states), keeps the fp16 scales raw, and
+ * decodes a tile of rows back into plain blocks in a small cache-resident
+ * buffer right before the dot products run on it. Nothing is approximated:
+ * decoded tiles are byte-identical to the original blocks, so the same
+ * vec_dot kernel produces bit-identical results.
+ *
+ * Layout of a compressed tensor:
+ * - freqs[256]:  symbol frequencies, normalised to WC_PROB_SCALE
+ * - scales:      the fp16 scale of every block, in block order
+ * - stream:      per tile, WC_LANES u32 initial states then u16 renorm words
+ * - tile_offset: start of each tile in the stream
+ * Tiles hold whole rows, about WC_TILE_SYMBOLS quant bytes each, and decode
+ * independently, so loader threads split a matrix by tiles.
+ *
+ * The decoder uses AVX-512 (a table gather per 16 lanes, renorm words
+ * expanded into the lanes that need them) when the CPU has it, else a
+ * scalar loop. The dot kernels use AVX2 like ggml's, else scalar.
+ */
+
+#pragma once
+
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#define WC_PROB_BITS 12
+#define WC_PROB_SCALE (1u << WC_PROB_BITS)
+#define WC_RANS_L (1u << 16)   // Lower bound of a normalised state; renorm moves 16 bits
+#define WC_LANES 64            // Interleaved states: four AVX-512 vectors of 16
+#define WC_LANE_VECTORS (WC_LANES / 16)
+#define WC_TILE_SYMBOLS 32768  // Target quant bytes per tile (decoded tile ~35KB, L2 resident)
+#define WC_STREAM_PAD 64       // The vector decoder reads up to 32 bytes past its position
+
+#define WC_BLOCK_ELEMS 32
+
+// ggml type ids of the supported block formats
+enum WCBlockType { WC_Q4_0 = 2, WC_Q8_0 = 8 };
+
+struct WCBlockFormat {
+    uint32_t type;
+    uint32_t block_bytes; // fp16 scale + quant bytes
+    uint32_t quant_bytes;
+};
+
+static inline bool wc_block_format(uint32_t type, WCBlockFormat* f) {
+    if (type == WC_Q8_0) {
+        *f = {WC_Q8_0, 34, 32};
+    } else if (type == WC_Q4_0) {
+        *f = {WC_Q4_0, 18, 16};
+    } else {
+        return false;
+    }
+    return true;
+}
+
+static inline const char* wc_type_name(uint32_t type) {
+    return type == WC_Q8_0 ? "q8_0" : type == WC_Q4_0 ? "q4_0" : "unknown";
+}
+
+struct WCTensor {
+    WCBlockFormat format;
+    uint64_t rows = 0;
+    uint64_t blocks_per_row = 0;
+    uint64_t rows_per_tile = 0;
+    uint16_t freqs[256];
+    uint32_t decode_table[WC_PROB_SCALE]; // symbol | freq << 8 | (slot - cum) << 20
+    std::vector<uint16_t> scales;
+    std::vector<uint8_t> stream;
+    std::vector<uint64_t> tile_offset;    // Tile count + 1 entries
+
+    size_t tiles() const { return tile_offset.size() - 1; }
+
+    // Bytes read from memory to decode the whole tensor once
+    size_t compressed_bytes() const {
+        return sizeof(freqs) + scales.size() * 2 + (stream.size() - WC_STREAM_PAD) + tile_offset.size() * 8;
+    }
+
+    size_t plain_bytes() const { return rows * blocks_per_row * format.block_bytes; }
+};
+
+// --- fp16 ----------------------------------------------------------------------
+
+static inline float wc_fp16_to_fp32(uint16_t h) {
+    uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+    uint32_t exp = (h >> 10) & 0x1f;
+    uint32_t mant = h & 0x3ff;
+    uint32_t bits;
+    if (exp == 0x1f) {
+        bits = sign | 0x7f800000 | (mant << 13);
+    } else if (exp != 0) {
+        bits = sign | ((exp + 112) << 23) | (mant << 13);
+    } else if (mant == 0) {
+        bits = sign;
+    } else {
+        // Subnormal: normalise the mantissa
+        exp = 113;
+        while (!(mant & 0x400)) {
+            mant <<= 1;
+            exp--;
+        }
+        bits = sign | (exp << 23) | ((mant & 0x3ff) << 13);
+    }
+    float f;
+    memcpy(&f, &bits, 4);
+    return f;
+}
+
+static inline uint16_t wc_fp32_to_fp16(float f) {
+    uint32_t x;
+    memcpy(&x, &f, 4);
+    uint32_t sign = (x >> 16) & 0x8000;
+    int32_t exp = (int32_t)((x >> 23) & 0xff) - 112;
+    uint32_t mant = x & 0x7fffff;
+    if (exp >= 0x1f) {
+        return (uint16_t)(sign | 0x7c00);
+    }
+    if (exp <= 0) {
+        if (exp < -10) return (uint16_t)sign;
+        mant |= 0x800000;
+        uint32_t shift = 14 - exp;
+        uint32_t half = (mant >> shift) + ((mant >> (shift - 1)) & 1);
+        return (uint16_t)(sign | half);
+    }
+    uint32_t h = sign | ((uint32_t)exp << 10) | (mant >> 13);
+    return (uint16_t)(h + ((mant >> 12) & 1)); // Round half up; a carry into the exponent is correct
+}
+
+// --- Frequency model -----------------------------------------------------------
+
+// Normalise symbol counts to WC_PROB_SCALE. Every present symbol keeps at least 1;
+// at least two symbols are present so no frequency reaches WC_PROB_SCALE (12 bits in the table).
+static inline void wc_normalize_freqs(const uint64_t counts[256], uint16_t freqs[256]) {
+    uint64_t total = 0;
+    int present = 0;
+    for (int s = 0; s < 256; s++) {
+        total += counts[s];
+        present += counts[s] != 0;
+    }
+    int32_t f[256];
+    int32_t sum = 0;
+    for (int s = 0; s < 256; s++) {
+        f[s] = counts[s] ? (int32_t)(counts[s] * WC_PROB_SCALE / total) : 0;
+        if (counts[s] && f[s] == 0) f[s] = 1;
+        sum += f[s];
+    }
+    if (present < 2) {
+        int s = 0;
+        while (s < 255 && f[s] != 0) s++;
+        f[s] = 1;
+        sum += 1;
+    }
+    // Give or take the rounding error from the largest frequencies
+    while (sum != (int32_t)WC_PROB_SCALE) {
+        int best = 0;
+        for (int s = 1; s < 256; s++) {
+            if (f[s] > f[best]) best = s;
+        }
+        int32_t step = (int32_t)WC_PROB_SCALE - sum;
+        if (step < 0 && f[best] + step < 1) step = 1 - f[best];
+        if (step > 0 && f[best] + step > (int32_t)WC_PROB_SCALE - 1) step = (int32_t)WC_PROB_SCALE - 1 - f[best];
+        f[best] += step;
+        sum += step;
+    }
+    for (int s = 0; s < 256; s++) {
+        freqs[s] = (uint16_t)f[s];
+    }
+}
+
+static inline void wc_build_decode_table(WCTensor* t) {
+    uint32_t cum = 0;
+    for (uint32_t s = 0; s < 256; s++) {
+        for (uint32_t i = 0; i < t->freqs[s]; i++) {
+            t->decode_table[cum + i] = s | ((uint32_t)t->freqs[s] << 8) | (i << 20);
+        }
+        cum += t->freqs[s];
+    }
+}
+
+// Order-0 entropy of the quant bytes in bits per byte, the bound for this codec
+static inline double wc_entropy(const uint64_t counts[256]) {
+    uint64_t total = 0;
+    for (int s = 0; s < 256; s++) total += counts[s];
+    double h = 0;
+    for (int s = 0; s < 256; s++) {
+        if (counts[s]) {
+            double p = (double)counts[s] / total;
+            h -= p * log2(p);
+        }
+    }
+    return h;
+}
+
+static inline void wc_count_symbols(const WCBlockFormat& f, const uint8_t* blocks, uint64_t n_blocks,
+                                    uint64_t counts[256]) {
+    memset(counts, 0, 256 * sizeof(uint64_t));
+    for (uint64_t b = 0; b < n_blocks; b++) {
+        const uint8_t* q = blocks + b * f.block_bytes + 2;
+        for (uint32_t i = 0; i < f.quant_bytes; i++) {
+            counts[q[i]]++;
+        }
+    }
+}
+
+// --- Encoder -----------------------------------------------------------------------
+
+// Quant bytes of a tile in decode order: 16-byte halves, padded to whole lane groups
+static inline void wc_gather_symbols(const WCBlockFormat& f, const uint8_t* blocks, uint64_t n_blocks,
+                                     uint8_t pad_symbol, std::vector<uint8_t>* out) {
+    out->clear();
+    for (uint64_t b = 0; b < n_blocks; b++) {
+        const uint8_t* q = blocks + b * f.block_bytes + 2;
+        out->insert(out->end(), q, q + f.quant_bytes);
+    }
+    while (out->size() % WC_LANES) {
+        out->push_back(pad_symbol);
+    }
+}
+
+// Encode one tile's symbols; appends initial states and renorm words to the stream
+static inline void wc_encode_tile(const WCTensor* t, const uint32_t cum[256], const std::vector<uint8_t>& syms,
+                                  std::vector<uint8_t>* stream) {
+    uint32_t x[WC_LANES];
+    for (int l = 0; l < WC_LANES; l++) x[l] = WC_RANS_L;
+    std::vector<uint16_t> words; // In reverse decode order
+    for (size_t i = syms.size(); i-- > 0;) {
+        uint32_t lane = i % WC_LANES;
+        uint32_t s = syms[i];
+        uint32_t freq = t->freqs[s];
+        uint32_t x_max = ((WC_RANS_L >> WC_PROB_BITS) << 16) * freq;
+        if (x[lane] >= x_max) {
+            words.push_back((uint16_t)x[lane]);
+            x[lane] >>= 16;
+        }
+        x[lane] = ((x[lane] / freq) << WC_PROB_BITS) + (x[lane] % freq) + cum[s];
+    }
+    size_t start = stream->size();
+    stream->resize(start + sizeof(x) + words.size() * 2);
+    memcpy(stream->data() + start, x, sizeof(x));
+    uint16_t* out = (uint16_t*)(stream->data() + start + sizeof(x));
+    for (size_t i = 0; i < words.size(); i++) {
+        out[i] = words[words.size() - 1 - i];
+    }
+}
+
+// Compress a row-major matrix of `rows` x `blocks_per_row` blocks of `type`
+static inline bool wc_compress(uint32_t type, const uint8_t* blocks, uint64_t rows, uint64_t blocks_per_row,
+                               WCTensor* t, std::string* error) {
+    if (!wc_block_format(type, &t->format)) {
+        *error = "unsupported block type";
+        return false;
+    }
+    if (rows == 0 || blocks_per_row == 0) {
+        *error = "empty tensor";
+        return false;
+    }
+    const WCBlockFormat& f = t->format;
+    t->rows = rows;
+    t->blocks_per_row = blocks_per_row;
+    uint64_t row_symbols = blocks_per_row * f.quant_bytes;
+    t->rows_per_tile = row_symbols >= WC_TILE_SYMBOLS ? 1 : WC_TILE_SYMBOLS / row_symbols;
+
+    uint64_t counts[256];
+    wc_count_symbols(f, blocks, rows * blocks_per_row, counts);
+    wc_normalize_freqs(counts, t->freqs);
+    wc_build_decode_table(t);
+    uint32_t cum[256];
+    uint32_t c = 0;
+    uint8_t pad_symbol = 0;
+    for (int s = 0; s < 256; s++) {
+        cum[s] = c;
+        c += t->freqs[s];
+        if (t->freqs[s] > t->freqs[pad_symbol]) pad_symbol = (uint8_t)s;
+    }
+
+    t->scales.resize(rows * blocks_per_row);
+    for (uint64_t b = 0; b < rows * blocks_per_row; b++) {
+        memcpy(&t->scales[b], blocks + b * f.block_bytes, 2);
+    }
+    t->stream.clear();
+    t->tile_offset.clear();
+    std::vector<uint8_t> syms;
+    for (uint64_t row = 0; row < rows; row += t->rows_per_tile) {
+        uint64_t n_rows = rows - row < t->rows_per_tile ? rows - row : t->rows_per_tile;
+        t->tile_offset.push_back(t->stream.size());
+        wc_gather_symbols(f, blocks + row * blocks_per_row * f.block_bytes, n_rows * blocks_per_row,
+                          pad_symbol, &syms);
+        wc_encode_tile(t, cum, syms, &t->stream);
+        // Keep every tile's states 4-byte aligned
+        while (t->stream.size() % 4) t->stream.push_back(0);
+    }
+    t->tile_offset.push_back(t->stream.size());
+    t->stream.resize(t->stream.size() + WC_STREAM_PAD, 0);
+    return true;
+}
+
+// --- Decoder -----------------------------------------------------------------------
+
+// Destination of the j-th 16-byte half of a tile's quant bytes within plain blocks
+static inline uint8_t* wc_half_dst(const WCBlockFormat& f, uint8_t* dst, uint64_t j) {
+    uint32_t halves_per_block = f.quant_bytes / 16;
+    return dst + (j / halves_per_block) * f.block_bytes + 2 + (j % halves_per_block) * 16;
+}
+
+static inline uint64_t wc_tile_blocks(const WCTensor* t, size_t tile) {
+    uint64_t first_row = tile * t->rows_per_tile;
+    uint64_t n_rows = t->rows - first_row < t->rows_per_tile ? t->rows - first_row : t->rows_per_tile;
+    return n_rows * t->blocks_per_row;
+}
+
+static inline void wc_copy_scales(const WCTensor* t, size_t tile, uint8_t* dst) {
+    uint64_t first = tile * t->rows_per_tile * t->blocks_per_row;
+    uint64_t n = wc_tile_blocks(t, tile);
+    for (uint64_t b = 0; b < n; b++) {
+        memcpy(dst + b * t->format.block_bytes, &t->scales[first + b], 2);
+    }
+}
+
+static inline void wc_decode_tile_scalar(const WCTensor* t, size_t tile, uint8_t* dst) {
+    const uint8_t* base = t->stream.data() + t->tile_offset[tile];
+    uint32_t x[WC_LANES];
+    memcpy(x, base, sizeof(x));
+    const uint16_t* words = (const uint16_t*)(base + sizeof(x));
+    uint64_t halves = wc_tile_blocks(t, tile) * t->format.quant_bytes / 16;
+    uint8_t group[WC_LANES];
+
+    for (uint64_t j = 0; j < halves; j += WC_LANE_VECTORS) {
+        for (int l = 0; l < WC_LANES; l++) {
+            uint32_t e = t->decode_table[x[l] & (WC_PROB_SCALE - 1)];
+            group[l] = (uint8_t)e;
+            x[l] = ((e >> 8) & (WC_PROB_SCALE - 1)) * (x[l] >> WC_PROB_BITS) + (e >> 20);
+            if (x[l] < WC_RANS_L) {
+                x[l] = (x[l] << 16) | *words++;
+            }
+        }
+        for (int v = 0; v < WC_LANE_VECTORS && j + v < halves; v++) {
+            memcpy(wc_half_dst(t->format, dst, j + v), group + v * 16, 16);
+        }
+    }
+    wc_copy_scales(t, tile, dst);
+}
+
+#if defined(__x86_64__)
+// GCC 12 flags the _mm512_undefined_* placeholders inside the intrinsics
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+__attribute__((target("avx512f,avx512bw")))
+static inline void wc_decode_tile_avx512(const WCTensor* t, size_t tile, uint8_t* dst) {
+    const uint8_t* base = t->stream.data() + t->tile_offset[tile];
+    const uint16_t* words = (const uint16_t*)(base + WC_LANES * 4);
+    uint64_t halves = wc_tile_blocks(t, tile) * t->format.quant_bytes / 16;
+    const int* table = (const int*)t->decode_table;
+    const __m512i slot_mask = _mm512_set1_epi32(WC_PROB_SCALE - 1);
+    const __m512i lower = _mm512_set1_epi32(WC_RANS_L);
+    __m512i x[WC_LANE_VECTORS];
+    for (int v = 0; v < WC_LANE_VECTORS; v++) x[v] = _mm512_loadu_si512(base + v * 64);
+
+    // The vectors are independent chains; interleaving them hides the gather latency
+    for (uint64_t j = 0; j < halves; j += WC_LANE_VECTORS) {
+        __m512i e[WC_LANE_VECTORS];
+#pragma GCC unroll 4
+        for (int v = 0; v < WC_LANE_VECTORS; v++) {
+            e[v] = _mm512_i32gather_epi32(_mm512_and_si512(x[v], slot_mask), table, 4);
+        }
+#pragma GCC unroll 4
+        for (int v = 0; v < WC_LANE_VECTORS; v++) {
+            if (j + v < halves) {
+                _mm_storeu_si128((__m128i*)wc_half_dst(t->format, dst, j + v), _mm512_cvtepi32_epi8(e[v]));
+            }
+            x[v] = _mm512_add_epi32(_mm512_mullo_epi32(_mm512_and_si512(_mm512_srli_epi32(e[v], 8), slot_mask),
+                                                       _mm512_srli_epi32(x[v], WC_PROB_BITS)),
+                                    _mm512_srli_epi32(e[v], 20));
+        }
+        // Lanes below L take the next words in lane order, as the encoder wrote them
+#pragma GCC unroll 4
+        for (int v = 0; v < WC_LANE_VECTORS; v++) {
+            __mmask16 m = _mm512_cmplt_epu32_mask(x[v], lower);
+            __m512i w = _mm512_cvtepu16_epi32(_mm256_loadu_si256((const __m256i*)words));
+            x[v] = _mm512_mask_or_epi32(x[v], m, _mm512_slli_epi32(x[v], 16), _mm512_maskz_expand_epi32(m, w));
+            words += __builtin_popcount(m);
+        }
+    }
+    wc_copy_scales(t, tile, dst);
+}
+#pragma GCC diagnostic pop
+#endif
+
+static inline bool wc_have_avx512() {
+#if defined(__x86_64__)
+    static int have = -1;
+    if (have < 0) {
+        have = __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw") &&
+               getenv("WC_DISABLE_AVX512") == nullptr;
+    }
+    return have;
+#else
+    return false;
+#endif
+}
+
+// Decode one tile into plain blocks at dst (wc_tile_blocks() * block_bytes bytes)
+static inline void wc_decode_tile(const WCTensor* t, size_t tile, uint8_t* dst) {
+#if defined(__x86_64__)
+    if (wc_have_avx512()) {
+        wc_decode_tile_avx512(t, tile, dst);
+        return;
+    }
+#endif
+    wc_decode_tile_scalar(t, tile, dst);
+}
+
+// --- Dot products ------------------------------------------------------------------
+
+// Activations are quantized to Q8_0 blocks, as ggml does for Q8_0 and Q4_0 weights
+static inline void wc_quantize_q8_0(const float* x, uint8_t* out, uint64_t n) {
+    for (uint64_t b = 0; b < n / WC_BLOCK_ELEMS; b++) {
+        const float* v = x + b * WC_BLOCK_ELEMS;
+        float amax = 0;
+        for (int i = 0; i < WC_BLOCK_ELEMS; i++) amax = fmaxf(amax, fabsf(v[i]));
+        float d = amax / 127.0f;
+        float id = d ? 1.0f / d : 0.0f;
+        uint8_t* block = out + b * 34;
+        uint16_t h = wc_fp32_to_fp16(d);
+        memcpy(block, &h, 2);
+        for (int i = 0; i < WC_BLOCK_ELEMS; i++) {
+            block[2 + i] = (uint8_t)(int8_t)lroundf(v[i] * id);
+        }
+    }
+}
+
+static inline float wc_dot_scalar(const WCBlockFormat& f, const uint8_t* w, const uint8_t* a, uint64_t n_blocks) {
+    float sum = 0;
+    for (uint64_t b = 0; b < n_blocks; b++) {
+        const uint8_t* wb = w + b * f.block_bytes;
+        const uint8_t* ab = a + b * 34;
+        uint16_t dw, da;
+        memcpy(&dw, wb, 2);
+        memcpy(&da, ab, 2);
+        int32_t isum = 0;
+        for (int i = 0; i < WC_BLOCK_ELEMS; i++) {
+            int32_t q;
+            if (f.type == WC_Q8_0) {
+                q = (int8_t)wb[2 + i];
+            } else {
+                q = (i < 16 ? (wb[2 + i] & 0x0f) : (wb[2 + i - 16] >> 4)) - 8;
+            }
+            isum += q * (int8_t)ab[2 + i];
+        }
+        sum += wc_fp16_to_fp32(dw) * wc_fp16_to_fp32(da) * (float)isum;
+    }
+    return sum;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("avx2,fma,f16c")))
+static inline float wc_dot_avx2(const WCBlockFormat& f, const uint8_t* w, const uint8_t* a, uint64_t n_blocks) {
+    __m256 acc = _mm256_setzero_ps();
+    const __m256i ones = _mm256_set1_epi16(1);
+    const __m256i low4 = _mm256_set1_epi8(0x0f);
+    const __m256i eight = _mm256_set1_epi8(8);
+    for (uint64_t b = 0; b < n_blocks; b++) {
+        const uint8_t* wb = w + b * f.block_bytes;
+        const uint8_t* ab = a + b * 34;
+        __m256i qw;
+        if (f.type == WC_Q8_0) {
+            qw = _mm256_loadu_si256((const __m256i*)(wb + 2));
+        } else {
+            __m128i packed = _mm_loadu_si128((const __m128i*)(wb + 2));
+            __m256i both = _mm256_set_m128i(_mm_srli_epi16(packed, 4), packed);
+            qw = _mm256_sub_epi8(_mm256_and_si256(both, low4), eight);
+        }
+        __m256i qa = _mm256_loadu_si256((const __m256i*)(ab + 2));
+        // |w| * (a with w's sign), as unsigned x signed byte products
+        __m256i prod = _mm256_maddubs_epi16(_mm256_sign_epi8(qw, qw), _mm256_sign_epi8(qa, qw));
+        __m256 sums = _mm256_cvtepi32_ps(_mm256_madd_epi16(prod, ones));
+        uint16_t dw, da;
+        memcpy(&dw, wb, 2);
+        memcpy(&da, ab, 2);
+        acc = _mm256_fmadd_ps(_mm256_set1_ps(_cvtsh_ss(dw) * _cvtsh_ss(da)), sums, acc);
+    }
+    __m128 r = _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+    r = _mm_add_ps(r, _mm_movehl_ps(r, r));
+    r = _mm_add_ss(r, _mm_movehdup_ps(r));
+    return _mm_cvtss_f32(r);
+}
+#endif
+
+static inline bool wc_have_avx2() {
+#if defined(__x86_64__)
+    static int have = -1;
+    if (have < 0) {
+        have = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") && __builtin_cpu_supports("f16c");
+    }
+    return have;
+#else
+    return false;
+#endif
+}
+
+// Dot product of one weight row (plain blocks) with Q8_0 activations
+static inline float wc_dot(const WCBlockFormat& f, const uint8_t* w, const uint8_t* a, uint64_t n_blocks) {
+#if defined(__x86_64__)
+    if (wc_have_avx2()) {
+        return wc_dot_avx2(f, w, a, n_blocks);
+    }
+#endif
+    return wc_dot_scalar(f, w, a, n_blocks);
+}
+
+// y[row] = W[row] . a for the rows of tiles [tile_begin, tile_end), decoding each
+// tile into `scratch` (rows_per_tile * blocks_per_row * block_bytes bytes) first
+static inline void wc_gemv_tiles(const WCTensor* t, const uint8_t* a, float* y, size_t tile_begin, size_t tile_end,
+                                 uint8_t* scratch) {
+    uint64_t row_bytes = t->blocks_per_row * t->format.block_bytes;
+    for (size_t tile = tile_begin; tile < tile_end; tile++) {
+        wc_decode_tile(t, tile, scratch);
+        uint64_t first_row = tile * t->rows_per_tile;
+        uint64_t n_rows = wc_tile_blocks(t, tile) / t->blocks_per_row;
+        for (uint64_t r = 0; r < n_rows; r++) {
+            y[first_row + r] = wc_dot(t->format, scratch + r * row_bytes, a, t->blocks_per_row);
+        }
+    }
+}
+
+// The same over plain blocks, for comparison
+static inline void wc_gemv_plain(const WCBlockFormat& f, const uint8_t* w, uint64_t blocks_per_row, const uint8_t* a,
+                                 float* y, uint64_t row_begin, uint64_t row_end) {
+    uint64_t row_bytes = blocks_per_row * f.block_bytes;
+    for (uint64_t r = row_begin; r < row_end; r++) {
+        y[r] = wc_dot(f, w + r * row_bytes, a, blocks_per_row);
+    }
+}
@@ -0,0 +1,404 @@
+/*
+ * weight_codec_bench.cpp
+ *
+ * Benchmark for the decode-on-use weight codec (weight_codec.h).
+ *
+ * For each block type it:
+ * 1. Takes a weight set larger than the last level cache: Q8_0/Q4_0 tensors
+ *    from a GGUF model (--model), or Laplacian weights quantized the way
+ *    ggml does (default)
+ * 2. Compresses it and reports the ratio, bits per weight and the order-0
+ *    entropy bound
+ * 3. Decodes every tile and checks the result is byte-identical
+ * 4. Times the decoder alone on one thread
+ * 5. Runs matrix-vector passes over the whole set (one pass reads every
+ *    weight once, like one decoded token) on plain blocks and on compressed
+ *    tiles, checks the outputs are bit-identical, and reports bytes/token,
+ *    effective weight bandwidth and tok/s for both
+ *
+ * Exit codes: 0 success, 1 error, 2 decoded output differs from the original.
+ */
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <time.h>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "gguf_reader.h"
+#include "weight_codec.h"
+
+#define EXIT_OK 0
+#define EXIT_ERROR 1
+#define EXIT_MISMATCH 2
+
+#define MiB (1024.0 * 1024.0)
+#define GB 1e9
+
+struct BenchOptions {
+    std::string model_path;
+    std::vector<uint32_t> types = {WC_Q8_0, WC_Q4_0};
+    uint64_t size_mb = 512;
+    uint64_t row = 4096;
+    int threads = 0;
+    int iterations = 10;
+    uint64_t seed = 1;
+};
+
+static double now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// --- Weight sets ---------------------------------------------------------------
+
+// Laplacian weights (the usual shape of trained weight distributions),
+// quantized with ggml's reference Q8_0 / Q4_0 rounding
+static void synthetic_blocks(const WCBlockFormat& f, uint64_t n_blocks, uint64_t seed, std::vector<uint8_t>* out) {
+    std::mt19937_64 rng(seed);
+    std::exponential_distribution<float> magnitude(1.0f);
+    out->resize(n_blocks * f.block_bytes);
+    for (uint64_t b = 0; b < n_blocks; b++) {
+        float v[WC_BLOCK_ELEMS];
+        for (int i = 0; i < WC_BLOCK_ELEMS; i++) {
+            v[i] = (rng() & 1) ? magnitude(rng) : -magnitude(rng);
+        }
+        uint8_t* blk = out->data() + b * f.block_bytes;
+        if (f.type == WC_Q8_0) {
+            float amax = 0.0f;
+            for (int i = 0; i < WC_BLOCK_ELEMS; i++) amax = fmaxf(amax, fabsf(v[i]));
+            float d = amax / 127.0f;
+            float id = d ? 1.0f / d : 0.0f;
+            uint16_t h = wc_fp32_to_fp16(d);
+            memcpy(blk, &h, 2);
+            for (int i = 0; i < WC_BLOCK_ELEMS; i++) blk[2 + i] = (uint8_t)(int8_t)lroundf(v[i] * id);
+        } else {
+            float max = 0.0f;
+            for (int i = 0; i < WC_BLOCK_ELEMS; i++) {
+                if (fabsf(v[i]) > fabsf(max)) max = v[i];
+            }
+            float d = max / -8.0f;
+            float id = d ? 1.0f / d : 0.0f;
+            uint16_t h = wc_fp32_to_fp16(d);
+            memcpy(blk, &h, 2);
+            for (int i = 0; i < WC_BLOCK_ELEMS / 2; i++) {
+                int lo = (int)(v[i] * id + 8.5f);
+                int hi = (int)(v[i + WC_BLOCK_ELEMS / 2] * id + 8.5f);
+                blk[2 + i] = (uint8_t)((lo < 15 ? lo : 15) | (hi < 15 ? hi : 15) << 4);
+            }
+        }
+    }
+}
+
+// Concatenates the model's tensors of `type` up to `limit` bytes. Rows are the
+// benchmark's own (--row), so tensors of any shape can be pooled.
+static bool model_blocks(int fd, const GGUFModel& model, const WCBlockFormat& f, uint64_t limit,
+                         std::vector<uint8_t>* out, size_t* tensors, std::string* error) {
+    out->clear();
+    *tensors = 0;
+    for (const GGUFTensorInfo& t : model.tensors) {
+        if (t.type != f.type || out->size() >= limit) continue;
+        uint64_t bytes = t.size - t.size % f.block_bytes;
+        if (bytes > limit - out->size()) bytes = (limit - out->size()) / f.block_bytes * f.block_bytes;
+        size_t start = out->size();
+        out->resize(start + bytes);
+        uint64_t done = 0;
+        while (done < bytes) {
+            ssize_t n = pread(fd, out->data() + start + done, bytes - done, model.data_offset + t.offset + done);
+            if (n <= 0) {
+                *error = "Cannot read tensor " + t.name + ": " + (n < 0 ? strerror(errno) : "short read");
+                return false;
+            }
+            done += n;
+        }
+        (*tensors)++;
+    }
+    return true;
+}
+
+// --- Parallel passes -----------------------------------------------------------
+
+struct PassJob {
+    const BenchOptions* o;
+    const WCBlockFormat* format;
+    const uint8_t* plain;         // Plain blocks, or null to use `tensor`
+    const WCTensor* tensor;
+    uint64_t rows;
+    uint64_t blocks_per_row;
+    const uint8_t* activation;    // Q8_0 blocks of one input vector
+    float* y;
+    pthread_barrier_t barrier;
+    double seconds = 0.0;
+};
+
+struct PassWorker {
+    PassJob* job;
+    int index;
+    std::vector<uint8_t> scratch;
+};
+
+static void* pass_worker(void* arg) {
+    PassWorker* w = (PassWorker*)arg;
+    PassJob* job = w->job;
+    int n = job->o->threads;
+    size_t units = job->plain ? job->rows : job->tensor->tiles();
+    size_t begin = units * w->index / n;
+    size_t end = units * (w->index + 1) / n;
+
+    // One untimed warm-up pass, then the timed ones
+    double start = 0.0;
+    for (int iter = 0; iter <= job->o->iterations; iter++) {
+        pthread_barrier_wait(&job->barrier);
+        if (iter == 1 && w->index == 0) start = now_seconds();
+        if (job->plain) {
+            wc_gemv_plain(*job->format, job->plain, job->blocks_per_row, job->activation, job->y, begin, end);
+        } else {
+            wc_gemv_tiles(job->tensor, job->activation, job->y, begin, end, w->scratch.data());
+        }
+    }
+    pthread_barrier_wait(&job->barrier);
+    if (w->index == 0) job->seconds = (now_seconds() - start) / job->o->iterations;
+    return nullptr;
+}
+
+// Sets job->seconds to the time of one pass over the weight set
+static void run_passes(PassJob* job) {
+    int n = job->o->threads;
+    pthread_barrier_init(&job->barrier, nullptr, n);
+    std::vector<PassWorker> workers(n);
+    std::vector<pthread_t> ids(n);
+    size_t tile_bytes = job->tensor ? job->tensor->rows_per_tile * job->blocks_per_row * job->format->block_bytes : 0;
+    for (int i = 0; i < n; i++) {
+        workers[i].job = job;
+        workers[i].index = i;
+        workers[i].scratch.resize(tile_bytes + 64);
+    }
+    // Worker 0 runs on this thread
+    for (int i = 1; i < n; i++) {
+        int rc = pthread_create(&ids[i], nullptr, pass_worker, &workers[i]);
+        if (rc != 0) {
+            // Threads already started wait on a barrier sized for all of them
+            fprintf(stderr, "weight_codec_bench: pthread_create: %s\n", strerror(rc));
+            exit(EXIT_ERROR);
+        }
+    }
+    pass_worker(&workers[0]);
+    for (int i = 1; i < n; i++) pthread_join(ids[i], nullptr);
+    pthread_barrier_destroy(&job->barrier);
+}
+
+// --- Per-type benchmark --------------------------------------------------------
+
+static int bench_type(const BenchOptions& o, uint32_t type, int fd, const GGUFModel* model) {
+    WCBlockFormat f;
+    wc_block_format(type, &f);
+    uint64_t limit = o.size_mb * 1024 * 1024;
+    std::vector<uint8_t> blocks;
+    std::string error;
+    printf("%s\n", wc_type_name(type));
+
+    if (model) {
+        size_t tensors = 0;
+        if (!model_blocks(fd, *model, f, limit, &blocks, &tensors, &error)) {
+            fprintf(stderr, "weight_codec_bench: %s\n", error.c_str());
+            return EXIT_ERROR;
+        }
+        if (tensors == 0) {
+            printf("  No %s tensors in the model, skipped\n\n", wc_type_name(type));
+            return EXIT_OK;
+        }
+        printf("  Source:            %zu tensors from %s\n", tensors, o.model_path.c_str());
+    } else {
+        synthetic_blocks(f, limit / f.block_bytes, o.seed, &blocks);
+        printf("  Source:            synthetic Laplacian weights (seed %llu)\n", (unsigned long long)o.seed);
+    }
+
+    uint64_t blocks_per_row = o.row / WC_BLOCK_ELEMS;
+    uint64_t rows = blocks.size() / f.block_bytes / blocks_per_row;
+    if (rows == 0) {
+        fprintf(stderr, "weight_codec_bench: Weight set smaller than one %llu-element row\n",
+                (unsigned long long)o.row);
+        return EXIT_ERROR;
+    }
+    blocks.resize(rows * blocks_per_row * f.block_bytes);
+
+    WCTensor t;
+    double start = now_seconds();
+    if (!wc_compress(type, blocks.data(), rows, blocks_per_row, &t, &error)) {
+        fprintf(stderr, "weight_codec_bench: %s\n", error.c_str());
+        return EXIT_ERROR;
+    }
+    double compress_seconds = now_seconds() - start;
+
+    uint64_t counts[256];
+    wc_count_symbols(f, blocks.data(), rows * blocks_per_row, counts);
+    double weights = (double)rows * o.row;
+    double ratio = (double)t.compressed_bytes() / t.plain_bytes();
+    printf("  Weights:           %llu rows x %llu (%.1f MiB plain)\n", (unsigned long long)rows,
+           (unsigned long long)o.row, t.plain_bytes() / MiB);
+    printf("  Compressed:        %.1f MiB, %.1f%% of plain (%.2f bits/weight, plain %.2f)\n",
+           t.compressed_bytes() / MiB, ratio * 100.0, t.compressed_bytes() * 8.0 / weights,
+           t.plain_bytes() * 8.0 / weights);
+    printf("  Entropy bound:     %.3f bits per quant byte\n", wc_entropy(counts));
+    printf("  Tiles:             %zu of %llu rows, compressed in %.2fs\n", t.tiles(),
+           (unsigned long long)t.rows_per_tile, compress_seconds);
+
+    // Lossless check and single-thread decode speed
+    uint64_t row_bytes = blocks_per_row * f.block_bytes;
+    std::vector<uint8_t> decoded(t.plain_bytes() + 64);
+    for (size_t tile = 0; tile < t.tiles(); tile++) {
+        wc_decode_tile(&t, tile, decoded.data() + tile * t.rows_per_tile * row_bytes);
+    }
+    if (memcmp(decoded.data(), blocks.data(), t.plain_bytes()) != 0) {
+        printf("  Lossless:          FAILED, decoded blocks differ from the original\n");
+        return EXIT_MISMATCH;
+    }
+    printf("  Lossless:          yes\n");
+
+    std::vector<uint8_t> scratch(t.rows_per_tile * row_bytes + 64);
+    start = now_seconds();
+    for (size_t tile = 0; tile < t.tiles(); tile++) wc_decode_tile(&t, tile, scratch.data());
+    double decode_seconds = now_seconds() - start;
+    printf("  Decode (1 thread): %.2f GB/s of plain blocks (%s)\n", t.plain_bytes() / decode_seconds / GB,
+           wc_have_avx512() ? "AVX-512" : "scalar");
+
+    // Matrix-vector passes
+    std::vector<float> x(o.row);
+    std::mt19937_64 rng(o.seed + 1);
+    std::normal_distribution<float> normal(0.0f, 1.0f);
+    for (float& v : x) v = normal(rng);
+    std::vector<uint8_t> activation(blocks_per_row * (2 + WC_BLOCK_ELEMS));
+    wc_quantize_q8_0(x.data(), activation.data(), o.row);
+    std::vector<float> y_plain(rows), y_codec(rows);
+
+    PassJob plain_job;
+    plain_job.o = &o;
+    plain_job.format = &f;
+    plain_job.plain = blocks.data();
+    plain_job.tensor = nullptr;
+    plain_job.rows = rows;
+    plain_job.blocks_per_row = blocks_per_row;
+    plain_job.activation = activation.data();
+    plain_job.y = y_plain.data();
+    PassJob codec_job = plain_job;
+    codec_job.plain = nullptr;
+    codec_job.tensor = &t;
+    codec_job.y = y_codec.data();
+    run_passes(&plain_job);
+    run_passes(&codec_job);
+    if (memcmp(y_plain.data(), y_codec.data(), rows * sizeof(float)) != 0) {
+        printf("  GEMV output:       FAILED, compressed path differs from plain blocks\n");
+        return EXIT_MISMATCH;
+    }
+
+    double plain_tps = 1.0 / plain_job.seconds;
+    double codec_tps = 1.0 / codec_job.seconds;
+    printf("  GEMV (%d threads, %d passes, outputs bit-identical):\n", o.threads, o.iterations);
+    printf("    %-10s %12s %14s %10s\n", "", "bytes/token", "weights GB/s", "tok/s");
+    printf("    %-10s %12.1fM %14.2f %10.2f\n", "plain", t.plain_bytes() / MiB, t.plain_bytes() * plain_tps / GB,
+           plain_tps);
+    printf("    %-10s %12.1fM %14.2f %10.2f\n", "compressed", t.compressed_bytes() / MiB,
+           t.plain_bytes() * codec_tps / GB, codec_tps);
+    printf("  Speedup:           %.2fx\n\n", codec_tps / plain_tps);
+    return EXIT_OK;
+}
+
+static void usage(const char* prog) {
+    fprintf(stderr,
+        "Usage: %s [options]\n"
+        "\n"
+        "Benchmark decode-on-use compressed weights against plain quantized blocks.\n"
+        "\n"
+        "Options:\n"
+        "  --model PATH       Take Q8_0/Q4_0 tensors from a GGUF model (default: synthetic weights)\n"
+        "  --type TYPE        q8_0, q4_0 or all (default: all)\n"
+        "  --size-mb N        Plain weight set per type; keep it above the LLC (default: 512)\n"
+        "  --row N            Row length in weights, a multiple of 32 (default: 4096)\n"
+        "  --threads N        GEMV threads (default: online CPUs)\n"
+        "  --iterations N     Timed passes per variant (default: 10)\n"
+        "  --seed N           Synthetic weight seed (default: 1)\n",
+        prog);
+}
+
+int main(int argc, char** argv) {
+    enum { OPT_MODEL = 1, OPT_TYPE, OPT_SIZE_MB, OPT_ROW, OPT_THREADS, OPT_ITERATIONS, OPT_SEED, OPT_HELP };
+    static const struct option long_options[] = {
+        {"model", required_argument, nullptr, OPT_MODEL},
+        {"type", required_argument, nullptr, OPT_TYPE},
+        {"size-mb", required_argument, nullptr, OPT_SIZE_MB},
+        {"row", required_argument, nullptr, OPT_ROW},
+        {"threads", required_argument, nullptr, OPT_THREADS},
+        {"iterations", required_argument, nullptr, OPT_ITERATIONS},
+        {"seed", required_argument, nullptr, OPT_SEED},
+        {"help", no_argument, nullptr, OPT_HELP},
+        {nullptr, 0, nullptr, 0},
+    };
+
+    BenchOptions o;
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", long_options, nullptr)) != -1) {
+        switch (opt) {
+            case OPT_MODEL: o.model_path = optarg; break;
+            case OPT_TYPE:
+                if (strcmp(optarg, "q8_0") == 0) {
+                    o.types = {WC_Q8_0};
+                } else if (strcmp(optarg, "q4_0") == 0) {
+                    o.types = {WC_Q4_0};
+                } else if (strcmp(optarg, "all") != 0) {
+                    fprintf(stderr, "weight_codec_bench: Unknown type: %s\n", optarg);
+                    return EXIT_ERROR;
+                }
+                break;
+            case OPT_SIZE_MB: o.size_mb = strtoull(optarg, nullptr, 10); break;
+            case OPT_ROW: o.row = strtoull(optarg, nullptr, 10); break;
+            case OPT_THREADS: o.threads = atoi(optarg); break;
+            case OPT_ITERATIONS: o.iterations = atoi(optarg); break;
+            case OPT_SEED: o.seed = strtoull(optarg, nullptr, 10); break;
+            case OPT_HELP: usage(argv[0]); return EXIT_OK;
+            default: usage(argv[0]); return EXIT_ERROR;
+        }
+    }
+    if (o.row == 0 || o.row % WC_BLOCK_ELEMS != 0 || o.size_mb == 0 || o.iterations <= 0) {
+        usage(argv[0]);
+        return EXIT_ERROR;
+    }
+    if (o.threads <= 0) {
+        long n = sysconf(_SC_NPROCESSORS_ONLN);
+        o.threads = n > 0 ? (int)n : 1;
+    }
+
+    int fd = -1;
+    GGUFModel model;
+    if (!o.model_path.empty()) {
+        fd = open(o.model_path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            fprintf(stderr, "weight_codec_bench: Cannot open %s: %s\n", o.model_path.c_str(), strerror(errno));
+            return EXIT_ERROR;
+        }
+        std::string error;
+        if (!gguf_read(fd, &model, &error)) {
+            fprintf(stderr, "weight_codec_bench: %s: %s\n", o.model_path.c_str(), error.c_str());
+            close(fd);
+            return EXIT_ERROR;
+        }
+    }
+
+    printf("Weight codec benchmark: %d threads, decoder %s, dot kernel %s\n\n", o.threads,
+           wc_have_avx512() ? "AVX-512" : "scalar", wc_have_avx2() ? "AVX2" : "scalar");
+    int rc = EXIT_OK;
+    for (uint32_t type : o.types) {
+        rc = bench_type(o, type, fd, o.model_path.empty() ? nullptr : &model);
+        if (rc != EXIT_OK) break;
+    }
+    if (fd >= 0) close(fd);
+    return rc;
+}
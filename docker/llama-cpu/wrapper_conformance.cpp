@@ -0,0 +1,1536 @@
+/*
+ * wrapper_conformance.cpp
+ *
+ * Conformance and overhead checks for hugepage_mmap_wrapper.so.
+ *
+ * Every scenario runs in a fresh process with the wrapper and
+ * wrapper_fault_shim.so preloaded (LD_PRELOAD="wrapper shim"), against files
+ * on a tmpfs directory and a fake huge page pool, so the checks need neither
+ * a reserved pool nor a real model:
+ * 1. Interception: whole-file mappings above the threshold are copied, other
+ *    mappings (offsets, partial lengths, small files, anonymous) pass through
+ * 2. munmap/mprotect/madvise/mlock on intercepted mappings
+ * 3. Short reads, EINTR and EIO from pread
+ * 4. ENOMEM from MAP_HUGETLB, pool exhaustion and partial placement
+ * 5. Concurrent mappers sharing one pool
+ * 6. Format recognition (safetensors, GGUF, PyTorch) and parallel loading
+ * 7. Load pipeline stages: plugin registration and ordering, checksum verification,
+ *    opt-in reads in device order for fragmented files
+ * 8. Shared images (hugepage_image.h): a changed tensor only rewrites its page
+ * 9. Startup calibration (hugepage_calibrate.h) and its overrides, and the
+ *    O_DIRECT source stage
+ * 10. Live load progress (hugepage_progress.h) of loaded and failed loads, and
+ *     address-to-tensor lookups (tensor_lookup.h) against the tensor index
+ * 11. With --arena, the HTTP thread staging arenas of hugepage_arena.so,
+ *     preloaded between the wrapper and the shim as in the container: which
+ *     threads get one, reset and reuse, moving past long-lived blocks, and
+ *     fallbacks to glibc
+ * Contents are verified byte for byte and the fake pool must be empty again
+ * after every unmap.
+ *
+ * --bench measures the per-call cost the wrapper (and the arena library) add
+ * to mmap/munmap and malloc/free calls they do not take over, against the same
+ * calls without them, and the cost of a tensor lookup against a scan.
+ *
+ * Exit codes: 0 all scenarios pass, 1 error, 2 scenario failures.
+ */
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "hugepage_image.h"
+#include "hugepage_progress.h"
+#include "tensor_lookup.h"
+
+#define EXIT_OK 0
+#define EXIT_ERROR 1
+#define EXIT_FAILED 2
+
+#define MiB (1024ULL * 1024)
+#define PAGE_2M (2 * MiB)
+
+// Scenario files are just above the threshold and deliberately not page aligned
+#define THRESHOLD_MB "4"
+#define MODEL_SIZE (9 * MiB + 123)
+#define SMALL_SIZE (1 * MiB)
+
+// Environment shared by all scenarios: threshold, no reserve, ample headroom,
+// 64MB pool, the static policy unless a scenario calibrates, and no arena
+// threads unless a scenario selects some
+static const char* BASE_ENV[] = {
+    "HUGEPAGE_WRAPPER_MIN_SIZE_MB=" THRESHOLD_MB,
+    "HUGEPAGE_WRAPPER_RESERVE_MB=0",
+    "FAULT_MEMORY_HEADROOM_BYTES=1073741824",
+    "FAULT_POOL_BYTES=67108864",
+    "HUGEPAGE_WRAPPER_CALIBRATE=off",
+    "HUGEPAGE_ARENA_THREADS=",
+    nullptr,
+};
+
+typedef int (*is_huge_fn)(const void*);
+typedef size_t (*pool_used_fn)();
+typedef void (*stage_counts_fn)(unsigned long*, unsigned long*, unsigned long*, unsigned long long*);
+typedef unsigned long (*pread_backwards_fn)();
+static is_huge_fn shim_is_huge = nullptr;
+static pool_used_fn shim_pool_used = nullptr;
+static stage_counts_fn shim_stage_counts = nullptr;
+static pread_backwards_fn shim_pread_backwards = nullptr;
+
+static std::string scratch_dir = "/dev/shm";
+
+// Failure reason of the running scenario, printed by the child on exit
+static char failure[512];
+
+#define CHECK(cond, ...)                                          \
+    do {                                                          \
+        if (!(cond)) {                                            \
+            snprintf(failure, sizeof(failure), __VA_ARGS__);      \
+            return false;                                         \
+        }                                                         \
+    } while (0)
+
+static size_t align_up(size_t value, size_t alignment) {
+    return (value + alignment - 1) / alignment * alignment;
+}
+
+static uint8_t pattern_byte(size_t offset) {
+    return (uint8_t)((offset * 2654435761ULL) >> 13);
+}
+
+// Model file layouts the wrapper recognises, plus two it must leave alone
+enum FileFormat { FILE_SAFETENSORS, FILE_GGUF, FILE_PYTORCH, FILE_RAW, FILE_SAFETENSORS_TRUNCATED };
+
+#define TENSOR_COUNT 16
+#define HEADER_RESERVE 4096
+
+// Header of a file of `size` bytes holding TENSOR_COUNT equal tensors
+static std::string file_header(FileFormat format, size_t size) {
+    std::string h;
+    if (format == FILE_SAFETENSORS || format == FILE_SAFETENSORS_TRUNCATED) {
+        // JSON padded with spaces to HEADER_RESERVE, as the safetensors writer pads to 8 bytes
+        size_t data = size - 8 - HEADER_RESERVE;
+        if (format == FILE_SAFETENSORS_TRUNCATED) {
+            data += 4096; // Index claims more data than the file holds
+        }
+        std::string json = "{\"__metadata__\":{\"format\":\"pt\"}";
+        for (int i = 0; i < TENSOR_COUNT; i++) {
+            size_t begin = data / TENSOR_COUNT * i;
+            size_t end = i == TENSOR_COUNT - 1 ? data : data / TENSOR_COUNT * (i + 1);
+            json += ",\"t" + std::to_string(i) + "\":{\"dtype\":\"U8\",\"shape\":[" + std::to_string(end - begin) +
+                    "],\"data_offsets\":[" + std::to_string(begin) + "," + std::to_string(end) + "]}";
+        }
+        json += "}";
+        json.resize(HEADER_RESERVE, ' ');
+        uint64_t len = HEADER_RESERVE;
+        h.assign((const char*)&len, 8);
+        h += json;
+    } else if (format == FILE_GGUF) {
+        // GGUF v3, no metadata, I8 tensors; data starts at the next 32-byte boundary
+        auto u32 = [&h](uint32_t v) { h.append((const char*)&v, 4); };
+        auto u64 = [&h](uint64_t v) { h.append((const char*)&v, 8); };
+        u32(0x46554747u);
+        u32(3);
+        u64(TENSOR_COUNT);
+        u64(0);
+        size_t data = size - HEADER_RESERVE;
+        for (int i = 0; i < TENSOR_COUNT; i++) {
+            std::string name = i < TENSOR_COUNT - 1 ? "blk." + std::to_string(i) + ".weight" : "output.weight";
+            u64(name.size());
+            h += name;
+            u32(1);
+            u64(data / TENSOR_COUNT);
+            u32(24); // I8
+            u64(data / TENSOR_COUNT * i);
+        }
+        h.resize(HEADER_RESERVE, '\0');
+    } else if (format == FILE_PYTORCH) {
+        // Zip local file header of the archive's first entry
+        const char name[] = "archive/data.pkl";
+        h.assign("PK\x03\x04", 4);
+        h.resize(26, '\0');
+        uint16_t name_len = sizeof(name) - 1;
+        h.append((const char*)&name_len, 2);
+        h.append(2, '\0');
+        h += name;
+    }
+    return h;
+}
+
+// Write a model file of `size` bytes: the format's header, then pattern bytes; returns the path
+static std::string create_file(const char* name, size_t size, FileFormat format = FILE_SAFETENSORS) {
+    std::string path = scratch_dir + "/wrapper_conformance_" + std::to_string(getpid()) + "_" + name;
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) {
+        return "";
+    }
+    std::string header = file_header(format, size);
+    std::vector<uint8_t> buf(MiB);
+    for (size_t done = 0; done < size;) {
+        size_t n = std::min((size_t)buf.size(), size - done);
+        for (size_t i = 0; i < n; i++) {
+            buf[i] = done + i < header.size() ? header[done + i] : pattern_byte(done + i);
+        }
+        if (write(fd, buf.data(), n) != (ssize_t)n) {
+            close(fd);
+            return "";
+        }
+        done += n;
+    }
+    close(fd);
+    return path;
+}
+
+// Offset of the first byte differing from the file, or SIZE_MAX. Reads with
+// read(), which the shim leaves alone, so injected pread faults do not apply.
+static size_t first_mismatch(const std::string& path, const void* mem, size_t length, size_t file_offset) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0 || lseek(fd, file_offset, SEEK_SET) < 0) {
+        return 0;
+    }
+    std::vector<uint8_t> buf(MiB);
+    const uint8_t* p = (const uint8_t*)mem;
+    size_t checked = 0;
+    while (checked < length) {
+        ssize_t n = read(fd, buf.data(), std::min(buf.size(), length - checked));
+        if (n <= 0) {
+            break;
+        }
+        if (memcmp(p + checked, buf.data(), n) != 0) {
+            for (ssize_t i = 0; i < n; i++) {
+                if (p[checked + i] != buf[i]) {
+                    close(fd);
+                    return checked + i;
+                }
+            }
+        }
+        checked += n;
+    }
+    close(fd);
+    return checked == length ? SIZE_MAX : checked;
+}
+
+// mmap a file the way llama.cpp does; the fd is closed right after, as llama.cpp does
+static void* map_file(const std::string& path, size_t length, off_t offset) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return MAP_FAILED;
+    }
+    void* mem = mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, offset);
+    int saved_errno = errno;
+    close(fd);
+    errno = saved_errno;
+    return mem;
+}
+
+static bool map_and_verify(const std::string& path, size_t size, void** out) {
+    void* mem = map_file(path, size, 0);
+    CHECK(mem != MAP_FAILED, "mmap failed: %s", strerror(errno));
+    size_t bad = first_mismatch(path, mem, size, 0);
+    CHECK(bad == SIZE_MAX, "contents differ from the file at offset %zu", bad);
+    *out = mem;
+    return true;
+}
+
+static bool pool_empty() {
+    size_t used = shim_pool_used();
+    CHECK(used == 0, "%zu bytes of the huge page pool still in use", used);
+    return true;
+}
+
+// --- Scenarios -------------------------------------------------------------
+
+static bool scenario_full_copy() {
+    std::string path = create_file("model", MODEL_SIZE);
+    void* mem;
+    if (!map_and_verify(path, MODEL_SIZE, &mem)) return false;
+    CHECK(shim_is_huge(mem), "mapping is not in huge pages");
+    CHECK(shim_pool_used() == align_up(MODEL_SIZE, PAGE_2M), "pool holds %zu bytes, expected %zu",
+          shim_pool_used(), (size_t)align_up(MODEL_SIZE, PAGE_2M));
+    CHECK(munmap(mem, MODEL_SIZE) == 0, "munmap with the file length failed: %s", strerror(errno));
+    return pool_empty();
+}
+
+static bool scenario_munmap_length() {
+    std::string path = create_file("model", MODEL_SIZE);
+    void* mem;
+    if (!map_and_verify(path, MODEL_SIZE, &mem)) return false;
+    // The wrapper owns the size of its mappings; a wrong length still unmaps all of it
+    CHECK(munmap(mem, 4096) == 0, "munmap with a short length failed: %s", strerror(errno));
+    return pool_empty();
+}
+
+static bool scenario_munmap_interior() {
+    std::string path = create_file("model", MODEL_SIZE);
+    void* mem;
+    if (!map_and_verify(path, MODEL_SIZE, &mem)) return false;
+    // Not the start of a mapping: passed through, and hugetlb refuses the split
+    errno = 0;
+    CHECK(munmap((char*)mem + 4096, 4096) == -1 && errno == EINVAL,
+          "interior munmap of a huge page mapping returned errno %d, expected EINVAL", errno);
+    size_t bad = first_mismatch(path, mem, MODEL_SIZE, 0);
+    CHECK(bad == SIZE_MAX, "contents changed after a failed interior munmap at offset %zu", bad);
+    CHECK(munmap(mem, MODEL_SIZE) == 0, "munmap failed: %s", strerror(errno));
+    return pool_empty();
+}
+
+static bool scenario_passthrough() {
+    std::string path = create_file("model", MODEL_SIZE);
+    std::string small = create_file("small", SMALL_SIZE);
+
+    void* mem = map_file(path, MODEL_SIZE - PAGE_2M, PAGE_2M);
+    CHECK(mem != MAP_FAILED, "mmap at an offset failed: %s", strerror(errno));
+    CHECK(!shim_is_huge(mem), "mapping at an offset was intercepted");
+    CHECK(first_mismatch(path, mem, MODEL_SIZE - PAGE_2M, PAGE_2M) == SIZE_MAX, "mapping at an offset has wrong contents");
+    CHECK(munmap(mem, MODEL_SIZE - PAGE_2M) == 0, "munmap failed: %s", strerror(errno));
+
+    mem = map_file(path, MODEL_SIZE - 4096, 0);
+    CHECK(mem != MAP_FAILED, "partial mmap failed: %s", strerror(errno));
+    CHECK(!shim_is_huge(mem), "partial-length mapping was intercepted");
+    CHECK(munmap(mem, MODEL_SIZE - 4096) == 0, "munmap failed: %s", strerror(errno));
+
+    mem = map_file(small, SMALL_SIZE, 0);
+    CHECK(mem != MAP_FAILED, "small mmap failed: %s", strerror(errno));
+    CHECK(!shim_is_huge(mem), "file below the threshold was intercepted");
+    CHECK(first_mismatch(small, mem, SMALL_SIZE, 0) == SIZE_MAX, "small mapping has wrong contents");
+    CHECK(munmap(mem, SMALL_SIZE) == 0, "munmap failed: %s", strerror(errno));
+
+    // Writes through a shared writable mapping must reach the file
+    int fd = open(path.c_str(), O_RDWR);
+    mem = mmap(nullptr, MODEL_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    CHECK(mem != MAP_FAILED, "shared writable mmap failed: %s", strerror(errno));
+    CHECK(!shim_is_huge(mem), "shared writable mapping was intercepted");
+    ((char*)mem)[MODEL_SIZE - 1] ^= 0xff;
+    CHECK(munmap(mem, MODEL_SIZE) == 0, "munmap failed: %s", strerror(errno));
+    char last = 0;
+    lseek(fd, MODEL_SIZE - 1, SEEK_SET);
+    CHECK(read(fd, &last, 1) == 1 && (uint8_t)last == (uint8_t)(pattern_byte(MODEL_SIZE - 1) ^ 0xff),
+          "write through a shared writable mapping did not reach the file");
+    close(fd);
+
+    mem = mmap(nullptr, MODEL_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    CHECK(mem != MAP_FAILED, "anonymous mmap failed: %s", strerror(errno));
+    CHECK(!shim_is_huge(mem), "anonymous mapping was intercepted");
+    memset(mem, 0x5a, MODEL_SIZE);
+    CHECK(munmap(mem, MODEL_SIZE) == 0, "munmap failed: %s", strerror(errno));
+    return pool_empty();
+}
+
+static bool scenario_protections() {
+    std::string path = create_file("model", MODEL_SIZE);
+    void* mem;
+    if (!map_and_verify(path, MODEL_SIZE, &mem)) return false;
+    // Results of these vary by backing and RLIMIT_MEMLOCK; they must not disturb the mapping
+    mprotect(mem, align_up(MODEL_SIZE, 4096), PROT_READ);
+    CHECK(madvise(mem, align_up(MODEL_SIZE, 4096), MADV_WILLNEED) == 0, "madvise(WILLNEED) failed: %s",
+          strerror(errno));
+    CHECK(madvise(mem, align_up(MODEL_SIZE, 4096), MADV_RANDOM) == 0, "madvise(RANDOM) failed: %s",
+          strerror(errno));
+    if (mlock(mem, MODEL_SIZE) == 0) {
+        munlock(mem, MODEL_SIZE);
+    } else {
+        CHECK(errno == ENOMEM || errno == EPERM, "mlock failed: %s", strerror(errno));
+    }
+    size_t bad = first_mismatch(path, mem, MODEL_SIZE, 0);
+    CHECK(bad == SIZE_MAX, "contents changed at offset %zu", bad);
+    CHECK(munmap(mem, MODEL_SIZE) == 0, "munmap failed: %s", strerror(errno));
+    return pool_empty();
+}
+
+static bool scenario_read_faults() {
+    std::string path = create_file("model", MODEL_SIZE);
+    void* mem;
+    if (!map_and_verify(path, MODEL_SIZE, &mem)) return false;
+    CHECK(shim_is_huge(mem), "mapping is not in huge pages");
+    CHECK(munmap(mem, MODEL_SIZE) == 0, "munmap failed: %s", strerror(errno));
+    return pool_empty();
+}
+
+static bool scenario_read_error() {
+    std::string path = create_file("model", MODEL_SIZE);
+    errno = 0;
+    void* mem = map_file(path, MODEL_SIZE, 0);
+    CHECK(mem == MAP_FAILED, "mmap succeeded although the file could not be read");
+    CHECK(errno == EIO, "mmap failed with errno %d, expected EIO", errno);
+    return pool_empty();
+}
+
+static bool scenario_anonymous_fallback() {
+    std::string path = create_file("model", MODEL_SIZE);
+    void* mem;
+    if (!map_and_verify(path, MODEL_SIZE, &mem)) return false;
+    CHECK(!shim_is_huge(mem), "mapping in huge pages although MAP_HUGETLB failed");
+    CHECK(munmap(mem, MODEL_SIZE) == 0, "munmap failed: %s", strerror(errno));
+    return pool_empty();
+}
+
+static bool scenario_file_fallback() {
+    std::string path = create_file("model", MODEL_SIZE);
+    void* mem;
+    if (!map_and_verify(path, MODEL_SIZE, &mem)) return false;
+    CHECK(!shim_is_huge(mem), "mapping in huge pages although the pool is empty");
+    CHECK(munmap(mem, MODEL_SIZE) == 0, "munmap failed: %s", strerror(errno));
+    return pool_empty();
+}
+
+static bool scenario_partial() {
+    std::string path = create_file("model", MODEL_SIZE);
+    void* mem;
+    if (!map_and_verify(path, MODEL_SIZE, &mem)) return false;
+    CHECK(shim_is_huge(mem), "leading part is not in huge pages");
+    CHECK(!shim_is_huge((char*)mem + MODEL_SIZE - 1), "tail is in huge pages although the pool is too small");
+    CHECK(shim_pool_used() == 3 * PAGE_2M, "pool holds %zu bytes, expected the whole 6MB pool",
+          shim_pool_used());
+    CHECK(munmap(mem, MODEL_SIZE) == 0, "munmap failed: %s", strerror(errno));
+    return pool_empty();
+}
+
+static bool scenario_pool_shared() {
+    // A draft and a main model: the second finds the pool drained by the first
+    std::string first = create_file("draft", MODEL_SIZE);
+    std::string second = create_file("model", MODEL_SIZE);
+    void *a, *b;
+    if (!map_and_verify(first, MODEL_SIZE, &a)) return false;
+    CHECK(shim_is_huge(a), "first mapping is not in huge pages");
+    if (!map_and_verify(second, MODEL_SIZE, &b)) return false;
+    CHECK(!shim_is_huge(b), "second mapping is in huge pages although the pool is drained");
+    CHECK(munmap(b, MODEL_SIZE) == 0, "munmap failed: %s", strerror(errno));
+    CHECK(munmap(a, MODEL_SIZE) == 0, "munmap failed: %s", strerror(errno));
+    return pool_empty();
+}
+
+static bool scenario_formats() {
+    // safetensors (the default scenario file) is covered above; GGUF and PyTorch here
+    const struct {
+        const char* name;
+        FileFormat format;
+        bool intercepted;
+    } files[] = {
+        {"gguf", FILE_GGUF, true},
+        {"pytorch", FILE_PYTORCH, true},
+        {"raw", FILE_RAW, false},
+        {"truncated", FILE_SAFETENSORS_TRUNCATED, false},
+    };
+    for (const auto& f : files) {
+        std::string path = create_file(f.name, MODEL_SIZE, f.format);
+        void* mem;
+        bool ok = map_and_verify(path, MODEL_SIZE, &mem);
+        unlink(path.c_str());
+        if (!ok) return false;
+        CHECK(shim_is_huge(mem) == f.intercepted, "%s file was %s", f.name,
+              f.intercepted ? "not intercepted" : "intercepted");
+        CHECK(munmap(mem, MODEL_SIZE) == 0, "munmap failed: %s", strerror(errno));
+    }
+    return pool_empty();
+}
+
+static bool scenario_format_filter() {
+    std::string safetensors = create_file("model", MODEL_SIZE);
+    std::string gguf = create_file("draft", MODEL_SIZE, FILE_GGUF);
+    void *a, *b;
+    if (!map_and_verify(safetensors, MODEL_SIZE, &a)) return false;
+    CHECK(!shim_is_huge(a), "safetensors file intercepted with HUGEPAGE_WRAPPER_FORMATS=gguf");
+    if (!map_and_verify(gguf, MODEL_SIZE, &b)) return false;
+    CHECK(shim_is_huge(b), "GGUF file not intercepted with HUGEPAGE_WRAPPER_FORMATS=gguf");
+    CHECK(munmap(a, MODEL_SIZE) == 0 && munmap(b, MODEL_SIZE) == 0, "munmap failed: %s", strerror(errno));
+    return pool_empty();
+}
+
+#define PARALLEL_SIZE (200 * MiB + 123)
+
+static bool scenario_parallel_load() {
+    // Large enough for four loader threads, each reading with faults injected
+    std::string path = create_file("model", PARALLEL_SIZE);
+    void* mem;
+    if (!map_and_verify(path, PARALLEL_SIZE, &mem)) return false;
+    CHECK(shim_is_huge(mem), "mapping is not in huge pages");
+    CHECK(munmap(mem, PARALLEL_SIZE) == 0, "munmap failed: %s", strerror(errno));
+    return pool_empty();
+}
+
+static bool scenario_plugin_stages() {
+    // Pipeline "fault_place,pread,fault_count" from the shim loaded as a plugin
+    std::string path = create_file("model", MODEL_SIZE);
+    void* mem;
+    if (!map_and_verify(path, MODEL_SIZE, &mem)) return false;
+    CHECK(shim_is_huge(mem), "mapping is not in huge pages");
+    unsigned long places, touched, chunks;
+    unsigned long long bytes;
+    shim_stage_counts(&places, &touched, &chunks, &bytes);
+    CHECK(places == 1, "placement stage ran %lu times, expected once", places);
+    CHECK(touched == 0, "placement stage ran after data was written");
+    CHECK(chunks == 3 && bytes == MODEL_SIZE, "transform saw %lu chunks / %llu bytes, expected 3 / %llu",
+          chunks, bytes, (unsigned long long)MODEL_SIZE);
+    CHECK(munmap(mem, MODEL_SIZE) == 0, "munmap failed: %s", strerror(errno));
+    return pool_empty();
+}
+
+// CRC-32C of the file, bitwise, independent of the wrapper's implementation
+static uint32_t file_crc32c(const std::string& path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    std::vector<uint8_t> buf(MiB);
+    uint32_t crc = 0xFFFFFFFFu;
+    ssize_t n;
+    while (fd >= 0 && (n = read(fd, buf.data(), buf.size())) > 0) {
+        for (ssize_t i = 0; i < n; i++) {
+            crc ^= buf[i];
+            for (int k = 0; k < 8; k++) {
+                crc = crc & 1 ? (crc >> 1) ^ 0x82F63B78u : crc >> 1;
+            }
+        }
+    }
+    if (fd >= 0) close(fd);
+    return ~crc;
+}
+
+static bool scenario_checksum() {
+    // 1MB chunks, so the digest is combined from ten per-chunk CRCs
+    std::string path = create_file("model", MODEL_SIZE);
+    char pipeline[64];
+    snprintf(pipeline, sizeof(pipeline), "pread,checksum:expect=%08x", file_crc32c(path));
+    setenv("HUGEPAGE_WRAPPER_PIPELINE", pipeline, 1);
+    void* mem;
+    if (!map_and_verify(path, MODEL_SIZE, &mem)) return false;
+    CHECK(shim_is_huge(mem), "mapping is not in huge pages");
+    CHECK(munmap(mem, MODEL_SIZE) == 0, "munmap failed: %s", strerror(errno));
+
+    snprintf(pipeline, sizeof(pipeline), "pread,checksum:expect=%08x", file_crc32c(path) ^ 1);
+    setenv("HUGEPAGE_WRAPPER_PIPELINE", pipeline, 1);
+    errno = 0;
+    mem = map_file(path, MODEL_SIZE, 0);
+    CHECK(mem == MAP_FAILED, "mmap succeeded despite a checksum mismatch");
+    CHECK(errno == EIO, "mmap failed with errno %d, expected EIO", errno);
+    return pool_empty();
+}
+
+static bool scenario_physical_order() {
+    // The shim lays the file out as 1MB extents in reverse order. The default
+    // file order reads it front to back despite the extents.
+    std::string path = create_file("model", MODEL_SIZE);
+    unsigned long before = shim_pread_backwards();
+    void* mem = nullptr;
+    if (!map_and_verify(path, MODEL_SIZE, &mem)) return false;
+    // The first read of the load goes back from the header to offset 0
+    unsigned long backwards = shim_pread_backwards() - before;
+    CHECK(backwards <= 1, "%lu reads went backwards in file order", backwards);
+    CHECK(munmap(mem, MODEL_SIZE) == 0, "munmap failed: %s", strerror(errno));
+
+    // HUGEPAGE_WRAPPER_READ_ORDER=physical reads it back to front, one
+    // backward step per extent after the first. The header read goes back
+    // from where the previous load ended, which makes one more.
+    setenv("HUGEPAGE_WRAPPER_READ_ORDER", "physical", 1);
+    before = shim_pread_backwards();
+    void* mem2 = map_file(path, MODEL_SIZE, 0);
+    CHECK(mem2 != MAP_FAILED, "mmap failed: %s", strerror(errno));
+    backwards = shim_pread_backwards() - before;
+    size_t extents = (MODEL_SIZE + MiB - 1) / MiB;
+    CHECK(backwards == extents, "%lu reads went backwards, expected %zu (one per extent)", backwards, extents);
+    size_t bad = first_mismatch(path, mem2, MODEL_SIZE, 0);
+    CHECK(bad == SIZE_MAX, "contents differ from the file at offset %zu", bad);
+    CHECK(munmap(mem2, MODEL_SIZE) == 0, "munmap failed: %s", strerror(errno));
+    return pool_empty();
+}
+
+// Published revisions of a scenario image, oldest first
+static std::vector<ImageRevision> image_revisions(const std::string& name) {
+    std::vector<ImageRevision> revisions;
+    int fd = open((scratch_dir + "/" + name + ".index").c_str(), O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        if (fd >= 0) close(fd);
+        return revisions;
+    }
+    void* mem = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mem == MAP_FAILED) {
+        return revisions;
+    }
+    ImageIndex* index = (ImageIndex*)mem;
+    for (uint32_t i = 0; index->magic == IMAGE_INDEX_MAGIC && i < index->slots; i++) {
+        if (image_revision(index, i)->generation != 0) {
+            revisions.push_back(*image_revision(index, i));
+        }
+    }
+    munmap(mem, st.st_size);
+    std::sort(revisions.begin(), revisions.end(),
+              [](const ImageRevision& a, const ImageRevision& b) { return a.generation < b.generation; });
+    return revisions;
+}
+
+static bool scenario_image_update() {
+    // Five 2MB pool pages; the last tensor starts in the last page, behind the tail of blk.14
+    std::string path = create_file("model", MODEL_SIZE, FILE_GGUF);
+    std::string name = "wrapper_conformance_" + std::to_string(getpid()) + "_model";
+    void *a, *b, *c;
+    if (!map_and_verify(path, MODEL_SIZE, &a)) return false;
+    std::vector<ImageRevision> revisions = image_revisions(name);
+    CHECK(revisions.size() == 1 && revisions[0].written_pages == 5 && revisions[0].read_bytes == MODEL_SIZE,
+          "first mapping did not build a 5-page revision from the file");
+
+    // Rewrite the last tensor while revision 1 stays mapped
+    GGUFModel m;
+    std::string error;
+    int fd = open(path.c_str(), O_RDWR);
+    CHECK(fd >= 0 && gguf_read(fd, &m, &error), "cannot read the GGUF header: %s", error.c_str());
+    size_t last = m.data_offset + m.tensors.back().offset;
+    std::vector<uint8_t> changed(MODEL_SIZE - last, 0x5a);
+    CHECK(pwrite(fd, changed.data(), changed.size(), last) == (ssize_t)changed.size(),
+          "cannot rewrite the model: %s", strerror(errno));
+    close(fd);
+    if (!map_and_verify(path, MODEL_SIZE, &b)) return false;
+    CHECK(first_mismatch(path, a, last, 0) == SIZE_MAX && ((uint8_t*)a)[last] == pattern_byte(last),
+          "revision 1 changed under its mapping");
+    revisions = image_revisions(name);
+    CHECK(revisions.size() == 2, "%zu published revisions, expected 2", revisions.size());
+    const ImageRevision& r = revisions[1];
+    CHECK(r.reused_pages == 4 && r.written_pages == 1, "update wrote %u pages and reused %u, expected 1 and 4",
+          r.written_pages, r.reused_pages);
+    CHECK(r.read_bytes == changed.size() && r.copied_bytes == last - 4 * PAGE_2M,
+          "update read %llu bytes and copied %llu, expected %zu and %llu", (unsigned long long)r.read_bytes,
+          (unsigned long long)r.copied_bytes, changed.size(), (unsigned long long)(last - 4 * PAGE_2M));
+
+    // Another mapper of the same file attaches to revision 2
+    if (!map_and_verify(path, MODEL_SIZE, &c)) return false;
+    CHECK(image_revisions(name).size() == 2, "a mapping of an unchanged file published a revision");
+
+    // Every replica maps the same pages: neither the builder's nor an
+    // attacher's mapping can be made writable
+    for (void* mem : {a, b, c}) {
+        CHECK(mprotect(mem, MODEL_SIZE, PROT_READ | PROT_WRITE) != 0 && errno == EACCES,
+              "mprotect made a shared image mapping writable");
+    }
+    CHECK(munmap(a, MODEL_SIZE) == 0 && munmap(b, MODEL_SIZE) == 0 && munmap(c, MODEL_SIZE) == 0,
+          "munmap failed: %s", strerror(errno));
+    return pool_empty();
+}
+
+// Metrics file the wrapper writes after a mapping, empty if there is none
+static std::string load_metrics() {
+    std::string path = scratch_dir + "/wrapper_conformance_" + std::to_string(getpid()) + ".prom";
+    setenv("HUGEPAGE_WRAPPER_METRICS", path.c_str(), 1);
+    return path;
+}
+
+static std::string read_text(const std::string& path) {
+    std::string text;
+    int fd = open(path.c_str(), O_RDONLY);
+    char buf[4096];
+    ssize_t n;
+    while (fd >= 0 && (n = read(fd, buf, sizeof(buf))) > 0) {
+        text.append(buf, n);
+    }
+    if (fd >= 0) close(fd);
+    return text;
+}
+
+static bool scenario_calibration() {
+    // The model sits in tmpfs, so it is fully cached and pread wins; only the
+    // 2MB pool holds it, and the measurement must hand its sample pages back
+    std::string metrics = load_metrics();
+    std::string path = create_file("model", MODEL_SIZE);
+    void* mem;
+    if (!map_and_verify(path, MODEL_SIZE, &mem)) return false;
+    CHECK(shim_is_huge(mem), "mapping is not in huge pages");
+    CHECK(shim_pool_used() == align_up(MODEL_SIZE, PAGE_2M), "pool holds %zu bytes, expected the model's %zu",
+          shim_pool_used(), (size_t)align_up(MODEL_SIZE, PAGE_2M));
+    std::string text = read_text(metrics);
+    unlink(metrics.c_str());
+    const char* policy = "hugepage_wrapper_policy{engine=\"pread\",page_size=\"2M\",placement=\"hugetlb\","
+                         "engine_source=\"calibrated\",page_size_source=\"calibrated\"} 1";
+    CHECK(text.find(policy) != std::string::npos, "metrics lack the calibrated policy");
+    CHECK(text.find("hugepage_wrapper_calibration_access_ns{page_size=\"2M\"}") != std::string::npos &&
+          text.find("hugepage_wrapper_calibration_access_ns{page_size=\"4K\"}") != std::string::npos,
+          "metrics lack access latencies for 2MB and base pages");
+    CHECK(text.find("page_size=\"1G\"") == std::string::npos, "the empty 1GB pool was measured");
+    CHECK(munmap(mem, MODEL_SIZE) == 0, "munmap failed: %s", strerror(errno));
+    return pool_empty();
+}
+
+static bool scenario_calibration_override() {
+    // Explicit settings win over the measurements and are reported as such;
+    // the O_DIRECT stage reads unaligned tensor edges through a bounce block
+    std::string metrics = load_metrics();
+    std::string path = create_file("model", MODEL_SIZE);
+    void* mem;
+    if (!map_and_verify(path, MODEL_SIZE, &mem)) return false;
+    CHECK(shim_is_huge(mem), "mapping is not in huge pages");
+    std::string text = read_text(metrics);
+    unlink(metrics.c_str());
+    const char* policy = "hugepage_wrapper_policy{engine=\"direct\",page_size=\"2M\",placement=\"hugetlb\","
+                         "engine_source=\"override\",page_size_source=\"override\"} 1";
+    CHECK(text.find(policy) != std::string::npos, "metrics lack the overridden policy");
+    CHECK(text.find("hugepage_wrapper_stage_seconds_total{stage=\"direct\"") != std::string::npos,
+          "metrics lack the direct stage");
+    CHECK(munmap(mem, MODEL_SIZE) == 0, "munmap failed: %s", strerror(errno));
+    return pool_empty();
+}
+
+#define CONCURRENT_THREADS 8
+#define CONCURRENT_ROUNDS 10
+
+struct MapperResult {
+    int index;
+    bool ok;
+    char reason[256];
+};
+
+static void* concurrent_mapper(void* arg) {
+    MapperResult* r = (MapperResult*)arg;
+    std::string path = create_file(("mapper" + std::to_string(r->index)).c_str(), MODEL_SIZE);
+    r->ok = !path.empty();
+    for (int round = 0; r->ok && round < CONCURRENT_ROUNDS; round++) {
+        void* mem = map_file(path, MODEL_SIZE, 0);
+        if (mem == MAP_FAILED) {
+            snprintf(r->reason, sizeof(r->reason), "mmap failed: %s", strerror(errno));
+            r->ok = false;
+        } else if (first_mismatch(path, mem, MODEL_SIZE, 0) != SIZE_MAX) {
+            snprintf(r->reason, sizeof(r->reason), "contents differ from the file");
+            r->ok = false;
+        } else if (munmap(mem, MODEL_SIZE) != 0) {
+            snprintf(r->reason, sizeof(r->reason), "munmap failed: %s", strerror(errno));
+            r->ok = false;
+        }
+    }
+    unlink(path.c_str());
+    return nullptr;
+}
+
+static bool scenario_concurrent() {
+    // The pool fits two models, so mappers race for it and fall back to partial/file
+    pthread_t threads[CONCURRENT_THREADS];
+    MapperResult results[CONCURRENT_THREADS] = {};
+    for (int i = 0; i < CONCURRENT_THREADS; i++) {
+        results[i].index = i;
+        pthread_create(&threads[i], nullptr, concurrent_mapper, &results[i]);
+    }
+    for (int i = 0; i < CONCURRENT_THREADS; i++) {
+        pthread_join(threads[i], nullptr);
+    }
+    for (int i = 0; i < CONCURRENT_THREADS; i++) {
+        CHECK(results[i].ok, "mapper %d: %s", i, results[i].reason);
+    }
+    return pool_empty();
+}
+
+// Replaced by the shim's path and the scratch directory in a scenario's environment
+#define SHIM_PLACEHOLDER "@shim"
+#define DIR_PLACEHOLDER "@dir"
+
+struct Scenario {
+    const char* name;
+    const char* description;
+    const char* env[5];  // Added to BASE_ENV
+    bool (*run)();
+    bool arena = false;  // Needs --arena
+};
+
+static bool scenario_load_progress() {
+    // The page reports the finished load, then the failed one, as the
+    // healthcheck and the router read it
+    const char* progress_file = getenv("HUGEPAGE_WRAPPER_PROGRESS");
+    std::string path = create_file("model", MODEL_SIZE);
+    void* mem;
+    if (!map_and_verify(path, MODEL_SIZE, &mem)) return false;
+    LoadProgress p;
+    CHECK(progress_read(progress_file, &p), "no load progress in %s", progress_file);
+    CHECK(p.state == LOAD_LOADED && p.models == 1, "progress is %s with %u models, expected loaded with 1",
+          load_state_names[p.state], p.models);
+    CHECK(p.pid == (uint32_t)getpid() && path == p.path, "progress names pid %u and %s", p.pid, p.path);
+    CHECK(strcmp(p.stage, "full") == 0, "progress names stage %s, expected the full strategy", p.stage);
+    CHECK(p.total_bytes == MODEL_SIZE && p.loaded_bytes == MODEL_SIZE,
+          "progress counts %llu of %llu bytes, expected %llu", (unsigned long long)p.loaded_bytes,
+          (unsigned long long)p.total_bytes, (unsigned long long)MODEL_SIZE);
+    CHECK(p.updated_ns >= p.started_ns && p.updated_ns <= progress_now_ns(), "progress times are inconsistent");
+    CHECK(munmap(mem, MODEL_SIZE) == 0, "munmap failed: %s", strerror(errno));
+
+    setenv("FAULT_PREAD_EIO", "5242880", 1);
+    CHECK(map_file(path, MODEL_SIZE, 0) == MAP_FAILED, "mmap succeeded although the file could not be read");
+    unsetenv("FAULT_PREAD_EIO");
+    CHECK(progress_read(progress_file, &p), "no load progress after the failed load");
+    CHECK(p.state == LOAD_FAILED && p.models == 1, "progress is %s with %u models after the failed load",
+          load_state_names[p.state], p.models);
+    CHECK(p.loaded_bytes < MODEL_SIZE, "progress counts the whole model although the load failed");
+    unlink(progress_file);
+    return pool_empty();
+}
+
+// Tensor holding file offset `offset` by a scan of the index, -1 if none
+static int scan_tensor(const GGUFModel& m, const std::vector<size_t>& order, uint64_t offset) {
+    for (size_t i = 0; i < order.size(); i++) {
+        const GGUFTensorInfo& t = m.tensors[order[i]];
+        if (offset >= m.data_offset + t.offset && offset < m.data_offset + t.offset + t.size) {
+            return (int)i;
+        }
+    }
+    return -1;
+}
+
+static bool scenario_tensor_lookup() {
+    hpw_tensor_lookup_fn lookup = (hpw_tensor_lookup_fn)dlsym(RTLD_DEFAULT, "hpw_tensor_lookup");
+    hpw_tensor_layer_fn layer = (hpw_tensor_layer_fn)dlsym(RTLD_DEFAULT, "hpw_tensor_layer");
+    CHECK(lookup && layer, "the wrapper exports no hpw_tensor_lookup/hpw_tensor_layer");
+    std::string path = create_file("model", MODEL_SIZE, FILE_GGUF);
+    GGUFModel m;
+    std::string error;
+    int fd = open(path.c_str(), O_RDONLY);
+    CHECK(fd >= 0 && gguf_read(fd, &m, &error), "cannot read the GGUF header: %s", error.c_str());
+    close(fd);
+    std::vector<size_t> order(m.tensors.size());
+    for (size_t i = 0; i < order.size(); i++) order[i] = i;
+    std::sort(order.begin(), order.end(),
+              [&m](size_t a, size_t b) { return m.tensors[a].offset < m.tensors[b].offset; });
+
+    // Every tensor's edges, and a stride across the whole mapping including the header
+    void* mem;
+    if (!map_and_verify(path, MODEL_SIZE, &mem)) return false;
+    std::vector<uint64_t> offsets;
+    for (const GGUFTensorInfo& t : m.tensors) {
+        uint64_t start = m.data_offset + t.offset;
+        for (uint64_t o : {start - 1, start, start + t.size / 2, start + t.size - 1, start + t.size}) {
+            offsets.push_back(o);
+        }
+    }
+    for (uint64_t o = 0; o < MODEL_SIZE; o += 4093) {
+        offsets.push_back(o);
+    }
+    for (uint64_t o : offsets) {
+        const char* addr = (const char*)mem + o;
+        int expected = o < MODEL_SIZE ? scan_tensor(m, order, o) : -1;
+        hpw_tensor t;
+        int found = lookup(addr, &t);
+        CHECK(found == (expected >= 0), "offset %llu: lookup %s a tensor, the index %s",
+              (unsigned long long)o, found ? "found" : "found no", expected >= 0 ? "has one" : "has none");
+        if (expected < 0) {
+            CHECK(layer(addr) == -2, "offset %llu outside every tensor has layer %d", (unsigned long long)o,
+                  layer(addr));
+            continue;
+        }
+        const GGUFTensorInfo& info = m.tensors[order[expected]];
+        int32_t block = expected < TENSOR_COUNT - 1 ? expected : -1;
+        CHECK(t.index == (uint32_t)expected && info.name == t.name && t.layer == block && layer(addr) == block &&
+              t.data == (const char*)mem + m.data_offset + info.offset && t.size == info.size &&
+              t.file_offset == m.data_offset + info.offset && path == t.model,
+              "offset %llu: lookup gave %s (index %u, layer %d), expected %s (index %d, layer %d)",
+              (unsigned long long)o, t.name, t.index, t.layer, info.name.c_str(), expected, block);
+    }
+    hpw_tensor t;
+    CHECK(!lookup((const char*)mem + MODEL_SIZE, &t) && !lookup(&m, &t),
+          "addresses outside the mapping found a tensor");
+    CHECK(munmap(mem, MODEL_SIZE) == 0, "munmap failed: %s", strerror(errno));
+    CHECK(!lookup((const char*)mem + m.data_offset, &t), "the unmapped model still answers lookups");
+
+    // Unmapped models give their slot to the next: a model reloaded more
+    // times than there are slots still answers, next to one kept mapped
+    void* kept = map_file(path, MODEL_SIZE, 0);
+    CHECK(kept != MAP_FAILED, "mmap failed: %s", strerror(errno));
+    uint64_t probe = m.data_offset + m.tensors[order[0]].offset;
+    for (int cycle = 0; cycle < 100; cycle++) {
+        char* reloaded = (char*)map_file(path, MODEL_SIZE, 0);
+        CHECK(reloaded != MAP_FAILED, "reload %d: mmap failed: %s", cycle, strerror(errno));
+        CHECK(lookup(reloaded + probe, &t) && t.index == 0 && t.data == reloaded + probe,
+              "reload %d: the reloaded model answers no lookups", cycle);
+        CHECK(lookup((char*)kept + probe, &t) && t.data == (char*)kept + probe,
+              "reload %d: the model kept mapped answers no lookups", cycle);
+        CHECK(munmap(reloaded, MODEL_SIZE) == 0, "munmap failed: %s", strerror(errno));
+    }
+    CHECK(munmap(kept, MODEL_SIZE) == 0, "munmap failed: %s", strerror(errno));
+
+    // Pages holding more starts than are scanned use the binary search
+    TensorTable table;
+    std::vector<TensorSpan> spans;
+    uint64_t at = 0;
+    for (int i = 0; i < 600; i++) {
+        uint64_t size = i % 40 < 30 ? 4096 + i : 37 * MiB / 10;
+        spans.push_back({at, size, "blk." + std::to_string(i / 40) + ".w" + std::to_string(i)});
+        at += size + (i % 3 == 0 ? 64 : 0);
+    }
+    tensor_table_build(spans, at, &table);
+    for (uint64_t o = 0; o < at; o += 997) {
+        int expected = -1;
+        for (size_t i = 0; i < spans.size(); i++) {
+            if (o >= spans[i].offset && o < spans[i].offset + spans[i].size) expected = (int)i;
+        }
+        int64_t found = tensor_table_find(table, o);
+        CHECK(found == expected, "synthetic table: offset %llu found tensor %lld, expected %d",
+              (unsigned long long)o, (long long)found, expected);
+    }
+    return pool_empty();
+}
+
+// --- Staging arenas (hugepage_arena.so) ------------------------------------
+
+#define ARENA_SIZE (4 * MiB)
+
+typedef int (*arena_owns_fn)(const void*);
+static arena_owns_fn arena_owns = nullptr;
+
+static bool find_arena() {
+    arena_owns = (arena_owns_fn)dlsym(RTLD_DEFAULT, "hugepage_arena_owns");
+    CHECK(arena_owns, "hugepage_arena.so is not preloaded");
+    return true;
+}
+
+// Allocation written through, as request buffers are
+static void* touched(size_t size) {
+    void* p = malloc(size);
+    if (p) memset(p, 0x5a, size);
+    return p;
+}
+
+static void fill(void* p, size_t size, size_t seed) {
+    for (size_t i = 0; i < size; i += 512) {
+        ((uint8_t*)p)[i] = pattern_byte(seed + i);
+    }
+}
+
+static bool filled(const void* p, size_t size, size_t seed) {
+    for (size_t i = 0; i < size; i += 512) {
+        if (((const uint8_t*)p)[i] != pattern_byte(seed + i)) return false;
+    }
+    return true;
+}
+
+// One request's worth of buffers on an HTTP thread: large blocks from the
+// arena, freed in random order, after which the arena starts over
+static bool arena_request(uintptr_t first, uint32_t seed) {
+    void* blocks[48];
+    size_t sizes[48];
+    for (int i = 0; i < 48; i++) {
+        seed = seed * 1103515245 + 12345;
+        sizes[i] = 16 * 1024 + (seed >> 8) % (48 * 1024);
+        if (i % 3 == 2) {
+            // The block just allocated is the top one, so it grows or shrinks in place
+            blocks[i] = realloc(blocks[i - 1], sizes[i]);
+            CHECK(blocks[i] == blocks[i - 1], "realloc of the top block moved it");
+            blocks[i - 1] = nullptr;
+        } else {
+            blocks[i] = malloc(sizes[i]);
+        }
+        CHECK(blocks[i] && arena_owns(blocks[i]), "block %d of %zu bytes is not in the arena", i, sizes[i]);
+        fill(blocks[i], sizes[i], i);
+    }
+    for (int live = 32; live > 0; live--) {
+        seed = seed * 1103515245 + 12345;
+        int i = (seed >> 8) % 48;
+        while (!blocks[i]) i = (i + 1) % 48;
+        CHECK(filled(blocks[i], sizes[i], i), "block %d was overwritten", i);
+        free(blocks[i]);
+        blocks[i] = nullptr;
+    }
+    void* again = touched(64 * 1024);
+    CHECK((uintptr_t)again == first, "the arena did not start over after the request");
+    free(again);
+    return true;
+}
+
+static bool arena_http_thread(void** handoff) {
+    void* p = touched(64 * 1024);
+    uintptr_t first = (uintptr_t)p;
+    CHECK(arena_owns(p), "std::thread allocation is not in an arena");
+    CHECK(shim_is_huge(p), "arena is not in huge pages");
+    void* small = touched(256);
+    CHECK(!arena_owns(small), "small allocation is in the arena");
+    free(small);
+    free(p);
+    for (uint32_t r = 1; r <= 3; r++) {
+        if (!arena_request(first, r)) return false;
+    }
+    void* big = touched(ARENA_SIZE + 1);
+    CHECK(big && !arena_owns(big), "allocation larger than the arena is in it");
+    free(big);
+    // A block the thread hands to another one, which frees it after the thread exited
+    *handoff = touched(32 * 1024);
+    CHECK(arena_owns(*handoff), "handed-off block is not in the arena");
+    return true;
+}
+
+static void* arena_named_thread(void* arg) {
+    // Selected by the name it gives itself, although pthread_create came from this binary
+    bool* owned = (bool*)arg;
+    void* p = touched(64 * 1024);
+    owned[0] = arena_owns(p);
+    free(p);
+    pthread_setname_np(pthread_self(), "http-worker");
+    p = touched(64 * 1024);
+    owned[1] = arena_owns(p);
+    free(p);
+    return nullptr;
+}
+
+static bool scenario_arena_http() {
+    if (!find_arena()) return false;
+    bool ok = false;
+    void* handoff = nullptr;
+    std::thread http([&] { ok = arena_http_thread(&handoff); });
+    http.join();
+    if (!ok) return false;
+
+    void* p = touched(64 * 1024);
+    CHECK(!arena_owns(p), "the main thread allocated from an arena");
+    free(p);
+    bool owned[2] = {true, false};
+    pthread_t named;
+    CHECK(pthread_create(&named, nullptr, arena_named_thread, owned) == 0, "pthread_create failed");
+    pthread_join(named, nullptr);
+    CHECK(!owned[0], "a thread from pthread_create in the binary got an arena before naming itself");
+    CHECK(owned[1], "a thread named http-worker got no arena");
+
+    // The exited thread's arena goes back to the pool with its last block
+    CHECK(shim_pool_used() > 0, "the arena was released while a block was live");
+    free(handoff);
+    return pool_empty();
+}
+
+// Requests whose reply buffer outlives them: each is freed only after the
+// next request has allocated above it, so the arena never empties, plus one
+// block that stays alive from the first request to the last
+static bool arena_pinned_thread(void** kept) {
+    void* reply = nullptr;
+    size_t reply_size = 0;
+    for (uint32_t r = 0; r < 100; r++) {
+        void* blocks[4];
+        for (int i = 0; i < 4; i++) {
+            blocks[i] = touched(32 * 1024);
+            CHECK(arena_owns(blocks[i]), "request %u: block %d fell back to glibc", r, i);
+        }
+        if (r == 0) {
+            *kept = touched(24 * 1024);
+            fill(*kept, 24 * 1024, 7);
+        }
+        if (reply) {
+            CHECK(filled(reply, reply_size, r - 1), "request %u: the previous reply was overwritten", r);
+            free(reply);
+        }
+        reply_size = 16 * 1024 + (r % 8) * 1024;
+        reply = touched(reply_size);
+        CHECK(arena_owns(reply), "request %u: the reply fell back to glibc", r);
+        fill(reply, reply_size, r);
+        for (int i = 3; i >= 0; i--) {
+            free(blocks[i]);
+        }
+    }
+    free(reply);
+    return true;
+}
+
+static bool scenario_arena_pinned() {
+    // 100 requests bump about 15MB past long-lived blocks, four 4MB arenas
+    if (!find_arena()) return false;
+    bool ok = false;
+    void* kept = nullptr;
+    std::thread http([&] { ok = arena_pinned_thread(&kept); });
+    http.join();
+    if (!ok) return false;
+    CHECK(kept && filled(kept, 24 * 1024, 7), "the block kept since the first request was overwritten");
+    // Its arena stays until it is freed; the others went back with their last block
+    CHECK(shim_pool_used() == ARENA_SIZE, "%zu bytes of arenas in the pool, expected one arena", shim_pool_used());
+    free(kept);
+    return pool_empty();
+}
+
+static bool scenario_arena_fallback() {
+    // An empty pool gives a regular arena; with one arena slot a second
+    // HTTP thread stays on glibc
+    if (!find_arena()) return false;
+    volatile int stage = 0;
+    bool first = false, second = true, huge = true;
+    std::thread a([&] {
+        void* p = touched(64 * 1024);
+        first = arena_owns(p);
+        huge = shim_is_huge(p);
+        stage = 1;
+        while (stage != 2) sched_yield();
+        free(p);
+    });
+    while (stage != 1) sched_yield();
+    std::thread b([&] {
+        void* p = touched(64 * 1024);
+        second = arena_owns(p);
+        free(p);
+    });
+    b.join();
+    stage = 2;
+    a.join();
+    CHECK(first && !huge, "the first thread's arena is %s, expected regular memory",
+          first ? "in huge pages" : "missing");
+    CHECK(!second, "a second arena exists although HUGEPAGE_ARENA_MAX=1");
+    return pool_empty();
+}
+
+static const Scenario SCENARIOS[] = {
+    {"full_copy", "whole-file mapping copied into huge pages and released by munmap",
+     {}, scenario_full_copy},
+    {"munmap_length", "munmap with a wrong length releases the whole copy",
+     {}, scenario_munmap_length},
+    {"munmap_interior", "unaligned interior munmap fails without damaging the copy",
+     {}, scenario_munmap_interior},
+    {"passthrough", "offset, partial, small, shared writable and anonymous mappings pass through",
+     {}, scenario_passthrough},
+    {"protections", "mprotect/madvise/mlock on a copied mapping",
+     {}, scenario_protections},
+    {"short_reads", "pread returning 4097 bytes at a time",
+     {"FAULT_PREAD_SHORT=4097"}, scenario_read_faults},
+    {"eintr", "pread interrupted by EINTR on every other call",
+     {"FAULT_PREAD_EINTR=2"}, scenario_read_faults},
+    {"read_error", "EIO during the copy fails the mmap and frees the pool",
+     {"FAULT_PREAD_EIO=5242880"}, scenario_read_error},
+    {"hugetlb_enomem", "MAP_HUGETLB fails despite a free pool: anonymous copy",
+     {"FAULT_HUGETLB_ENOMEM=1"}, scenario_anonymous_fallback},
+    {"no_headroom", "MAP_HUGETLB fails and memory.max is too small: file-backed",
+     {"FAULT_HUGETLB_ENOMEM=1", "FAULT_MEMORY_HEADROOM_BYTES=1048576"}, scenario_file_fallback},
+    {"pool_exhausted", "empty pool: file-backed",
+     {"FAULT_POOL_BYTES=0"}, scenario_file_fallback},
+    {"pool_partial", "pool smaller than the model: huge pages stitched to a file-backed tail",
+     {"FAULT_POOL_BYTES=6291456"}, scenario_partial},
+    {"pool_shared", "second model placed after the first drained the pool",
+     {"FAULT_POOL_BYTES=12582912"}, scenario_pool_shared},
+    {"concurrent", "8 threads mapping and unmapping models against a 20MB pool",
+     {"FAULT_POOL_BYTES=20971520"}, scenario_concurrent},
+    {"formats", "GGUF and PyTorch files intercepted, unknown and inconsistent files not",
+     {}, scenario_formats},
+    {"format_filter", "HUGEPAGE_WRAPPER_FORMATS limits interception to the listed formats",
+     {"HUGEPAGE_WRAPPER_FORMATS=gguf"}, scenario_format_filter},
+    {"parallel_load", "200MB model on 4 loader threads with short reads and EINTR",
+     {"HUGEPAGE_WRAPPER_LOAD_THREADS=4", "FAULT_POOL_BYTES=268435456", "FAULT_PREAD_SHORT=1000003",
+      "FAULT_PREAD_EINTR=7"}, scenario_parallel_load},
+    {"plugin_stages", "plugin placement and transform stages run in pipeline order",
+     {"HUGEPAGE_WRAPPER_PLUGINS=" SHIM_PLACEHOLDER, "HUGEPAGE_WRAPPER_PIPELINE=fault_place,pread,fault_count"},
+     scenario_plugin_stages},
+    {"checksum", "CRC-32C of the loaded file verified; a mismatch fails the mmap",
+     {"HUGEPAGE_WRAPPER_CHUNK_MB=1", "FAULT_PREAD_SHORT=300001"},
+     scenario_checksum},
+    {"physical_order", "fragmented file read in file order; READ_ORDER=physical follows the device",
+     {"FAULT_FIEMAP_EXTENT=1048576"}, scenario_physical_order},
+    {"image_update", "shared image: a changed tensor rewrites one page, replicas attach read-only",
+     {"HUGEPAGE_WRAPPER_IMAGE_DIR=" DIR_PLACEHOLDER}, scenario_image_update},
+    {"calibration", "startup calibration picks pread and 2MB pages and releases its samples",
+     {"HUGEPAGE_WRAPPER_CALIBRATE=on", "HUGEPAGE_WRAPPER_CALIBRATE_MS=500"}, scenario_calibration},
+    {"policy_override", "PAGE_SIZE and a source in PIPELINE override calibration; O_DIRECT load",
+     {"HUGEPAGE_WRAPPER_CALIBRATE=on", "HUGEPAGE_WRAPPER_PAGE_SIZE=2M", "HUGEPAGE_WRAPPER_PIPELINE=direct",
+      "HUGEPAGE_WRAPPER_CHUNK_MB=1"}, scenario_calibration_override},
+    {"load_progress", "progress page reports the loaded and the failed load",
+     {"HUGEPAGE_WRAPPER_PROGRESS=" DIR_PLACEHOLDER "/wrapper_conformance.progress"}, scenario_load_progress},
+    {"tensor_lookup", "addresses of mapped and reloaded models resolve to tensor and layer, none once unmapped",
+     {}, scenario_tensor_lookup},
+    {"arena_http", "HTTP threads bump requests off a huge page arena that resets per request",
+     {"HUGEPAGE_ARENA_THREADS=site:libstdc++,name:http-", "HUGEPAGE_ARENA_MB=4"}, scenario_arena_http, true},
+    {"arena_pinned", "long-lived blocks do not fill the arena; the thread moves to a fresh one",
+     {"HUGEPAGE_ARENA_THREADS=site:libstdc++", "HUGEPAGE_ARENA_MB=4"}, scenario_arena_pinned, true},
+    {"arena_fallback", "empty pool gives a regular arena; threads beyond HUGEPAGE_ARENA_MAX use glibc",
+     {"HUGEPAGE_ARENA_THREADS=site:libstdc++", "HUGEPAGE_ARENA_MB=4", "HUGEPAGE_ARENA_MAX=1", "FAULT_POOL_BYTES=0"},
+     scenario_arena_fallback, true},
+};
+static const size_t SCENARIO_COUNT = sizeof(SCENARIOS) / sizeof(SCENARIOS[0]);
+
+// Child side of a scenario: print the failure reason, exit 0 on success
+static int run_scenario(const char* name) {
+    shim_is_huge = (is_huge_fn)dlsym(RTLD_DEFAULT, "fault_shim_is_huge");
+    shim_pool_used = (pool_used_fn)dlsym(RTLD_DEFAULT, "fault_shim_pool_used");
+    shim_stage_counts = (stage_counts_fn)dlsym(RTLD_DEFAULT, "fault_shim_stage_counts");
+    shim_pread_backwards = (pread_backwards_fn)dlsym(RTLD_DEFAULT, "fault_shim_pread_backwards");
+    if (!shim_is_huge || !shim_pool_used || !shim_stage_counts || !shim_pread_backwards) {
+        printf("wrapper_fault_shim.so is not preloaded\n");
+        return EXIT_ERROR;
+    }
+    for (size_t i = 0; i < SCENARIO_COUNT; i++) {
+        if (strcmp(SCENARIOS[i].name, name) == 0) {
+            alarm(120);
+            bool ok = SCENARIOS[i].run();
+            // Scenario files are named after this process
+            std::string prefix = "wrapper_conformance_" + std::to_string(getpid()) + "_";
+            for (const char* f : {"model", "small", "draft", "model.index", "model.pages"}) {
+                unlink((scratch_dir + "/" + prefix + f).c_str());
+            }
+            if (!ok) {
+                printf("%s\n", failure);
+            }
+            return ok ? EXIT_OK : EXIT_FAILED;
+        }
+    }
+    printf("unknown scenario %s\n", name);
+    return EXIT_ERROR;
+}
+
+// --- Overhead benchmark ----------------------------------------------------
+
+#define BENCH_MAP_SIZE (64 * 1024)
+#define BENCH_REPEATS 9
+
+static double now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// ns per mmap+munmap pair
+static double time_map_pairs(int fd, long iterations) {
+    double start = now_ns();
+    for (long i = 0; i < iterations; i++) {
+        void* mem = fd >= 0 ? mmap(nullptr, BENCH_MAP_SIZE, PROT_READ, MAP_SHARED, fd, 0)
+                            : mmap(nullptr, BENCH_MAP_SIZE, PROT_READ | PROT_WRITE,
+                                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED) {
+            return -1;
+        }
+        munmap(mem, BENCH_MAP_SIZE);
+    }
+    return (now_ns() - start) / iterations;
+}
+
+// ns per malloc+free pair of BENCH_MAP_SIZE on a thread without an arena
+static double time_malloc_pairs(long iterations) {
+    double start = now_ns();
+    for (long i = 0; i < iterations; i++) {
+        void* volatile p = malloc(BENCH_MAP_SIZE);
+        free(p);
+    }
+    return (now_ns() - start) / iterations;
+}
+
+// Child side of the benchmark: one "case ns" line per case on stdout. Each
+// case runs once untimed first, so lazy symbol binding, the wrapper's first
+// calls and the allocator's first chunks stay out of the measurement.
+static int run_bench(long iterations) {
+    std::string path = create_file("bench", BENCH_MAP_SIZE, FILE_RAW);
+    int fd = open(path.c_str(), O_RDONLY);
+    unlink(path.c_str());
+    if (fd < 0) {
+        return EXIT_ERROR;
+    }
+    time_map_pairs(-1, iterations);
+    printf("anonymous %.1f\n", time_map_pairs(-1, iterations));
+    time_map_pairs(fd, iterations);
+    printf("file %.1f\n", time_map_pairs(fd, iterations));
+    time_malloc_pairs(iterations);
+    printf("malloc %.1f\n", time_malloc_pairs(iterations));
+    close(fd);
+    return EXIT_OK;
+}
+
+static double median(std::vector<double> v) {
+    std::sort(v.begin(), v.end());
+    return v[v.size() / 2];
+}
+
+#define LOOKUP_LAYERS 66           // 9 tensors each: ~600, as in a 30B model
+#define LOOKUP_SAMPLES (1 << 20)
+
+// ns per address-to-tensor lookup: the wrapper's table, a binary search over
+// the tensor starts and a linear scan, over the layout of a 15GB model
+static void bench_tensor_lookup() {
+    std::vector<TensorSpan> spans;
+    uint64_t at = 32 * 1024;
+    for (int l = 0; l < LOOKUP_LAYERS; l++) {
+        // Two norms and seven weight matrices per block, 32-byte aligned
+        for (uint64_t size : {16384ULL, 16384ULL, 26 * MiB, 26 * MiB, 26 * MiB, 26 * MiB, 45 * MiB, 45 * MiB,
+                              45 * MiB}) {
+            spans.push_back({at, size - 100, "blk." + std::to_string(l) + ".w"});
+            at += size;
+        }
+    }
+    TensorTable table;
+    tensor_table_build(spans, at, &table);
+    std::vector<uint64_t> addrs(LOOKUP_SAMPLES);
+    uint64_t x = 88172645463325252ULL;
+    for (uint64_t& a : addrs) {
+        x ^= x << 13, x ^= x >> 7, x ^= x << 17;
+        a = x % at;
+    }
+    const std::vector<uint64_t>& starts = table.starts;
+    auto measure = [&addrs](const std::function<int64_t(uint64_t)>& find) {
+        int64_t sum = 0;
+        double start = now_ns();
+        for (uint64_t a : addrs) sum += find(a);
+        double ns = (now_ns() - start) / addrs.size();
+        return sum == 42 ? -ns : ns;  // Keeps the loop
+    };
+    double radix = measure([&table](uint64_t a) { return tensor_table_find(table, a); });
+    double search = measure([&starts, &table](uint64_t a) -> int64_t {
+        size_t i = std::upper_bound(starts.begin(), starts.end(), a) - starts.begin();
+        return i && a < table.ends[i - 1] ? (int64_t)i - 1 : -1;
+    });
+    double scan = measure([&starts, &table](uint64_t a) -> int64_t {
+        for (size_t i = 0; i < starts.size(); i++) {
+            if (a >= starts[i] && a < table.ends[i]) return (int64_t)i;
+        }
+        return -1;
+    });
+    printf("\nAddress-to-tensor lookup (%zu tensors over %.1f GB, %d random addresses):\n", starts.size(),
+           at / (1024.0 * 1024 * 1024), LOOKUP_SAMPLES);
+    printf("  %-14s %8.1f ns (%zu KB)\n", "table", radix,
+           (table.pages.size() * sizeof(uint32_t) + starts.size() * 2 * sizeof(uint64_t)) / 1024);
+    printf("  %-14s %8.1f ns\n", "binary search", search);
+    printf("  %-14s %8.1f ns\n", "linear scan", scan);
+}
+
+// --- Parent side -----------------------------------------------------------
+
+struct ChildResult {
+    int status;
+    std::string output;
+};
+
+// Re-run this binary with `args`, LD_PRELOAD and extra environment; capture stdout
+static bool spawn(const std::vector<std::string>& args, const std::string& preload,
+                  const std::vector<const char*>& env, bool verbose, ChildResult* result) {
+    int pipefd[2];
+    if (pipe(pipefd) != 0) {
+        return false;
+    }
+    pid_t pid = fork();
+    if (pid < 0) {
+        return false;
+    }
+    if (pid == 0) {
+        close(pipefd[0]);
+        dup2(pipefd[1], STDOUT_FILENO);
+        if (!verbose) {
+            int devnull = open("/dev/null", O_WRONLY);
+            dup2(devnull, STDERR_FILENO);
+        }
+        for (const char* e : env) {
+            putenv((char*)e);
+        }
+        if (preload.empty()) {
+            unsetenv("LD_PRELOAD");
+        } else {
+            setenv("LD_PRELOAD", preload.c_str(), 1);
+        }
+        std::vector<char*> argv;
+        argv.push_back((char*)"/proc/self/exe");
+        for (const std::string& a : args) {
+            argv.push_back((char*)a.c_str());
+        }
+        argv.push_back(nullptr);
+        execv("/proc/self/exe", argv.data());
+        _exit(127);
+    }
+    close(pipefd[1]);
+    result->output.clear();
+    char buf[512];
+    ssize_t n;
+    while ((n = read(pipefd[0], buf, sizeof(buf))) > 0) {
+        result->output.append(buf, n);
+    }
+    close(pipefd[0]);
+    waitpid(pid, &result->status, 0);
+    return true;
+}
+
+static bool valid_library(const char* path) {
+    if (access(path, R_OK) != 0) {
+        fprintf(stderr, "wrapper_conformance: Cannot read %s: %s\n", path, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+static void usage(const char* prog) {
+    printf("Usage: %s --wrapper PATH --shim PATH [--arena PATH] [options]\n\n", prog);
+    printf("Run the hugepage_mmap_wrapper conformance scenarios in fresh processes.\n\n");
+    printf("Options:\n");
+    printf("  --wrapper PATH      hugepage_mmap_wrapper.so to check\n");
+    printf("  --shim PATH         wrapper_fault_shim.so (fake pool and fault injection)\n");
+    printf("  --arena PATH        hugepage_arena.so, preloaded in every scenario and checked by the arena ones\n");
+    printf("  --dir DIR           Directory for scenario files, preferably tmpfs (default: /dev/shm)\n");
+    printf("  --scenario NAME     Run only this scenario (repeatable)\n");
+    printf("  --list              List scenarios\n");
+    printf("  --bench             Also measure mmap/munmap overhead of non-intercepted calls and tensor lookups\n");
+    printf("  --iterations N      mmap/munmap pairs per benchmark run (default: 100000)\n");
+    printf("  --verbose           Show the wrapper's log output\n");
+    printf("  --help              Show this help\n\n");
+    printf("Exit codes: 0 all scenarios pass, 1 error, 2 scenario failures\n");
+}
+
+int main(int argc, char** argv) {
+    enum {
+        OPT_WRAPPER = 1, OPT_SHIM, OPT_ARENA, OPT_DIR, OPT_SCENARIO, OPT_LIST, OPT_BENCH, OPT_ITERATIONS,
+        OPT_VERBOSE, OPT_HELP, OPT_RUN_SCENARIO, OPT_RUN_BENCH,
+    };
+    static const struct option long_options[] = {
+        {"wrapper", required_argument, nullptr, OPT_WRAPPER},
+        {"shim", required_argument, nullptr, OPT_SHIM},
+        {"arena", required_argument, nullptr, OPT_ARENA},
+        {"dir", required_argument, nullptr, OPT_DIR},
+        {"scenario", required_argument, nullptr, OPT_SCENARIO},
+        {"list", no_argument, nullptr, OPT_LIST},
+        {"bench", no_argument, nullptr, OPT_BENCH},
+        {"iterations", required_argument, nullptr, OPT_ITERATIONS},
+        {"verbose", no_argument, nullptr, OPT_VERBOSE},
+        {"help", no_argument, nullptr, OPT_HELP},
+        // Internal: child processes
+        {"run-scenario", required_argument, nullptr, OPT_RUN_SCENARIO},
+        {"run-bench", no_argument, nullptr, OPT_RUN_BENCH},
+        {nullptr, 0, nullptr, 0},
+    };
+
+    std::string wrapper, shim, arena, child_scenario;
+    std::vector<std::string> selected;
+    bool list = false, bench = false, verbose = false, child_bench = false;
+    long iterations = 100000;
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", long_options, nullptr)) != -1) {
+        switch (opt) {
+            case OPT_WRAPPER: wrapper = optarg; break;
+            case OPT_SHIM: shim = optarg; break;
+            case OPT_ARENA: arena = optarg; break;
+            case OPT_DIR: scratch_dir = optarg; break;
+            case OPT_SCENARIO: selected.push_back(optarg); break;
+            case OPT_LIST: list = true; break;
+            case OPT_BENCH: bench = true; break;
+            case OPT_ITERATIONS: iterations = std::max(1L, atol(optarg)); break;
+            case OPT_VERBOSE: verbose = true; break;
+            case OPT_HELP: usage(argv[0]); return EXIT_OK;
+            case OPT_RUN_SCENARIO: child_scenario = optarg; break;
+            case OPT_RUN_BENCH: child_bench = true; break;
+            default: usage(argv[0]); return EXIT_ERROR;
+        }
+    }
+
+    if (!child_scenario.empty()) {
+        return run_scenario(child_scenario.c_str());
+    }
+    if (child_bench) {
+        return run_bench(iterations);
+    }
+    if (list) {
+        for (const Scenario& s : SCENARIOS) {
+            printf("%-16s %s\n", s.name, s.description);
+        }
+        return EXIT_OK;
+    }
+
+    if (wrapper.empty() || shim.empty()) {
+        fprintf(stderr, "wrapper_conformance: --wrapper and --shim are required\n");
+        return EXIT_ERROR;
+    }
+    if (!valid_library(wrapper.c_str()) || !valid_library(shim.c_str()) ||
+        (!arena.empty() && !valid_library(arena.c_str()))) {
+        return EXIT_ERROR;
+    }
+    // LD_PRELOAD resolves relative paths against the child's cwd; make them absolute
+    char resolved[PATH_MAX];
+    if (realpath(wrapper.c_str(), resolved)) wrapper = resolved;
+    if (realpath(shim.c_str(), resolved)) shim = resolved;
+    if (!arena.empty() && realpath(arena.c_str(), resolved)) arena = resolved;
+    for (const std::string& name : selected) {
+        bool known = false;
+        for (const Scenario& s : SCENARIOS) {
+            known = known || name == s.name;
+        }
+        if (!known) {
+            fprintf(stderr, "wrapper_conformance: Unknown scenario: %s (see --list)\n", name.c_str());
+            return EXIT_ERROR;
+        }
+    }
+
+    // The wrapper and the arena library must resolve mmap to the shim, so it
+    // goes last, and the arena library sits behind the wrapper as in the container
+    std::string libraries = arena.empty() ? wrapper : wrapper + " " + arena;
+    std::string preload = libraries + " " + shim;
+    printf("Conformance: %s\n", libraries.c_str());
+    int passed = 0, run = 0;
+    for (const Scenario& s : SCENARIOS) {
+        if (!selected.empty() && std::find(selected.begin(), selected.end(), s.name) == selected.end()) {
+            continue;
+        }
+        if (s.arena && arena.empty()) {
+            continue;
+        }
+        std::vector<const char*> env(BASE_ENV, BASE_ENV + sizeof(BASE_ENV) / sizeof(BASE_ENV[0]) - 1);
+        std::vector<std::string> substituted;
+        for (const char* e : s.env) {
+            if (e) substituted.push_back(e);
+        }
+        for (std::string& e : substituted) {
+            size_t at = e.find(SHIM_PLACEHOLDER);
+            if (at != std::string::npos) {
+                e.replace(at, strlen(SHIM_PLACEHOLDER), shim);
+            }
+            at = e.find(DIR_PLACEHOLDER);
+            if (at != std::string::npos) {
+                e.replace(at, strlen(DIR_PLACEHOLDER), scratch_dir);
+            }
+            env.push_back(e.c_str());
+        }
+        ChildResult child;
+        std::string reason;
+        if (!spawn({"--run-scenario", s.name, "--dir", scratch_dir}, preload, env, verbose, &child)) {
+            reason = std::string("cannot start scenario: ") + strerror(errno);
+        } else if (WIFSIGNALED(child.status)) {
+            reason = std::string("killed by ") + strsignal(WTERMSIG(child.status));
+        } else if (WEXITSTATUS(child.status) != EXIT_OK) {
+            reason = child.output.substr(0, child.output.find('\n'));
+        }
+        run++;
+        if (reason.empty()) {
+            passed++;
+            printf("  PASS  %-16s %s\n", s.name, s.description);
+        } else {
+            printf("  FAIL  %-16s %s\n        %s\n", s.name, s.description, reason.c_str());
+        }
+    }
+    printf("%d/%d scenarios passed\n", passed, run);
+
+    if (bench) {
+        printf("\nOverhead of non-intercepted calls (64KB mmap+munmap and malloc+free, median of %d alternating runs x %ld):\n",
+               BENCH_REPEATS, iterations);
+        std::vector<std::string> args = {"--run-bench", "--dir", scratch_dir,
+                                         "--iterations", std::to_string(iterations)};
+        // Runs without and with the wrapper alternate, so frequency scaling and
+        // other load drifting over the benchmark hit both sides alike; the
+        // overhead is the median of the per-round differences
+        std::vector<std::string> names;
+        std::vector<std::vector<double>> runs[2];   // [with wrapper][case][round]
+        for (int r = 0; r < BENCH_REPEATS; r++) {
+            for (int side = 0; side < 2; side++) {
+                int wrapped = (r + side) % 2;
+                ChildResult child;
+                if (!spawn(args, wrapped ? libraries : "", {}, verbose, &child) || child.status != 0) {
+                    fprintf(stderr, "wrapper_conformance: Benchmark failed\n");
+                    return EXIT_ERROR;
+                }
+                char name[32];
+                double ns;
+                int consumed;
+                const char* p = child.output.c_str();
+                for (size_t c = 0; sscanf(p, "%31s %lf\n%n", name, &ns, &consumed) == 2; c++, p += consumed) {
+                    if (c == names.size()) names.push_back(name);
+                    if (c == runs[wrapped].size()) runs[wrapped].emplace_back();
+                    runs[wrapped][c].push_back(ns);
+                }
+            }
+        }
+        for (size_t c = 0; c < names.size() && c < runs[0].size() && c < runs[1].size(); c++) {
+            std::vector<double> diffs;
+            for (size_t r = 0; r < runs[0][c].size() && r < runs[1][c].size(); r++) {
+                diffs.push_back(runs[1][c][r] - runs[0][c][r]);
+            }
+            double base_ns = median(runs[0][c]), wrapped_ns = median(runs[1][c]), diff = median(diffs);
+            // Half the interquartile range of the differences: an overhead within it is noise
+            std::sort(diffs.begin(), diffs.end());
+            double noise = (diffs[diffs.size() * 3 / 4] - diffs[diffs.size() / 4]) / 2;
+            printf("  %-10s %8.1f ns with wrapper, %8.1f ns without (%+.1f ns +-%.1f, %+.1f%%)\n",
+                   names[c].c_str(), wrapped_ns, base_ns, diff, noise, diff / base_ns * 100);
+        }
+        bench_tensor_lookup();
+    }
+    return passed == run ? EXIT_OK : EXIT_FAILED;
+}
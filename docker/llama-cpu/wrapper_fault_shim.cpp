@@ -0,0 +1,372 @@
+/*
+ * wrapper_fault_shim.cpp
+ *
+ * Fault injection library for the hugepage_mmap_wrapper conformance suite.
+ * Preloaded after the wrapper (LD_PRELOAD="wrapper.so shim.so"), so the
+ * wrapper's dlsym(RTLD_NEXT, "mmap") and its pread/fopen calls land here.
+ *
+ * Controlled through the environment:
+ * - FAULT_POOL_BYTES:           emulate a huge page pool of this size. MAP_HUGETLB
+ *                               requests are served from regular memory while the
+ *                               pool lasts and fail with ENOMEM after that, and the
+ *                               pool's sysfs counters report the fake pool of 2MB
+ *                               pages (other page sizes have empty pools). Like the
+ *                               kernel, munmap of a pool mapping must be aligned to
+ *                               the huge page size
+ * - FAULT_HUGETLB_ENOMEM=1:     MAP_HUGETLB always fails, whatever sysfs reports
+ * - FAULT_MEMORY_HEADROOM_BYTES: cgroup memory.max seen by the wrapper (usage 0)
+ * - FAULT_PREAD_SHORT=n:        pread returns at most n bytes per call
+ * - FAULT_PREAD_EINTR=k:        every k-th pread fails with EINTR
+ * - FAULT_PREAD_EIO=offset:     pread fails with EIO at or beyond this file offset
+ * - FAULT_FIEMAP_EXTENT=n:      FS_IOC_FIEMAP reports the file as n-byte extents
+ *                               laid out on the device in reverse file order
+ *
+ * The conformance driver queries the fake pool through fault_shim_is_huge()
+ * and fault_shim_pool_used(), and the order of reads through
+ * fault_shim_pread_backwards().
+ *
+ * The shim is also a load stage plugin (HUGEPAGE_WRAPPER_PLUGINS): it
+ * registers "fault_place", a placement stage that counts its calls and checks
+ * the destination is still untouched, and "fault_count", a transform that
+ * counts chunks and bytes. fault_shim_stage_counts() reports them.
+ */
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <linux/fiemap.h>
+#include <linux/fs.h>
+
+#include "hugepage_load_stage.h"
+
+typedef void* (*mmap_fn)(void*, size_t, int, int, int, off_t);
+typedef int (*munmap_fn)(void*, size_t);
+typedef ssize_t (*pread_fn)(int, void*, size_t, off_t);
+typedef FILE* (*fopen_fn)(const char*, const char*);
+typedef int (*ioctl_fn)(int, unsigned long, ...);
+
+static mmap_fn real_mmap = nullptr;
+static munmap_fn real_munmap = nullptr;
+static pread_fn real_pread = nullptr;
+static fopen_fn real_fopen = nullptr;
+static ioctl_fn real_ioctl = nullptr;
+
+static const size_t HUGEPAGE_SIZE = 2ULL * 1024 * 1024;
+static const size_t MAX_REGIONS = 256;
+
+// Regular memory standing in for huge pages taken from the fake pool
+struct FakeRegion {
+    char* addr;
+    size_t size;
+};
+static FakeRegion regions[MAX_REGIONS];
+static size_t pool_used = 0;
+static unsigned long pread_calls = 0;
+static long long last_pread_offset = 0;
+static unsigned long pread_backwards = 0; // preads at a lower offset than the one before
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void init_functions() {
+    if (!real_mmap) real_mmap = (mmap_fn)dlsym(RTLD_NEXT, "mmap");
+    if (!real_munmap) real_munmap = (munmap_fn)dlsym(RTLD_NEXT, "munmap");
+    if (!real_pread) real_pread = (pread_fn)dlsym(RTLD_NEXT, "pread");
+    if (!real_fopen) real_fopen = (fopen_fn)dlsym(RTLD_NEXT, "fopen");
+    if (!real_ioctl) real_ioctl = (ioctl_fn)dlsym(RTLD_NEXT, "ioctl");
+}
+
+// Numeric environment setting; `fallback` when unset
+static long long env_value(const char* name, long long fallback) {
+    const char* value = getenv(name);
+    return value && *value ? strtoll(value, nullptr, 10) : fallback;
+}
+
+static bool pool_emulated() {
+    return getenv("FAULT_POOL_BYTES") != nullptr;
+}
+
+static size_t pool_free() {
+    size_t total = (size_t)env_value("FAULT_POOL_BYTES", 0);
+    return total > pool_used ? total - pool_used : 0;
+}
+
+extern "C" int fault_shim_is_huge(const void* addr) {
+    pthread_mutex_lock(&lock);
+    int found = 0;
+    for (size_t i = 0; i < MAX_REGIONS && !found; i++) {
+        found = regions[i].addr && (const char*)addr >= regions[i].addr &&
+                (const char*)addr < regions[i].addr + regions[i].size;
+    }
+    pthread_mutex_unlock(&lock);
+    return found;
+}
+
+extern "C" size_t fault_shim_pool_used() {
+    pthread_mutex_lock(&lock);
+    size_t used = pool_used;
+    pthread_mutex_unlock(&lock);
+    return used;
+}
+
+extern "C" void* mmap(void* addr, size_t length, int prot, int flags, int fd, off_t offset) {
+    init_functions();
+    if (!(flags & MAP_HUGETLB) || (!pool_emulated() && !getenv("FAULT_HUGETLB_ENOMEM"))) {
+        return real_mmap(addr, length, prot, flags, fd, offset);
+    }
+    if (env_value("FAULT_HUGETLB_ENOMEM", 0)) {
+        errno = ENOMEM;
+        return MAP_FAILED;
+    }
+    // MAP_HUGE_* selects a page size; only the 2MB pool has pages
+    int size_shift = (flags >> MAP_HUGE_SHIFT) & MAP_HUGE_MASK;
+    if (size_shift != 0 && size_shift != 21) {
+        errno = ENOMEM;
+        return MAP_FAILED;
+    }
+
+    size_t size = (length + HUGEPAGE_SIZE - 1) / HUGEPAGE_SIZE * HUGEPAGE_SIZE;
+    if ((flags & MAP_FIXED) && ((uintptr_t)addr % HUGEPAGE_SIZE) != 0) {
+        errno = EINVAL;
+        return MAP_FAILED;
+    }
+    pthread_mutex_lock(&lock);
+    if (size > pool_free()) {
+        pthread_mutex_unlock(&lock);
+        errno = ENOMEM;
+        return MAP_FAILED;
+    }
+    size_t slot = 0;
+    while (slot < MAX_REGIONS && regions[slot].addr) {
+        slot++;
+    }
+    if (slot == MAX_REGIONS) {
+        pthread_mutex_unlock(&lock);
+        errno = ENOMEM;
+        return MAP_FAILED;
+    }
+    void* mem = real_mmap(addr, size, prot, flags & ~(MAP_HUGETLB | (MAP_HUGE_MASK << MAP_HUGE_SHIFT)), fd, offset);
+    if (mem != MAP_FAILED) {
+        regions[slot].addr = (char*)mem;
+        regions[slot].size = size;
+        pool_used += size;
+    }
+    pthread_mutex_unlock(&lock);
+    return mem;
+}
+
+extern "C" int munmap(void* addr, size_t length) {
+    init_functions();
+    char* start = (char*)addr;
+    char* end = start + (length + 4095) / 4096 * 4096;
+
+    pthread_mutex_lock(&lock);
+    // hugetlb mappings can only be split at huge page boundaries
+    for (size_t i = 0; i < MAX_REGIONS; i++) {
+        FakeRegion* r = &regions[i];
+        if (!r->addr || end <= r->addr || start >= r->addr + r->size) {
+            continue;
+        }
+        bool start_ok = start <= r->addr || (size_t)(start - r->addr) % HUGEPAGE_SIZE == 0;
+        bool end_ok = end >= r->addr + r->size || (size_t)(end - r->addr) % HUGEPAGE_SIZE == 0;
+        if (!start_ok || !end_ok) {
+            pthread_mutex_unlock(&lock);
+            errno = EINVAL;
+            return -1;
+        }
+    }
+    int result = real_munmap(addr, length);
+    if (result == 0) {
+        for (size_t i = 0; i < MAX_REGIONS; i++) {
+            FakeRegion* r = &regions[i];
+            if (!r->addr || end <= r->addr || start >= r->addr + r->size) {
+                continue;
+            }
+            // Release the covered part; a region split in the middle keeps its accounting
+            char* lo = start > r->addr ? start : r->addr;
+            char* hi = end < r->addr + r->size ? end : r->addr + r->size;
+            pool_used -= hi - lo;
+            if (lo == r->addr && hi == r->addr + r->size) {
+                r->addr = nullptr;
+                r->size = 0;
+            } else if (lo == r->addr) {
+                r->size -= hi - lo;
+                r->addr = hi;
+            } else {
+                r->size = lo - r->addr;
+            }
+        }
+    }
+    pthread_mutex_unlock(&lock);
+    return result;
+}
+
+extern "C" ssize_t pread(int fd, void* buf, size_t count, off_t offset) {
+    init_functions();
+    long long eio_at = env_value("FAULT_PREAD_EIO", -1);
+    if (eio_at >= 0 && offset + (long long)count > eio_at) {
+        errno = EIO;
+        return -1;
+    }
+    long long eintr_every = env_value("FAULT_PREAD_EINTR", 0);
+    if (eintr_every > 0 && __atomic_add_fetch(&pread_calls, 1, __ATOMIC_RELAXED) % eintr_every == 0) {
+        errno = EINTR;
+        return -1;
+    }
+    long long max_bytes = env_value("FAULT_PREAD_SHORT", 0);
+    if (max_bytes > 0 && count > (size_t)max_bytes) {
+        count = (size_t)max_bytes;
+    }
+    pthread_mutex_lock(&lock);
+    if (offset < last_pread_offset) {
+        pread_backwards++;
+    }
+    last_pread_offset = offset;
+    pthread_mutex_unlock(&lock);
+    return real_pread(fd, buf, count, offset);
+}
+
+extern "C" unsigned long fault_shim_pread_backwards() {
+    pthread_mutex_lock(&lock);
+    unsigned long result = pread_backwards;
+    pthread_mutex_unlock(&lock);
+    return result;
+}
+
+extern "C" ssize_t pread64(int fd, void* buf, size_t count, off_t offset) {
+    return pread(fd, buf, count, offset);
+}
+
+// FS_IOC_FIEMAP with FAULT_FIEMAP_EXTENT set: the file's extents of that size,
+// the last one first on the device and with gaps between them
+extern "C" int ioctl(int fd, unsigned long request, ...) {
+    init_functions();
+    va_list ap;
+    va_start(ap, request);
+    void* arg = va_arg(ap, void*);
+    va_end(ap);
+    long long extent = env_value("FAULT_FIEMAP_EXTENT", 0);
+    struct stat st;
+    if (request != FS_IOC_FIEMAP || extent <= 0 || fstat(fd, &st) != 0) {
+        return real_ioctl(fd, request, arg);
+    }
+    struct fiemap* fm = (struct fiemap*)arg;
+    uint64_t size = st.st_size;
+    uint64_t count = (size + extent - 1) / extent;
+    fm->fm_mapped_extents = 0;
+    for (uint64_t i = fm->fm_start / extent; i < count && fm->fm_mapped_extents < fm->fm_extent_count; i++) {
+        uint64_t logical = i * extent;
+        if (logical >= fm->fm_start + fm->fm_length) break;
+        struct fiemap_extent* e = &fm->fm_extents[fm->fm_mapped_extents++];
+        memset(e, 0, sizeof(*e));
+        e->fe_logical = logical;
+        e->fe_physical = (count - i) * 2 * extent;
+        e->fe_length = size - logical < (uint64_t)extent ? size - logical : extent;
+        e->fe_flags = i + 1 == count ? FIEMAP_EXTENT_LAST : 0;
+    }
+    return 0;
+}
+
+// Serve a fake sysfs/cgroup file from memory
+static FILE* fake_file(unsigned long long value, bool unlimited) {
+    static __thread char buf[32];
+    if (unlimited) {
+        snprintf(buf, sizeof(buf), "max\n");
+    } else {
+        snprintf(buf, sizeof(buf), "%llu\n", value);
+    }
+    return fmemopen(buf, strlen(buf), "r");
+}
+
+static bool ends_with(const char* s, const char* suffix) {
+    size_t n = strlen(s), m = strlen(suffix);
+    return n >= m && strcmp(s + n - m, suffix) == 0;
+}
+
+extern "C" FILE* fopen(const char* path, const char* mode) {
+    init_functions();
+    if (pool_emulated() && strcmp(path, "/proc/meminfo") == 0) {
+        // The wrapper only reads Hugepagesize; pin it to the fake pool's page size
+        static const char meminfo[] = "Hugepagesize:       2048 kB\n";
+        return fmemopen((void*)meminfo, sizeof(meminfo) - 1, "r");
+    }
+    if (pool_emulated() && strncmp(path, "/sys/kernel/mm/hugepages/", 25) == 0) {
+        if (ends_with(path, "/free_hugepages")) {
+            // Pools of other page sizes are empty
+            if (!strstr(path, "/hugepages-2048kB/")) {
+                return fake_file(0, false);
+            }
+            pthread_mutex_lock(&lock);
+            size_t free_pages = pool_free() / HUGEPAGE_SIZE;
+            pthread_mutex_unlock(&lock);
+            return fake_file(free_pages, false);
+        }
+        if (ends_with(path, "/resv_hugepages")) {
+            return fake_file(0, false);
+        }
+    }
+    if (strncmp(path, "/sys/fs/cgroup/", 15) == 0) {
+        bool memory_max = ends_with(path, "/memory.max") || ends_with(path, "/memory.limit_in_bytes");
+        bool memory_usage = ends_with(path, "/memory.current") || ends_with(path, "/memory.usage_in_bytes");
+        if (getenv("FAULT_MEMORY_HEADROOM_BYTES") && (memory_max || memory_usage)) {
+            return fake_file(memory_max ? (unsigned long long)env_value("FAULT_MEMORY_HEADROOM_BYTES", 0) : 0,
+                             false);
+        }
+        // The fake pool is the only huge page limit
+        if (pool_emulated() && strstr(path, "/hugetlb.")) {
+            return fake_file(0, ends_with(path, ".max") || ends_with(path, ".limit_in_bytes"));
+        }
+    }
+    return real_fopen(path, mode);
+}
+
+// --- Load stage plugin ---------------------------------------------------------
+
+static unsigned long place_calls = 0;
+static unsigned long place_touched = 0; // Destinations that already held data
+static unsigned long chunks_seen = 0;
+static unsigned long long bytes_seen = 0;
+
+extern "C" void fault_shim_stage_counts(unsigned long* places, unsigned long* touched, unsigned long* chunks,
+                                        unsigned long long* bytes) {
+    *places = __atomic_load_n(&place_calls, __ATOMIC_RELAXED);
+    *touched = __atomic_load_n(&place_touched, __ATOMIC_RELAXED);
+    *chunks = __atomic_load_n(&chunks_seen, __ATOMIC_RELAXED);
+    *bytes = __atomic_load_n(&bytes_seen, __ATOMIC_RELAXED);
+}
+
+static int fault_place(void*, void* addr, size_t length) {
+    // Fresh anonymous and huge page memory reads as zero until the source fills it
+    const char* p = (const char*)addr;
+    if (p[0] != 0 || p[length - 1] != 0) {
+        __atomic_add_fetch(&place_touched, 1, __ATOMIC_RELAXED);
+    }
+    __atomic_add_fetch(&place_calls, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+static int fault_count(void*, hpw_chunk* chunk) {
+    __atomic_add_fetch(&chunks_seen, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&bytes_seen, chunk->length, __ATOMIC_RELAXED);
+    return 0;
+}
+
+static const hpw_stage place_stage = {
+    HPW_STAGE_ABI_VERSION, HPW_STAGE_PLACEMENT, "fault_place", nullptr, nullptr, fault_place, nullptr,
+};
+
+static const hpw_stage count_stage = {
+    HPW_STAGE_ABI_VERSION, HPW_STAGE_TRANSFORM, "fault_count", nullptr, fault_count, nullptr, nullptr,
+};
+
+extern "C" int hpw_register_stages(hpw_register_fn register_stage) {
+    int rc = register_stage(&place_stage);
+    return rc ? rc : register_stage(&count_stage);
+}
@@ -0,0 +1,459 @@
+#!/usr/bin/env python3
+"""
+Accuracy guardrail for performance-motivated llama-server configurations.
+Runs a fixed evaluation set through the server under a baseline and a
+candidate configuration (load-time quantization, repacking, kernels, KV cache
+types, wrapper settings), compares the candidate's next-token distributions
+with the baseline's at the same contexts (KL divergence, top-1 agreement),
+scores task exact-match, and reports pass/fail next to the speed delta.
+"""
+
+import argparse
+import json
+import math
+import re
+import statistics
+import sys
+from datetime import datetime
+from typing import Any, Dict, List, Optional
+
+import requests
+
+from server_launcher import (
+    LaunchError,
+    ServerConfig,
+    add_launcher_arguments,
+    create_launcher,
+    wait_ready,
+)
+
+# Status indicators
+STATUS_OK = "OK"
+STATUS_WARN = "WARN"
+STATUS_ERROR = "ERROR"
+
+# Exit codes
+EXIT_SUCCESS = 0
+EXIT_FAILURE = 1
+EXIT_INVALID_USAGE = 2
+EXIT_REGRESSION = 3
+
+# Probability floor for tokens outside a returned top-K list
+MIN_PROB = 1e-10
+
+# Fixed evaluation set: short tasks with a single checkable answer
+EVAL_TASKS = [
+    {"id": "arith_add", "prompt": "What is 47 + 38? Answer with only the number.", "expected": "85"},
+    {"id": "arith_mul", "prompt": "What is 23 * 17? Answer with only the number.", "expected": "391"},
+    {"id": "arith_word", "prompt": "A box holds 12 eggs. How many eggs are in 9 boxes? Answer with only the number.",
+     "expected": "108"},
+    {"id": "capital", "prompt": "What is the capital of Australia? Answer with one word.", "expected": "Canberra"},
+    {"id": "element", "prompt": "What is the chemical symbol for gold? Answer with only the symbol.", "expected": "Au"},
+    {"id": "sequence", "prompt": "Continue the sequence with the next number only: 2, 6, 18, 54,",
+     "expected": "162"},
+    {"id": "reverse", "prompt": "Write the word 'stream' backwards. Answer with only the result.",
+     "expected": "maerts"},
+    {"id": "code_output", "prompt": "What does this Python print? Answer with only the output.\n\n"
+     "print(sum(range(5)))", "expected": "10"},
+    {"id": "code_len", "prompt": "What does this Python print? Answer with only the output.\n\n"
+     "print(len('hugepage'.split('e')))", "expected": "3"},
+    {"id": "json_field", "prompt": "Given {\"name\": \"llama\", \"ctx\": 32768}, what is the value of ctx? "
+     "Answer with only the value.", "expected": "32768"},
+    {"id": "unit", "prompt": "How many bytes are in 2 KiB? Answer with only the number.", "expected": "2048"},
+    {"id": "logic", "prompt": "If all blorps are fleems and no fleems are glips, can a blorp be a glip? "
+     "Answer yes or no.", "expected": "no"},
+    {"id": "long_list", "prompt": "List the first 12 prime numbers separated by commas.",
+     "expected": "2, 3, 5, 7, 11, 13, 17, 19, 23, 29, 31, 37", "match": "contains", "max_tokens": 96},
+    {"id": "long_explain", "prompt": "Explain in three sentences why huge pages reduce TLB misses.",
+     "expected": "", "match": "none", "max_tokens": 128},
+]
+
+
+def normalize(text: str) -> str:
+    text = re.sub(r"\s+", " ", text.strip().lower())
+    return text.rstrip(".")
+
+
+def task_correct(task: Dict[str, Any], text: str) -> Optional[bool]:
+    """Exact-match a task answer; None for tasks only used for divergence."""
+    mode = task.get("match", "exact")
+    if mode == "none":
+        return None
+    expected, answer = normalize(task["expected"]), normalize(text)
+    if mode == "contains":
+        return expected in answer
+    return answer == expected
+
+
+def load_eval_set(path: Optional[str]) -> List[Dict[str, Any]]:
+    """Load tasks as JSONL: prompt (chat-templated unless raw is true) or messages,
+    expected, and optional match (exact, contains, none) and max_tokens.
+    """
+    if path is None:
+        return EVAL_TASKS
+    tasks = []
+    with open(path) as f:
+        for i, line in enumerate(f):
+            if line.strip():
+                task = json.loads(line)
+                task.setdefault("id", f"task_{i}")
+                task.setdefault("expected", "")
+                tasks.append(task)
+    return tasks
+
+
+def top_logprobs(entry: Dict[str, Any]) -> Dict[int, float]:
+    """Top-K token id -> logprob for one generated position.
+
+    Raises:
+        ValueError: If the server predates token ids in completion_probabilities
+    """
+    if "top_logprobs" not in entry:
+        raise ValueError("llama-server did not return top_logprobs; a newer build is required")
+    return {c["id"]: c["logprob"] for c in entry["top_logprobs"]}
+
+
+def kl_divergence(base: Dict[int, float], cand: Dict[int, float]) -> float:
+    """KL(base || cand) over the baseline's top-K tokens plus one bucket for the rest.
+
+    Tokens missing from the candidate's top-K get at most its smallest
+    listed probability, so this slightly overestimates small divergences.
+    """
+    cand_probs = {t: math.exp(lp) for t, lp in cand.items()}
+    floor = min(cand_probs.values()) if cand_probs else MIN_PROB
+    cand_rest = max(MIN_PROB, 1.0 - sum(cand_probs.values()))
+
+    kl, base_mass, cand_mass = 0.0, 0.0, 0.0
+    for token, logprob in base.items():
+        p = math.exp(logprob)
+        q = cand_probs.get(token, min(floor, cand_rest))
+        q = max(q, MIN_PROB)
+        kl += p * (logprob - math.log(q))
+        base_mass += p
+        cand_mass += q
+    p_rest = max(MIN_PROB, 1.0 - base_mass)
+    q_rest = max(MIN_PROB, 1.0 - cand_mass)
+    kl += p_rest * (math.log(p_rest) - math.log(q_rest))
+    return max(0.0, kl)
+
+
+class ServerClient:
+    """Greedy completions with token ids and top-K logprobs from llama-server."""
+
+    def __init__(self, base_url: str, n_probs: int, timeout: int):
+        self.base_url = base_url
+        self.n_probs = n_probs
+        self.timeout = timeout
+
+    def _post(self, path: str, body: Dict[str, Any]) -> Dict[str, Any]:
+        response = requests.post(f"{self.base_url}{path}", json=body, timeout=self.timeout)
+        if response.status_code != 200:
+            raise ValueError(f"{path}: HTTP {response.status_code}")
+        return response.json()
+
+    def prompt_tokens(self, task: Dict[str, Any]) -> List[int]:
+        """Tokenize a task's prompt, applying the model's chat template to messages."""
+        messages = task.get("messages")
+        if messages is None and not task.get("raw"):
+            messages = [{"role": "user", "content": task["prompt"]}]
+        prompt = task["prompt"] if messages is None else self._post("/apply-template", {"messages": messages})["prompt"]
+        return self._post("/tokenize", {"content": prompt, "add_special": True})["tokens"]
+
+    def complete(self, tokens: List[int], n_predict: int) -> Dict[str, Any]:
+        """Greedy-generate up to n_predict tokens after `tokens`."""
+        data = self._post("/completion", {
+            "prompt": tokens, "n_predict": n_predict, "temperature": 0.0,
+            "n_probs": self.n_probs, "cache_prompt": True, "stream": False,
+        })
+        positions = data.get("completion_probabilities", [])
+        return {
+            "text": data.get("content", ""),
+            "tokens": [p["id"] for p in positions],
+            "logprobs": [top_logprobs(p) for p in positions],
+            "timings": data.get("timings", {}),
+        }
+
+
+def run_baseline(client: ServerClient, tasks: List[Dict[str, Any]], default_max_tokens: int) -> List[Dict[str, Any]]:
+    """Greedy outputs of the baseline: the reference tokens and distributions."""
+    results = []
+    for task in tasks:
+        tokens = client.prompt_tokens(task)
+        result = client.complete(tokens, task.get("max_tokens", default_max_tokens))
+        results.append(dict(result, prompt_tokens=tokens))
+    return results
+
+
+def score_candidate(client: ServerClient, base: Dict[str, Any], max_resyncs: int) -> Dict[str, Any]:
+    """Compare the candidate with the baseline along the baseline's tokens.
+
+    The candidate first generates freely (exact-match and speed). Where it
+    diverges, it is re-prompted with the baseline's tokens up to that point,
+    so every compared distribution is conditioned on the same context.
+    """
+    reference, prompt = base["tokens"], base["prompt_tokens"]
+    free = None
+    kls: List[float] = []
+    compared, agree = 0, 0
+    pos, resyncs = 0, 0
+    while pos < len(reference) and resyncs <= max_resyncs:
+        result = client.complete(prompt + reference[:pos], len(reference) - pos)
+        if free is None:
+            free = result
+        for offset, logprobs in enumerate(result["logprobs"]):
+            position = pos + offset
+            kls.append(kl_divergence(base["logprobs"][position], logprobs))
+            compared += 1
+            if result["tokens"][offset] != reference[position]:
+                diverged = position
+                break
+            agree += 1
+        else:
+            end = pos + len(result["tokens"])
+            if end >= len(reference):
+                break
+            # The candidate ended its generation where the baseline continued
+            compared += 1
+            diverged = end
+        # Context differs from here on; resync with the baseline token
+        pos = diverged + 1
+        resyncs += 1
+
+    return {"text": free["text"] if free else "", "timings": free["timings"] if free else {},
+            "kl": kls, "top1_agree": agree, "compared": compared, "resyncs": resyncs}
+
+
+def decode_rate(timings: List[Dict[str, Any]], n_key: str, ms_key: str) -> Optional[float]:
+    tokens = sum(t.get(n_key, 0) for t in timings)
+    ms = sum(t.get(ms_key, 0.0) for t in timings)
+    return round(tokens / ms * 1000, 2) if ms else None
+
+
+def percentile(values: List[float], pct: float) -> Optional[float]:
+    if not values:
+        return None
+    ordered = sorted(values)
+    return ordered[min(len(ordered) - 1, int(len(ordered) * pct / 100))]
+
+
+def evaluate(tasks: List[Dict[str, Any]], baseline: List[Dict[str, Any]],
+             candidate: List[Dict[str, Any]], args: argparse.Namespace) -> Dict[str, Any]:
+    """Aggregate divergence, exact-match and speed into a pass/fail verdict."""
+    kls = [kl for c in candidate for kl in c["kl"]]
+    compared = sum(c["compared"] for c in candidate)
+    agree = sum(c["top1_agree"] for c in candidate)
+    graded = [(task_correct(t, b["text"]), task_correct(t, c["text"]))
+              for t, b, c in zip(tasks, baseline, candidate) if task_correct(t, "") is not None]
+    base_em = sum(b for b, _ in graded) / len(graded) if graded else None
+    cand_em = sum(c for _, c in graded) / len(graded) if graded else None
+
+    base_timings = [b["timings"] for b in baseline]
+    cand_timings = [c["timings"] for c in candidate]
+    speed = {}
+    for name, n_key, ms_key in (("decode", "predicted_n", "predicted_ms"), ("prefill", "prompt_n", "prompt_ms")):
+        base_tps = decode_rate(base_timings, n_key, ms_key)
+        cand_tps = decode_rate(cand_timings, n_key, ms_key)
+        speed[name] = {"baseline_tps": base_tps, "candidate_tps": cand_tps,
+                       "delta": round(cand_tps / base_tps - 1, 4) if base_tps and cand_tps else None}
+
+    summary = {
+        "positions_compared": compared,
+        "mean_kl": round(statistics.mean(kls), 6) if kls else None,
+        "p99_kl": round(percentile(kls, 99), 6) if kls else None,
+        "max_kl": round(max(kls), 6) if kls else None,
+        "top1_agreement": round(agree / compared, 4) if compared else None,
+        "baseline_exact_match": round(base_em, 4) if base_em is not None else None,
+        "candidate_exact_match": round(cand_em, 4) if cand_em is not None else None,
+        "identical_outputs": sum(b["text"] == c["text"] for b, c in zip(baseline, candidate)),
+        "speed": speed,
+    }
+
+    failures = []
+    if not compared:
+        failures.append("no positions compared")
+    else:
+        if summary["mean_kl"] > args.max_mean_kl:
+            failures.append(f"mean KL {summary['mean_kl']:.5f} > {args.max_mean_kl}")
+        if summary["p99_kl"] > args.max_p99_kl:
+            failures.append(f"p99 KL {summary['p99_kl']:.5f} > {args.max_p99_kl}")
+        if summary["top1_agreement"] < args.min_top1:
+            failures.append(f"top-1 agreement {summary['top1_agreement']:.2%} < {args.min_top1:.0%}")
+    if base_em is not None and cand_em < base_em - args.max_em_drop:
+        failures.append(f"exact match {cand_em:.0%} vs baseline {base_em:.0%}")
+    summary["passed"] = not failures
+    summary["failures"] = failures
+    return summary
+
+
+def parse_env(values: Optional[List[str]]) -> Dict[str, str]:
+    env = {}
+    for value in values or []:
+        key, sep, val = value.partition("=")
+        if not sep or not key:
+            raise ValueError(f"expected KEY=VALUE, got {value!r}")
+        env[key] = val
+    return env
+
+
+def create_parser() -> argparse.ArgumentParser:
+    """Create command line argument parser."""
+    parser = argparse.ArgumentParser(
+        description="Accuracy guardrail for llama-server configuration changes",
+        formatter_class=argparse.RawDescriptionHelpFormatter,
+        epilog="""
+Examples:
+  python accuracy_eval.py --candidate-args "--cache-type-k q8_0 --cache-type-v q8_0"
+  python accuracy_eval.py --candidate-model /app/models/gguf/model-Q4_K_M.gguf --max-mean-kl 0.05
+  python accuracy_eval.py --candidate-env HUGEPAGE_WRAPPER_STRATEGY=file --eval-set tasks.jsonl
+  python accuracy_eval.py --baseline-url http://localhost:8001 --candidate-url http://localhost:8002
+        """
+    )
+
+    for role in ("baseline", "candidate"):
+        group = parser.add_argument_group(role)
+        group.add_argument(f"--{role}-args", default="",
+                           help=f"Extra llama-server flags for the {role}")
+        group.add_argument(f"--{role}-env", action="append", metavar="KEY=VALUE",
+                           help=f"Environment for the {role} (wrapper/entrypoint settings), repeatable")
+        group.add_argument(f"--{role}-model", help=f"Model file for the {role} (default: --model)")
+        group.add_argument(f"--{role}-url", help=f"Use an already running {role} server instead")
+
+    parser.add_argument("--eval-set", help="Tasks as JSONL (default: built-in set)")
+    parser.add_argument("--max-tokens", type=int, default=32,
+                        help="Tokens generated per task unless it sets max_tokens (default: 32)")
+    parser.add_argument("--n-probs", type=int, default=20,
+                        help="Top-K logprobs compared per position (default: 20)")
+    parser.add_argument("--max-resyncs", type=int, default=16,
+                        help="Re-prompts after divergence per task (default: 16)")
+
+    gate = parser.add_argument_group("guardrail")
+    gate.add_argument("--max-mean-kl", type=float, default=0.01,
+                      help="Max mean KL divergence in nats (default: 0.01)")
+    gate.add_argument("--max-p99-kl", type=float, default=0.2,
+                      help="Max 99th percentile KL divergence (default: 0.2)")
+    gate.add_argument("--min-top1", type=float, default=0.95,
+                      help="Min top-1 agreement with the baseline (default: 0.95)")
+    gate.add_argument("--max-em-drop", type=float, default=0.0,
+                      help="Max exact-match drop versus the baseline (default: 0.0)")
+
+    add_launcher_arguments(parser, port=8102)
+    parser.add_argument("--output", help="Output JSON filename (default: auto-generated)")
+    return parser
+
+
+def run_config(launcher: Any, args: argparse.Namespace, role: str, work) -> List[Dict[str, Any]]:
+    """Run `work(client)` against the role's server, starting and stopping it unless a URL is given."""
+    url = getattr(args, f"{role}_url")
+    if url:
+        return work(ServerClient(url.rstrip("/"), args.n_probs, args.timeout))
+
+    config = ServerConfig(role, getattr(args, f"{role}_args").split(),
+                          parse_env(getattr(args, f"{role}_env")), getattr(args, f"{role}_model"))
+    base_url = f"http://127.0.0.1:{args.port}"
+    launcher.start(config)
+    try:
+        wait_ready(base_url, launcher, args.load_timeout)
+        return work(ServerClient(base_url, args.n_probs, args.timeout))
+    finally:
+        launcher.stop()
+
+
+def print_report(tasks: List[Dict[str, Any]], baseline: List[Dict[str, Any]],
+                 candidate: List[Dict[str, Any]], summary: Dict[str, Any]) -> None:
+    print()
+    print("Per-task divergence:")
+    print(f"{'Task':<16} {'Compared':>9} {'Top-1':>7} {'Mean KL':>9} {'Base':>5} {'Cand':>5}")
+    for task, b, c in zip(tasks, baseline, candidate):
+        def mark(correct: Optional[bool]) -> str:
+            return "-" if correct is None else "yes" if correct else "no"
+
+        mean_kl = statistics.mean(c["kl"]) if c["kl"] else 0.0
+        top1 = c["top1_agree"] / c["compared"] if c["compared"] else 0.0
+        print(f"{task['id']:<16} {c['compared']:>9} {top1:>7.1%} {mean_kl:>9.5f} "
+              f"{mark(task_correct(task, b['text'])):>5} {mark(task_correct(task, c['text'])):>5}")
+
+    print()
+    print(f"Mean KL: {summary['mean_kl']}, p99 KL: {summary['p99_kl']}, "
+          f"top-1 agreement: {summary['top1_agreement']}")
+    if summary["baseline_exact_match"] is not None:
+        print(f"Exact match: baseline {summary['baseline_exact_match']:.0%}, "
+              f"candidate {summary['candidate_exact_match']:.0%}")
+    for name, speed in summary["speed"].items():
+        if speed["delta"] is not None:
+            print(f"{name.capitalize()} speed: {speed['baseline_tps']} -> {speed['candidate_tps']} tok/s "
+                  f"({speed['delta']:+.1%})")
+    decode_delta = summary["speed"]["decode"]["delta"]
+    delta = f", decode {decode_delta:+.1%}" if decode_delta is not None else ""
+    if summary["passed"]:
+        print(f"Accuracy guardrail: {STATUS_OK} (PASS{delta})")
+    else:
+        print(f"Accuracy guardrail: {STATUS_ERROR} (FAIL{delta}: {'; '.join(summary['failures'])})")
+
+
+def main() -> int:
+    """Main function to run the guardrail.
+
+    Returns:
+        Exit code: 0 if the candidate passes, 3 if it fails the guardrail,
+        1 for errors, 2 for invalid usage.
+    """
+    parser = create_parser()
+    args = parser.parse_args()
+
+    try:
+        tasks = load_eval_set(args.eval_set)
+        parse_env(args.baseline_env)
+        parse_env(args.candidate_env)
+        launcher = None if args.baseline_url and args.candidate_url else create_launcher(args)
+    except (OSError, ValueError, LaunchError) as e:
+        print(f"Configuration: {STATUS_ERROR} ({e})", file=sys.stderr)
+        return EXIT_INVALID_USAGE
+
+    print("Accuracy guardrail")
+    print(f"  Evaluation set: {len(tasks)} tasks ({args.eval_set or 'built-in'})")
+    print(f"  Baseline: {args.baseline_url or args.baseline_args or 'default'}"
+          f"{' model ' + args.baseline_model if args.baseline_model else ''}")
+    print(f"  Candidate: {args.candidate_url or args.candidate_args or 'default'}"
+          f"{' model ' + args.candidate_model if args.candidate_model else ''}"
+          f"{' env ' + ' '.join(args.candidate_env) if args.candidate_env else ''}")
+
+    try:
+        baseline = run_config(launcher, args, "baseline",
+                              lambda client: run_baseline(client, tasks, args.max_tokens))
+        print(f"Baseline run: {STATUS_OK} ({sum(len(b['tokens']) for b in baseline)} reference tokens)")
+        candidate = run_config(launcher, args, "candidate",
+                               lambda client: [score_candidate(client, b, args.max_resyncs) for b in baseline])
+        print(f"Candidate run: {STATUS_OK}")
+    except (LaunchError, requests.RequestException, ValueError, KeyError) as e:
+        print(f"Evaluation: {STATUS_ERROR} ({e})", file=sys.stderr)
+        return EXIT_FAILURE
+    except KeyboardInterrupt:
+        if launcher is not None:
+            launcher.stop()
+        return EXIT_FAILURE
+
+    summary = evaluate(tasks, baseline, candidate, args)
+    print_report(tasks, baseline, candidate, summary)
+
+    filename = args.output or f"accuracy_eval_{datetime.now().strftime('%Y%m%d_%H%M%S')}.json"
+    try:
+        with open(filename, "w") as f:
+            json.dump({"timestamp": datetime.now().isoformat(),
+                       "baseline": {"args": args.baseline_args, "env": args.baseline_env,
+                                    "model": args.baseline_model, "url": args.baseline_url},
+                       "candidate": {"args": args.candidate_args, "env": args.candidate_env,
+                                     "model": args.candidate_model, "url": args.candidate_url},
+                       "summary": summary,
+                       "tasks": [{"id": t["id"], "baseline": b["text"], "candidate": c["text"],
+                                  "compared": c["compared"], "top1_agree": c["top1_agree"],
+                                  "resyncs": c["resyncs"]}
+                                 for t, b, c in zip(tasks, baseline, candidate)]}, f, indent=2)
+        print(f"Results: {STATUS_OK} (saved to {filename})")
+    except OSError as e:
+        print(f"Results: {STATUS_ERROR} (cannot save {filename}: {e})", file=sys.stderr)
+        return EXIT_FAILURE
+    return EXIT_SUCCESS if summary["passed"] else EXIT_REGRESSION
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -16,6 +16,8 @@ from typing import Dict, List, Any, Optional
 
 import requests
 
+from results_store import StoreError, record_benchmark
+
 # Status indicators
 STATUS_OK = "OK"
 STATUS_WARN = "WARN"
@@ -200,6 +202,7 @@ class LlamaBenchmark:
             - label: Optional benchmark label
             - api_url: API endpoint URL
             - model: Model identifier
+            - llama_build: llama.cpp build reported by the server
             - gpu_config: GPU configuration parameters
             - hugepages_total: Total huge pages configured
             - hugepages_free: Available huge pages
@@ -223,6 +226,14 @@ class LlamaBenchmark:
         except (requests.RequestException, requests.Timeout, KeyError):
             info["model"] = "unknown"
 
+        # llama-server reports its build (e.g. "b6500-1a2b3c4d") in /props
+        try:
+            response = requests.get(f"{self.base_url}/props", timeout=5)
+            if response.status_code == 200 and response.json().get("build_info"):
+                info["llama_build"] = response.json()["build_info"]
+        except (requests.RequestException, ValueError, AttributeError):
+            pass
+
         # Get GPU configuration
         gpu_config = self.get_gpu_config()
         if gpu_config:
@@ -558,6 +569,7 @@ Examples:
   python benchmark.py --label baseline
   python benchmark.py --label optimized --runs 10 --output baseline_results.json
   python benchmark.py --prompts memory_sequential,compute_arithmetic --port 8004
+  python benchmark.py --label nightly --store benchmarks/history.store
         """
     )
 
@@ -603,6 +615,11 @@ Examples:
         help="Benchmark label (e.g., baseline, optimized)"
     )
 
+    parser.add_argument(
+        "--store",
+        help="Also append the results to this history store (see results_store.py)"
+    )
+
     return parser
 
 def main() -> int:
@@ -642,6 +659,12 @@ def main() -> int:
 
         # Save results
         benchmark.save_results(results, args.output)
+        if args.store:
+            try:
+                samples = record_benchmark(args.store, results)
+                print(f"History store: {STATUS_OK} ({samples} samples appended to {args.store})")
+            except (OSError, StoreError) as e:
+                print(f"History store: {STATUS_WARN} ({e})", file=sys.stderr)
 
         return EXIT_SUCCESS
 
@@ -0,0 +1,745 @@
+#!/usr/bin/env python3
+"""
+Benchmark history store with trend and change-point detection.
+
+All benchmark, evaluation and soak results go into one append-only file,
+keyed by git revision, llama.cpp build, image digest, model and an
+environment snapshot, so a run is compared against its whole history rather
+than against the previous run only. Change points in each metric's time
+series show where performance stepped, and which of the keys changed there
+(e.g. a llama.cpp upgrade); drift against the best segment catches slow
+regressions made of steps too small to notice one at a time.
+
+Store format (little-endian), readable with mmap and no parsing of old data:
+  file     = "LLBHIST1" segment*
+  segment  = header body
+  header   = magic "SEG1", u32 rows, u32 crc32(body), u32 dir_len, u64 body_len
+  body     = directory (JSON, dir_len bytes) pad8 column* (each pad8)
+Each append writes one segment. The directory holds the segment's string
+dictionary and column offsets; string columns are u32 indices into the
+dictionary, `ts` is i64 Unix seconds and `value` is f64. A torn segment at
+the end (crash during append) is ignored by readers and cut off by the next
+writer.
+"""
+
+import argparse
+import fcntl
+import fnmatch
+import hashlib
+import json
+import math
+import mmap
+import os
+import platform
+import statistics
+import struct
+import subprocess
+import sys
+import zlib
+from array import array
+from datetime import datetime
+from pathlib import Path
+from typing import Any, Dict, Iterator, List, Optional, Tuple
+
+# Status indicators
+STATUS_OK = "OK"
+STATUS_WARN = "WARN"
+STATUS_ERROR = "ERROR"
+
+# Exit codes
+EXIT_SUCCESS = 0
+EXIT_FAILURE = 1
+EXIT_INVALID_USAGE = 2
+EXIT_REGRESSION = 3
+
+DEFAULT_STORE = "benchmarks/history.store"
+
+FILE_MAGIC = b"LLBHIST1"
+SEGMENT_MAGIC = b"SEG1"
+SEGMENT_HEADER = struct.Struct("<4sIIIQ")
+ALIGN = 8
+
+# Dictionary-encoded key columns, in the order rows are compared
+KEY_COLUMNS = ["run", "source", "label", "git_rev", "llama_commit", "image_digest", "model", "env", "series"]
+
+# Keys reported when they differ across a change point
+ATTRIBUTION_KEYS = ["llama_commit", "image_digest", "git_rev", "env", "model"]
+
+# Series whose values should go down; everything else (tok/s, speedup) should go up
+LOWER_IS_BETTER = ("latency", "ttft", "_ms", "seconds", "kl", "memory", "bytes")
+
+# Environment variables that change inference behaviour, recorded in the snapshot
+ENV_PREFIXES = ("LLAMA_", "GGML_", "OMP_", "HUGEPAGE_WRAPPER_", "CPU_", "THREADS")
+
+
+class StoreError(Exception):
+    """Raised when the store cannot be read or written."""
+    pass
+
+
+def _pad(n: int) -> int:
+    return (ALIGN - n % ALIGN) % ALIGN
+
+
+def _column_bytes(values: array) -> bytes:
+    if sys.byteorder != "little":
+        values = array(values.typecode, values)
+        values.byteswap()
+    return values.tobytes()
+
+
+def _encode_segment(rows: List[Dict[str, Any]]) -> bytes:
+    """Encode rows (dicts of KEY_COLUMNS strings plus ts and value) as one segment."""
+    strings: List[str] = []
+    index: Dict[str, int] = {}
+    columns: Dict[str, array] = {"ts": array("q"), "value": array("d")}
+    for name in KEY_COLUMNS:
+        columns[name] = array("I")
+    for row in rows:
+        columns["ts"].append(int(row["ts"]))
+        columns["value"].append(float(row["value"]))
+        for name in KEY_COLUMNS:
+            s = str(row.get(name) or "")
+            if s not in index:
+                index[s] = len(strings)
+                strings.append(s)
+            columns[name].append(index[s])
+
+    blobs = [(name, values.typecode, _column_bytes(values)) for name, values in columns.items()]
+    # Column offsets follow the directory, whose length depends on the offsets; iterate until stable
+    directory = {"strings": strings, "columns": []}
+    dir_bytes = b""
+    while True:
+        offset = len(dir_bytes) + _pad(len(dir_bytes))
+        directory["columns"] = []
+        for name, typecode, blob in blobs:
+            directory["columns"].append({"name": name, "type": typecode, "offset": offset})
+            offset += len(blob) + _pad(len(blob))
+        encoded = json.dumps(directory, separators=(",", ":")).encode()
+        settled = len(encoded) == len(dir_bytes)
+        dir_bytes = encoded
+        if settled:
+            break
+
+    body = bytearray(dir_bytes)
+    body += b"\0" * _pad(len(body))
+    for _, _, blob in blobs:
+        body += blob
+        body += b"\0" * _pad(len(blob))
+    header = SEGMENT_HEADER.pack(SEGMENT_MAGIC, len(rows), zlib.crc32(body), len(dir_bytes), len(body))
+    return header + bytes(body)
+
+
+def _valid_end(buf, size: int, verify_all: bool) -> Tuple[int, List[Tuple[int, int, int, int]]]:
+    """Walk segments; return the end of the last complete one and (offset, rows, dir_len, body_len) each."""
+    segments = []
+    pos = len(FILE_MAGIC)
+    while pos + SEGMENT_HEADER.size <= size:
+        magic, rows, crc, dir_len, body_len = SEGMENT_HEADER.unpack_from(buf, pos)
+        body_start = pos + SEGMENT_HEADER.size
+        if magic != SEGMENT_MAGIC or body_start + body_len > size:
+            break
+        # Checking the CRC of every segment costs a pass over the file; the last one is
+        # the only one a crash can have torn
+        last = body_start + body_len + SEGMENT_HEADER.size > size
+        if (verify_all or last) and zlib.crc32(buf[body_start:body_start + body_len]) != crc:
+            break
+        segments.append((body_start, rows, dir_len, body_len))
+        pos = body_start + body_len
+    return pos, segments
+
+
+def append_rows(path: str, rows: List[Dict[str, Any]]) -> None:
+    """Append rows as one segment. Safe against concurrent writers and torn previous appends."""
+    if not rows:
+        return
+    segment = _encode_segment(rows)
+    Path(path).parent.mkdir(parents=True, exist_ok=True)
+    fd = os.open(path, os.O_RDWR | os.O_CREAT, 0o644)
+    try:
+        fcntl.flock(fd, fcntl.LOCK_EX)
+        size = os.fstat(fd).st_size
+        if size == 0:
+            os.write(fd, FILE_MAGIC)
+            size = len(FILE_MAGIC)
+        else:
+            with mmap.mmap(fd, size, prot=mmap.PROT_READ) as buf:
+                if buf[:len(FILE_MAGIC)] != FILE_MAGIC:
+                    raise StoreError(f"{path} is not a benchmark history store")
+                end, _ = _valid_end(buf, size, verify_all=False)
+            if end < size:
+                print(f"History store: {STATUS_WARN} (dropping {size - end} bytes of an interrupted append)")
+                os.ftruncate(fd, end)
+                size = end
+        os.lseek(fd, size, os.SEEK_SET)
+        written = 0
+        while written < len(segment):
+            written += os.write(fd, segment[written:])
+        os.fsync(fd)
+    finally:
+        os.close(fd)
+
+
+class Segment:
+    """Zero-copy column views of one segment."""
+
+    def __init__(self, buf: memoryview, body_start: int, rows: int, dir_len: int):
+        directory = json.loads(bytes(buf[body_start:body_start + dir_len]))
+        self.rows = rows
+        self.strings: List[str] = directory["strings"]
+        self.columns: Dict[str, memoryview] = {}
+        sizes = {"q": 8, "d": 8, "I": 4}
+        for col in directory["columns"]:
+            start = body_start + col["offset"]
+            self.columns[col["name"]] = buf[start:start + rows * sizes[col["type"]]].cast(col["type"])
+
+    def key(self, name: str, i: int) -> str:
+        return self.strings[self.columns[name][i]]
+
+    def release(self) -> None:
+        for view in self.columns.values():
+            view.release()
+
+
+class HistoryStore:
+    """Read-only view of a store file, mapped into memory."""
+
+    def __init__(self, path: str, verify: bool = False):
+        self.path = path
+        self.segments: List[Segment] = []
+        self._file = open(path, "rb")
+        size = os.fstat(self._file.fileno()).st_size
+        if size < len(FILE_MAGIC):
+            raise StoreError(f"{path} is empty")
+        self._map = mmap.mmap(self._file.fileno(), size, prot=mmap.PROT_READ)
+        self._view = memoryview(self._map)
+        if self._view[:len(FILE_MAGIC)] != FILE_MAGIC:
+            self.close()
+            raise StoreError(f"{path} is not a benchmark history store")
+        end, segments = _valid_end(self._view, size, verify_all=verify)
+        self.torn_bytes = size - end
+        for body_start, rows, dir_len, _ in segments:
+            self.segments.append(Segment(self._view, body_start, rows, dir_len))
+        self.size = size
+
+    def close(self) -> None:
+        for seg in self.segments:
+            seg.release()
+        self.segments = []
+        self._view.release()
+        self._map.close()
+        self._file.close()
+
+    def __enter__(self) -> "HistoryStore":
+        return self
+
+    def __exit__(self, *exc) -> None:
+        self.close()
+
+    def rows(self, filters: Dict[str, str]) -> Iterator[Dict[str, Any]]:
+        """Rows whose key columns match the given glob patterns.
+
+        Patterns are matched against each segment's dictionary first, so
+        segments without a matching string are skipped without touching
+        their columns.
+        """
+        for seg in self.segments:
+            allowed: Dict[str, set] = {}
+            for name, pattern in filters.items():
+                allowed[name] = {i for i, s in enumerate(seg.strings) if fnmatch.fnmatchcase(s, pattern)}
+            if any(not ids for ids in allowed.values()):
+                continue
+            for i in range(seg.rows):
+                if all(seg.columns[name][i] in ids for name, ids in allowed.items()):
+                    row = {name: seg.key(name, i) for name in KEY_COLUMNS}
+                    row["ts"] = seg.columns["ts"][i]
+                    row["value"] = seg.columns["value"][i]
+                    yield row
+
+
+# --- Run metadata -------------------------------------------------------------
+
+def _command(args: List[str], cwd: Optional[Path] = None) -> Optional[str]:
+    try:
+        result = subprocess.run(args, capture_output=True, text=True, timeout=10, cwd=cwd)
+    except (OSError, subprocess.TimeoutExpired):
+        return None
+    return result.stdout.strip() if result.returncode == 0 else None
+
+
+def git_revision() -> str:
+    repo = Path(__file__).resolve().parent
+    rev = _command(["git", "rev-parse", "--short=12", "HEAD"], repo)
+    if not rev:
+        return "unknown"
+    dirty = _command(["git", "status", "--porcelain", "--untracked-files=no"], repo)
+    return rev + "-dirty" if dirty else rev
+
+
+def image_digest(container: Optional[str]) -> str:
+    if not container:
+        return "unknown"
+    return _command(["docker", "inspect", "--format", "{{.Image}}", container]) or "unknown"
+
+
+def _read_first(path: str) -> Optional[str]:
+    try:
+        with open(path) as f:
+            return f.readline().strip()
+    except OSError:
+        return None
+
+
+def environment_snapshot() -> Dict[str, Any]:
+    """Host settings that move inference performance, as a canonical JSON-able dict."""
+    snapshot: Dict[str, Any] = {"kernel": platform.release(), "cpus": os.cpu_count()}
+    try:
+        with open("/proc/cpuinfo") as f:
+            for line in f:
+                if line.startswith("model name"):
+                    snapshot["cpu"] = line.split(":", 1)[1].strip()
+                    break
+    except OSError:
+        pass
+    governor = _read_first("/sys/devices/system/cpu/cpu0/cpufreq/scaling_governor")
+    if governor:
+        snapshot["governor"] = governor
+    thp = _read_first("/sys/kernel/mm/transparent_hugepage/enabled")
+    if thp and "[" in thp:
+        snapshot["thp"] = thp.split("[", 1)[1].split("]", 1)[0]
+    try:
+        with open("/proc/meminfo") as f:
+            for line in f:
+                if line.startswith(("MemTotal:", "HugePages_Total:", "Hugepagesize:")):
+                    name, value = line.split(":", 1)
+                    snapshot[name.lower()] = value.strip()
+    except OSError:
+        pass
+    snapshot["vars"] = {k: v for k, v in sorted(os.environ.items()) if k.startswith(ENV_PREFIXES)}
+    return snapshot
+
+
+def env_id(env_json: str) -> str:
+    """Short stable id of an environment snapshot, for display."""
+    return hashlib.sha1(env_json.encode()).hexdigest()[:8] if env_json else "-"
+
+
+def _timestamp(value: Optional[str]) -> int:
+    try:
+        return int(datetime.fromisoformat(value).timestamp()) if value else int(datetime.now().timestamp())
+    except ValueError:
+        return int(datetime.now().timestamp())
+
+
+# --- Result file importers ------------------------------------------------------
+
+def samples_from_benchmark(data: Dict[str, Any]) -> List[Tuple[str, float]]:
+    """Per-request samples of a scripts/benchmark.py result file."""
+    samples = []
+    for prompt, entry in data.get("prompts", {}).items():
+        for r in entry.get("results", []):
+            if r.get("success"):
+                samples.append((f"tok_s/{prompt}", r["tokens_per_second"]))
+                samples.append((f"latency_s/{prompt}", r["total_time"]))
+    if data.get("summary", {}).get("overall_avg_tokens_per_second") is not None:
+        samples.append(("tok_s/overall", data["summary"]["overall_avg_tokens_per_second"]))
+    return samples
+
+
+def samples_from_speculative(data: Dict[str, Any]) -> List[Tuple[str, float]]:
+    """Per-candidate summaries of a scripts/speculative_eval.py result file."""
+    samples = []
+    for c in data.get("candidates", []):
+        for metric in ("decode_tps", "median_request_tps", "speedup", "acceptance_rate", "output_match"):
+            if isinstance(c.get(metric), (int, float)):
+                samples.append((f"spec/{c['label']}/{metric}", c[metric]))
+    return samples
+
+
+def samples_from_accuracy(data: Dict[str, Any]) -> List[Tuple[str, float]]:
+    """Numeric summary fields of a scripts/accuracy_eval.py result file."""
+    return [(f"accuracy/{k}", v) for k, v in data.get("summary", {}).items()
+            if isinstance(v, (int, float)) and not isinstance(v, bool)]
+
+
+def detect_source(data: Dict[str, Any]) -> str:
+    if "prompts" in data and "system_info" in data:
+        return "benchmark"
+    if "candidates" in data and "recommendation" in data:
+        return "speculative"
+    if "tasks" in data and "summary" in data:
+        return "accuracy"
+    raise StoreError("unrecognised result file (expected benchmark.py, speculative_eval.py or accuracy_eval.py output)")
+
+
+IMPORTERS = {
+    "benchmark": samples_from_benchmark,
+    "speculative": samples_from_speculative,
+    "accuracy": samples_from_accuracy,
+}
+
+
+def rows_for_run(samples: List[Tuple[str, float]], keys: Dict[str, str], ts: int) -> List[Dict[str, Any]]:
+    run = keys.get("run") or f"{keys['source']}-{ts}-{os.getpid()}"
+    return [dict(keys, run=run, ts=ts, series=series, value=value) for series, value in samples]
+
+
+def run_keys(args: argparse.Namespace, source: str, info: Dict[str, Any]) -> Dict[str, str]:
+    """Keys of one run; explicit options win over what the result file recorded."""
+    return {
+        "source": source,
+        "label": args.label or info.get("label") or "",
+        "git_rev": args.git_rev or git_revision(),
+        "llama_commit": args.llama_commit or info.get("llama_build") or "unknown",
+        "image_digest": args.image_digest or image_digest(args.container),
+        "model": args.model or Path(info.get("model") or "unknown").name,
+        "env": json.dumps(environment_snapshot(), sort_keys=True, separators=(",", ":")),
+    }
+
+
+def record_benchmark(store: str, results: Dict[str, Any], container: Optional[str] = "llama-cpu") -> int:
+    """Append a benchmark.py result; returns the number of rows written."""
+    info = results.get("system_info", {})
+    args = argparse.Namespace(label=None, git_rev=None, llama_commit=None, image_digest=None,
+                              container=container, model=None)
+    rows = rows_for_run(samples_from_benchmark(results), run_keys(args, "benchmark", info),
+                        _timestamp(info.get("timestamp")))
+    append_rows(store, rows)
+    return len(rows)
+
+
+# --- Change points ----------------------------------------------------------------
+
+def lower_is_better(series: str) -> bool:
+    name = series.lower()
+    return any(token in name for token in LOWER_IS_BETTER)
+
+
+def noise_sigma(values: List[float]) -> float:
+    """Noise estimate from successive differences, insensitive to steps and trends."""
+    diffs = [abs(b - a) for a, b in zip(values, values[1:])]
+    sigma = statistics.median(diffs) / 0.9539 if diffs else 0.0
+    scale = abs(statistics.mean(values)) if values else 1.0
+    return max(sigma, 1e-6 * scale, 1e-12)
+
+
+def change_points(values: List[float], min_size: int, penalty: float) -> List[int]:
+    """Indices where the mean shifts, by binary segmentation on the squared-error cost.
+
+    A split is kept when it reduces the cost of its segment by more than
+    penalty * sigma^2 * ln(n), a BIC-style bound that grows slowly with history length.
+    """
+    n = len(values)
+    prefix = [0.0]
+    prefix_sq = [0.0]
+    for v in values:
+        prefix.append(prefix[-1] + v)
+        prefix_sq.append(prefix_sq[-1] + v * v)
+
+    def cost(i: int, j: int) -> float:
+        s = prefix[j] - prefix[i]
+        return prefix_sq[j] - prefix_sq[i] - s * s / (j - i)
+
+    threshold = penalty * noise_sigma(values) ** 2 * math.log(max(n, 2))
+    found = []
+    pending = [(0, n)]
+    while pending:
+        i, j = pending.pop()
+        best_gain, best_k = 0.0, None
+        for k in range(i + min_size, j - min_size + 1):
+            gain = cost(i, j) - cost(i, k) - cost(k, j)
+            if gain > best_gain:
+                best_gain, best_k = gain, k
+        if best_k is not None and best_gain > threshold:
+            found.append(best_k)
+            pending += [(i, best_k), (best_k, j)]
+    return sorted(found)
+
+
+def theil_sen(values: List[float]) -> float:
+    """Median pairwise slope, per run."""
+    slopes = [(values[j] - values[i]) / (j - i) for i in range(len(values)) for j in range(i + 1, len(values))]
+    return statistics.median(slopes) if slopes else 0.0
+
+
+def build_series(store: HistoryStore, filters: Dict[str, str]) -> Dict[Tuple[str, str, str, str], List[Dict[str, Any]]]:
+    """Run-level points (median of a run's samples) per (series, model, source, label), oldest first."""
+    runs: Dict[Tuple[str, str, str, str], Dict[str, Dict[str, Any]]] = {}
+    for row in store.rows(filters):
+        key = (row["series"], row["model"], row["source"], row["label"])
+        point = runs.setdefault(key, {}).setdefault(row["run"], dict(row, samples=[]))
+        point["samples"].append(row["value"])
+    series = {}
+    for key, by_run in runs.items():
+        points = sorted(by_run.values(), key=lambda p: (p["ts"], p["run"]))
+        for p in points:
+            p["value"] = statistics.median(p["samples"])
+        series[key] = points
+    return series
+
+
+def analyse(points: List[Dict[str, Any]], series: str, args: argparse.Namespace) -> Dict[str, Any]:
+    values = [p["value"] for p in points]
+    lower = lower_is_better(series)
+    cuts = change_points(values, args.min_size, args.penalty) if len(values) >= 2 * args.min_size else []
+    bounds = [0] + cuts + [len(values)]
+    segments = [{"start": bounds[i], "end": bounds[i + 1],
+                 "mean": statistics.mean(values[bounds[i]:bounds[i + 1]])} for i in range(len(bounds) - 1)]
+
+    changes = []
+    for prev, seg in zip(segments, segments[1:]):
+        before, after = points[seg["start"] - 1], points[seg["start"]]
+        rel = (seg["mean"] - prev["mean"]) / prev["mean"] if prev["mean"] else 0.0
+        if abs(rel) < args.min_change:
+            continue
+        keys = {k: (before[k], after[k]) for k in ATTRIBUTION_KEYS if before[k] != after[k]}
+        if "env" in keys:
+            keys["env"] = (env_id(keys["env"][0]), env_id(keys["env"][1]))
+        changes.append({
+            "at": datetime.fromtimestamp(after["ts"]).isoformat(timespec="seconds"),
+            "run": after["run"],
+            "before": round(prev["mean"], 4),
+            "after": round(seg["mean"], 4),
+            "change": round(rel, 4),
+            "regression": rel > 0 if lower else rel < 0,
+            "changed_keys": keys,
+        })
+
+    # Drift of the latest segment against the best one the series has reached
+    best = (min if lower else max)(segments, key=lambda s: s["mean"])
+    latest = segments[-1]
+    drift = (latest["mean"] - best["mean"]) / best["mean"] if best["mean"] else 0.0
+    window = values[-args.window:]
+    slope = theil_sen(window)
+    median = statistics.median(window)
+    return {
+        "runs": len(values),
+        "latest": round(values[-1], 4),
+        "changes": changes,
+        "drift": round(drift, 4),
+        "drift_regression": abs(drift) >= args.max_drift,
+        "trend_per_run": round(slope / median, 5) if median else 0.0,
+        "lower_is_better": lower,
+    }
+
+
+# --- Commands ---------------------------------------------------------------------
+
+def cmd_ingest(args: argparse.Namespace) -> int:
+    total = 0
+    for filename in args.files:
+        try:
+            with open(filename) as f:
+                data = json.load(f)
+            source = args.source or detect_source(data)
+            info = dict(data.get("system_info", {}))
+            info.setdefault("timestamp", data.get("timestamp"))
+            if source == "accuracy":
+                info.setdefault("model", data.get("candidate", {}).get("model"))
+            samples = IMPORTERS[source](data)
+            rows = rows_for_run(samples, run_keys(args, source, info), _timestamp(info.get("timestamp")))
+            append_rows(args.store, rows)
+        except (OSError, ValueError, KeyError, StoreError) as e:
+            print(f"Ingest {filename}: {STATUS_ERROR} ({e})", file=sys.stderr)
+            return EXIT_FAILURE
+        total += len(rows)
+        print(f"Ingest {filename}: {STATUS_OK} ({source}, {len(rows)} samples)")
+    print(f"History store: {STATUS_OK} ({total} samples appended to {args.store})")
+    return EXIT_SUCCESS
+
+
+def cmd_add(args: argparse.Namespace) -> int:
+    samples = []
+    for item in args.sample:
+        name, sep, value = item.partition("=")
+        try:
+            samples.append((name, float(value)))
+        except ValueError:
+            sep = ""
+        if not sep or not name:
+            print(f"Invalid sample: {item} (expected SERIES=VALUE)", file=sys.stderr)
+            return EXIT_INVALID_USAGE
+    try:
+        rows = rows_for_run(samples, run_keys(args, args.source, {}), _timestamp(args.timestamp))
+        append_rows(args.store, rows)
+    except (OSError, StoreError) as e:
+        print(f"History store: {STATUS_ERROR} ({e})", file=sys.stderr)
+        return EXIT_FAILURE
+    print(f"History store: {STATUS_OK} ({len(rows)} samples appended to {args.store})")
+    return EXIT_SUCCESS
+
+
+def _filters(args: argparse.Namespace) -> Dict[str, str]:
+    filters = {"series": args.series}
+    for name in ("model", "source", "label", "llama_commit"):
+        if getattr(args, name, None):
+            filters[name] = getattr(args, name)
+    return filters
+
+
+def cmd_info(args: argparse.Namespace) -> int:
+    with HistoryStore(args.store, verify=True) as store:
+        rows = sum(s.rows for s in store.segments)
+        runs, series, models = set(), set(), set()
+        for seg in store.segments:
+            runs.update(seg.key("run", i) for i in range(seg.rows))
+            series.update(seg.key("series", i) for i in range(seg.rows))
+            models.update(seg.key("model", i) for i in range(seg.rows))
+        print(f"Store: {args.store} ({store.size / 1024:.1f} KB, {len(store.segments)} segments)")
+        print(f"Samples: {rows}, runs: {len(runs)}, series: {len(series)}, models: {len(models)}")
+        if store.torn_bytes:
+            print(f"Integrity: {STATUS_WARN} ({store.torn_bytes} trailing bytes ignored)")
+        else:
+            print(f"Integrity: {STATUS_OK} (all segment checksums match)")
+    return EXIT_SUCCESS
+
+
+def cmd_show(args: argparse.Namespace) -> int:
+    with HistoryStore(args.store) as store:
+        series = build_series(store, _filters(args))
+    for (name, model, source, label), points in sorted(series.items()):
+        print(f"{name}  [{model}, {source}{', ' + label if label else ''}]")
+        print(f"  {'Time':<20} {'Value':>10} {'n':>4}  {'llama.cpp':<20} {'Git':<14} {'Env':<8} Image")
+        for p in points[-args.last:]:
+            at = datetime.fromtimestamp(p["ts"]).strftime("%Y-%m-%d %H:%M:%S")
+            print(f"  {at:<20} {p['value']:>10.3f} {len(p['samples']):>4}  {p['llama_commit'][:20]:<20} "
+                  f"{p['git_rev'][:14]:<14} {env_id(p['env']):<8} {p['image_digest'][:19]}")
+    if not series:
+        print(f"No samples match series '{args.series}'")
+    return EXIT_SUCCESS
+
+
+def cmd_changes(args: argparse.Namespace) -> int:
+    with HistoryStore(args.store) as store:
+        series = build_series(store, _filters(args))
+    report = []
+    regressions = 0
+    for (name, model, source, label), points in sorted(series.items()):
+        if len(points) < args.min_runs:
+            continue
+        result = analyse(points, name, args)
+        result.update({"series": name, "model": model, "source": source, "label": label})
+        report.append(result)
+
+        flagged = [c for c in result["changes"] if c["regression"]]
+        status = STATUS_WARN if flagged or result["drift_regression"] else STATUS_OK
+        regressions += status == STATUS_WARN
+        direction = "lower" if result["lower_is_better"] else "higher"
+        print(f"{name} [{model}, {source}{', ' + label if label else ''}]: {status} "
+              f"({result['runs']} runs, latest {result['latest']:.3f}, {direction} is better)")
+        for c in result["changes"]:
+            tag = "regression" if c["regression"] else "improvement"
+            keys = ", ".join(f"{k} {a[:16]} -> {b[:16]}" for k, (a, b) in c["changed_keys"].items())
+            print(f"  {c['at']}  {c['before']:.3f} -> {c['after']:.3f} ({c['change'] * 100:+.1f}%, {tag})"
+                  f"{'  ' + keys if keys else '  no key changed'}")
+        print(f"  Drift from best segment: {result['drift'] * 100:+.1f}%, "
+              f"trend {result['trend_per_run'] * 100:+.2f}%/run over the last {min(args.window, result['runs'])} runs")
+
+    if not report:
+        print(f"No series with at least {args.min_runs} runs match '{args.series}'")
+    if args.output:
+        try:
+            with open(args.output, "w") as f:
+                json.dump({"timestamp": datetime.now().isoformat(), "store": args.store, "series": report}, f, indent=2)
+            print(f"Results: {STATUS_OK} (saved to {args.output})")
+        except OSError as e:
+            print(f"Results: {STATUS_ERROR} (cannot save {args.output}: {e})", file=sys.stderr)
+            return EXIT_FAILURE
+    return EXIT_REGRESSION if regressions else EXIT_SUCCESS
+
+
+def add_key_arguments(parser: argparse.ArgumentParser) -> None:
+    parser.add_argument("--label", help="Run label (default: the result file's label)")
+    parser.add_argument("--git-rev", help="Repository revision (default: git rev-parse HEAD, -dirty if modified)")
+    parser.add_argument("--llama-commit",
+                        help="llama.cpp build (default: llama_build recorded by benchmark.py, else unknown)")
+    parser.add_argument("--image-digest", help="Container image digest (default: from --container)")
+    parser.add_argument("--container", default="llama-cpu",
+                        help="Container whose image digest is recorded (default: llama-cpu; empty to skip)")
+    parser.add_argument("--model", help="Model name (default: the result file's model)")
+
+
+def add_analysis_arguments(parser: argparse.ArgumentParser) -> None:
+    parser.add_argument("--series", default="*", help="Series glob, e.g. 'tok_s/*' (default: all)")
+    parser.add_argument("--model", help="Model glob")
+    parser.add_argument("--source", help="Source glob (benchmark, speculative, accuracy, soak, ...)")
+    parser.add_argument("--label", help="Label glob")
+
+
+def create_parser() -> argparse.ArgumentParser:
+    """Create command line argument parser."""
+    parser = argparse.ArgumentParser(
+        description="Benchmark history store with change-point detection",
+        formatter_class=argparse.RawDescriptionHelpFormatter,
+        epilog="""
+Examples:
+  python results_store.py ingest docs/optimizations/bios/*.json
+  python results_store.py add --source soak latency_s/p99=1.84 tok_s/decode=27.9
+  python results_store.py show --series 'tok_s/overall' --last 20
+  python results_store.py changes --series 'tok_s/*' --model '*IQ4_XS*'
+        """
+    )
+    parser.add_argument("--store", default=os.environ.get("BENCH_HISTORY", DEFAULT_STORE),
+                        help=f"Store file (default: $BENCH_HISTORY or {DEFAULT_STORE})")
+    sub = parser.add_subparsers(dest="command", required=True)
+
+    ingest = sub.add_parser("ingest", help="Append benchmark.py, speculative_eval.py or accuracy_eval.py results")
+    ingest.add_argument("files", nargs="+", help="Result JSON files")
+    ingest.add_argument("--source", choices=sorted(IMPORTERS), help="Result type (default: detected)")
+    add_key_arguments(ingest)
+    ingest.set_defaults(func=cmd_ingest)
+
+    add = sub.add_parser("add", help="Append samples from another harness (soak tests, load tests)")
+    add.add_argument("sample", nargs="+", help="SERIES=VALUE, e.g. latency_s/p99=1.84")
+    add.add_argument("--source", default="soak", help="Source name (default: soak)")
+    add.add_argument("--timestamp", help="ISO timestamp of the run (default: now)")
+    add_key_arguments(add)
+    add.set_defaults(func=cmd_add)
+
+    info = sub.add_parser("info", help="Summarize the store and verify its checksums")
+    info.set_defaults(func=cmd_info)
+
+    show = sub.add_parser("show", help="Print run-level values of matching series")
+    add_analysis_arguments(show)
+    show.add_argument("--last", type=int, default=20, help="Runs per series (default: 20)")
+    show.set_defaults(func=cmd_show)
+
+    changes = sub.add_parser("changes", help="Detect change points and drift; exit 3 on a regression")
+    add_analysis_arguments(changes)
+    changes.add_argument("--llama-commit", help="llama.cpp build glob")
+    changes.add_argument("--min-runs", type=int, default=6, help="Skip series with fewer runs (default: 6)")
+    changes.add_argument("--min-size", type=int, default=3, help="Runs per segment at least (default: 3)")
+    changes.add_argument("--penalty", type=float, default=3.0,
+                         help="Split penalty in sigma^2 * ln(n) units; higher finds fewer changes (default: 3)")
+    changes.add_argument("--min-change", type=float, default=0.02,
+                         help="Ignore shifts below this fraction of the mean (default: 0.02)")
+    changes.add_argument("--max-drift", type=float, default=0.05,
+                         help="Flag a latest segment this far behind the best (default: 0.05)")
+    changes.add_argument("--window", type=int, default=20, help="Runs in the trend estimate (default: 20)")
+    changes.add_argument("--output", help="Save the report as JSON")
+    changes.set_defaults(func=cmd_changes)
+    return parser
+
+
+def main() -> int:
+    """Main function.
+
+    Returns:
+        Exit code: 0 for success, 1 for failure, 2 for invalid usage, 3 if a regression is flagged.
+    """
+    parser = create_parser()
+    args = parser.parse_args()
+    if args.command in ("ingest", "add") and args.container == "":
+        args.container = None
+    try:
+        return args.func(args)
+    except FileNotFoundError:
+        print(f"History store: {STATUS_ERROR} ({args.store} does not exist; ingest results first)", file=sys.stderr)
+        return EXIT_FAILURE
+    except StoreError as e:
+        print(f"History store: {STATUS_ERROR} ({e})", file=sys.stderr)
+        return EXIT_FAILURE
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,497 @@
+#!/usr/bin/env python3
+"""
+Per-request resource accounting for the router.
+Samples CPU time and hardware counters (cycles, instructions, LLC and dTLB
+misses) of each backend's cgroup at a fixed interval and splits every
+interval between the requests active on that backend, in proportion to the
+tokens each pushed through it. Finished requests become cost records with
+their CPU time, estimated DRAM traffic, cache and TLB misses and KV cache
+footprint, written as JSON lines and summarised per prompt shape.
+"""
+
+import asyncio
+import ctypes
+import glob
+import json
+import os
+import platform
+import struct
+import subprocess
+import time
+import uuid
+from collections import defaultdict
+from dataclasses import dataclass, field
+from typing import Any, Callable, Dict, List, Optional, TextIO
+
+from admission import RequestCost
+
+# Counter sampling interval (seconds)
+SAMPLE_INTERVAL_S = 0.1
+
+# DRAM traffic per last-level cache miss (one cache line); an estimate, since
+# prefetches and write-backs are not counted as misses
+CACHE_LINE_BYTES = 64
+
+# Prompt and generation length bucket edges (tokens) of the cost summaries
+PROMPT_BUCKETS = (512, 2048, 8192, 32768)
+GENERATION_BUCKETS = (64, 256, 1024)
+
+# perf_event_open(2)
+PERF_TYPE_HARDWARE = 0
+PERF_TYPE_HW_CACHE = 3
+PERF_COUNT_HW_CPU_CYCLES = 0
+PERF_COUNT_HW_INSTRUCTIONS = 1
+PERF_COUNT_HW_CACHE_MISSES = 3
+PERF_COUNT_HW_CACHE_DTLB = 3
+PERF_COUNT_HW_CACHE_OP_READ = 0
+PERF_COUNT_HW_CACHE_RESULT_MISS = 1
+PERF_FORMAT_TOTAL_TIME_ENABLED = 1
+PERF_FORMAT_TOTAL_TIME_RUNNING = 2
+PERF_FLAG_PID_CGROUP = 4
+PERF_ATTR_SIZE = 128
+PERF_SYSCALL = {"x86_64": 298, "aarch64": 241}
+
+HW_EVENTS = {
+    "cycles": (PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES),
+    "instructions": (PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS),
+    "llc_misses": (PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES),
+    "dtlb_misses": (PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB
+                    | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)),
+}
+
+# Resources attributed to requests, in record order
+RESOURCES = ("cpu_seconds",) + tuple(HW_EVENTS)
+
+
+def online_cpus() -> List[int]:
+    """CPUs listed in /sys/devices/system/cpu/online ("0-3,8-11")."""
+    try:
+        with open("/sys/devices/system/cpu/online") as f:
+            spec = f.read().strip()
+    except OSError:
+        return list(range(os.cpu_count() or 1))
+    cpus = []
+    for part in spec.split(","):
+        first, _, last = part.partition("-")
+        cpus.extend(range(int(first), int(last or first) + 1))
+    return cpus
+
+
+def resolve_cgroup(spec: str) -> str:
+    """Cgroup directory of a backend: a path, or `docker:NAME` for a container.
+
+    Raises:
+        ValueError: if the container or its cgroup cannot be found
+    """
+    if not spec.startswith("docker:"):
+        if not os.path.isdir(spec):
+            raise ValueError(f"no cgroup directory {spec}")
+        return spec
+    name = spec[len("docker:"):]
+    try:
+        container = subprocess.run(["docker", "inspect", "--format", "{{.Id}}", name], check=True,
+                                   capture_output=True, text=True, timeout=10).stdout.strip()
+    except (OSError, subprocess.SubprocessError) as e:
+        raise ValueError(f"cannot inspect container {name}: {e}")
+    # systemd and cgroupfs drivers, cgroup v2 and v1 (perf_event hierarchy)
+    for pattern in (f"/sys/fs/cgroup/system.slice/docker-{container}.scope",
+                    f"/sys/fs/cgroup/docker/{container}",
+                    f"/sys/fs/cgroup/perf_event/docker/{container}",
+                    f"/sys/fs/cgroup/perf_event/system.slice/docker-{container}.scope"):
+        matches = glob.glob(pattern)
+        if matches:
+            return matches[0]
+    raise ValueError(f"no cgroup found for container {name} ({container[:12]})")
+
+
+def cpu_seconds(cgroup: Optional[str]) -> Optional[float]:
+    """CPU time used by the cgroup, or by the whole host without one."""
+    try:
+        if cgroup is None:
+            with open("/proc/stat") as f:
+                fields = [int(v) for v in f.readline().split()[1:]]
+            # user nice system idle iowait irq softirq steal
+            return (sum(fields[:8]) - fields[3] - fields[4]) / os.sysconf("SC_CLK_TCK")
+        stat = os.path.join(cgroup, "cpu.stat")
+        if os.path.exists(stat):
+            with open(stat) as f:
+                for line in f:
+                    key, _, value = line.partition(" ")
+                    if key == "usage_usec":
+                        return int(value) / 1e6
+        # cgroup v1: cpuacct of the same path
+        v1 = cgroup.replace("/perf_event/", "/cpuacct/")
+        with open(os.path.join(v1, "cpuacct.usage")) as f:
+            return int(f.read()) / 1e9
+    except (OSError, ValueError):
+        return None
+    return None
+
+
+class PerfCounters:
+    """Hardware counters of a cgroup (or the whole host), summed over all CPUs.
+
+    Opens one counter per event and online CPU with perf_event_open and
+    scales counts for multiplexing. Events the CPU or kernel does not offer
+    (VMs often have no PMU) or may not be opened (perf_event_paranoid) are
+    left out; `errors` says why.
+    """
+
+    def __init__(self, cgroup: Optional[str] = None):
+        self.fds: Dict[str, List[int]] = {}
+        self.errors: Dict[str, str] = {}
+        number = PERF_SYSCALL.get(platform.machine())
+        if number is None:
+            self.errors = {name: f"unsupported architecture {platform.machine()}" for name in HW_EVENTS}
+            return
+        libc = ctypes.CDLL(None, use_errno=True)
+        cgroup_fd = os.open(cgroup, os.O_RDONLY) if cgroup else -1
+        try:
+            for name, (type_, config) in HW_EVENTS.items():
+                attr = struct.pack("IIQQQQQ", type_, PERF_ATTR_SIZE, config, 0, 0,
+                                   PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING, 0)
+                attr = ctypes.create_string_buffer(attr.ljust(PERF_ATTR_SIZE, b"\0"), PERF_ATTR_SIZE)
+                fds = []
+                for cpu in online_cpus():
+                    fd = libc.syscall(number, attr, cgroup_fd, cpu, -1, PERF_FLAG_PID_CGROUP if cgroup else 0)
+                    if fd < 0:
+                        self.errors[name] = os.strerror(ctypes.get_errno())
+                        break
+                    fds.append(fd)
+                if name in self.errors:
+                    for fd in fds:
+                        os.close(fd)
+                else:
+                    self.fds[name] = fds
+        finally:
+            if cgroup_fd >= 0:
+                os.close(cgroup_fd)
+
+    @property
+    def available(self) -> List[str]:
+        return list(self.fds)
+
+    def read(self) -> Dict[str, float]:
+        totals = {}
+        for name, fds in self.fds.items():
+            total = 0.0
+            for fd in fds:
+                value, enabled, running = struct.unpack("QQQ", os.read(fd, 24))
+                if running:
+                    total += value * enabled / running
+            totals[name] = total
+        return totals
+
+    def close(self) -> None:
+        for fds in self.fds.values():
+            for fd in fds:
+                os.close(fd)
+        self.fds = {}
+
+
+@dataclass
+class RequestWindow:
+    """The active time window of one request on one backend and what it was charged.
+
+    Tokens are credited as the backend works through them: prompt tokens at
+    the calibrated prefill rate until the first token arrives (the rest then
+    at once), generated tokens as they stream, or at the calibrated decode
+    rate for non-streamed responses until the final count is known.
+    """
+    request_id: str
+    stage: str
+    backend: str
+    priority: str
+    prompt_tokens: int
+    cached_tokens: int
+    max_tokens: int
+    stream: bool
+    prefill_tps: float
+    decode_tps: float
+    started: float
+    hedge: bool = False
+    first_token_at: Optional[float] = None
+    ended: Optional[float] = None
+    generated: int = 0
+    final: bool = False
+    credited_prompt: float = 0.0
+    credited_generated: float = 0.0
+    usage: Dict[str, float] = field(default_factory=lambda: defaultdict(float))
+    active_s: float = 0.0
+    concurrency_s: float = 0.0
+    kv_token_s: float = 0.0
+
+    def progress(self, t0: float, t1: float) -> float:
+        """Credit and return the tokens this request pushed through the backend in [t0, t1)."""
+        dt = max(0.0, t1 - max(t0, self.started))
+        prompt = max(0.0, self.prompt_tokens - self.credited_prompt)
+        if self.first_token_at is None and not self.final:
+            prompt = min(prompt, self.prefill_tps * dt)
+        dt = max(0.0, dt - prompt / self.prefill_tps)
+        if self.stream or self.final:
+            generated = self.generated - self.credited_generated
+        elif self.credited_prompt + prompt >= self.prompt_tokens:
+            generated = min(self.max_tokens - self.credited_generated, self.decode_tps * dt)
+        else:
+            generated = 0.0
+        generated = max(0.0, generated)
+        self.credited_prompt += prompt
+        self.credited_generated += generated
+        return prompt + generated
+
+    def charge(self, deltas: Dict[str, float], share: float, overlap: float, concurrency: int) -> None:
+        for name, value in deltas.items():
+            self.usage[name] += value * share
+        self.active_s += overlap
+        self.concurrency_s += overlap * concurrency
+        self.kv_token_s += (self.cached_tokens + self.credited_prompt + self.credited_generated) * overlap
+
+
+class ResourceMeter:
+    """Counter source of one cgroup (or the host) shared by the backends it runs.
+
+    Every sample's deltas are split between the windows active in the
+    interval by the tokens each was credited; intervals without tokens are
+    split by time, and intervals without requests are booked as idle.
+    """
+
+    def __init__(self, name: str, cgroup: Optional[str] = None, counters: bool = True):
+        self.name = name
+        self.cgroup = cgroup
+        self.perf = PerfCounters(cgroup) if counters else None
+        self.windows: List[RequestWindow] = []
+        self.idle: Dict[str, float] = defaultdict(float)
+        self.attributed: Dict[str, float] = defaultdict(float)
+        self.last = self.read()
+        self.last_at = time.monotonic()
+
+    def read(self) -> Dict[str, float]:
+        values = self.perf.read() if self.perf else {}
+        cpu = cpu_seconds(self.cgroup)
+        if cpu is not None:
+            values["cpu_seconds"] = cpu
+        return values
+
+    def sample(self, now: float) -> None:
+        current = self.read()
+        deltas = {k: max(0.0, v - self.last.get(k, v)) for k, v in current.items()}
+        active = [w for w in self.windows if w.started < now]
+        if not active:
+            for name, value in deltas.items():
+                self.idle[name] += value
+        else:
+            tokens = [w.progress(self.last_at, now) for w in active]
+            total = sum(tokens)
+            for window, credited in zip(active, tokens):
+                share = credited / total if total > 0 else 1.0 / len(active)
+                overlap = now - max(self.last_at, window.started)
+                window.charge(deltas, share, overlap, len(active))
+            for name, value in deltas.items():
+                self.attributed[name] += value
+        self.last, self.last_at = current, now
+
+    def stats(self) -> Dict[str, Any]:
+        idle_share = {name: round(self.idle[name] / (self.idle[name] + self.attributed[name]), 3)
+                      for name in self.idle if self.idle[name] + self.attributed[name] > 0}
+        return {
+            "cgroup": self.cgroup or "host",
+            "events": ([name for name in RESOURCES if name in self.last]),
+            "unavailable": self.perf.errors if self.perf else {},
+            "active_requests": len(self.windows),
+            "idle_share": idle_share,
+        }
+
+
+class ShapeSummary:
+    """Running cost-per-token totals of the records in one prompt/generation bucket."""
+
+    def __init__(self):
+        self.requests = 0
+        self.tokens = 0
+        self.totals: Dict[str, float] = defaultdict(float)
+
+    def add(self, record: Dict[str, Any]) -> None:
+        self.requests += 1
+        self.tokens += record["prompt_tokens"] + record["completion_tokens"]
+        for name in RESOURCES + ("dram_bytes_est",):
+            if record.get(name) is not None:
+                self.totals[name] += record[name]
+        self.totals["mean_concurrency"] += record["mean_concurrency"]
+
+    def to_dict(self) -> Dict[str, Any]:
+        per_token = {}
+        for name, value in self.totals.items():
+            if name == "cpu_seconds":
+                per_token["cpu_ms"] = round(value * 1000 / max(1, self.tokens), 4)
+            elif name != "mean_concurrency":
+                per_token[name] = round(value / max(1, self.tokens), 1)
+        return {"requests": self.requests, "tokens": self.tokens,
+                "mean_concurrency": round(self.totals["mean_concurrency"] / self.requests, 2),
+                "per_token": per_token}
+
+
+def bucket(value: int, edges: tuple) -> str:
+    for edge in edges:
+        if value < edge:
+            return f"<{edge}"
+    return f">={edges[-1]}"
+
+
+class CostAccountant:
+    """Tags request windows, meters the backends and writes the cost records.
+
+    Backends are metered through the cgroup given for them, e.g. a docker
+    container; CPU backends without one share a host-wide meter, and GPU
+    backends without one only get time, token and KV figures.
+    """
+
+    def __init__(self, log_path: Optional[str] = None, kv_bytes_per_token: Optional[float] = None,
+                 interval_s: float = SAMPLE_INTERVAL_S,
+                 learned_kv_bytes: Optional[Callable[[], Optional[float]]] = None):
+        self.log_path = log_path
+        self.kv_bytes_per_token = kv_bytes_per_token
+        self.learned_kv_bytes = learned_kv_bytes
+        self.interval_s = interval_s
+        self.meters: Dict[str, Optional[ResourceMeter]] = {}
+        self.shapes: Dict[str, ShapeSummary] = defaultdict(ShapeSummary)
+        self.counters = {"records": 0, "aborted": 0, "failed": 0}
+        self.log: Optional[TextIO] = open(log_path, "a", buffering=1) if log_path else None
+        self.task: Optional[asyncio.Task] = None
+
+    def add_backend(self, url: str, kind: str, cgroup: Optional[str] = None) -> ResourceMeter:
+        """Meter `url` through `cgroup`; the host meter is shared by every backend without one."""
+        if cgroup is None and kind != "cpu":
+            self.meters[url] = None
+            return None
+        key = cgroup or "host"
+        meter = next((m for m in self.meters.values() if m is not None and (m.cgroup or "host") == key), None)
+        self.meters[url] = meter or ResourceMeter(key, cgroup)
+        return self.meters[url]
+
+    @staticmethod
+    def new_request_id() -> str:
+        return uuid.uuid4().hex[:16]
+
+    def begin(self, request_id: str, stage: str, backend: Any, cost: RequestCost, priority: str,
+              cached_tokens: int = 0, stream: bool = False, hedge: bool = False) -> RequestWindow:
+        calibrator = backend.admission.calibrator
+        window = RequestWindow(request_id, stage, backend.url, priority, cost.prompt_tokens, cached_tokens,
+                               cost.max_tokens, stream, calibrator.prefill_tps, calibrator.decode_tps,
+                               time.monotonic(), hedge)
+        meter = self.meters.get(backend.url)
+        if meter is not None:
+            meter.sample(window.started)
+            meter.windows.append(window)
+        return window
+
+    @staticmethod
+    def first_token(window: Optional[RequestWindow]) -> None:
+        if window is not None and window.first_token_at is None:
+            window.first_token_at = time.monotonic()
+
+    @staticmethod
+    def token(window: Optional[RequestWindow]) -> None:
+        if window is not None:
+            window.generated += 1
+
+    def end(self, window: Optional[RequestWindow], status: str = "ok",
+            timings: Optional[Dict[str, Any]] = None, usage: Optional[Dict[str, Any]] = None,
+            completion_tokens: Optional[int] = None) -> None:
+        """Close a window, charge its last interval and write its record; later calls are ignored."""
+        if window is None or window.ended is not None:
+            return
+        window.ended = time.monotonic()
+        # Server-side counts replace the estimates before the last interval is charged
+        timings, usage = timings or {}, usage or {}
+        if timings.get("prompt_n"):
+            window.prompt_tokens = int(timings["prompt_n"])
+        elif usage.get("prompt_tokens"):
+            window.prompt_tokens = max(1, int(usage["prompt_tokens"]) - window.cached_tokens)
+        if completion_tokens is not None:
+            window.generated = completion_tokens
+        window.final = True
+        meter = self.meters.get(window.backend)
+        if meter is not None:
+            meter.sample(window.ended)
+            meter.windows.remove(window)
+        record = self.record(window, status, timings)
+        if status == "ok":
+            self.shapes[f"prompt{bucket(record['prompt_tokens'], PROMPT_BUCKETS)}/"
+                        f"gen{bucket(record['completion_tokens'], GENERATION_BUCKETS)}"].add(record)
+        self.counters["records"] += 1
+        if status != "ok":
+            self.counters["aborted" if status == "aborted" else "failed"] += 1
+        if self.log is not None:
+            self.log.write(json.dumps(record) + "\n")
+
+    def kv_bytes(self) -> Optional[float]:
+        if self.kv_bytes_per_token:
+            return self.kv_bytes_per_token
+        return self.learned_kv_bytes() if self.learned_kv_bytes else None
+
+    def record(self, w: RequestWindow, status: str, timings: Dict[str, Any]) -> Dict[str, Any]:
+        metered = self.meters.get(w.backend) is not None
+        prompt_tokens = w.prompt_tokens
+        completion_tokens = w.generated
+        tokens = max(1, prompt_tokens + completion_tokens)
+        duration = w.ended - w.started
+        record: Dict[str, Any] = {
+            "ts": round(time.time(), 3),
+            "request_id": w.request_id,
+            "stage": w.stage,
+            "backend": w.backend,
+            "priority": w.priority,
+            "hedge": w.hedge,
+            "status": status,
+            "prompt_tokens": prompt_tokens,
+            "cached_tokens": w.cached_tokens,
+            "completion_tokens": completion_tokens,
+            "ttft_s": round(w.first_token_at - w.started, 3) if w.first_token_at else None,
+            "duration_s": round(duration, 3),
+            "server_prompt_ms": timings.get("prompt_ms"),
+            "server_predicted_ms": timings.get("predicted_ms"),
+            "mean_concurrency": round(w.concurrency_s / w.active_s, 2) if w.active_s else 1.0,
+        }
+        for name in RESOURCES:
+            value = w.usage.get(name) if metered else None
+            record[name] = round(value, 6 if name == "cpu_seconds" else 0) if value is not None else None
+        llc = record.get("llc_misses")
+        record["dram_bytes_est"] = llc * CACHE_LINE_BYTES if llc is not None else None
+        kv = self.kv_bytes()
+        context = w.cached_tokens + prompt_tokens + completion_tokens
+        record["kv_bytes"] = int(context * kv) if kv else None
+        record["kv_byte_seconds"] = round(w.kv_token_s * kv, 1) if kv and metered else None
+        record["per_token"] = {name: round(record[name] / tokens, 9 if name == "cpu_seconds" else 1)
+                               for name in RESOURCES + ("dram_bytes_est",) if record[name] is not None}
+        return record
+
+    async def start(self) -> None:
+        self.task = asyncio.create_task(self._sample_loop())
+
+    async def stop(self) -> None:
+        if self.task:
+            self.task.cancel()
+        for meter in set(m for m in self.meters.values() if m is not None):
+            if meter.perf:
+                meter.perf.close()
+        if self.log is not None:
+            self.log.close()
+
+    async def _sample_loop(self) -> None:
+        while True:
+            await asyncio.sleep(self.interval_s)
+            now = time.monotonic()
+            for meter in set(m for m in self.meters.values() if m is not None):
+                meter.sample(now)
+
+    def stats(self) -> Dict[str, Any]:
+        meters = {}
+        for url, meter in self.meters.items():
+            meters[url] = meter.stats() if meter is not None else {"cgroup": None}
+        return {
+            "log": self.log_path,
+            "kv_bytes_per_token": self.kv_bytes(),
+            "meters": meters,
+            "shapes": {key: shape.to_dict() for key, shape in sorted(self.shapes.items())},
+            **self.counters,
+        }
@@ -0,0 +1,414 @@
+#!/usr/bin/env python3
+"""
+SLO-aware admission control for llama-server endpoints.
+Estimates request cost from prompt length and max_tokens, keeps interactive
+and batch priority classes with per-class concurrency and token budgets, and
+defers or sheds batch work when it would push interactive TTFT past the SLO.
+"""
+
+import asyncio
+import time
+from dataclasses import dataclass, field
+from typing import Any, Dict, List, Optional
+
+# Priority classes
+PRIORITY_INTERACTIVE = "interactive"
+PRIORITY_BATCH = "batch"
+PRIORITIES = (PRIORITY_INTERACTIVE, PRIORITY_BATCH)
+
+# Queue re-evaluation interval for deferred work (seconds)
+PUMP_INTERVAL_S = 0.25
+
+
+class InvalidRequest(ValueError):
+    """Raised for a request body that cannot be costed; answered with 400."""
+
+
+def _int_field(body: Dict[str, Any], key: str) -> Optional[int]:
+    value = body.get(key)
+    if value is None:
+        return None
+    if isinstance(value, bool) or not isinstance(value, int):
+        raise InvalidRequest(f"'{key}' must be an integer")
+    return value
+
+
+def classify_priority(header: Optional[str], body: Dict[str, Any], prompt_tokens: int,
+                      batch_threshold_tokens: int) -> str:
+    """Determine the priority class of a request.
+
+    An explicit X-Priority header or `priority` body field wins; otherwise
+    prompts above the batch threshold are treated as batch work. The body
+    field is router-only and removed before the body is forwarded.
+    """
+    field = body.pop("priority", None)
+    explicit = header or field
+    if explicit in PRIORITIES:
+        return explicit
+    if prompt_tokens >= batch_threshold_tokens:
+        return PRIORITY_BATCH
+    return PRIORITY_INTERACTIVE
+
+
+class AdmissionRejected(Exception):
+    """Raised when a request is shed instead of admitted."""
+
+    def __init__(self, reason: str, retry_after: float):
+        super().__init__(reason)
+        self.reason = reason
+        self.retry_after = retry_after
+
+
+@dataclass
+class ClassPolicy:
+    """Per-priority-class limits."""
+    name: str
+    max_concurrency: int
+    max_tokens_in_flight: int
+    max_queue: int
+    max_wait_s: float
+
+
+@dataclass
+class RequestCost:
+    """Estimated work for one request, in tokens."""
+    prompt_tokens: int
+    max_tokens: int
+    prompt_chars: int = 0
+
+    @property
+    def total_tokens(self) -> int:
+        return self.prompt_tokens + self.max_tokens
+
+
+@dataclass
+class Ticket:
+    """An admitted request holding class capacity until released."""
+    priority: str
+    cost: RequestCost
+    admitted_at: float
+    first_token_at: Optional[float] = None
+
+
+@dataclass
+class _Waiter:
+    priority: str
+    cost: RequestCost
+    enqueued_at: float
+    future: asyncio.Future = field(repr=False)
+
+
+class RateCalibrator:
+    """Online estimate of prefill/decode rates and characters per token.
+
+    Seeded from configured rates and refined with an exponentially weighted
+    moving average of the `timings` and `usage` blocks llama-server returns.
+    """
+
+    def __init__(self, prefill_tps: float, decode_tps: float,
+                 chars_per_token: float = 3.5, alpha: float = 0.2):
+        self.prefill_tps = prefill_tps
+        self.decode_tps = decode_tps
+        self.chars_per_token = chars_per_token
+        self.alpha = alpha
+        self.samples = 0
+
+    def _ewma(self, current: float, sample: float) -> float:
+        return (1.0 - self.alpha) * current + self.alpha * sample
+
+    def estimate_cost(self, body: Dict[str, Any], default_max_tokens: int = 512) -> RequestCost:
+        """Estimate the token cost of an OpenAI-style or /completion request body.
+
+        Args:
+            body: Parsed JSON request body
+            default_max_tokens: Generation budget assumed when the request sets none
+
+        Returns:
+            RequestCost with estimated prompt tokens and requested max tokens
+
+        Raises:
+            InvalidRequest: If the body is not an object, or messages or token limits are malformed
+        """
+        if not isinstance(body, dict):
+            raise InvalidRequest("request body must be a JSON object")
+        chars = 0
+        if "messages" in body:
+            messages = body.get("messages") or []
+            if not isinstance(messages, list):
+                raise InvalidRequest("'messages' must be a list")
+            for message in messages:
+                if not isinstance(message, dict):
+                    raise InvalidRequest("each entry of 'messages' must be an object")
+                content = message.get("content", "")
+                if isinstance(content, list):
+                    # Multi-part content: count text parts only
+                    chars += sum(len(str(p.get("text", ""))) for p in content if isinstance(p, dict))
+                elif content is not None:
+                    chars += len(str(content))
+        elif "prompt" in body:
+            prompt = body["prompt"]
+            if isinstance(prompt, list):
+                chars = sum(len(str(p)) for p in prompt)
+            else:
+                chars = len(str(prompt))
+
+        max_tokens = _int_field(body, "max_tokens") or _int_field(body, "n_predict") or default_max_tokens
+        if max_tokens < 0:
+            max_tokens = default_max_tokens
+
+        return RequestCost(
+            prompt_tokens=max(1, int(chars / self.chars_per_token)),
+            max_tokens=int(max_tokens),
+            prompt_chars=chars,
+        )
+
+    def observe(self, timings: Optional[Dict[str, Any]], usage: Optional[Dict[str, Any]],
+                prompt_chars: int) -> None:
+        """Fold one completed request's server-side measurements into the estimates."""
+        if timings:
+            # Short prompts are dominated by fixed overhead; only learn from real prefills
+            if timings.get("prompt_n", 0) >= 64 and timings.get("prompt_per_second", 0) > 0:
+                self.prefill_tps = self._ewma(self.prefill_tps, timings["prompt_per_second"])
+            if timings.get("predicted_n", 0) >= 8 and timings.get("predicted_per_second", 0) > 0:
+                self.decode_tps = self._ewma(self.decode_tps, timings["predicted_per_second"])
+        if usage and usage.get("prompt_tokens", 0) > 0 and prompt_chars > 0:
+            self.chars_per_token = self._ewma(self.chars_per_token,
+                                              prompt_chars / usage["prompt_tokens"])
+        self.samples += 1
+
+    def observe_wall(self, prompt_tokens: int, ttft_s: Optional[float],
+                     completion_tokens: int, total_s: float) -> None:
+        """Calibrate from router-side timing for backends that return no `timings` (vLLM)."""
+        prefill_s = ttft_s if ttft_s is not None else prompt_tokens / self.prefill_tps
+        if ttft_s is not None and prompt_tokens >= 64 and ttft_s > 0:
+            self.prefill_tps = self._ewma(self.prefill_tps, prompt_tokens / ttft_s)
+        decode_s = total_s - prefill_s
+        if completion_tokens >= 8 and decode_s > 0:
+            self.decode_tps = self._ewma(self.decode_tps, completion_tokens / decode_s)
+        self.samples += 1
+
+    def to_dict(self) -> Dict[str, Any]:
+        return {
+            "prefill_tps": round(self.prefill_tps, 2),
+            "decode_tps": round(self.decode_tps, 2),
+            "chars_per_token": round(self.chars_per_token, 3),
+            "samples": self.samples,
+        }
+
+
+class AdmissionController:
+    """Priority admission in front of a single llama-server instance.
+
+    Interactive requests are admitted whenever their class budgets allow.
+    Batch requests are additionally held back while the predicted TTFT of
+    the instance (outstanding prefill plus their own prompt) exceeds the
+    interactive SLO and interactive traffic is active. Held batch work is
+    deferred up to its class max_wait_s, then shed.
+    """
+
+    def __init__(self, calibrator: RateCalibrator, policies: Dict[str, ClassPolicy],
+                 ttft_slo_s: float, interactive_idle_s: float = 5.0):
+        self.calibrator = calibrator
+        self.policies = policies
+        self.ttft_slo_s = ttft_slo_s
+        self.interactive_idle_s = interactive_idle_s
+
+        self._active: List[Ticket] = []
+        self._queues: Dict[str, List[_Waiter]] = {p: [] for p in PRIORITIES}
+        self._last_interactive_at = 0.0
+
+        # Prefill backlog drained at the calibrated rate
+        self._backlog_tokens = 0.0
+        self._backlog_at = time.monotonic()
+
+        self._pump_task: Optional[asyncio.Task] = None
+        self.counters = {"admitted": 0, "deferred": 0, "shed": 0}
+
+    # --- Cost model ---
+
+    def _drain_backlog(self, now: float) -> None:
+        elapsed = now - self._backlog_at
+        self._backlog_at = now
+        self._backlog_tokens = max(0.0, self._backlog_tokens - elapsed * self.calibrator.prefill_tps)
+        # Never more than the prompts still waiting for their first token
+        pending = sum(t.cost.prompt_tokens for t in self._active if t.first_token_at is None)
+        self._backlog_tokens = min(self._backlog_tokens, float(pending))
+
+    def predicted_ttft(self, cost: RequestCost, now: Optional[float] = None) -> float:
+        """Predicted time to first token if `cost` were dispatched now."""
+        now = time.monotonic() if now is None else now
+        self._drain_backlog(now)
+        return (self._backlog_tokens + cost.prompt_tokens) / max(self.calibrator.prefill_tps, 1e-6)
+
+    # --- Admission ---
+
+    def _class_usage(self, priority: str) -> tuple:
+        active = [t for t in self._active if t.priority == priority]
+        return len(active), sum(t.cost.total_tokens for t in active)
+
+    def _fits_budget(self, priority: str, cost: RequestCost) -> bool:
+        policy = self.policies[priority]
+        count, tokens = self._class_usage(priority)
+        if count >= policy.max_concurrency:
+            return False
+        # A single oversized request is still admitted into an empty class
+        return count == 0 or tokens + cost.total_tokens <= policy.max_tokens_in_flight
+
+    def _interactive_active(self, now: float) -> bool:
+        if self._queues[PRIORITY_INTERACTIVE]:
+            return True
+        if any(t.priority == PRIORITY_INTERACTIVE for t in self._active):
+            return True
+        return now - self._last_interactive_at < self.interactive_idle_s
+
+    def _can_admit(self, priority: str, cost: RequestCost, now: float) -> bool:
+        if not self._fits_budget(priority, cost):
+            return False
+        if priority == PRIORITY_BATCH:
+            if self._queues[PRIORITY_INTERACTIVE]:
+                return False
+            if self.predicted_ttft(cost, now) > self.ttft_slo_s and self._interactive_active(now):
+                return False
+        return True
+
+    def _admit(self, priority: str, cost: RequestCost, now: float) -> Ticket:
+        self._drain_backlog(now)
+        self._backlog_tokens += cost.prompt_tokens
+        ticket = Ticket(priority=priority, cost=cost, admitted_at=now)
+        self._active.append(ticket)
+        self.counters["admitted"] += 1
+        return ticket
+
+    async def acquire(self, cost: RequestCost, priority: str) -> Ticket:
+        """Admit a request, waiting in its class queue if necessary.
+
+        Args:
+            cost: Estimated request cost
+            priority: PRIORITY_INTERACTIVE or PRIORITY_BATCH
+
+        Returns:
+            Ticket that must be passed to release() when the request finishes
+
+        Raises:
+            AdmissionRejected: If the class queue is full or the wait exceeded max_wait_s
+        """
+        now = time.monotonic()
+        if priority == PRIORITY_INTERACTIVE:
+            self._last_interactive_at = now
+
+        # Fast path: nothing of equal or higher priority is queued ahead
+        if not self._queues[priority] and self._can_admit(priority, cost, now):
+            return self._admit(priority, cost, now)
+
+        policy = self.policies[priority]
+        if len(self._queues[priority]) >= policy.max_queue:
+            self.counters["shed"] += 1
+            raise AdmissionRejected(f"{priority} queue full", retry_after=self.predicted_ttft(cost, now))
+
+        waiter = _Waiter(priority=priority, cost=cost, enqueued_at=now,
+                         future=asyncio.get_running_loop().create_future())
+        self._queues[priority].append(waiter)
+        self.counters["deferred"] += 1
+        self._ensure_pump()
+
+        try:
+            return await asyncio.wait_for(asyncio.shield(waiter.future), timeout=policy.max_wait_s)
+        except asyncio.TimeoutError:
+            if waiter.future.done() and not waiter.future.cancelled():
+                # Admitted in the same tick the wait expired; keep it
+                return waiter.future.result()
+            self._remove_waiter(waiter)
+            self.counters["shed"] += 1
+            raise AdmissionRejected(
+                f"{priority} request deferred {policy.max_wait_s:.0f}s without capacity",
+                retry_after=self.predicted_ttft(cost),
+            )
+        except asyncio.CancelledError:
+            # Client went away while queued
+            if waiter.future.done() and not waiter.future.cancelled():
+                self.release(waiter.future.result())
+            self._remove_waiter(waiter)
+            raise
+
+    def try_acquire(self, cost: RequestCost, priority: str) -> Optional[Ticket]:
+        """Admit a request only if it can run immediately, without queueing."""
+        now = time.monotonic()
+        if self._queues[priority] or not self._can_admit(priority, cost, now):
+            return None
+        return self._admit(priority, cost, now)
+
+    def _remove_waiter(self, waiter: _Waiter) -> None:
+        queue = self._queues[waiter.priority]
+        if waiter in queue:
+            queue.remove(waiter)
+        if not waiter.future.done():
+            waiter.future.cancel()
+
+    def mark_first_token(self, ticket: Ticket) -> None:
+        """Record that prefill for `ticket` finished; frees backlog for queued work."""
+        if ticket.first_token_at is None:
+            ticket.first_token_at = time.monotonic()
+            self._pump()
+
+    def release(self, ticket: Ticket) -> None:
+        """Return a ticket's class capacity and admit queued work."""
+        if ticket in self._active:
+            self._active.remove(ticket)
+        self._pump()
+
+    # --- Queue pump ---
+
+    def _pump(self) -> None:
+        now = time.monotonic()
+        for priority in PRIORITIES:
+            queue = self._queues[priority]
+            while queue:
+                waiter = queue[0]
+                if waiter.future.done():
+                    queue.pop(0)
+                    continue
+                if not self._can_admit(priority, waiter.cost, now):
+                    break
+                queue.pop(0)
+                waiter.future.set_result(self._admit(priority, waiter.cost, now))
+
+    def _ensure_pump(self) -> None:
+        if self._pump_task is None or self._pump_task.done():
+            self._pump_task = asyncio.get_running_loop().create_task(self._pump_loop())
+
+    async def _pump_loop(self) -> None:
+        # Deferred batch work becomes admissible as the backlog drains even
+        # without a release, so re-evaluate on a timer while anything waits
+        while any(self._queues.values()):
+            await asyncio.sleep(PUMP_INTERVAL_S)
+            self._pump()
+
+    # --- State for routing ---
+
+    def active_tickets(self) -> List[Ticket]:
+        return list(self._active)
+
+    def queued_costs(self) -> List[RequestCost]:
+        return [w.cost for p in PRIORITIES for w in self._queues[p] if not w.future.done()]
+
+    # --- Reporting ---
+
+    def stats(self) -> Dict[str, Any]:
+        now = time.monotonic()
+        self._drain_backlog(now)
+        classes = {}
+        for priority in PRIORITIES:
+            count, tokens = self._class_usage(priority)
+            classes[priority] = {
+                "active": count,
+                "tokens_in_flight": tokens,
+                "queued": len(self._queues[priority]),
+            }
+        return {
+            "ttft_slo_s": self.ttft_slo_s,
+            "prefill_backlog_tokens": int(self._backlog_tokens),
+            "predicted_ttft_s": round(self._backlog_tokens / max(self.calibrator.prefill_tps, 1e-6), 3),
+            "calibration": self.calibrator.to_dict(),
+            "classes": classes,
+            "counters": dict(self.counters),
+        }
@@ -0,0 +1,140 @@
+#!/usr/bin/env python3
+"""
+Learned per-backend cost model for routing between inference backends.
+Predicts a request's completion time on each backend from calibrated
+prefill/decode rates, slot occupancy, queue depth and context limits, and
+keeps those inputs current by probing the backends.
+"""
+
+import time
+from typing import Any, Dict, Optional
+
+from aiohttp import ClientError, ClientSession, ClientTimeout
+
+from admission import AdmissionController, RequestCost
+
+# Backend kinds and their seed rates (prefill tok/s, decode tok/s) until calibrated
+KIND_CPU = "cpu"
+KIND_GPU = "gpu"
+SEED_RATES = {
+    KIND_CPU: (250.0, 35.0),
+    KIND_GPU: (4000.0, 250.0),
+}
+
+# Backend probing
+PROBE_TIMEOUT_S = 3.0
+PROBE_INTERVAL_S = 10.0
+
+
+class BackendModel:
+    """Learned performance model of one inference backend.
+
+    The prefill/decode rates come from the backend's RateCalibrator. On top of
+    that the model learns how much of max_tokens requests actually generate,
+    and probes the backend for health, slot count and context limit.
+    """
+
+    def __init__(self, kind: str, admission: AdmissionController,
+                 slots: int = 1, context_limit: Optional[int] = None, alpha: float = 0.2):
+        self.kind = kind
+        self.admission = admission
+        self.slots = slots
+        self.context_limit = context_limit
+        self.alpha = alpha
+
+        self.healthy = True
+        self.model_id: Optional[str] = None
+        self.generation_ratio = 1.0
+        self.last_probe = 0.0
+
+    @property
+    def calibrator(self):
+        return self.admission.calibrator
+
+    def expected_generation(self, cost: RequestCost) -> float:
+        return max(1.0, cost.max_tokens * self.generation_ratio)
+
+    def service_time(self, cost: RequestCost) -> float:
+        """Seconds to prefill and decode `cost` once it holds a slot."""
+        return (cost.prompt_tokens / self.calibrator.prefill_tps
+                + self.expected_generation(cost) / self.calibrator.decode_tps)
+
+    def queue_wait(self, now: float) -> float:
+        """Seconds until a slot frees up for a newly dispatched request."""
+        active = self.admission.active_tickets()
+        queued = self.admission.queued_costs()
+        if len(active) + len(queued) < self.slots:
+            return 0.0
+
+        # The oldest `slots` dispatched requests are running; the rest wait in
+        # the backend's own queue, then router-queued work drains in order
+        active.sort(key=lambda t: t.admitted_at)
+        running, waiting = active[:self.slots], active[self.slots:]
+        free_at = sorted(max(0.0, self.service_time(t.cost) - (now - t.admitted_at)) for t in running)
+        free_at += [0.0] * (self.slots - len(free_at))
+        for cost in [t.cost for t in waiting] + queued:
+            free_at[0] += self.service_time(cost)
+            free_at.sort()
+        return free_at[0]
+
+    def fits(self, cost: RequestCost) -> bool:
+        return self.context_limit is None or cost.total_tokens <= self.context_limit
+
+    def predict(self, cost: RequestCost, now: Optional[float] = None) -> float:
+        """Predicted completion time in seconds, or infinity if the backend cannot serve it."""
+        if not self.healthy or not self.fits(cost):
+            return float("inf")
+        now = time.monotonic() if now is None else now
+        # Shared prefill backlog delays the first token even when a slot is free
+        prefill_wait = self.admission.predicted_ttft(cost, now) - cost.prompt_tokens / self.calibrator.prefill_tps
+        return max(self.queue_wait(now), prefill_wait) + self.service_time(cost)
+
+    def observe(self, cost: RequestCost, completion_tokens: int) -> None:
+        """Learn the fraction of max_tokens that requests actually generate."""
+        if cost.max_tokens > 0 and completion_tokens > 0:
+            sample = min(1.0, completion_tokens / cost.max_tokens)
+            self.generation_ratio = (1.0 - self.alpha) * self.generation_ratio + self.alpha * sample
+
+    async def probe(self, session: ClientSession, url: str) -> None:
+        """Refresh health, served model, slot count and context limit from the backend.
+
+        llama-server reports n_ctx per slot and total_slots in /props; vLLM
+        reports max_model_len in /v1/models and only accepts its own model id.
+        """
+        self.last_probe = time.monotonic()
+        timeout = ClientTimeout(total=PROBE_TIMEOUT_S)
+        try:
+            async with session.get(f"{url}/health", timeout=timeout) as response:
+                # llama-server answers 503 while the model is still loading
+                self.healthy = response.status == 200
+            if not self.healthy:
+                return
+
+            async with session.get(f"{url}/v1/models", timeout=timeout) as response:
+                if response.status == 200:
+                    models = (await response.json()).get("data", [])
+                    if models:
+                        self.model_id = models[0].get("id", self.model_id)
+                        if models[0].get("max_model_len"):
+                            self.context_limit = int(models[0]["max_model_len"])
+
+            async with session.get(f"{url}/props", timeout=timeout) as response:
+                if response.status == 200:
+                    props = await response.json()
+                    self.slots = int(props.get("total_slots", self.slots))
+                    n_ctx = props.get("default_generation_settings", {}).get("n_ctx")
+                    if n_ctx:
+                        self.context_limit = int(n_ctx)
+        except (ClientError, TimeoutError, ValueError):
+            self.healthy = False
+
+    def to_dict(self) -> Dict[str, Any]:
+        return {
+            "kind": self.kind,
+            "healthy": self.healthy,
+            "model_id": self.model_id,
+            "slots": self.slots,
+            "context_limit": self.context_limit,
+            "generation_ratio": round(self.generation_ratio, 3),
+            "queue_wait_s": round(self.queue_wait(time.monotonic()), 3),
+        }
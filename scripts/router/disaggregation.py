@@ -0,0 +1,137 @@
+#!/usr/bin/env python3
+"""
+Prefill/decode disaggregation across local llama-server replicas.
+Runs the prefill of long prompts on a prefill-designated replica, hands the
+resulting KV state to a decode replica as a slot snapshot in the shared
+memory-backed directory, and lets the decode replica continue from there, so
+long prefills never enter a decode replica's continuous batch.
+"""
+
+import asyncio
+import time
+from dataclasses import replace
+from typing import Any, Dict, List, Optional
+
+from aiohttp import ClientError, ClientSession
+
+from accounting import CostAccountant
+from admission import AdmissionRejected, RequestCost
+from snapshots import SnapshotStore
+
+# Backend roles
+ROLE_MIXED = "mixed"
+ROLE_PREFILL = "prefill"
+ROLE_DECODE = "decode"
+ROLES = (ROLE_MIXED, ROLE_PREFILL, ROLE_DECODE)
+
+
+class DisaggregationCoordinator:
+    """Prefill stage of disaggregated requests.
+
+    A request whose uncached prompt is at least min_prompt_tokens long is
+    first sent to the least loaded prefill replica with a one-token
+    generation budget, pinned to a slot. That slot is saved into the
+    snapshot store under the request's prefixes; the router then dispatches
+    the original request to a decode replica, which restores the snapshot
+    and only prefills the remaining token before streaming.
+    """
+
+    def __init__(self, store: SnapshotStore, min_prompt_tokens: int = 4096,
+                 accounting: Optional[CostAccountant] = None):
+        self.store = store
+        self.min_prompt_tokens = min_prompt_tokens
+        self.accounting = accounting
+        self.counters = {"handoffs": 0, "prefill_failures": 0, "handoff_failures": 0, "shed": 0}
+        self.prefill_ms: List[float] = []
+        self.handoff_ms: List[float] = []
+
+    def eligible(self, cost: RequestCost) -> bool:
+        return cost.prompt_tokens >= self.min_prompt_tokens
+
+    @staticmethod
+    def select_prefill(backends: List[Any], model_id: Optional[str], cost: RequestCost) -> Optional[Any]:
+        """Healthy prefill replica serving `model_id` with the lowest predicted TTFT."""
+        now = time.monotonic()
+        candidates = [b for b in backends
+                      if b.role == ROLE_PREFILL and b.model.healthy and b.snapshots_enabled
+                      and b.model.model_id == model_id and b.model.fits(cost)]
+        if not candidates:
+            return None
+        return min(candidates, key=lambda b: b.admission.predicted_ttft(cost, now))
+
+    async def prefill(self, session: ClientSession, backend: Any, path: str, body: Dict[str, Any],
+                      headers: Dict[str, str], cost: RequestCost, priority: str,
+                      request_id: str = "") -> bool:
+        """Prefill `body` on `backend` and save the slot for a decode replica.
+
+        Returns False when the prefill replica sheds or fails the request;
+        the caller then serves it without disaggregation.
+        """
+        try:
+            ticket = await backend.admission.acquire(replace(cost, max_tokens=1), priority)
+        except AdmissionRejected:
+            self.counters["shed"] += 1
+            return False
+
+        slot = None
+        window = None
+        try:
+            # Acquired inside the try so a cancellation while waiting for a slot
+            # still returns the ticket, and one right after returns the slot
+            slot = await backend.slot_pool.acquire()
+            model_id = backend.model.model_id or ""
+            plan = self.store.plan(body, model_id, backend.admission.calibrator.chars_per_token)
+            started = time.monotonic()
+            if self.accounting is not None:
+                # Cost record of the prefill stage, under the same request id as the decode stage
+                window = self.accounting.begin(request_id, "prefill", backend, ticket.cost, priority)
+            # A cached part of the prompt still does not need prefilling here
+            await self.store.restore(session, backend.url, slot, plan)
+            prefill_body = dict(body, max_tokens=1, n_predict=1, stream=False, id_slot=slot)
+            prefill_body.pop("stream_options", None)
+            if model_id:
+                prefill_body["model"] = model_id
+            try:
+                async with session.post(f"{backend.url}{path}", json=prefill_body,
+                                        headers=headers) as response:
+                    payload = await response.json(content_type=None)
+                    if response.status != 200:
+                        raise ValueError(payload)
+            except (ClientError, asyncio.TimeoutError, ValueError):
+                self.counters["prefill_failures"] += 1
+                return False
+            if self.accounting is not None:
+                self.accounting.end(window, "ok", payload.get("timings"), payload.get("usage"),
+                                    (payload.get("usage") or {}).get("completion_tokens", 1))
+            backend.admission.mark_first_token(ticket)
+            backend.admission.calibrator.observe(payload.get("timings"), payload.get("usage"),
+                                                 cost.prompt_chars)
+            prefilled = time.monotonic()
+
+            # Index the handoff under the full request so the decode replica hits it
+            if not plan.prefixes or not await self.store.save(session, backend.url, slot, plan,
+                                                              key=plan.prefixes[0].key):
+                self.counters["handoff_failures"] += 1
+                return False
+
+            self.counters["handoffs"] += 1
+            self.prefill_ms = (self.prefill_ms + [(prefilled - started) * 1000])[-256:]
+            self.handoff_ms = (self.handoff_ms + [(time.monotonic() - prefilled) * 1000])[-256:]
+            return True
+        finally:
+            if self.accounting is not None:
+                self.accounting.end(window, "failed")
+            if slot is not None:
+                backend.slot_pool.release(slot)
+            backend.admission.release(ticket)
+
+    def stats(self) -> Dict[str, Any]:
+        def p50(samples: List[float]) -> Optional[float]:
+            return round(sorted(samples)[len(samples) // 2], 1) if samples else None
+
+        return {
+            "min_prompt_tokens": self.min_prompt_tokens,
+            "prefill_ms_p50": p50(self.prefill_ms),
+            "handoff_save_ms_p50": p50(self.handoff_ms),
+            **self.counters,
+        }
@@ -0,0 +1,92 @@
+#!/usr/bin/env python3
+"""
+Hedged request policy for short interactive requests.
+If the first token has not arrived within a percentile of recently observed
+TTFTs, a duplicate is sent to a second replica and the slower one is aborted.
+A credit budget caps the extra load hedging may add.
+"""
+
+import math
+from collections import deque
+from typing import Any, Deque, Dict
+
+from admission import PRIORITY_INTERACTIVE, RequestCost
+
+# Samples required before the percentile threshold replaces the initial delay
+MIN_TTFT_SAMPLES = 20
+
+
+class LatencyTracker:
+    """Sliding window of observed time-to-first-token samples."""
+
+    def __init__(self, window: int = 512):
+        self.samples: Deque[float] = deque(maxlen=window)
+
+    def record(self, seconds: float) -> None:
+        self.samples.append(seconds)
+
+    def percentile(self, pct: float) -> float:
+        if not self.samples:
+            return 0.0
+        ordered = sorted(self.samples)
+        index = min(len(ordered) - 1, max(0, math.ceil(pct / 100.0 * len(ordered)) - 1))
+        return ordered[index]
+
+
+class HedgePolicy:
+    """Decides whether and when a request is hedged.
+
+    Every eligible request earns `budget_ratio` credits (capped at `burst`);
+    each hedge spends one credit, so at most ~budget_ratio extra requests per
+    eligible request reach the replicas over time.
+    """
+
+    def __init__(self, percentile: float = 95.0, initial_delay_s: float = 1.0,
+                 min_delay_s: float = 0.05, max_prompt_tokens: int = 2048,
+                 budget_ratio: float = 0.05, burst: float = 5.0):
+        self.percentile = percentile
+        self.initial_delay_s = initial_delay_s
+        self.min_delay_s = min_delay_s
+        self.max_prompt_tokens = max_prompt_tokens
+        self.budget_ratio = budget_ratio
+        self.burst = burst
+
+        self.ttft = LatencyTracker()
+        self.credits = burst
+        self.counters = {"eligible": 0, "hedged": 0, "hedge_won": 0, "budget_exhausted": 0}
+
+    def eligible(self, priority: str, cost: RequestCost) -> bool:
+        """Short interactive requests are the only ones worth duplicating."""
+        if priority != PRIORITY_INTERACTIVE or cost.prompt_tokens > self.max_prompt_tokens:
+            return False
+        self.counters["eligible"] += 1
+        self.credits = min(self.burst, self.credits + self.budget_ratio)
+        return True
+
+    def delay(self) -> float:
+        """Seconds to wait for the first token before sending the hedge."""
+        if len(self.ttft.samples) < MIN_TTFT_SAMPLES:
+            return self.initial_delay_s
+        return max(self.min_delay_s, self.ttft.percentile(self.percentile))
+
+    def try_spend(self) -> bool:
+        if self.credits < 1.0:
+            self.counters["budget_exhausted"] += 1
+            return False
+        self.credits -= 1.0
+        self.counters["hedged"] += 1
+        return True
+
+    def record(self, ttft_s: float, hedge_won: bool) -> None:
+        self.ttft.record(ttft_s)
+        if hedge_won:
+            self.counters["hedge_won"] += 1
+
+    def stats(self) -> Dict[str, Any]:
+        return {
+            "percentile": self.percentile,
+            "delay_s": round(self.delay(), 3),
+            "ttft_samples": len(self.ttft.samples),
+            "credits": round(self.credits, 2),
+            "counters": dict(self.counters),
+        }
@@ -0,0 +1,306 @@
+#!/usr/bin/env python3
+"""
+Mock inference backend for exercising the router without models or hardware.
+Emulates the llama-server or vLLM HTTP surface with configurable prefill and
+decode rates, slot count, context limit, load time, random stalls and
+llama-server's per-slot prompt cache with slot save/restore.
+"""
+
+import argparse
+import asyncio
+import json
+import os
+import random
+import sys
+import time
+from typing import Any, Dict
+
+from aiohttp import web
+
+# Exit codes
+EXIT_SUCCESS = 0
+EXIT_FAILURE = 1
+
+FLAVOR_LLAMA = "llama"
+FLAVOR_VLLM = "vllm"
+
+# Rough characters per token of the emulated tokenizer
+CHARS_PER_TOKEN = 4
+
+
+class MockEngine:
+    """Slot-limited engine with a shared, serialized prefill stage."""
+
+    def __init__(self, args: argparse.Namespace):
+        self.args = args
+        self.slots = asyncio.Semaphore(args.slots)
+        self.prefill_lock = asyncio.Lock()
+        self.ready_at = time.monotonic() + args.load_time
+        self.counters = {"requests": 0, "processing": 0, "deferred": 0, "cancelled": 0,
+                         "prompt_tokens": 0, "completion_tokens": 0}
+        # Prompt text cached per slot id, reused as the longest common prefix
+        self.slot_cache: Dict[int, str] = {}
+
+    @property
+    def ready(self) -> bool:
+        return time.monotonic() >= self.ready_at
+
+    @staticmethod
+    def prompt_text(body: Dict[str, Any]) -> str:
+        if "messages" in body:
+            return "".join(str(m.get("content", "")) for m in body["messages"])
+        return str(body.get("prompt", ""))
+
+    def prompt_tokens(self, body: Dict[str, Any]) -> int:
+        return max(1, len(self.prompt_text(body)) // CHARS_PER_TOKEN)
+
+    def cached_tokens(self, id_slot: int, text: str) -> int:
+        cached = self.slot_cache.get(id_slot, "")
+        common = len(os.path.commonprefix([cached, text]))
+        return common // CHARS_PER_TOKEN
+
+    def completion_tokens(self, body: Dict[str, Any]) -> int:
+        max_tokens = body.get("max_tokens") or body.get("n_predict") or 256
+        # Most requests stop before max_tokens
+        return max(1, int(max_tokens * random.uniform(self.args.min_generation, 1.0)))
+
+    def timings(self, n_prompt: int, prompt_s: float, n_gen: int, gen_s: float) -> Dict[str, Any]:
+        return {
+            "prompt_n": n_prompt,
+            "prompt_ms": prompt_s * 1000,
+            "prompt_per_second": n_prompt / prompt_s if prompt_s > 0 else 0,
+            "predicted_n": n_gen,
+            "predicted_ms": gen_s * 1000,
+            "predicted_per_second": n_gen / gen_s if gen_s > 0 else 0,
+        }
+
+    def chunk(self, content: str = "", finish: bool = False, extra: Dict[str, Any] = None) -> bytes:
+        payload = {"object": "chat.completion.chunk", "model": self.args.model,
+                   "choices": [{"index": 0, "delta": {"content": content} if content else {},
+                                "finish_reason": "length" if finish else None}]}
+        payload.update(extra or {})
+        return f"data: {json.dumps(payload)}\n\n".encode()
+
+    async def handle_completion(self, request: web.Request) -> web.StreamResponse:
+        if not self.ready:
+            return web.json_response({"error": {"message": "Loading model", "code": 503}}, status=503)
+
+        body = await request.json()
+        n_prompt = self.prompt_tokens(body)
+        n_gen = self.completion_tokens(body)
+        if n_prompt + n_gen > self.args.ctx_size:
+            return web.json_response(
+                {"error": {"message": "the request exceeds the available context size", "code": 400}},
+                status=400)
+
+        self.counters["requests"] += 1
+        self.counters["deferred"] += 1
+        try:
+            async with self.slots:
+                self.counters["deferred"] -= 1
+                self.counters["processing"] += 1
+                try:
+                    return await self._generate(request, body, n_prompt, n_gen)
+                finally:
+                    self.counters["processing"] -= 1
+        except asyncio.CancelledError:
+            self.counters["cancelled"] += 1
+            raise
+
+    async def _generate(self, request: web.Request, body: Dict[str, Any],
+                        n_prompt: int, n_gen: int) -> web.StreamResponse:
+        started = time.monotonic()
+        id_slot = body.get("id_slot", -1)
+        text = self.prompt_text(body)
+        n_processed = n_prompt
+        if id_slot >= 0:
+            # Only the part after the slot's cached prefix is prefilled
+            n_processed = max(1, n_prompt - self.cached_tokens(id_slot, text))
+            self.slot_cache[id_slot] = text + " ".join(f"tok{i}" for i in range(n_gen))
+        async with self.prefill_lock:
+            if random.random() < self.args.stall_probability:
+                await asyncio.sleep(self.args.stall)
+            await asyncio.sleep(n_processed / self.args.prefill_tps)
+        prompt_s = time.monotonic() - started
+        self.counters["prompt_tokens"] += n_processed
+
+        usage = {"prompt_tokens": n_prompt, "completion_tokens": n_gen,
+                 "total_tokens": n_prompt + n_gen}
+        token_s = 1.0 / self.args.decode_tps
+
+        if body.get("stream"):
+            response = web.StreamResponse()
+            response.content_type = "text/event-stream"
+            await response.prepare(request)
+            decode_started = time.monotonic()
+            for i in range(n_gen):
+                await response.write(self.chunk(f"tok{i} "))
+                self.counters["completion_tokens"] += 1
+                await asyncio.sleep(token_s)
+            extra = {"usage": usage}
+            if self.args.flavor == FLAVOR_LLAMA:
+                extra["timings"] = self.timings(n_processed, prompt_s, n_gen, time.monotonic() - decode_started)
+            await response.write(self.chunk(finish=True, extra=extra))
+            await response.write(b"data: [DONE]\n\n")
+            await response.write_eof()
+            return response
+
+        decode_started = time.monotonic()
+        await asyncio.sleep(n_gen * token_s)
+        self.counters["completion_tokens"] += n_gen
+        payload = {
+            "object": "chat.completion",
+            "model": self.args.model,
+            "choices": [{"index": 0, "finish_reason": "length",
+                         "message": {"role": "assistant", "content": " ".join(f"tok{i}" for i in range(n_gen))}}],
+            "usage": usage,
+        }
+        if self.args.flavor == FLAVOR_LLAMA:
+            payload["timings"] = self.timings(n_processed, prompt_s, n_gen, time.monotonic() - decode_started)
+        return web.json_response(payload)
+
+    async def handle_slot_action(self, request: web.Request) -> web.Response:
+        """Emulate POST /slots/{id}?action=save|restore with a text file per snapshot."""
+        if not self.args.slot_save_path:
+            return web.json_response(
+                {"error": {"code": 501, "type": "not_supported_error",
+                           "message": "This server does not support slots action. Start it with `--slot-save-path`"}},
+                status=501)
+        id_slot = int(request.match_info["id_slot"])
+        action = request.query.get("action")
+        filename = (await request.json()).get("filename", "")
+        if not filename or "/" in filename:
+            return web.json_response({"error": {"code": 400, "message": "Invalid filename"}}, status=400)
+        path = os.path.join(self.args.slot_save_path, filename)
+        started = time.monotonic()
+
+        if action == "save":
+            text = self.slot_cache.get(id_slot, "")
+            n_tokens = len(text) // CHARS_PER_TOKEN
+            with open(path, "w") as f:
+                f.write(text)
+                # Pad to the size of a real KV cache for this many tokens
+                f.write("\0" * (n_tokens * self.args.kv_bytes_per_token))
+            return web.json_response({"id_slot": id_slot, "filename": filename, "n_saved": n_tokens,
+                                      "n_written": os.path.getsize(path),
+                                      "timings": {"save_ms": (time.monotonic() - started) * 1000}})
+        if action == "restore":
+            try:
+                with open(path) as f:
+                    text = f.read().split("\0", 1)[0]
+            except OSError:
+                return web.json_response({"error": {"code": 400, "message": "Unable to restore slot"}},
+                                         status=400)
+            self.slot_cache[id_slot] = text
+            return web.json_response({"id_slot": id_slot, "filename": filename,
+                                      "n_restored": len(text) // CHARS_PER_TOKEN,
+                                      "n_read": os.path.getsize(path),
+                                      "timings": {"restore_ms": (time.monotonic() - started) * 1000}})
+        return web.json_response({"error": {"code": 400, "message": "Invalid action"}}, status=400)
+
+    async def handle_health(self, request: web.Request) -> web.Response:
+        if not self.ready:
+            return web.json_response({"error": {"message": "Loading model", "code": 503}}, status=503)
+        return web.json_response({"status": "ok"})
+
+    async def handle_props(self, request: web.Request) -> web.Response:
+        return web.json_response({
+            "total_slots": self.args.slots,
+            "default_generation_settings": {"n_ctx": self.args.ctx_size},
+            "model_path": self.args.model,
+        })
+
+    async def handle_models(self, request: web.Request) -> web.Response:
+        model = {"id": self.args.model, "object": "model"}
+        if self.args.flavor == FLAVOR_VLLM:
+            model["max_model_len"] = self.args.ctx_size
+        return web.json_response({"object": "list", "data": [model]})
+
+    async def handle_metrics(self, request: web.Request) -> web.Response:
+        lines = [
+            f"llamacpp:requests_processing {self.counters['processing']}",
+            f"llamacpp:requests_deferred {self.counters['deferred']}",
+            f"llamacpp:prompt_tokens_total {self.counters['prompt_tokens']}",
+            f"llamacpp:tokens_predicted_total {self.counters['completion_tokens']}",
+            f"mock:requests_total {self.counters['requests']}",
+            f"mock:requests_cancelled_total {self.counters['cancelled']}",
+        ]
+        return web.Response(text="\n".join(lines) + "\n", content_type="text/plain")
+
+    def build_app(self) -> web.Application:
+        app = web.Application(client_max_size=64 * 1024 * 1024)
+        for path in ("/v1/chat/completions", "/v1/completions", "/completion"):
+            app.router.add_post(path, self.handle_completion)
+        app.router.add_get("/health", self.handle_health)
+        app.router.add_get("/v1/health", self.handle_health)
+        app.router.add_get("/v1/models", self.handle_models)
+        app.router.add_get("/metrics", self.handle_metrics)
+        if self.args.flavor == FLAVOR_LLAMA:
+            app.router.add_get("/props", self.handle_props)
+            app.router.add_post("/slots/{id_slot}", self.handle_slot_action)
+        return app
+
+
+def create_parser() -> argparse.ArgumentParser:
+    """Create command line argument parser."""
+    parser = argparse.ArgumentParser(
+        description="Mock llama-server / vLLM backend for router testing",
+        formatter_class=argparse.RawDescriptionHelpFormatter,
+        epilog="""
+Examples:
+  python mock_backend.py --port 9001 --prefill-tps 250 --decode-tps 35 --slots 4
+  python mock_backend.py --port 9004 --prefill-tps 4000 --decode-tps 250 --slots 2
+  python mock_backend.py --port 9005 --flavor vllm --prefill-tps 8000 --decode-tps 200 --slots 16
+        """
+    )
+
+    parser.add_argument("--host", default="127.0.0.1", help="Listen address (default: 127.0.0.1)")
+    parser.add_argument("--port", type=int, default=9001, help="Listen port (default: 9001)")
+    parser.add_argument("--flavor", choices=[FLAVOR_LLAMA, FLAVOR_VLLM], default=FLAVOR_LLAMA,
+                        help="HTTP surface to emulate (default: llama)")
+    parser.add_argument("--model", default="mock-model", help="Reported model id (default: mock-model)")
+    parser.add_argument("--prefill-tps", type=float, default=250.0,
+                        help="Prompt processing rate in tokens/sec (default: 250)")
+    parser.add_argument("--decode-tps", type=float, default=35.0,
+                        help="Per-stream generation rate in tokens/sec (default: 35)")
+    parser.add_argument("--slots", type=int, default=4, help="Parallel slots (default: 4)")
+    parser.add_argument("--ctx-size", type=int, default=32768,
+                        help="Context limit per request in tokens (default: 32768)")
+    parser.add_argument("--load-time", type=float, default=0.0,
+                        help="Seconds /health reports 503 after start (default: 0)")
+    parser.add_argument("--min-generation", type=float, default=0.5,
+                        help="Minimum fraction of max_tokens generated (default: 0.5)")
+    parser.add_argument("--stall", type=float, default=0.0,
+                        help="Extra prefill delay in seconds for stalled requests (default: 0)")
+    parser.add_argument("--stall-probability", type=float, default=0.0,
+                        help="Probability a request stalls before prefill (default: 0)")
+    parser.add_argument("--slot-save-path",
+                        help="Directory for slot save/restore, as llama-server's --slot-save-path (default: off)")
+    parser.add_argument("--kv-bytes-per-token", type=int, default=1024,
+                        help="Padding per token in saved slot files (default: 1024)")
+
+    return parser
+
+
+def main() -> int:
+    """Main function to run the mock backend.
+
+    Returns:
+        Exit code: 0 for success, 1 for failure.
+    """
+    args = create_parser().parse_args()
+    engine = MockEngine(args)
+    print(f"Mock {args.flavor} backend on {args.host}:{args.port} "
+          f"(prefill {args.prefill_tps:g} tok/s, decode {args.decode_tps:g} tok/s, {args.slots} slots)")
+    try:
+        # Cancel handlers on client disconnect, as llama-server cancels the slot
+        web.run_app(engine.build_app(), host=args.host, port=args.port, print=None,
+                    handler_cancellation=True)
+        return EXIT_SUCCESS
+    except OSError as e:
+        print(f"Mock backend: cannot listen on {args.host}:{args.port}: {e}", file=sys.stderr)
+        return EXIT_FAILURE
+
+
+if __name__ == "__main__":
+    sys.exit(main())
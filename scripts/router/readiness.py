@@ -0,0 +1,119 @@
+#!/usr/bin/env python3
+"""
+Backend readiness from the huge page wrapper's live load progress.
+Reads the progress file a llama-cpu replica's wrapper keeps current while it
+loads the model (HUGEPAGE_WRAPPER_PROGRESS, layout in
+docker/llama-cpu/hugepage_progress.h), so the router can report bytes
+loaded, rate and ETA of a starting replica and probe it the moment its model
+is mapped instead of on the next regular probe.
+"""
+
+import os
+import struct
+import time
+from dataclasses import dataclass
+from typing import Any, Dict, Optional
+
+# hugepage_progress.h: magic, version, pid, seq, state, models, started_ns,
+# updated_ns, total_bytes, loaded_bytes, stage[32], path[256]
+PROGRESS_MAGIC = 0x50474F5250575048
+PROGRESS_VERSION = 1
+PROGRESS_LAYOUT = struct.Struct("<QIIQIIQQQQ32s256s")
+SEQ_OFFSET = 16
+
+LOAD_STATES = ("starting", "calibrating", "loading", "loaded", "failed")
+STATE_LOADING = "loading"
+STATE_CALIBRATING = "calibrating"
+STATE_LOADED = "loaded"
+
+# A load whose progress has not moved for this long is reported as stalled
+STALL_S = 60.0
+READ_ATTEMPTS = 100
+
+# Backends that are down are probed this often, so a replica that finished
+# loading takes traffic within a second
+READY_PROBE_INTERVAL_S = 1.0
+
+
+@dataclass
+class LoadProgress:
+    """One consistent snapshot of a replica's load progress."""
+
+    state: str
+    stage: str
+    path: str
+    models: int
+    total_bytes: int
+    loaded_bytes: int
+    elapsed_s: float
+    age_s: float
+
+    @property
+    def active(self) -> bool:
+        return self.state in (STATE_LOADING, STATE_CALIBRATING)
+
+    @property
+    def stalled(self) -> bool:
+        return self.active and self.age_s > STALL_S
+
+    @property
+    def rate(self) -> float:
+        """Bytes per second of the current load."""
+        return self.loaded_bytes / self.elapsed_s if self.elapsed_s > 0 else 0.0
+
+    @property
+    def eta_s(self) -> Optional[float]:
+        if self.state != STATE_LOADING or self.rate <= 0:
+            return None
+        return max(0, self.total_bytes - self.loaded_bytes) / self.rate
+
+    def to_dict(self) -> Dict[str, Any]:
+        eta = self.eta_s
+        return {
+            "state": "stalled" if self.stalled else self.state,
+            "stage": self.stage,
+            "path": self.path,
+            "models": self.models,
+            "total_bytes": self.total_bytes,
+            "loaded_bytes": self.loaded_bytes,
+            "bytes_per_second": round(self.rate),
+            "eta_s": round(eta, 1) if eta is not None else None,
+        }
+
+
+def read_progress(path: str) -> Optional[LoadProgress]:
+    """Read a progress file; None if it is missing, foreign or keeps changing.
+
+    A copy is consistent when the wrapper's sequence counter was even and
+    unchanged after reading it, as in progress_read() of hugepage_progress.h.
+    Times are CLOCK_MONOTONIC, which the container shares with the host.
+    """
+    try:
+        with open(path, "rb", buffering=0) as f:
+            for _ in range(READ_ATTEMPTS):
+                data = os.pread(f.fileno(), PROGRESS_LAYOUT.size, 0)
+                seq_after = os.pread(f.fileno(), 8, SEQ_OFFSET)
+                if len(data) < PROGRESS_LAYOUT.size or len(seq_after) < 8:
+                    return None
+                (magic, version, _pid, seq, state, models, started_ns, updated_ns,
+                 total_bytes, loaded_bytes, stage, file_path) = PROGRESS_LAYOUT.unpack(data)
+                if seq % 2 == 0 and struct.unpack("<Q", seq_after)[0] == seq:
+                    break
+                time.sleep(0.0001)
+            else:
+                return None
+    except OSError:
+        return None
+    if magic != PROGRESS_MAGIC or version != PROGRESS_VERSION or state >= len(LOAD_STATES):
+        return None
+    now_ns = time.monotonic_ns()
+    return LoadProgress(
+        state=LOAD_STATES[state],
+        stage=stage.split(b"\0", 1)[0].decode(errors="replace"),
+        path=file_path.split(b"\0", 1)[0].decode(errors="replace"),
+        models=models,
+        total_bytes=total_bytes,
+        loaded_bytes=loaded_bytes,
+        elapsed_s=max(0, updated_ns - started_ns) / 1e9,
+        age_s=max(0, now_ns - updated_ns) / 1e9,
+    )
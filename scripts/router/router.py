@@ -0,0 +1,761 @@
+#!/usr/bin/env python3
+"""
+Admission-controlled router for llama-server inference endpoints.
+Proxies OpenAI-compatible and native completion requests to one or more
+llama-server or vLLM backends, routing each request to the backend with the
+lowest predicted completion time and applying SLO-aware admission control,
+interactive/batch priority queueing, optional hedging of short interactive
+requests, optional KV slot snapshots for reused prompt prefixes, optional
+prefill/decode disaggregation across CPU replicas and optional per-request
+resource accounting. Backends that are down are probed every second, and a
+replica still loading its model (per the huge page wrapper's progress file)
+reports its load progress instead.
+"""
+
+import argparse
+import asyncio
+import json
+import os
+import sys
+import time
+from dataclasses import replace
+from typing import Any, Dict, List, Optional
+
+from aiohttp import ClientError, ClientResponse, ClientSession, ClientTimeout, web
+
+from accounting import SAMPLE_INTERVAL_S, CostAccountant, RequestWindow, resolve_cgroup
+from admission import (
+    PRIORITY_BATCH,
+    PRIORITY_INTERACTIVE,
+    AdmissionController,
+    AdmissionRejected,
+    ClassPolicy,
+    InvalidRequest,
+    RateCalibrator,
+    RequestCost,
+    Ticket,
+    classify_priority,
+)
+from cost_model import KIND_CPU, KIND_GPU, PROBE_INTERVAL_S, SEED_RATES, BackendModel
+from disaggregation import ROLE_MIXED, ROLE_PREFILL, ROLES, DisaggregationCoordinator
+from hedging import HedgePolicy
+from readiness import READY_PROBE_INTERVAL_S, LoadProgress, read_progress
+from snapshots import SlotPool, SnapshotPlan, SnapshotStore
+
+# Status indicators
+STATUS_OK = "OK"
+STATUS_WARN = "WARN"
+STATUS_ERROR = "ERROR"
+
+# Exit codes
+EXIT_SUCCESS = 0
+EXIT_FAILURE = 1
+EXIT_INVALID_USAGE = 2
+
+# Request paths that carry a generation workload and go through admission
+COMPLETION_PATHS = ("/v1/chat/completions", "/v1/completions", "/completion")
+
+# Hop-by-hop headers that must not be forwarded
+HOP_HEADERS = {"host", "content-length", "transfer-encoding", "connection", "keep-alive"}
+
+PRIORITY_HEADER = "X-Priority"
+BACKEND_HEADER = "X-Router-Backend"
+
+
+def extract_timings(payload: Dict[str, Any]) -> tuple:
+    """Return (timings, usage) from a llama-server response or final stream chunk."""
+    return payload.get("timings"), payload.get("usage")
+
+
+def parse_backend_spec(spec: str) -> tuple:
+    """Split a `[kind[:role]=]url` backend spec into (kind, role, url)."""
+    prefix, sep, url = spec.partition("=")
+    if not sep or "://" in prefix:
+        return KIND_CPU, ROLE_MIXED, spec
+    kind, _, role = prefix.partition(":")
+    return kind, role or ROLE_MIXED, url
+
+
+class Backend:
+    """One inference backend, its admission state and learned cost model."""
+
+    def __init__(self, url: str, admission: AdmissionController, kind: str = KIND_CPU,
+                 snapshots: Optional[SnapshotStore] = None, role: str = ROLE_MIXED,
+                 progress_file: Optional[str] = None):
+        self.url = url.rstrip("/")
+        self.role = role
+        self.progress_file = progress_file
+        self.admission = admission
+        self.model = BackendModel(kind, admission)
+        self.snapshots = snapshots
+        self.slot_pool = SlotPool(self.model.slots) if snapshots is not None else None
+
+    @property
+    def snapshots_enabled(self) -> bool:
+        return self.snapshots is not None and self.snapshots.supports(self.url)
+
+    def load_progress(self) -> Optional[LoadProgress]:
+        return read_progress(self.progress_file) if self.progress_file else None
+
+    def stats(self) -> Dict[str, Any]:
+        stats = {"url": self.url, "role": self.role, "model": self.model.to_dict(),
+                 "admission": self.admission.stats()}
+        progress = self.load_progress()
+        if progress is not None:
+            stats["load"] = progress.to_dict()
+        return stats
+
+
+class Attempt:
+    """One dispatch of a request to one backend, up to its first token."""
+
+    def __init__(self, backend: Backend, ticket: Ticket, hedge: bool = False,
+                 plan: Optional[SnapshotPlan] = None, accounting: Optional[CostAccountant] = None,
+                 request_id: str = ""):
+        self.backend = backend
+        self.ticket = ticket
+        self.hedge = hedge
+        self.plan = plan
+        self.accounting = accounting
+        self.request_id = request_id
+        self.window: Optional[RequestWindow] = None
+        self.slot: Optional[int] = None
+        self.session: Optional[ClientSession] = None
+        self.response: Optional[ClientResponse] = None
+        self.first_chunk = b""
+        self.released = False
+        self.started = 0.0
+        self.first_token_at: Optional[float] = None
+
+    @property
+    def ok(self) -> bool:
+        return self.response is not None and self.response.status == 200
+
+    async def run(self, session: ClientSession, path: str, body: Dict[str, Any],
+                  headers: Dict[str, str]) -> "Attempt":
+        """Send the request and wait for the first streamed line or the full body."""
+        self.started = time.monotonic()
+        self.session = session
+        if self.accounting is not None:
+            cached_tokens = 0
+            if self.plan is not None and self.plan.cached_chars:
+                cached_tokens = int(self.plan.cached_chars / self.backend.admission.calibrator.chars_per_token)
+            self.window = self.accounting.begin(self.request_id, "serve", self.backend, self.ticket.cost,
+                                                self.ticket.priority, cached_tokens, bool(body.get("stream")),
+                                                self.hedge)
+        if self.backend.model.model_id:
+            # Backends serving different models each expect their own model id
+            body = dict(body, model=self.backend.model.model_id)
+        try:
+            if self.plan is not None:
+                # Pin the request to the slot its prefix snapshot is restored into
+                self.slot = await self.backend.slot_pool.acquire()
+                if self.released:
+                    # Aborted while waiting for the slot: give it straight back
+                    raise asyncio.CancelledError()
+                await self.backend.snapshots.restore(session, self.backend.url, self.slot, self.plan)
+                body = dict(body, id_slot=self.slot)
+            self.response = await session.post(f"{self.backend.url}{path}", json=body, headers=headers)
+            if body.get("stream") and self.response.status == 200:
+                while not self.first_chunk.strip():
+                    line = await self.response.content.readline()
+                    if not line:
+                        break
+                    self.first_chunk += line
+            else:
+                self.first_chunk = await self.response.read()
+            self.first_token_at = time.monotonic()
+            self.backend.admission.mark_first_token(self.ticket)
+            if body.get("stream"):
+                CostAccountant.first_token(self.window)
+            return self
+        except BaseException:
+            # Cancelled, or the restore or request failed: release the slot and
+            # ticket here rather than relying on the caller to abort
+            self.abort()
+            raise
+
+    def abort(self) -> None:
+        """Drop the upstream connection; llama-server cancels the slot on disconnect."""
+        if self.response is not None:
+            self.response.close()
+        if self.accounting is not None:
+            self.accounting.end(self.window, "aborted" if self.response is None or self.ok else "failed")
+        self.release()
+
+    def finish(self) -> None:
+        """Return a fully relayed response's connection to the pool."""
+        if self.response is not None:
+            self.response.release()
+        if self.slot is not None and self.ok and self.plan.save:
+            # The slot stays reserved until its state has been snapshotted
+            asyncio.create_task(self._save_snapshot(self.slot))
+            self.slot = None
+        self.release()
+
+    async def _save_snapshot(self, slot: int) -> None:
+        try:
+            await self.backend.snapshots.save(self.session, self.backend.url, slot, self.plan)
+        finally:
+            self.backend.slot_pool.release(slot)
+
+    def release(self) -> None:
+        if self.slot is not None:
+            self.backend.slot_pool.release(self.slot)
+            self.slot = None
+        if not self.released:
+            self.released = True
+            self.backend.admission.release(self.ticket)
+
+
+class Router:
+    def __init__(self, backends: List[Backend], batch_threshold_tokens: int,
+                 timeout: int = 600, hedging: Optional[HedgePolicy] = None,
+                 disaggregation: Optional[DisaggregationCoordinator] = None,
+                 accounting: Optional[CostAccountant] = None):
+        self.backends = backends
+        self.batch_threshold_tokens = batch_threshold_tokens
+        self.timeout = timeout
+        self.hedging = hedging
+        self.disaggregation = disaggregation
+        self.accounting = accounting
+        self.session: Optional[ClientSession] = None
+        self.probe_task: Optional[asyncio.Task] = None
+
+    async def start(self, app: web.Application) -> None:
+        self.session = ClientSession(timeout=ClientTimeout(total=self.timeout))
+        await self.probe_backends()
+        self.probe_task = asyncio.create_task(self._probe_loop())
+        if self.accounting is not None:
+            await self.accounting.start()
+
+    async def stop(self, app: web.Application) -> None:
+        if self.probe_task:
+            self.probe_task.cancel()
+        if self.accounting is not None:
+            await self.accounting.stop()
+        if self.session:
+            await self.session.close()
+
+    async def probe_backends(self, backends: Optional[List[Backend]] = None) -> None:
+        backends = self.backends if backends is None else backends
+        await asyncio.gather(*(b.model.probe(self.session, b.url) for b in backends))
+        for backend in backends:
+            if backend.slot_pool is not None:
+                backend.slot_pool.resize(backend.model.slots)
+
+    def probe_due(self, backend: Backend, now: float) -> bool:
+        """Healthy backends are probed every PROBE_INTERVAL_S; ones that are down
+        every tick, except while their progress file shows the model loading."""
+        if backend.model.healthy:
+            return now - backend.model.last_probe >= PROBE_INTERVAL_S
+        progress = backend.load_progress()
+        return progress is None or not progress.active or progress.stalled
+
+    async def _probe_loop(self) -> None:
+        while True:
+            await asyncio.sleep(READY_PROBE_INTERVAL_S)
+            now = time.monotonic()
+            due = [b for b in self.backends if self.probe_due(b, now)]
+            if due:
+                await self.probe_backends(due)
+
+    def classify(self, request: web.Request, body: Dict[str, Any], prompt_tokens: int) -> str:
+        """Determine the priority class of a request (see classify_priority)."""
+        return classify_priority(request.headers.get(PRIORITY_HEADER), body, prompt_tokens,
+                                 self.batch_threshold_tokens)
+
+    @staticmethod
+    def snapshot_plan(backend: Backend, body: Dict[str, Any],
+                      plans: Dict[str, SnapshotPlan]) -> Optional[SnapshotPlan]:
+        """Snapshot plan of a request on a backend, shared between backends serving one model."""
+        if not backend.snapshots_enabled:
+            return None
+        model_id = backend.model.model_id or ""
+        if model_id not in plans:
+            plans[model_id] = backend.snapshots.plan(body, model_id, backend.admission.calibrator.chars_per_token)
+        return plans[model_id]
+
+    def estimate_cost(self, backend: Backend, body: Dict[str, Any],
+                      plans: Dict[str, SnapshotPlan]) -> RequestCost:
+        """Cost a request on a backend; a restorable prefix snapshot is not prefilled again."""
+        cost = backend.admission.calibrator.estimate_cost(body)
+        plan = self.snapshot_plan(backend, body, plans)
+        if plan is not None and plan.cached_chars:
+            cached_tokens = int(plan.cached_chars / backend.admission.calibrator.chars_per_token)
+            cost = replace(cost, prompt_tokens=max(1, cost.prompt_tokens - cached_tokens))
+        return cost
+
+    def select_backend(self, body: Dict[str, Any], plans: Dict[str, SnapshotPlan],
+                       exclude: Optional[Backend] = None) -> Optional[Backend]:
+        """Pick the backend with the lowest predicted completion time.
+
+        Each backend costs the request with its own calibration, so a busy GPU
+        queue naturally spills work to idle CPU replicas once waiting for a
+        GPU slot costs more than running on the CPU. Prefill replicas only
+        serve the prefill stage of disaggregated requests. Returns None when
+        no healthy backend can hold the request in its context.
+        """
+        now = time.monotonic()
+        best, best_time = None, float("inf")
+        for backend in self.backends:
+            if backend is exclude or backend.role == ROLE_PREFILL:
+                continue
+            predicted = backend.model.predict(self.estimate_cost(backend, body, plans), now)
+            if predicted < best_time:
+                best, best_time = backend, predicted
+        return best
+
+    @staticmethod
+    def forward_headers(request: web.Request) -> Dict[str, str]:
+        return {k: v for k, v in request.headers.items()
+                if k.lower() not in HOP_HEADERS and k != PRIORITY_HEADER}
+
+    async def handle_completion(self, request: web.Request) -> web.StreamResponse:
+        try:
+            body = await request.json()
+        except (json.JSONDecodeError, UnicodeDecodeError):
+            return web.json_response({"error": {"message": "invalid JSON body"}}, status=400)
+
+        try:
+            estimate = self.backends[0].admission.calibrator.estimate_cost(body)
+        except InvalidRequest as e:
+            return web.json_response({"error": {"message": str(e)}}, status=400)
+        priority = self.classify(request, body, estimate.prompt_tokens)
+        plans: Dict[str, SnapshotPlan] = {}
+        primary = self.select_backend(body, plans)
+        if primary is None:
+            if not any(b.model.fits(b.admission.calibrator.estimate_cost(body)) for b in self.backends):
+                return web.json_response(
+                    {"error": {"message": "request exceeds the context limit of every backend"}},
+                    status=400)
+            return web.json_response({"error": {"message": "no healthy backend"}}, status=503)
+        cost = self.estimate_cost(primary, body, plans)
+        request_id = CostAccountant.new_request_id()
+
+        if (self.disaggregation is not None and primary.snapshots_enabled
+                and self.disaggregation.eligible(cost)):
+            prefill = self.disaggregation.select_prefill(self.backends, primary.model.model_id, cost)
+            if prefill is not None and await self.disaggregation.prefill(
+                    self.session, prefill, request.path, body, self.forward_headers(request),
+                    cost, priority, request_id):
+                # Re-plan so a decode replica restores the handed-off slot
+                plans.clear()
+                primary = self.select_backend(body, plans) or primary
+                cost = self.estimate_cost(primary, body, plans)
+
+        try:
+            ticket = await primary.admission.acquire(cost, priority)
+        except AdmissionRejected as e:
+            return web.json_response(
+                {"error": {"message": f"request shed: {e.reason}", "type": "overloaded"}},
+                status=503,
+                headers={"Retry-After": str(max(1, int(e.retry_after)))},
+            )
+
+        hedgeable = (self.hedging is not None and len(self.backends) > 1
+                     and self.hedging.eligible(priority, cost))
+        attempts = [Attempt(primary, ticket, plan=self.snapshot_plan(primary, body, plans),
+                            accounting=self.accounting, request_id=request_id)]
+        winner = None
+        try:
+            winner = await self._race(request, body, cost, priority, attempts, hedgeable, plans)
+            if winner is None:
+                return web.json_response({"error": {"message": "all backends failed"}}, status=502)
+            if body.get("stream") and winner.ok:
+                response = await self._relay_stream(request, winner, cost)
+            else:
+                response = self._relay_body(winner, cost)
+            winner.finish()
+            return response
+        finally:
+            for attempt in attempts:
+                attempt.abort()
+
+    async def _race(self, request: web.Request, body: Dict[str, Any], cost: RequestCost,
+                    priority: str, attempts: List[Attempt], hedgeable: bool,
+                    plans: Dict[str, SnapshotPlan]) -> Optional[Attempt]:
+        """Dispatch the primary attempt and, if it is slow to start, a hedge.
+
+        Returns the first attempt that produced a successful first token, or
+        the last failed attempt if none succeeded.
+        """
+        headers = self.forward_headers(request)
+        started = time.monotonic()
+        tasks = {asyncio.create_task(attempts[0].run(self.session, request.path, body, headers))}
+
+        if hedgeable:
+            done, _ = await asyncio.wait(tasks, timeout=self.hedging.delay())
+            if not done and self.hedging.try_spend():
+                second = self.select_backend(body, plans, exclude=attempts[0].backend)
+                hedge_ticket = second.admission.try_acquire(cost, priority) if second else None
+                if hedge_ticket is not None:
+                    attempts.append(Attempt(second, hedge_ticket, hedge=True,
+                                            plan=self.snapshot_plan(second, body, plans),
+                                            accounting=self.accounting, request_id=attempts[0].request_id))
+                    tasks.add(asyncio.create_task(
+                        attempts[-1].run(self.session, request.path, body, headers)))
+
+        winner = None
+        last_failed = None
+        try:
+            while tasks and winner is None:
+                done, tasks = await asyncio.wait(tasks, return_when=asyncio.FIRST_COMPLETED)
+                for task in done:
+                    if task.exception() is not None:
+                        continue
+                    attempt = task.result()
+                    if attempt.ok:
+                        winner = attempt
+                        break
+                    last_failed = attempt
+        finally:
+            # Losers are cancelled, which aborts their upstream connections
+            for task in tasks:
+                task.cancel()
+
+        if winner is not None and hedgeable:
+            self.hedging.record(time.monotonic() - started, winner.hedge)
+        return winner or last_failed
+
+    def _observe(self, attempt: Attempt, cost: RequestCost, payload: Optional[bytes],
+                 streamed_tokens: int = 0) -> None:
+        """Feed a finished request into its backend's calibration and cost model."""
+        timings, usage = None, None
+        if payload:
+            try:
+                timings, usage = extract_timings(json.loads(payload))
+            except (json.JSONDecodeError, AttributeError):
+                pass
+
+        calibrator = attempt.backend.admission.calibrator
+        completion_tokens = (usage or {}).get("completion_tokens") or streamed_tokens
+        if timings:
+            calibrator.observe(timings, usage, cost.prompt_chars)
+        else:
+            prompt_tokens = (usage or {}).get("prompt_tokens") or cost.prompt_tokens
+            ttft = attempt.first_token_at - attempt.started if streamed_tokens else None
+            calibrator.observe_wall(prompt_tokens, ttft, completion_tokens,
+                                    time.monotonic() - attempt.started)
+        attempt.backend.model.observe(cost, completion_tokens)
+        if self.accounting is not None:
+            self.accounting.end(attempt.window, "ok", timings, usage, completion_tokens)
+
+    def _relay_body(self, attempt: Attempt, cost: RequestCost) -> web.Response:
+        if attempt.ok:
+            self._observe(attempt, cost, attempt.first_chunk)
+        return web.Response(body=attempt.first_chunk, status=attempt.response.status,
+                            content_type=attempt.response.content_type,
+                            headers={BACKEND_HEADER: attempt.backend.url})
+
+    async def _relay_stream(self, request: web.Request, attempt: Attempt,
+                            cost: RequestCost) -> web.StreamResponse:
+        upstream = attempt.response
+        response = web.StreamResponse(status=upstream.status, headers={BACKEND_HEADER: attempt.backend.url})
+        response.content_type = upstream.content_type or "text/event-stream"
+        await response.prepare(request)
+        await response.write(attempt.first_chunk)
+
+        final_chunk = None
+        streamed_tokens = 1
+        async for line in upstream.content:
+            if line.startswith(b"data: {"):
+                # The final SSE chunk carries timings and usage used for calibration
+                if b'"timings"' in line or b'"usage"' in line:
+                    final_chunk = line[6:]
+                else:
+                    streamed_tokens += 1
+                    CostAccountant.token(attempt.window)
+            await response.write(line)
+
+        self._observe(attempt, cost, final_chunk, streamed_tokens)
+        await response.write_eof()
+        return response
+
+    async def handle_passthrough(self, request: web.Request) -> web.Response:
+        """Forward non-generation requests (health, models, metrics) to the first backend."""
+        data = await request.read()
+        try:
+            async with self.session.request(request.method, f"{self.backends[0].url}{request.path_qs}",
+                                            data=data or None,
+                                            headers=self.forward_headers(request)) as upstream:
+                payload = await upstream.read()
+                return web.Response(body=payload, status=upstream.status,
+                                    content_type=upstream.content_type)
+        except ClientError as e:
+            return web.json_response({"error": {"message": str(e)}}, status=502)
+
+    async def handle_stats(self, request: web.Request) -> web.Response:
+        stats = {"backends": [b.stats() for b in self.backends]}
+        if self.hedging is not None:
+            stats["hedging"] = self.hedging.stats()
+        snapshots = next((b.snapshots for b in self.backends if b.snapshots is not None), None)
+        if snapshots is not None:
+            stats["snapshots"] = snapshots.stats()
+        if self.disaggregation is not None:
+            stats["disaggregation"] = self.disaggregation.stats()
+        if self.accounting is not None:
+            stats["accounting"] = self.accounting.stats()
+        return web.json_response(stats)
+
+    def build_app(self) -> web.Application:
+        app = web.Application(client_max_size=64 * 1024 * 1024)
+        app.on_startup.append(self.start)
+        app.on_cleanup.append(self.stop)
+        app.router.add_get("/router/stats", self.handle_stats)
+        for path in COMPLETION_PATHS:
+            app.router.add_post(path, self.handle_completion)
+        app.router.add_route("*", "/{tail:.*}", self.handle_passthrough)
+        return app
+
+
+def create_parser() -> argparse.ArgumentParser:
+    """Create command line argument parser."""
+    parser = argparse.ArgumentParser(
+        description="Admission-controlled router for llama-server",
+        formatter_class=argparse.RawDescriptionHelpFormatter,
+        epilog="""
+Examples:
+  python router.py --backend http://localhost:8001
+  python router.py --backend http://localhost:8001 --ttft-slo 1.5 --prefill-tps 300
+  python router.py --backend http://localhost:8001 --backend http://localhost:8002 --hedge
+  python router.py --backend gpu=http://localhost:8004 --backend gpu=http://localhost:8005 \
+                   --backend cpu=http://localhost:8001
+  python router.py --backend http://localhost:8001 --snapshot-dir /mnt/llama-slots
+  python router.py --backend cpu:prefill=http://localhost:8001 --backend cpu:decode=http://localhost:8002 \
+                   --snapshot-dir /mnt/llama-slots --disagg-min-prompt 4096
+  python router.py --backend http://localhost:8001 --account-log costs.jsonl \
+                   --account-cgroup http://localhost:8001=docker:llama-cpu
+  python router.py --backend http://localhost:8001 \
+                   --progress-file http://localhost:8001=logs/cpu/hugepage_wrapper.progress
+  curl -H 'X-Priority: batch' http://localhost:8000/v1/chat/completions -d @request.json
+        """
+    )
+
+    parser.add_argument("--host", default="127.0.0.1", help="Listen address (default: 127.0.0.1)")
+    parser.add_argument("--port", type=int, default=8000, help="Listen port (default: 8000)")
+    parser.add_argument("--backend", action="append",
+                        help="Backend as [cpu|gpu[:mixed|prefill|decode]=]URL, repeat for several "
+                             "(default: cpu=http://localhost:8001)")
+    parser.add_argument("--timeout", type=int, default=600,
+                        help="Upstream request timeout in seconds (default: 600)")
+
+    cost = parser.add_argument_group("cost model")
+    cost.add_argument("--prefill-tps", type=float, default=SEED_RATES[KIND_CPU][0],
+                      help="Initial CPU prompt processing rate in tokens/sec (default: 250)")
+    cost.add_argument("--decode-tps", type=float, default=SEED_RATES[KIND_CPU][1],
+                      help="Initial CPU generation rate in tokens/sec (default: 35)")
+    cost.add_argument("--gpu-prefill-tps", type=float, default=SEED_RATES[KIND_GPU][0],
+                      help="Initial GPU prompt processing rate in tokens/sec (default: 4000)")
+    cost.add_argument("--gpu-decode-tps", type=float, default=SEED_RATES[KIND_GPU][1],
+                      help="Initial GPU generation rate in tokens/sec (default: 250)")
+    cost.add_argument("--chars-per-token", type=float, default=3.5,
+                      help="Initial characters-per-token estimate (default: 3.5)")
+
+    slo = parser.add_argument_group("admission")
+    slo.add_argument("--ttft-slo", type=float, default=2.0,
+                     help="Interactive time-to-first-token SLO in seconds (default: 2.0)")
+    slo.add_argument("--batch-threshold", type=int, default=8192,
+                     help="Prompt tokens above which untagged requests are batch (default: 8192)")
+    slo.add_argument("--interactive-concurrency", type=int, default=4,
+                     help="Max concurrent interactive requests (default: 4)")
+    slo.add_argument("--interactive-tokens", type=int, default=32768,
+                     help="Interactive prompt+max_tokens budget in flight (default: 32768)")
+    slo.add_argument("--batch-concurrency", type=int, default=1,
+                     help="Max concurrent batch requests (default: 1)")
+    slo.add_argument("--batch-tokens", type=int, default=36864,
+                     help="Batch prompt+max_tokens budget in flight (default: 36864)")
+    slo.add_argument("--batch-max-wait", type=float, default=300.0,
+                     help="Seconds batch work may be deferred before it is shed (default: 300)")
+    slo.add_argument("--max-queue", type=int, default=64,
+                     help="Max queued requests per class (default: 64)")
+
+    hedge = parser.add_argument_group("hedging")
+    hedge.add_argument("--hedge", action="store_true",
+                       help="Hedge short interactive requests across replicas")
+    hedge.add_argument("--hedge-percentile", type=float, default=95.0,
+                       help="TTFT percentile after which a hedge is sent (default: 95)")
+    hedge.add_argument("--hedge-initial-delay", type=float, default=1.0,
+                       help="Hedge delay in seconds until enough TTFT samples exist (default: 1.0)")
+    hedge.add_argument("--hedge-max-prompt", type=int, default=2048,
+                       help="Largest prompt in tokens that may be hedged (default: 2048)")
+    hedge.add_argument("--hedge-budget", type=float, default=0.05,
+                       help="Max extra requests per eligible request (default: 0.05)")
+
+    snap = parser.add_argument_group("KV snapshots")
+    snap.add_argument("--snapshot-dir",
+                      help="Slot save directory shared with the CPU backends' --slot-save-path (default: off)")
+    snap.add_argument("--snapshot-budget-gb", type=float, default=16.0,
+                      help="Max snapshot bytes kept in the directory, LRU evicted (default: 16)")
+    snap.add_argument("--snapshot-min-tokens", type=int, default=2048,
+                      help="Min new prefix tokens worth snapshotting (default: 2048)")
+
+    disagg = parser.add_argument_group("disaggregation")
+    disagg.add_argument("--disagg-min-prompt", type=int, default=4096,
+                        help="Uncached prompt tokens above which prefill runs on a prefill replica "
+                             "(default: 4096, active with a cpu:prefill backend)")
+
+    account = parser.add_argument_group("accounting")
+    account.add_argument("--account-log",
+                         help="Append a JSON cost record per request to this file (default: off)")
+    account.add_argument("--account-cgroup", action="append", default=[],
+                         help="Meter a backend through its cgroup as URL=PATH or URL=docker:NAME, repeat "
+                              "for several (default: CPU backends share host-wide counters)")
+    account.add_argument("--kv-bytes-per-token", type=float,
+                         help="KV cache bytes per token (default: learned from slot snapshots)")
+    account.add_argument("--account-interval", type=float, default=SAMPLE_INTERVAL_S,
+                         help=f"Counter sampling interval in seconds (default: {SAMPLE_INTERVAL_S})")
+
+    ready = parser.add_argument_group("readiness")
+    ready.add_argument("--progress-file", action="append", default=[],
+                       help="Load progress file of a backend's huge page wrapper as URL=PATH, repeat for "
+                            "several (default: none, starting backends are only probed over HTTP)")
+
+    return parser
+
+
+def build_admission(args: argparse.Namespace, kind: str = KIND_CPU) -> AdmissionController:
+    if kind == KIND_GPU:
+        calibrator = RateCalibrator(args.gpu_prefill_tps, args.gpu_decode_tps, args.chars_per_token)
+    else:
+        calibrator = RateCalibrator(args.prefill_tps, args.decode_tps, args.chars_per_token)
+    policies = {
+        PRIORITY_INTERACTIVE: ClassPolicy(PRIORITY_INTERACTIVE, args.interactive_concurrency,
+                                          args.interactive_tokens, args.max_queue, args.ttft_slo * 10),
+        PRIORITY_BATCH: ClassPolicy(PRIORITY_BATCH, args.batch_concurrency,
+                                    args.batch_tokens, args.max_queue, args.batch_max_wait),
+    }
+    return AdmissionController(calibrator, policies, args.ttft_slo)
+
+
+def main() -> int:
+    """Main function to run the router.
+
+    Returns:
+        Exit code: 0 for success, 1 for failure.
+    """
+    parser = create_parser()
+    args = parser.parse_args()
+    specs = [parse_backend_spec(s) for s in (args.backend or ["http://localhost:8001"])]
+    unknown = [kind for kind, _, _ in specs if kind not in SEED_RATES]
+    if unknown:
+        print(f"Configuration: {STATUS_ERROR} (unknown backend kind: {unknown[0]})", file=sys.stderr)
+        return EXIT_INVALID_USAGE
+    unknown = [role for _, role, _ in specs if role not in ROLES]
+    if unknown:
+        print(f"Configuration: {STATUS_ERROR} (unknown backend role: {unknown[0]})", file=sys.stderr)
+        return EXIT_INVALID_USAGE
+
+    if args.ttft_slo <= 0 or args.prefill_tps <= 0 or args.decode_tps <= 0:
+        print(f"Configuration: {STATUS_ERROR} (SLO and rates must be positive)", file=sys.stderr)
+        return EXIT_INVALID_USAGE
+    if args.hedge and len(specs) < 2:
+        print(f"Hedging: {STATUS_WARN} (needs at least two backends, disabled)", file=sys.stderr)
+
+    hedging = None
+    if args.hedge and len(specs) > 1:
+        hedging = HedgePolicy(percentile=args.hedge_percentile,
+                              initial_delay_s=args.hedge_initial_delay,
+                              max_prompt_tokens=args.hedge_max_prompt,
+                              budget_ratio=args.hedge_budget)
+
+    snapshots = None
+    if args.snapshot_dir:
+        if not os.path.isdir(args.snapshot_dir) or not os.access(args.snapshot_dir, os.W_OK):
+            print(f"Snapshots: {STATUS_ERROR} (directory not writable: {args.snapshot_dir})", file=sys.stderr)
+            return EXIT_INVALID_USAGE
+        snapshots = SnapshotStore(args.snapshot_dir, int(args.snapshot_budget_gb * 1024 ** 3),
+                                  args.snapshot_min_tokens)
+
+    disaggregation = None
+    prefill_specs = [(kind, url) for kind, role, url in specs if role == ROLE_PREFILL]
+    if prefill_specs:
+        # The KV handoff is a slot snapshot, so both stages need the shared directory
+        if snapshots is None or any(kind != KIND_CPU for kind, _ in prefill_specs):
+            print(f"Disaggregation: {STATUS_ERROR} (prefill replicas must be cpu backends "
+                  f"with --snapshot-dir)", file=sys.stderr)
+            return EXIT_INVALID_USAGE
+        if len(prefill_specs) == len(specs):
+            print(f"Disaggregation: {STATUS_ERROR} (no backend left for decode)", file=sys.stderr)
+            return EXIT_INVALID_USAGE
+        disaggregation = DisaggregationCoordinator(snapshots, args.disagg_min_prompt)
+
+    accounting = None
+    cgroups = {}
+    for spec in args.account_cgroup:
+        url, sep, cgroup = spec.rpartition("=")
+        if not sep or not url:
+            print(f"Accounting: {STATUS_ERROR} (expected URL=CGROUP, got {spec})", file=sys.stderr)
+            return EXIT_INVALID_USAGE
+        try:
+            cgroups[url.rstrip("/")] = resolve_cgroup(cgroup)
+        except ValueError as e:
+            print(f"Accounting: {STATUS_ERROR} ({e})", file=sys.stderr)
+            return EXIT_INVALID_USAGE
+    if args.account_log:
+        try:
+            accounting = CostAccountant(args.account_log, args.kv_bytes_per_token, args.account_interval,
+                                        snapshots.kv_bytes_per_token if snapshots is not None else None)
+        except OSError as e:
+            print(f"Accounting: {STATUS_ERROR} (cannot open {args.account_log}: {e})", file=sys.stderr)
+            return EXIT_INVALID_USAGE
+        for kind, _, url in specs:
+            accounting.add_backend(url.rstrip("/"), kind, cgroups.get(url.rstrip("/")))
+        if disaggregation is not None:
+            disaggregation.accounting = accounting
+    elif cgroups:
+        print(f"Accounting: {STATUS_WARN} (--account-cgroup without --account-log, disabled)", file=sys.stderr)
+
+    progress_files = {}
+    for spec in args.progress_file:
+        url, sep, path = spec.rpartition("=")
+        if not sep or not url or not path:
+            print(f"Readiness: {STATUS_ERROR} (expected URL=PATH, got {spec})", file=sys.stderr)
+            return EXIT_INVALID_USAGE
+        progress_files[url.rstrip("/")] = path
+    unknown = sorted(set(progress_files) - {url.rstrip("/") for _, _, url in specs})
+    if unknown:
+        print(f"Readiness: {STATUS_ERROR} (--progress-file for unknown backend: {unknown[0]})", file=sys.stderr)
+        return EXIT_INVALID_USAGE
+
+    try:
+        # Snapshots are restored by llama-server's slot API, which the CPU backends mount
+        backends = [Backend(url, build_admission(args, kind), kind,
+                            snapshots if kind == KIND_CPU else None, role, progress_files.get(url.rstrip("/")))
+                    for kind, role, url in specs]
+        router = Router(backends, args.batch_threshold, args.timeout, hedging, disaggregation, accounting)
+        print(f"Router: {STATUS_OK} (listening on {args.host}:{args.port})")
+        for backend in backends:
+            print(f"  Backend: {backend.url} ({backend.model.kind}, {backend.role})")
+            if backend.progress_file:
+                progress = backend.load_progress()
+                print(f"    Load progress: {backend.progress_file} "
+                      f"({progress.state if progress is not None else 'not written yet'})")
+        print(f"  TTFT SLO: {args.ttft_slo}s, batch threshold: {args.batch_threshold} tokens")
+        if hedging is not None:
+            print(f"  Hedging: p{args.hedge_percentile:g} TTFT, budget {args.hedge_budget:.0%}")
+        if snapshots is not None:
+            print(f"  Snapshots: {args.snapshot_dir} ({len(snapshots.snapshots)} restored from index, "
+                  f"budget {args.snapshot_budget_gb:g} GB)")
+        if disaggregation is not None:
+            print(f"  Disaggregation: prefill on {len(prefill_specs)} replica(s) "
+                  f"above {args.disagg_min_prompt} prompt tokens")
+        if accounting is not None:
+            print(f"  Accounting: {args.account_log}")
+            for url, meter in accounting.meters.items():
+                if meter is None:
+                    print(f"    {url}: time, tokens and KV only (no cgroup)")
+                    continue
+                events = meter.stats()["events"]
+                missing = meter.perf.errors if meter.perf else {}
+                print(f"    {url}: {meter.name} ({', '.join(events) or 'no counters'}"
+                      + (f"; unavailable: {', '.join(sorted(missing))}" if missing else "") + ")")
+        web.run_app(router.build_app(), host=args.host, port=args.port, print=None)
+        return EXIT_SUCCESS
+    except OSError as e:
+        print(f"Router: {STATUS_ERROR} (cannot listen on {args.host}:{args.port}: {e})", file=sys.stderr)
+        return EXIT_FAILURE
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,330 @@
+#!/usr/bin/env python3
+"""
+KV slot snapshot store for frequently reused prompt prefixes.
+Saves llama-server slot state for long prefixes (system prompts, RAG contexts,
+long conversations) into a memory-backed directory shared with the backends,
+indexes it by prompt-prefix hash and restores it into the serving slot before
+a request, so the backend only prefills the new suffix. Snapshots are evicted
+LRU under a byte budget.
+"""
+
+import asyncio
+import hashlib
+import json
+import os
+import time
+from collections import OrderedDict
+from dataclasses import asdict, dataclass
+from typing import Any, Dict, List, Optional, Set
+
+from aiohttp import ClientError, ClientSession, ClientTimeout
+
+INDEX_FILE = "index.json"
+SNAPSHOT_SUFFIX = ".bin"
+
+# Raw /completion prompts have no message boundaries; hash them in chunks
+PREFIX_CHUNK_CHARS = 8192
+
+# Slot save/restore calls move whole KV caches; allow for large contexts
+SLOT_ACTION_TIMEOUT_S = 60.0
+
+# llama-server answers slot actions with 501 when started without --slot-save-path
+STATUS_NOT_SUPPORTED = 501
+
+
+@dataclass
+class Prefix:
+    """A reusable leading part of a request, identified by its hash."""
+    key: str
+    chars: int
+
+
+@dataclass
+class Snapshot:
+    """One saved slot state file and the prefixes it covers."""
+    filename: str
+    keys: List[str]
+    n_tokens: int
+    size_bytes: int
+    created: float
+    last_used: float
+    hits: int = 0
+
+
+@dataclass
+class SnapshotPlan:
+    """What to do around one request: restore a snapshot, save a new one, or both."""
+    prefixes: List[Prefix]
+    history: List[Prefix]
+    hit: Optional[Snapshot] = None
+    hit_prefix: Optional[Prefix] = None
+    save: bool = False
+
+    @property
+    def cached_chars(self) -> int:
+        return self.hit_prefix.chars if self.hit_prefix else 0
+
+
+def _hash(model_id: str, payload: Any) -> str:
+    data = json.dumps([model_id, payload], sort_keys=True, ensure_ascii=False)
+    return hashlib.sha256(data.encode()).hexdigest()
+
+
+def _content_chars(message: Dict[str, Any]) -> int:
+    content = message.get("content", "")
+    if isinstance(content, list):
+        return sum(len(p.get("text", "")) for p in content if isinstance(p, dict))
+    return len(str(content))
+
+
+def prefix_keys(body: Dict[str, Any], model_id: str) -> List[Prefix]:
+    """Hash every reusable prefix of a request, longest first.
+
+    Chat requests are split at message boundaries, so a conversation's
+    history and its system prompt are both reusable prefixes of the next
+    turn. Raw prompts are split every PREFIX_CHUNK_CHARS characters.
+    """
+    prefixes = []
+    if isinstance(body.get("messages"), list):
+        messages = body["messages"]
+        chars = 0
+        for i, message in enumerate(messages):
+            chars += _content_chars(message) if isinstance(message, dict) else 0
+            prefixes.append(Prefix(_hash(model_id, messages[:i + 1]), chars))
+    elif isinstance(body.get("prompt"), str):
+        prompt = body["prompt"]
+        for end in range(PREFIX_CHUNK_CHARS, len(prompt) + 1, PREFIX_CHUNK_CHARS):
+            prefixes.append(Prefix(_hash(model_id, prompt[:end]), end))
+    prefixes.reverse()
+    return prefixes
+
+
+class SnapshotStore:
+    """LRU index of slot snapshots in a directory shared with the backends.
+
+    The directory is mounted into every llama-server container as its
+    --slot-save-path, so a snapshot saved by one replica can be restored by
+    any replica serving the same model. It should live on tmpfs (ideally
+    with huge=within_size) so that saving and restoring are memory copies.
+    """
+
+    def __init__(self, directory: str, budget_bytes: int, min_prefix_tokens: int = 2048):
+        self.directory = directory
+        self.budget_bytes = budget_bytes
+        self.min_prefix_tokens = min_prefix_tokens
+        self.snapshots: "OrderedDict[str, Snapshot]" = OrderedDict()
+        self.keys: Dict[str, str] = {}
+        self.pending: Set[str] = set()
+        self.unsupported: Set[str] = set()
+        self.counters = {"hits": 0, "misses": 0, "saves": 0, "save_failures": 0,
+                         "restore_failures": 0, "evictions": 0, "restored_tokens": 0}
+        self.restore_ms: List[float] = []
+        self.load()
+
+    def supports(self, url: str) -> bool:
+        return url not in self.unsupported
+
+    def _check_response(self, url: str, status: int, result: Any) -> None:
+        if status == STATUS_NOT_SUPPORTED:
+            self.unsupported.add(url)
+        if status != 200:
+            raise ValueError(result)
+
+    @property
+    def total_bytes(self) -> int:
+        return sum(s.size_bytes for s in self.snapshots.values())
+
+    def kv_bytes_per_token(self) -> Optional[float]:
+        """Mean KV cache bytes per token of the saved slots, None before any save."""
+        tokens = sum(s.n_tokens for s in self.snapshots.values())
+        return self.total_bytes / tokens if tokens else None
+
+    def load(self) -> None:
+        """Rebuild the index from disk, dropping entries whose files are gone and unindexed files."""
+        path = os.path.join(self.directory, INDEX_FILE)
+        try:
+            with open(path) as f:
+                entries = json.load(f)
+        except (OSError, ValueError):
+            entries = []
+        for entry in sorted(entries, key=lambda e: e.get("last_used", 0)):
+            try:
+                snapshot = Snapshot(**entry)
+            except TypeError:
+                continue
+            if os.path.exists(os.path.join(self.directory, snapshot.filename)):
+                self._index(snapshot)
+        try:
+            for name in os.listdir(self.directory):
+                if name.endswith(SNAPSHOT_SUFFIX) and name not in self.snapshots:
+                    os.unlink(os.path.join(self.directory, name))
+        except OSError:
+            pass
+        self._evict()
+
+    def _persist(self) -> None:
+        path = os.path.join(self.directory, INDEX_FILE)
+        try:
+            with open(path + ".tmp", "w") as f:
+                json.dump([asdict(s) for s in self.snapshots.values()], f)
+            os.replace(path + ".tmp", path)
+        except OSError:
+            pass
+
+    def _index(self, snapshot: Snapshot) -> None:
+        self.snapshots[snapshot.filename] = snapshot
+        self.snapshots.move_to_end(snapshot.filename)
+        for key in snapshot.keys:
+            self.keys[key] = snapshot.filename
+
+    def _remove(self, filename: str) -> None:
+        snapshot = self.snapshots.pop(filename, None)
+        if snapshot is None:
+            return
+        for key in snapshot.keys:
+            if self.keys.get(key) == filename:
+                del self.keys[key]
+        try:
+            os.unlink(os.path.join(self.directory, filename))
+        except OSError:
+            pass
+
+    def _evict(self) -> None:
+        while self.snapshots and self.total_bytes > self.budget_bytes:
+            oldest = next(iter(self.snapshots))
+            self._remove(oldest)
+            self.counters["evictions"] += 1
+
+    def plan(self, body: Dict[str, Any], model_id: str, chars_per_token: float) -> SnapshotPlan:
+        """Find the longest cached prefix and decide whether to snapshot after the request.
+
+        A snapshot is taken when the request's history (everything but its
+        final message or chunk) extends at least min_prefix_tokens beyond
+        what is already cached.
+        """
+        prefixes = prefix_keys(body, model_id)
+        # A chat request's final message is new; everything before it is history
+        history = prefixes[1:] if body.get("messages") else prefixes
+        plan = SnapshotPlan(prefixes=prefixes, history=history)
+        for prefix in plan.prefixes:
+            filename = self.keys.get(prefix.key)
+            if filename is not None:
+                plan.hit, plan.hit_prefix = self.snapshots[filename], prefix
+                break
+
+        if history:
+            new_tokens = (history[0].chars - plan.cached_chars) / chars_per_token
+            plan.save = new_tokens >= self.min_prefix_tokens and history[0].key not in self.pending
+        return plan
+
+    async def restore(self, session: ClientSession, url: str, slot: int, plan: SnapshotPlan) -> bool:
+        """Load the planned snapshot into `slot`; the request then reuses it as its prompt cache."""
+        if plan.hit is None:
+            self.counters["misses"] += 1
+            return False
+        snapshot = plan.hit
+        started = time.monotonic()
+        try:
+            async with session.post(f"{url}/slots/{slot}", params={"action": "restore"},
+                                    json={"filename": snapshot.filename},
+                                    timeout=ClientTimeout(total=SLOT_ACTION_TIMEOUT_S)) as response:
+                result = await response.json(content_type=None)
+                self._check_response(url, response.status, result)
+        except (ClientError, asyncio.TimeoutError, ValueError):
+            # Evicted underneath us, or saved for a different context size
+            self.counters["restore_failures"] += 1
+            if self.supports(url):
+                self._remove(snapshot.filename)
+                self._persist()
+            plan.hit, plan.hit_prefix = None, None
+            return False
+
+        snapshot.hits += 1
+        snapshot.last_used = time.time()
+        self.snapshots.move_to_end(snapshot.filename)
+        self.counters["hits"] += 1
+        self.counters["restored_tokens"] += int(result.get("n_restored", 0))
+        self.restore_ms = (self.restore_ms + [(time.monotonic() - started) * 1000])[-256:]
+        return True
+
+    async def save(self, session: ClientSession, url: str, slot: int, plan: SnapshotPlan,
+                   key: Optional[str] = None) -> bool:
+        """Save `slot` after a request and index it under every prefix of the request.
+
+        The file is named after `key`, by default the request's history.
+        """
+        key = key or plan.history[0].key
+        filename = key[:32] + SNAPSHOT_SUFFIX
+        self.pending.add(key)
+        try:
+            async with session.post(f"{url}/slots/{slot}", params={"action": "save"},
+                                    json={"filename": filename},
+                                    timeout=ClientTimeout(total=SLOT_ACTION_TIMEOUT_S)) as response:
+                result = await response.json(content_type=None)
+                self._check_response(url, response.status, result)
+        except (ClientError, asyncio.TimeoutError, ValueError):
+            self.counters["save_failures"] += 1
+            return False
+        finally:
+            self.pending.discard(key)
+
+        now = time.time()
+        # The slot holds the whole prompt plus the generation; llama-server
+        # reuses the longest common prefix, so every prefix of the prompt hits
+        self._remove(filename)
+        self._index(Snapshot(filename=filename, keys=[p.key for p in plan.prefixes],
+                             n_tokens=int(result.get("n_saved", 0)),
+                             size_bytes=int(result.get("n_written", 0)),
+                             created=now, last_used=now))
+        self.counters["saves"] += 1
+        self._evict()
+        self._persist()
+        return True
+
+    def stats(self) -> Dict[str, Any]:
+        restore_ms = sorted(self.restore_ms)
+        return {
+            "directory": self.directory,
+            "unsupported_backends": sorted(self.unsupported),
+            "snapshots": len(self.snapshots),
+            "bytes": self.total_bytes,
+            "budget_bytes": self.budget_bytes,
+            "restore_ms_p50": round(restore_ms[len(restore_ms) // 2], 1) if restore_ms else None,
+            **self.counters,
+        }
+
+
+class SlotPool:
+    """Explicit llama-server slot ids for one backend.
+
+    Requests to a snapshot-enabled backend are pinned to a slot with id_slot,
+    so the slot a snapshot is restored into is the one that serves the
+    request, and the slot stays reserved until its snapshot is saved.
+    """
+
+    def __init__(self, size: int):
+        self.size = 0
+        self.created = 0
+        self.free: asyncio.Queue = asyncio.Queue()
+        self.retired: Set[int] = set()
+        self.resize(size)
+
+    def resize(self, size: int) -> None:
+        self.size = max(1, size)
+        for slot in sorted(s for s in self.retired if s < self.size):
+            self.retired.discard(slot)
+            self.free.put_nowait(slot)
+        for slot in range(self.created, self.size):
+            self.free.put_nowait(slot)
+        self.created = max(self.created, self.size)
+
+    async def acquire(self) -> int:
+        while True:
+            slot = await self.free.get()
+            # Slots beyond a shrunken pool are retired as they come back
+            if slot < self.size:
+                return slot
+            self.retired.add(slot)
+
+    def release(self, slot: int) -> None:
+        self.free.put_nowait(slot)
@@ -0,0 +1,726 @@
+#!/usr/bin/env python3
+"""
+Scheduling-latency tracer for the CPU llama-server.
+The compute threads of a decode step meet at barriers, so one thread kept
+off its CPU stalls the whole step. This tool traces, with eBPF and for the
+llama-server threads only, the time each thread spends runnable but not
+running (after preemption or wakeup), in interrupt handlers and in page
+faults, attributes it to the task that held the CPU (other containers, host
+processes, kernel threads, the server's own HTTP threads), and reports the
+stall on the slowest thread of every decode step next to the step's latency.
+Requires root and bcc (apt install python3-bpfcc), so it runs with the
+system python3 rather than the Poetry environment.
+"""
+
+import argparse
+import json
+import os
+import platform
+import re
+import subprocess
+import sys
+import time
+from bisect import bisect_right
+from collections import defaultdict
+from dataclasses import dataclass, field
+from datetime import datetime
+from itertools import accumulate
+from typing import Any, Dict, List, Optional, Tuple
+
+# Status indicators
+STATUS_OK = "OK"
+STATUS_WARN = "WARN"
+STATUS_ERROR = "ERROR"
+
+# Exit codes
+EXIT_SUCCESS = 0
+EXIT_FAILURE = 1
+EXIT_INVALID_USAGE = 2
+EXIT_INTERFERENCE = 3
+
+# Process names of llama-server (the container runs it as ./server)
+SERVER_COMMS = ("server", "llama-server")
+
+# Threads using at least this share of the busiest thread's CPU time are
+# compute threads; the rest (HTTP, sampling, idle pool threads) are not
+COMPUTE_CPU_SHARE = 0.25
+
+# Softirq vector names (include/linux/interrupt.h)
+SOFTIRQ_NAMES = ("HI", "TIMER", "NET_TX", "NET_RX", "BLOCK", "IRQ_POLL", "TASKLET", "SCHED", "HRTIMER", "RCU")
+
+# Culprit categories that come from sharing the CPUs; the others are
+# compute (oversubscribed threads), idle-cpu (wakeup from idle) and fault
+SHARING = ("container", "host", "kernel", "irq", "softirq", "http")
+
+BPF_PROGRAM = r"""
+#include <uapi/linux/ptrace.h>
+#include <linux/sched.h>
+
+#define EV_STEP    1
+#define EV_OFFCPU  2
+#define EV_IRQ     3
+#define EV_SOFTIRQ 4
+#define EV_FAULT   5
+
+// sched_switch prev_state of a task preempted in the kernel
+#define TASK_REPORT_MAX 0x100
+#define VM_FAULT_MAJOR 0x4
+
+struct event {
+    u32 type;
+    u32 tid;
+    u64 start;      // step begin, switched out, handler or fault entry
+    u64 ready;      // EV_OFFCPU: runnable again (preempted: = start)
+    u64 end;
+    u32 culprit;    // EV_OFFCPU: task holding the CPU; irq, vector, major fault, step tokens
+    u32 flags;      // EV_OFFCPU: preempted
+    char comm[TASK_COMM_LEN];
+};
+
+struct offcpu {
+    u64 ts;
+    u64 ready;
+    u32 preemptor;
+    u32 preempted;
+    char comm[TASK_COMM_LEN];
+};
+
+struct step {
+    u64 ts;
+    s32 tokens;
+};
+
+BPF_RINGBUF_OUTPUT(events, 1 << 10);
+BPF_HASH(offcpu, u32, struct offcpu, 4096);
+BPF_HASH(faults, u32, u64, 4096);
+BPF_HASH(steps, u32, struct step, 64);
+BPF_PERCPU_ARRAY(handler_start, u64, 2);
+
+static inline int is_target(void)
+{
+    return (bpf_get_current_pid_tgid() >> 32) == TARGET_TGID;
+}
+
+static inline void emit(u32 type, u32 tid, u64 start, u64 end, u32 culprit)
+{
+    struct event *e = events.ringbuf_reserve(sizeof(struct event));
+    if (!e)
+        return;
+    __builtin_memset(e, 0, sizeof(*e));
+    e->type = type;
+    e->tid = tid;
+    e->start = start;
+    e->ready = start;
+    e->end = end;
+    e->culprit = culprit;
+    events.ringbuf_submit(e, 0);
+}
+
+TRACEPOINT_PROBE(sched, sched_wakeup)
+{
+    u32 tid = args->pid;
+    struct offcpu *o = offcpu.lookup(&tid);
+    if (o && !o->ready)
+        o->ready = bpf_ktime_get_ns();
+    return 0;
+}
+
+TRACEPOINT_PROBE(sched, sched_switch)
+{
+    u64 now = bpf_ktime_get_ns();
+    u32 prev = args->prev_pid, next = args->next_pid;
+
+    // current is still prev here
+    if (prev && is_target()) {
+        struct offcpu o = {};
+        o.ts = now;
+        o.preempted = args->prev_state == 0 || (args->prev_state & TASK_REPORT_MAX);
+        if (o.preempted) {
+            o.ready = now;
+            o.preemptor = next;
+            __builtin_memcpy(&o.comm, args->next_comm, sizeof(o.comm));
+        }
+        offcpu.update(&prev, &o);
+    }
+
+    struct offcpu *o = offcpu.lookup(&next);
+    if (!o)
+        return 0;
+    struct event *e = events.ringbuf_reserve(sizeof(struct event));
+    if (e) {
+        e->type = EV_OFFCPU;
+        e->tid = next;
+        e->start = o->ts;
+        e->ready = o->ready ? o->ready : now;
+        e->end = now;
+        e->flags = o->preempted;
+        // A preempted thread is charged to its preemptor, a woken one to the
+        // task it waited behind (pid 0 if the CPU was idle)
+        if (o->preempted) {
+            e->culprit = o->preemptor;
+            __builtin_memcpy(&e->comm, o->comm, sizeof(e->comm));
+        } else {
+            e->culprit = prev;
+            __builtin_memcpy(&e->comm, args->prev_comm, sizeof(e->comm));
+        }
+        events.ringbuf_submit(e, 0);
+    }
+    offcpu.delete(&next);
+    return 0;
+}
+
+static inline void handler_enter(u32 slot)
+{
+    if (!is_target())
+        return;
+    u64 *start = handler_start.lookup(&slot);
+    if (start)
+        *start = bpf_ktime_get_ns();
+}
+
+static inline void handler_exit(u32 slot, u32 type, u32 which)
+{
+    u64 *start = handler_start.lookup(&slot);
+    if (!start || !*start)
+        return;
+    if (is_target())
+        emit(type, (u32)bpf_get_current_pid_tgid(), *start, bpf_ktime_get_ns(), which);
+    *start = 0;
+}
+
+TRACEPOINT_PROBE(irq, irq_handler_entry) { handler_enter(0); return 0; }
+TRACEPOINT_PROBE(irq, irq_handler_exit) { handler_exit(0, EV_IRQ, args->irq); return 0; }
+TRACEPOINT_PROBE(irq, softirq_entry) { handler_enter(1); return 0; }
+TRACEPOINT_PROBE(irq, softirq_exit) { handler_exit(1, EV_SOFTIRQ, args->vec); return 0; }
+
+int fault_begin(struct pt_regs *ctx)
+{
+    if (!is_target())
+        return 0;
+    u32 tid = bpf_get_current_pid_tgid();
+    u64 now = bpf_ktime_get_ns();
+    faults.update(&tid, &now);
+    return 0;
+}
+
+int fault_end(struct pt_regs *ctx)
+{
+    u32 tid = bpf_get_current_pid_tgid();
+    u64 *start = faults.lookup(&tid);
+    if (!start)
+        return 0;
+    emit(EV_FAULT, tid, *start, bpf_ktime_get_ns(), (PT_REGS_RC(ctx) & VM_FAULT_MAJOR) ? 1 : 0);
+    faults.delete(&tid);
+    return 0;
+}
+
+int step_begin(struct pt_regs *ctx)
+{
+    if (!is_target())
+        return 0;
+    u32 tid = bpf_get_current_pid_tgid();
+    struct step s = {};
+    s.ts = bpf_ktime_get_ns();
+    s.tokens = -1;
+#if defined(READ_BATCH) && defined(BATCH_ON_STACK)
+    // llama_decode(ctx, struct llama_batch batch): the batch is passed by
+    // value in memory above the return address; n_tokens is its first field
+    bpf_probe_read_user(&s.tokens, sizeof(s.tokens), (void *)(PT_REGS_SP(ctx) + 8));
+#elif defined(READ_BATCH)
+    bpf_probe_read_user(&s.tokens, sizeof(s.tokens), (void *)PT_REGS_PARM2(ctx));
+#endif
+    steps.update(&tid, &s);
+    return 0;
+}
+
+int step_end(struct pt_regs *ctx)
+{
+    u32 tid = bpf_get_current_pid_tgid();
+    struct step *s = steps.lookup(&tid);
+    if (!s)
+        return 0;
+    emit(EV_STEP, tid, s->ts, bpf_ktime_get_ns(), (u32)s->tokens);
+    steps.delete(&tid);
+    return 0;
+}
+"""
+
+EV_STEP, EV_OFFCPU, EV_IRQ, EV_SOFTIRQ, EV_FAULT = 1, 2, 3, 4, 5
+
+
+class TraceError(Exception):
+    """Raised when the target cannot be found or traced."""
+    pass
+
+
+@dataclass
+class Interval:
+    """Time a thread was held off its CPU, charged to a culprit label."""
+    start: int
+    end: int
+    culprit: str
+
+
+@dataclass
+class Step:
+    tid: int
+    start: int
+    end: int
+    tokens: int
+
+
+@dataclass
+class ThreadStats:
+    tid: int
+    name: str = ""
+    cpu_s: float = 0.0
+    involuntary: int = 0
+    voluntary: int = 0
+    runq_ns: int = 0
+    irq_ns: int = 0
+    minor_faults: int = 0
+    major_faults: int = 0
+    fault_ns: int = 0
+
+
+@dataclass
+class Trace:
+    """Everything recorded for one process, timestamps in CLOCK_MONOTONIC ns."""
+    pid: int
+    started: int
+    stopped: int = 0
+    steps: List[Step] = field(default_factory=list)
+    intervals: Dict[int, List[Interval]] = field(default_factory=lambda: defaultdict(list))
+    threads: Dict[int, ThreadStats] = field(default_factory=dict)
+
+    def thread(self, tid: int) -> ThreadStats:
+        if tid not in self.threads:
+            self.threads[tid] = ThreadStats(tid)
+        return self.threads[tid]
+
+
+def percentile(values: List[float], pct: float) -> Optional[float]:
+    if not values:
+        return None
+    ordered = sorted(values)
+    return ordered[min(len(ordered) - 1, int(len(ordered) * pct / 100))]
+
+
+def read_file(path: str) -> str:
+    try:
+        with open(path) as f:
+            return f.read()
+    except OSError:
+        return ""
+
+
+def container_pid(name: str) -> int:
+    """Host PID of the llama-server process in a docker container."""
+    try:
+        init = subprocess.run(["docker", "inspect", "-f", "{{.State.Pid}}", name],
+                              capture_output=True, text=True, timeout=10, check=True).stdout.strip()
+    except (OSError, subprocess.SubprocessError) as e:
+        raise TraceError(f"cannot inspect container {name}: {e}") from e
+    if not init.isdigit() or init == "0":
+        raise TraceError(f"container {name} is not running")
+    cgroup = read_file(f"/proc/{init}/cgroup")
+    candidates = [init] + [p for p in os.listdir("/proc") if p.isdigit() and p != init]
+    for pid in candidates:
+        if read_file(f"/proc/{pid}/comm").strip() in SERVER_COMMS and read_file(f"/proc/{pid}/cgroup") == cgroup:
+            return int(pid)
+    raise TraceError(f"no {'/'.join(SERVER_COMMS)} process in container {name}")
+
+
+def step_binary(pid: int) -> str:
+    """Object defining the step symbol: libllama if loaded as a shared library, else the executable."""
+    for line in read_file(f"/proc/{pid}/maps").splitlines():
+        parts = line.split(None, 5)
+        if len(parts) == 6 and "/libllama" in parts[5]:
+            return f"/proc/{pid}/root{parts[5].strip()}"
+    return f"/proc/{pid}/exe"
+
+
+def thread_cpu(pid: int) -> Dict[int, Tuple[str, float]]:
+    """Per-thread name and CPU seconds (utime + stime)."""
+    ticks = os.sysconf("SC_CLK_TCK")
+    threads = {}
+    try:
+        tids = os.listdir(f"/proc/{pid}/task")
+    except OSError:
+        return threads
+    for tid in tids:
+        stat = read_file(f"/proc/{pid}/task/{tid}/stat")
+        if ")" not in stat:
+            continue
+        name = stat[stat.index("(") + 1:stat.rindex(")")]
+        fields = stat[stat.rindex(")") + 2:].split()
+        threads[int(tid)] = (name, (int(fields[11]) + int(fields[12])) / ticks)
+    return threads
+
+
+def irq_names() -> Dict[int, str]:
+    names = {}
+    for line in read_file("/proc/interrupts").splitlines()[1:]:
+        number, _, rest = line.partition(":")
+        if number.strip().isdigit() and rest.split():
+            names[int(number)] = rest.split()[-1]
+    return names
+
+
+class CulpritResolver:
+    """Labels the task that held a CPU: container:NAME, kernel:COMM, host:COMM, self:TID or idle-cpu."""
+
+    def __init__(self, pid: int):
+        self.pid = pid
+        self.cache: Dict[int, str] = {}
+        self.containers: Dict[str, str] = {}
+        try:
+            out = subprocess.run(["docker", "ps", "--no-trunc", "--format", "{{.ID}} {{.Names}}"],
+                                 capture_output=True, text=True, timeout=10).stdout
+            self.containers = dict(line.split(None, 1) for line in out.splitlines() if " " in line)
+        except (OSError, subprocess.SubprocessError):
+            pass
+
+    def resolve(self, pid: int, comm: str) -> str:
+        if pid == 0:
+            return "idle-cpu"
+        if pid not in self.cache:
+            self.cache[pid] = self._lookup(pid, comm)
+        return self.cache[pid]
+
+    def _lookup(self, pid: int, comm: str) -> str:
+        status = read_file(f"/proc/{pid}/status")
+        match = re.search(r"^Tgid:\s+(\d+)", status, re.M)
+        if match is None:
+            return f"host:{comm}"  # Exited before it could be looked up
+        if int(match.group(1)) == self.pid:
+            return f"self:{pid}"
+        if not read_file(f"/proc/{pid}/cmdline"):
+            return f"kernel:{comm.split('/')[0]}"
+        container = re.search(r"[0-9a-f]{64}", read_file(f"/proc/{pid}/cgroup"))
+        if container:
+            return f"container:{self.containers.get(container.group(0), container.group(0)[:12])}"
+        return f"host:{comm}"
+
+
+class Tracer:
+    """Attaches the eBPF program to one llama-server process and collects its events."""
+
+    def __init__(self, pid: int, step_symbol: str):
+        try:
+            from bcc import BPF
+        except ImportError as e:
+            raise TraceError("bcc not found (apt install python3-bpfcc, run with the system python3)") from e
+        if os.geteuid() != 0:
+            raise TraceError("eBPF tracing requires root")
+        self.trace = Trace(pid, time.monotonic_ns())
+        self.resolver = CulpritResolver(pid)
+        self.irqs = irq_names()
+        self.binary = step_binary(pid)
+        self.step_symbol = step_symbol
+        self.unavailable: List[str] = []
+        cflags = [f"-DTARGET_TGID={pid}"]
+        if step_symbol == "llama_decode":
+            cflags.append("-DREAD_BATCH")
+            if platform.machine() == "x86_64":
+                cflags.append("-DBATCH_ON_STACK")
+        try:
+            self.bpf = BPF(text=BPF_PROGRAM, cflags=cflags)
+            self.bpf.attach_uprobe(name=self.binary, sym=step_symbol, fn_name="step_begin", pid=pid)
+            self.bpf.attach_uretprobe(name=self.binary, sym=step_symbol, fn_name="step_end", pid=pid)
+        except Exception as e:
+            raise TraceError(f"cannot attach to {step_symbol} in {self.binary}: {e}") from e
+        try:
+            self.bpf.attach_kprobe(event="handle_mm_fault", fn_name="fault_begin")
+            self.bpf.attach_kretprobe(event="handle_mm_fault", fn_name="fault_end")
+        except Exception:
+            self.unavailable.append("page faults")
+        self.bpf["events"].open_ring_buffer(self._on_event)
+
+    def _on_event(self, ctx: Any, data: Any, size: int) -> None:
+        e = self.bpf["events"].event(data)
+        trace = self.trace
+        if e.type == EV_STEP:
+            trace.steps.append(Step(e.tid, e.start, e.end, e.culprit if e.culprit < 2 ** 31 else -1))
+            return
+        thread = trace.thread(e.tid)
+        if e.type == EV_OFFCPU:
+            if e.flags:
+                thread.involuntary += 1
+            else:
+                thread.voluntary += 1
+            if e.end > e.ready:
+                thread.runq_ns += e.end - e.ready
+                culprit = self.resolver.resolve(e.culprit, e.comm.decode(errors="replace"))
+                trace.intervals[e.tid].append(Interval(e.ready, e.end, culprit))
+        elif e.type in (EV_IRQ, EV_SOFTIRQ):
+            thread.irq_ns += e.end - e.start
+            if e.type == EV_IRQ:
+                culprit = f"irq:{self.irqs.get(e.culprit, e.culprit)}"
+            else:
+                culprit = f"softirq:{SOFTIRQ_NAMES[e.culprit] if e.culprit < len(SOFTIRQ_NAMES) else e.culprit}"
+            trace.intervals[e.tid].append(Interval(e.start, e.end, culprit))
+        elif e.type == EV_FAULT:
+            if e.culprit:
+                thread.major_faults += 1
+            else:
+                thread.minor_faults += 1
+            thread.fault_ns += e.end - e.start
+            trace.intervals[e.tid].append(Interval(e.start, e.end, "fault:major" if e.culprit else "fault:minor"))
+
+    def run(self, duration: float) -> Trace:
+        """Trace until the duration elapses, the process exits or Ctrl-C."""
+        before = thread_cpu(self.trace.pid)
+        deadline = time.monotonic() + duration
+        try:
+            while time.monotonic() < deadline and os.path.exists(f"/proc/{self.trace.pid}"):
+                self.bpf.ring_buffer_poll(200)
+        except KeyboardInterrupt:
+            pass
+        self.bpf.ring_buffer_consume()
+        self.trace.stopped = time.monotonic_ns()
+        for tid, (name, cpu) in thread_cpu(self.trace.pid).items():
+            thread = self.trace.thread(tid)
+            thread.name = name
+            thread.cpu_s = cpu - before.get(tid, (name, 0.0))[1]
+        return self.trace
+
+
+def category(culprit: str) -> str:
+    return culprit.split(":", 1)[0]
+
+
+def label_self(culprit: str, compute: set) -> str:
+    """Resolve self:TID to the server's compute or HTTP/other threads."""
+    if not culprit.startswith("self:"):
+        return culprit
+    return "compute:llama-server" if int(culprit[5:]) in compute else "http:llama-server"
+
+
+def charge(intervals: List[Interval], reach: List[int], begin: int, end: int) -> Dict[str, int]:
+    """Time of [begin, end) covered by intervals, each instant charged once to
+    the earliest interval covering it. intervals are sorted by start and
+    reach[i] is the latest end among intervals[:i + 1]."""
+    charged: Dict[str, int] = defaultdict(int)
+    covered = begin
+    i = bisect_right(reach, begin)
+    while i < len(intervals) and intervals[i].start < end:
+        iv = intervals[i]
+        lo, hi = max(iv.start, covered), min(iv.end, end)
+        if hi > lo:
+            charged[iv.culprit] += hi - lo
+            covered = hi
+        i += 1
+    return charged
+
+
+def analyze(trace: Trace, decode_max_tokens: int, tail_pct: float) -> Dict[str, Any]:
+    """Per-step critical-thread stall and its attribution."""
+    busiest = max((t.cpu_s for t in trace.threads.values()), default=0.0)
+    step_tids = {s.tid for s in trace.steps}
+    compute = {tid for tid, t in trace.threads.items()
+               if tid in step_tids or (busiest and t.cpu_s >= COMPUTE_CPU_SHARE * busiest)}
+
+    intervals = {}
+    for tid in compute:
+        ivs = sorted(trace.intervals.get(tid, []), key=lambda iv: iv.start)
+        for iv in ivs:
+            iv.culprit = label_self(iv.culprit, compute)
+        intervals[tid] = (ivs, list(accumulate((iv.end for iv in ivs), max)))
+
+    decode = [s for s in trace.steps if 0 <= s.tokens <= decode_max_tokens or s.tokens < 0]
+    prefill = len(trace.steps) - len(decode)
+    rows = []
+    culprits: Dict[str, Dict[str, float]] = defaultdict(lambda: {"critical_ns": 0, "all_ns": 0, "steps": 0, "tail_ns": 0})
+    for step in decode:
+        worst_tid, worst, worst_charge = None, 0, {}
+        for tid, (ivs, reach) in intervals.items():
+            charged = charge(ivs, reach, step.start, step.end)
+            for culprit, ns in charged.items():
+                culprits[culprit]["all_ns"] += ns
+            total = sum(charged.values())
+            if total > worst:
+                worst_tid, worst, worst_charge = tid, total, charged
+        for culprit, ns in worst_charge.items():
+            culprits[culprit]["critical_ns"] += ns
+            culprits[culprit]["steps"] += 1
+        top = max(worst_charge, key=worst_charge.get) if worst_charge else None
+        rows.append({"offset_ms": round((step.start - trace.started) / 1e6, 3),
+                     "duration_ms": round((step.end - step.start) / 1e6, 3), "tokens": step.tokens,
+                     "stall_ms": round(worst / 1e6, 3), "critical_tid": worst_tid, "top_culprit": top,
+                     "charge": worst_charge})
+
+    durations = [r["duration_ms"] for r in rows]
+    stalls = [r["stall_ms"] for r in rows]
+    p50 = percentile(durations, 50)
+    tail_cut = percentile(durations, tail_pct)
+    tail = [r for r in rows if tail_cut is not None and r["duration_ms"] >= tail_cut]
+    excess = sum(r["duration_ms"] - p50 for r in tail) if tail else 0.0
+    tail_stall = sum(min(r["stall_ms"], r["duration_ms"] - p50) for r in tail if r["duration_ms"] > p50)
+    for r in tail:
+        for culprit, ns in r["charge"].items():
+            culprits[culprit]["tail_ns"] += ns
+    for r in rows:
+        del r["charge"]
+
+    sharing_tail = sum(c["tail_ns"] for name, c in culprits.items() if category(name) in SHARING) / 1e6
+    tail_charged = sum(c["tail_ns"] for c in culprits.values()) / 1e6
+    by_category: Dict[str, float] = defaultdict(float)
+    for name, c in culprits.items():
+        by_category[category(name)] += c["critical_ns"] / 1e6
+
+    def dist(values: List[float]) -> Dict[str, Optional[float]]:
+        return {f"p{p}": percentile(values, p) for p in (50, 90, 99)} | {"max": max(values, default=None)}
+
+    return {
+        "duration_s": round((trace.stopped - trace.started) / 1e9, 1),
+        "compute_threads": sorted(compute),
+        "decode_steps": len(decode),
+        "prefill_steps": prefill,
+        "step_ms": dist(durations),
+        "stall_ms": dist(stalls),
+        "steps_stalled": round(sum(1 for s in stalls if s > 0) / len(stalls), 3) if stalls else None,
+        "mean_stall_share": round(sum(stalls) / sum(durations), 4) if durations and sum(durations) else None,
+        "tail_steps": len(tail),
+        "tail_excess_ms": round(excess, 3),
+        "tail_stall_share": round(tail_stall / excess, 3) if excess > 0 else None,
+        "tail_sharing_share": round(sharing_tail / tail_charged, 3) if tail_charged else None,
+        "categories_ms": {k: round(v, 3) for k, v in sorted(by_category.items(), key=lambda kv: -kv[1])},
+        "culprits": {name: {"critical_ms": round(c["critical_ns"] / 1e6, 3), "all_threads_ms": round(c["all_ns"] / 1e6, 3),
+                            "steps": c["steps"], "tail_ms": round(c["tail_ns"] / 1e6, 3)}
+                     for name, c in sorted(culprits.items(), key=lambda kv: -kv[1]["critical_ns"])},
+        "steps": rows,
+    }
+
+
+def print_report(trace: Trace, summary: Dict[str, Any], top: int) -> None:
+    compute = set(summary["compute_threads"])
+    print()
+    print(f"Decode steps: {summary['decode_steps']} ({summary['prefill_steps']} prefill steps excluded)")
+    if not summary["decode_steps"]:
+        return
+    print(f"{'(ms)':<22} {'p50':>8} {'p90':>8} {'p99':>8} {'max':>8}")
+    for label, key in (("Step duration", "step_ms"), ("Stall, slowest thread", "stall_ms")):
+        d = summary[key]
+        print(f"{label:<22} " + " ".join(f"{d[k]:>8.2f}" for k in ("p50", "p90", "p99", "max")))
+    print(f"Steps with a stall: {summary['steps_stalled']:.1%}, "
+          f"stall share of decode time: {summary['mean_stall_share']:.2%}")
+
+    print()
+    print(f"Stall on the slowest thread by culprit (top {top}):")
+    print(f"{'Culprit':<36} {'Total ms':>9} {'Steps':>6} {'Tail ms':>8} {'All thr ms':>11}")
+    for name, c in list(summary["culprits"].items())[:top]:
+        print(f"{name[:36]:<36} {c['critical_ms']:>9.2f} {c['steps']:>6} {c['tail_ms']:>8.2f} {c['all_threads_ms']:>11.2f}")
+
+    print()
+    print("Threads:")
+    print(f"{'TID':>8} {'Name':<16} {'Role':<8} {'CPU s':>7} {'Invol':>6} {'Vol':>7} {'RunQ ms':>8} "
+          f"{'IRQ ms':>7} {'Faults':>7} {'Major':>6}")
+    for tid, t in sorted(trace.threads.items(), key=lambda kv: (kv[0] not in compute, -kv[1].cpu_s)):
+        print(f"{tid:>8} {t.name[:16]:<16} {'compute' if tid in compute else 'other':<8} {t.cpu_s:>7.2f} "
+              f"{t.involuntary:>6} {t.voluntary:>7} {t.runq_ns / 1e6:>8.2f} {t.irq_ns / 1e6:>7.2f} "
+              f"{t.minor_faults + t.major_faults:>7} {t.major_faults:>6}")
+
+
+def verdict(summary: Dict[str, Any], args: argparse.Namespace) -> Tuple[bool, str]:
+    """Whether scheduling interference from sharing the CPUs explains the tail."""
+    stall_share, sharing = summary["tail_stall_share"], summary["tail_sharing_share"]
+    if stall_share is None:
+        return False, "no tail excess to explain"
+    detail = (f"stalls explain {stall_share:.0%} of the p{args.tail_pct:g} steps' excess over p50, "
+              f"{(sharing or 0):.0%} of it from sharing the CPUs")
+    costly = stall_share >= args.max_tail_share and (sharing or 0) >= 0.5
+    if costly:
+        shared = [n for n in summary["culprits"] if category(n) in SHARING]
+        detail += f"; top culprit {shared[0]}" if shared else ""
+    return costly, detail
+
+
+def create_parser() -> argparse.ArgumentParser:
+    """Create command line argument parser."""
+    parser = argparse.ArgumentParser(
+        description="Trace scheduling stalls of llama-server compute threads per decode step",
+        formatter_class=argparse.RawDescriptionHelpFormatter,
+        epilog="""
+Examples:
+  sudo python3 sched_trace.py --container llama-cpu --duration 60
+  sudo python3 sched_trace.py --pid 4242 --decode-max-tokens 4 --output trace.json
+        """
+    )
+    target = parser.add_mutually_exclusive_group()
+    target.add_argument("--container", default="llama-cpu",
+                        help="Docker container running llama-server (default: llama-cpu)")
+    target.add_argument("--pid", type=int, help="Host PID of llama-server instead of a container")
+    parser.add_argument("--duration", type=float, default=30.0,
+                        help="Seconds to trace; Ctrl-C stops early (default: 30)")
+    parser.add_argument("--step-symbol", default="llama_decode",
+                        help="Function bracketing one step (default: llama_decode)")
+    parser.add_argument("--decode-max-tokens", type=int, default=16,
+                        help="Steps with more batch tokens are prefill and excluded (default: 16)")
+    parser.add_argument("--tail-pct", type=float, default=99.0,
+                        help="Percentile of step duration analysed as the tail (default: 99)")
+    parser.add_argument("--max-tail-share", type=float, default=0.3,
+                        help="Share of the tail excess that stalls may explain before the "
+                             "trace reports interference (default: 0.3)")
+    parser.add_argument("--top", type=int, default=12, help="Culprits listed (default: 12)")
+    parser.add_argument("--output", help="Output JSON filename (default: auto-generated)")
+    return parser
+
+
+def main() -> int:
+    """Main function to run the tracer.
+
+    Returns:
+        Exit code: 0 if sharing the CPUs does not explain the tail, 3 if it
+        does, 1 for errors, 2 for invalid usage.
+    """
+    parser = create_parser()
+    args = parser.parse_args()
+
+    try:
+        pid = args.pid if args.pid is not None else container_pid(args.container)
+        if not os.path.exists(f"/proc/{pid}"):
+            raise TraceError(f"no process {pid}")
+        tracer = Tracer(pid, args.step_symbol)
+    except TraceError as e:
+        print(f"Configuration: {STATUS_ERROR} ({e})", file=sys.stderr)
+        return EXIT_INVALID_USAGE
+
+    cpus = re.search(r"^Cpus_allowed_list:\s+(\S+)", read_file(f"/proc/{pid}/status"), re.M)
+    print("Scheduling trace")
+    print(f"  Target: pid {pid} ({read_file(f'/proc/{pid}/comm').strip()}"
+          f"{', container ' + args.container if args.pid is None else ''}), CPUs {cpus.group(1) if cpus else '?'}")
+    print(f"  Steps: {args.step_symbol} in {tracer.binary}")
+    for what in tracer.unavailable:
+        print(f"  {what.capitalize()}: {STATUS_WARN} (not traced)")
+    print(f"Tracing for {args.duration:g} s...")
+
+    trace = tracer.run(args.duration)
+    summary = analyze(trace, args.decode_max_tokens, args.tail_pct)
+    print_report(trace, summary, args.top)
+    costly, detail = verdict(summary, args)
+    print()
+    if not summary["decode_steps"]:
+        print(f"Scheduling interference: {STATUS_WARN} (no decode steps traced; send requests during the trace)")
+    elif costly:
+        print(f"Scheduling interference: {STATUS_WARN} ({detail})")
+    else:
+        print(f"Scheduling interference: {STATUS_OK} ({detail})")
+
+    filename = args.output or f"sched_trace_{datetime.now().strftime('%Y%m%d_%H%M%S')}.json"
+    try:
+        with open(filename, "w") as f:
+            json.dump({"timestamp": datetime.now().isoformat(), "pid": pid,
+                       "container": args.container if args.pid is None else None,
+                       "step_symbol": args.step_symbol, "interference": costly,
+                       "summary": summary,
+                       "threads": {tid: vars(t) for tid, t in trace.threads.items()}}, f, indent=2)
+        print(f"Results: {STATUS_OK} (saved to {filename})")
+    except OSError as e:
+        print(f"Results: {STATUS_ERROR} (cannot save {filename}: {e})", file=sys.stderr)
+        return EXIT_FAILURE
+    return EXIT_INTERFERENCE if costly else EXIT_SUCCESS
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,168 @@
+#!/usr/bin/env python3
+"""
+Start and stop llama-server configurations for the evaluation harnesses.
+A configuration is an optional model override, extra llama-server flags and
+environment (for the huge page wrapper and entrypoint), run either as a
+one-off llama-cpu compose container or as a local llama-server process under
+the wrapper.
+"""
+
+import argparse
+import os
+import subprocess
+import tempfile
+import time
+from dataclasses import dataclass, field
+from pathlib import Path
+from typing import Dict, List, Optional
+
+import requests
+
+# Wrapper metrics file, relative to the llama-cpu logs volume (./logs/cpu:/app/logs)
+METRICS_FILE = "eval_server.prom"
+CONTAINER_NAME = "llama-cpu-eval"
+
+
+class LaunchError(Exception):
+    """Raised when a server configuration cannot be started or does not load."""
+    pass
+
+
+@dataclass
+class ServerConfig:
+    """Model, extra llama-server flags and environment for one configuration."""
+    name: str
+    args: List[str] = field(default_factory=list)
+    env: Dict[str, str] = field(default_factory=dict)
+    model: Optional[str] = None
+
+
+class ComposeLauncher:
+    """Runs configurations as a one-off llama-cpu compose container.
+
+    The compose service's cpuset, memory limit, model mount and entrypoint
+    (huge page wrapper, pre-flight check) apply exactly as in production;
+    flags are passed through the entrypoint's EXTRA_ARGS.
+    """
+
+    def __init__(self, port: int, model: Optional[str], logs_dir: Path):
+        self.port = port
+        self.model = model
+        self.metrics_path = logs_dir / METRICS_FILE
+
+    def start(self, config: ServerConfig) -> None:
+        env = dict(config.env, SERVER_PORT=str(self.port),
+                   HUGEPAGE_WRAPPER_METRICS=f"/app/logs/{METRICS_FILE}")
+        if config.args:
+            # The entrypoint word-splits EXTRA_ARGS, so flags cannot contain spaces
+            env["EXTRA_ARGS"] = " ".join(config.args)
+        if config.model or self.model:
+            env["MODEL_PATH"] = config.model or self.model
+        command = ["docker-compose", "run", "-d", "--rm", "--name", CONTAINER_NAME,
+                   "-p", f"127.0.0.1:{self.port}:{self.port}"]
+        for key, value in env.items():
+            command += ["-e", f"{key}={value}"]
+        command.append("llama-cpu")
+        result = subprocess.run(command, capture_output=True, text=True)
+        if result.returncode != 0:
+            raise LaunchError(f"docker-compose run failed: {result.stderr.strip()}")
+
+    def running(self) -> bool:
+        result = subprocess.run(["docker", "inspect", "-f", "{{.State.Running}}", CONTAINER_NAME],
+                                capture_output=True, text=True)
+        return result.stdout.strip() == "true"
+
+    def stop(self) -> None:
+        subprocess.run(["docker", "stop", CONTAINER_NAME], capture_output=True)
+
+
+class LocalLauncher:
+    """Runs configurations as a local llama-server process under the wrapper."""
+
+    def __init__(self, port: int, model: str, server_bin: str, wrapper: Optional[str],
+                 threads: int, ctx_size: int):
+        self.port = port
+        self.model = model
+        self.server_bin = server_bin
+        self.wrapper = wrapper
+        self.threads = threads
+        self.ctx_size = ctx_size
+        self.metrics_path = Path(tempfile.gettempdir()) / METRICS_FILE
+        self.process: Optional[subprocess.Popen] = None
+
+    def start(self, config: ServerConfig) -> None:
+        command = [self.server_bin, "--model", config.model or self.model, "--host", "127.0.0.1",
+                   "--port", str(self.port), "--ctx-size", str(self.ctx_size),
+                   "--threads", str(self.threads), "--threads-batch", str(self.threads),
+                   "--cont-batching", "--no-warmup"] + config.args
+        env = dict(os.environ, HUGEPAGE_WRAPPER_METRICS=str(self.metrics_path), **config.env)
+        if self.wrapper:
+            env["LD_PRELOAD"] = self.wrapper
+        try:
+            self.process = subprocess.Popen(command, env=env, stdout=subprocess.DEVNULL,
+                                            stderr=subprocess.DEVNULL)
+        except OSError as e:
+            raise LaunchError(f"cannot start {self.server_bin}: {e}")
+
+    def running(self) -> bool:
+        return self.process is not None and self.process.poll() is None
+
+    def stop(self) -> None:
+        if self.process is not None:
+            self.process.terminate()
+            try:
+                self.process.wait(timeout=30)
+            except subprocess.TimeoutExpired:
+                self.process.kill()
+                self.process.wait()
+            self.process = None
+
+
+def wait_ready(base_url: str, launcher, timeout: int) -> None:
+    """Wait until /health answers 200; the model is loaded by then.
+
+    Raises:
+        LaunchError: If the server exits or does not load in time
+    """
+    deadline = time.monotonic() + timeout
+    while time.monotonic() < deadline:
+        try:
+            if requests.get(f"{base_url}/health", timeout=2).status_code == 200:
+                return
+        except requests.RequestException:
+            pass
+        if not launcher.running():
+            raise LaunchError("server exited while loading")
+        time.sleep(2)
+    raise LaunchError(f"server not ready after {timeout}s")
+
+
+def add_launcher_arguments(parser: argparse.ArgumentParser, port: int) -> None:
+    """Add the options selecting and configuring the launcher."""
+    launch = parser.add_argument_group("server")
+    launch.add_argument("--launcher", choices=["compose", "local"], default="compose",
+                        help="Start configurations as llama-cpu compose containers or local processes (default: compose)")
+    launch.add_argument("--port", type=int, default=port, help=f"Port for evaluated servers (default: {port})")
+    launch.add_argument("--model", help="Main model (default: the llama-cpu service's MODEL_PATH)")
+    launch.add_argument("--logs-dir", default="logs/cpu",
+                        help="Host directory mounted at /app/logs in llama-cpu (default: logs/cpu)")
+    launch.add_argument("--server-bin", help="llama-server binary for --launcher local")
+    launch.add_argument("--wrapper", help="hugepage_mmap_wrapper.so to preload for --launcher local")
+    launch.add_argument("--threads", type=int, default=12, help="Main model threads for --launcher local (default: 12)")
+    launch.add_argument("--ctx-size", type=int, default=8192, help="Context size for --launcher local (default: 8192)")
+    launch.add_argument("--timeout", type=int, default=600, help="Request timeout in seconds (default: 600)")
+    launch.add_argument("--load-timeout", type=int, default=900, help="Model load timeout in seconds (default: 900)")
+
+
+def create_launcher(args: argparse.Namespace):
+    """Build the launcher selected on the command line.
+
+    Raises:
+        LaunchError: If --launcher local is missing --server-bin or --model
+    """
+    if args.launcher == "local":
+        if not args.server_bin or not args.model:
+            raise LaunchError("--launcher local needs --server-bin and --model")
+        return LocalLauncher(args.port, args.model, args.server_bin, args.wrapper,
+                             args.threads, args.ctx_size)
+    return ComposeLauncher(args.port, args.model, Path(args.logs_dir))
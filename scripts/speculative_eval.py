@@ -0,0 +1,433 @@
+#!/usr/bin/env python3
+"""
+Speculative decoding evaluation harness for the CPU llama-server.
+Replays recorded traffic against llama-server started with each candidate
+draft model, draft length and draft thread count, with the draft loaded on
+huge pages next to the main model by the wrapper. Measures acceptance rate,
+effective decode tokens per second, memory cost and weight bytes read per
+generated token, and recommends whether and how to enable speculative decoding.
+"""
+
+import argparse
+import json
+import statistics
+import sys
+import time
+from dataclasses import dataclass
+from datetime import datetime
+from pathlib import Path
+from typing import Any, Dict, List, Optional
+
+import requests
+
+from benchmark import BENCHMARK_PROMPTS
+from server_launcher import (
+    LaunchError,
+    ServerConfig,
+    add_launcher_arguments,
+    create_launcher,
+    wait_ready,
+)
+
+# Status indicators
+STATUS_OK = "OK"
+STATUS_WARN = "WARN"
+STATUS_ERROR = "ERROR"
+
+# Exit codes
+EXIT_SUCCESS = 0
+EXIT_FAILURE = 1
+EXIT_INVALID_USAGE = 2
+
+# Draft models are a few hundred MB; the wrapper's default threshold is 1GB
+DRAFT_MIN_SIZE_MB = 64
+
+
+class EvalError(Exception):
+    """Raised when a replayed request fails."""
+    pass
+
+
+@dataclass
+class Candidate:
+    """One server configuration; draft is None for the baseline."""
+    draft: Optional[str] = None
+    draft_max: int = 0
+    threads_draft: int = 0
+
+    @property
+    def label(self) -> str:
+        if self.draft is None:
+            return "baseline"
+        return f"{Path(self.draft).stem} max={self.draft_max} threads={self.threads_draft}"
+
+    def server_config(self) -> ServerConfig:
+        if self.draft is None:
+            return ServerConfig(self.label)
+        return ServerConfig(self.label,
+                            ["--model-draft", self.draft, "--draft-max", str(self.draft_max),
+                             "--threads-draft", str(self.threads_draft),
+                             "--threads-batch-draft", str(self.threads_draft)],
+                            {"HUGEPAGE_WRAPPER_MIN_SIZE_MB": str(DRAFT_MIN_SIZE_MB)})
+
+    def entrypoint_env(self) -> Dict[str, str]:
+        """Settings for docker/llama-cpu/entrypoint.sh."""
+        if self.draft is None:
+            return {"DRAFT_MODEL_PATH": ""}
+        return {"DRAFT_MODEL_PATH": self.draft, "DRAFT_MAX": str(self.draft_max),
+                "THREADS_DRAFT": str(self.threads_draft)}
+
+
+def read_meminfo() -> Dict[str, int]:
+    """Return /proc/meminfo values in bytes (huge page counts stay page counts)."""
+    values = {}
+    with open("/proc/meminfo") as f:
+        for line in f:
+            key, _, rest = line.partition(":")
+            parts = rest.split()
+            if not parts:
+                continue
+            values[key] = int(parts[0]) * (1024 if len(parts) > 1 else 1)
+    return values
+
+
+def memory_in_use(meminfo: Dict[str, int]) -> int:
+    """Bytes taken from regular memory plus huge pages taken from the pool."""
+    hugepages_used = meminfo.get("HugePages_Total", 0) - meminfo.get("HugePages_Free", 0)
+    return (meminfo.get("MemTotal", 0) - meminfo.get("MemAvailable", 0)
+            + hugepages_used * meminfo.get("Hugepagesize", 0))
+
+
+def read_wrapper_bytes(path: Path) -> Optional[int]:
+    """Total model bytes the wrapper mapped, from its Prometheus metrics file."""
+    try:
+        total = 0
+        for line in path.read_text().splitlines():
+            if line.startswith("hugepage_wrapper_bytes{"):
+                total += int(line.split()[-1])
+        return total
+    except (OSError, ValueError):
+        return None
+
+
+def load_traffic(path: Optional[str], limit: Optional[int]) -> List[Dict[str, Any]]:
+    """Load recorded requests, one JSON request body (or {"path", "body"}) per line.
+
+    Without a recording, the benchmark.py prompts are used.
+    """
+    if path is None:
+        traffic = [{"path": "/v1/chat/completions",
+                    "body": {"messages": [{"role": "user", "content": p["prompt"]}],
+                             "max_tokens": p["max_tokens"]}}
+                   for p in BENCHMARK_PROMPTS.values()]
+    else:
+        traffic = []
+        with open(path) as f:
+            for line in f:
+                if not line.strip():
+                    continue
+                entry = json.loads(line)
+                body = entry.get("body", entry)
+                default_path = "/completion" if "prompt" in body else "/v1/chat/completions"
+                traffic.append({"path": entry.get("path", default_path), "body": body})
+    return traffic[:limit] if limit else traffic
+
+
+class SpeculativeEval:
+    def __init__(self, launcher: Any, port: int, traffic: List[Dict[str, Any]],
+                 greedy: bool = True, timeout: int = 600, load_timeout: int = 900):
+        self.launcher = launcher
+        self.base_url = f"http://127.0.0.1:{port}"
+        self.traffic = traffic
+        self.greedy = greedy
+        self.timeout = timeout
+        self.load_timeout = load_timeout
+
+    def send(self, entry: Dict[str, Any]) -> Dict[str, Any]:
+        """Replay one recorded request; returns its text and llama-server timings."""
+        body = dict(entry["body"], stream=False)
+        body.pop("stream_options", None)
+        if self.greedy:
+            # Speculative decoding is lossless under greedy sampling, so outputs must match
+            body.update(temperature=0.0, seed=0)
+        response = requests.post(f"{self.base_url}{entry['path']}", json=body, timeout=self.timeout)
+        if response.status_code != 200:
+            raise EvalError(f"HTTP {response.status_code}")
+        data = response.json()
+        if "choices" in data:
+            choice = data["choices"][0]
+            text = choice.get("message", {}).get("content") or choice.get("text", "")
+        else:
+            text = data.get("content", "")
+        return {"text": text, "timings": data.get("timings", {})}
+
+    def run_candidate(self, candidate: Candidate) -> Dict[str, Any]:
+        """Start the server for `candidate`, replay the traffic and stop it."""
+        print(f"Candidate: {candidate.label}")
+        try:
+            self.launcher.metrics_path.unlink()
+        except OSError:
+            pass
+        before = memory_in_use(read_meminfo())
+        load_started = time.monotonic()
+        self.launcher.start(candidate.server_config())
+        try:
+            wait_ready(self.base_url, self.launcher, self.load_timeout)
+            load_s = time.monotonic() - load_started
+            memory = memory_in_use(read_meminfo()) - before
+            weight_bytes = read_wrapper_bytes(self.launcher.metrics_path)
+            print(f"  Load: {STATUS_OK} ({load_s:.0f}s, {memory / 1024 ** 3:.2f} GB in use)")
+
+            try:
+                self.send(self.traffic[0])  # warmup
+            except (requests.RequestException, EvalError, ValueError):
+                pass
+            responses = []
+            for entry in self.traffic:
+                try:
+                    responses.append(self.send(entry))
+                except (requests.RequestException, EvalError, ValueError) as e:
+                    responses.append({"error": str(e)})
+        finally:
+            self.launcher.stop()
+
+        ok = [r for r in responses if "error" not in r]
+        status = STATUS_OK if len(ok) == len(responses) else STATUS_WARN if ok else STATUS_ERROR
+        print(f"  Replay: {status} ({len(ok)}/{len(responses)} requests)")
+        return {"candidate": candidate, "load_s": round(load_s, 1), "memory_bytes": max(0, memory),
+                "weight_bytes": weight_bytes, "responses": responses}
+
+
+def summarize(run: Dict[str, Any], baseline: Optional[Dict[str, Any]]) -> Dict[str, Any]:
+    """Derive acceptance, decode rate, memory and bandwidth figures for one run.
+
+    Each main-model pass verifies the drafted tokens and yields one token plus
+    the accepted drafts, so a run reads the main weights (predicted_n -
+    accepted) times and the draft weights once per drafted token. Weight bytes
+    are the file sizes, an upper bound for MoE models that read only the
+    active experts.
+    """
+    ok = [r for r in run["responses"] if "error" not in r]
+    predicted_n = sum(r["timings"].get("predicted_n", 0) for r in ok)
+    predicted_ms = sum(r["timings"].get("predicted_ms", 0.0) for r in ok)
+    drafted = sum(r["timings"].get("draft_n", 0) for r in ok)
+    accepted = sum(r["timings"].get("draft_n_accepted", 0) for r in ok)
+    per_request_tps = [r["timings"]["predicted_per_second"] for r in ok
+                       if r["timings"].get("predicted_per_second")]
+
+    summary = {
+        "label": run["candidate"].label,
+        "settings": run["candidate"].entrypoint_env(),
+        "requests": len(run["responses"]),
+        "successful": len(ok),
+        "load_s": run["load_s"],
+        "memory_bytes": run["memory_bytes"],
+        "weight_bytes": run["weight_bytes"],
+        "generated_tokens": predicted_n,
+        "decode_tps": round(predicted_n / predicted_ms * 1000, 2) if predicted_ms else None,
+        "median_request_tps": round(statistics.median(per_request_tps), 2) if per_request_tps else None,
+        "drafted_tokens": drafted,
+        "accepted_tokens": accepted,
+        "acceptance_rate": round(accepted / drafted, 3) if drafted else None,
+        "tokens_per_main_pass": round(predicted_n / (predicted_n - accepted), 2) if predicted_n > accepted else None,
+    }
+    if baseline is None:
+        summary["main_weight_bytes"] = run["weight_bytes"]
+        if run["weight_bytes"]:
+            summary["weight_bytes_per_token"] = run["weight_bytes"]
+        return summary
+
+    base = baseline["summary"]
+    main_bytes = base.get("main_weight_bytes")
+    draft_bytes = (run["weight_bytes"] - main_bytes) if run["weight_bytes"] and main_bytes else None
+    summary["extra_memory_bytes"] = max(0, run["memory_bytes"] - base["memory_bytes"])
+    if base["decode_tps"] and summary["decode_tps"]:
+        summary["speedup"] = round(summary["decode_tps"] / base["decode_tps"], 3)
+    if draft_bytes is not None and predicted_n:
+        summary["draft_weight_bytes"] = draft_bytes
+        summary["weight_bytes_per_token"] = int(
+            (main_bytes * (predicted_n - accepted) + draft_bytes * drafted) / predicted_n)
+        if accepted:
+            summary["draft_bytes_per_accepted_token"] = int(draft_bytes * drafted / accepted)
+
+    # Compare outputs request by request against the baseline
+    pairs = [(r, b) for r, b in zip(run["responses"], baseline["responses"])
+             if "error" not in r and "error" not in b]
+    if pairs:
+        summary["output_match"] = round(sum(r["text"] == b["text"] for r, b in pairs) / len(pairs), 3)
+    return summary
+
+
+def recommend(summaries: List[Dict[str, Any]], min_speedup: float, min_match: Optional[float],
+              max_extra_memory: Optional[int]) -> Dict[str, Any]:
+    """Pick the fastest candidate that is worth its memory and keeps outputs intact."""
+    rejected = {}
+    eligible = []
+    for s in summaries[1:]:
+        if s["successful"] < s["requests"]:
+            rejected[s["label"]] = "failed requests"
+        elif (s.get("speedup") or 0) < min_speedup:
+            rejected[s["label"]] = f"speedup {s.get('speedup')} below {min_speedup}"
+        elif min_match is not None and s.get("output_match", 1.0) < min_match:
+            rejected[s["label"]] = f"output match {s.get('output_match')} below {min_match}"
+        elif max_extra_memory is not None and s["extra_memory_bytes"] > max_extra_memory:
+            rejected[s["label"]] = f"extra memory {s['extra_memory_bytes'] / 1024 ** 3:.2f} GB over budget"
+        else:
+            eligible.append(s)
+
+    if not eligible:
+        return {"enable": False, "settings": summaries[0]["settings"], "rejected": rejected}
+    best = max(eligible, key=lambda s: s["decode_tps"])
+    return {"enable": True, "label": best["label"], "settings": best["settings"],
+            "speedup": best["speedup"], "rejected": rejected}
+
+
+def print_report(summaries: List[Dict[str, Any]], recommendation: Dict[str, Any]) -> None:
+    print()
+    print("Speculative decoding results:")
+    print(f"{'Candidate':<40} {'tok/s':>8} {'Speedup':>8} {'Accept':>7} {'Match':>6} "
+          f"{'+Mem GB':>8} {'MB/token':>9}")
+    for s in summaries:
+        def fmt(value: Optional[float], spec: str) -> str:
+            return format(value, spec) if value is not None else "-"
+
+        extra = s.get("extra_memory_bytes")
+        per_token = s.get("weight_bytes_per_token")
+        print(f"{s['label']:<40} {fmt(s['decode_tps'], '.2f'):>8} {fmt(s.get('speedup'), '.2f'):>8} "
+              f"{fmt(s.get('acceptance_rate'), '.0%'):>7} {fmt(s.get('output_match'), '.0%'):>6} "
+              f"{fmt(extra / 1024 ** 3 if extra is not None else None, '.2f'):>8} "
+              f"{fmt(per_token / 1024 ** 2 if per_token else None, '.0f'):>9}")
+
+    print()
+    for label, reason in recommendation["rejected"].items():
+        print(f"  Rejected: {label} ({reason})")
+    if recommendation["enable"]:
+        print(f"Recommendation: {STATUS_OK} (enable {recommendation['label']}, "
+              f"{recommendation['speedup']:.2f}x decode)")
+        print("  Set in docker-compose.yaml (llama-cpu environment):")
+        for key, value in recommendation["settings"].items():
+            print(f"    - {key}={value}")
+    else:
+        print(f"Recommendation: {STATUS_WARN} (keep speculative decoding off, no candidate qualified)")
+
+
+def parse_int_list(value: str) -> List[int]:
+    return [int(v) for v in value.split(",") if v.strip()]
+
+
+def create_parser() -> argparse.ArgumentParser:
+    """Create command line argument parser."""
+    parser = argparse.ArgumentParser(
+        description="Speculative decoding evaluation for the CPU llama-server",
+        formatter_class=argparse.RawDescriptionHelpFormatter,
+        epilog="""
+Examples:
+  python speculative_eval.py --draft /app/models/gguf/Qwen3-0.6B-GGUF/Qwen3-0.6B-Q8_0.gguf
+  python speculative_eval.py --draft /app/models/gguf/a.gguf --draft /app/models/gguf/b.gguf \\
+                             --draft-max 4,8,16 --threads-draft 4,12 --traffic recorded.jsonl
+  python speculative_eval.py --launcher local --server-bin ./llama-server \\
+                             --wrapper ./hugepage_mmap_wrapper.so --model main.gguf --draft draft.gguf
+        """
+    )
+
+    parser.add_argument("--draft", action="append", required=True,
+                        help="Candidate draft model GGUF, repeat for several (container path for compose)")
+    parser.add_argument("--draft-max", type=parse_int_list, default=[4, 8, 16],
+                        help="Comma-separated draft lengths to try (default: 4,8,16)")
+    parser.add_argument("--threads-draft", type=parse_int_list, default=[4, 12],
+                        help="Comma-separated draft model thread counts to try (default: 4,12)")
+    parser.add_argument("--traffic",
+                        help="Recorded requests as JSONL (default: the benchmark.py prompts)")
+    parser.add_argument("--limit", type=int, help="Replay at most this many requests")
+    parser.add_argument("--sampling", choices=["greedy", "recorded"], default="greedy",
+                        help="Force greedy sampling to check outputs, or keep recorded settings (default: greedy)")
+
+    add_launcher_arguments(parser, port=8101)
+
+    policy = parser.add_argument_group("recommendation")
+    policy.add_argument("--min-speedup", type=float, default=1.10,
+                        help="Decode speedup a candidate must reach (default: 1.10)")
+    policy.add_argument("--min-match", type=float, default=0.95,
+                        help="Fraction of greedy outputs that must match the baseline (default: 0.95)")
+    policy.add_argument("--max-extra-memory-gb", type=float,
+                        help="Memory a draft may add over the baseline (default: unlimited)")
+    parser.add_argument("--output", help="Output JSON filename (default: auto-generated)")
+
+    return parser
+
+
+def main() -> int:
+    """Main function to run the evaluation.
+
+    Returns:
+        Exit code: 0 for success, 1 for failure, 2 for invalid usage.
+    """
+    parser = create_parser()
+    args = parser.parse_args()
+
+    try:
+        launcher = create_launcher(args)
+    except LaunchError as e:
+        print(f"Configuration: {STATUS_ERROR} ({e})", file=sys.stderr)
+        return EXIT_INVALID_USAGE
+    try:
+        traffic = load_traffic(args.traffic, args.limit)
+    except (OSError, ValueError) as e:
+        print(f"Traffic: {STATUS_ERROR} ({e})", file=sys.stderr)
+        return EXIT_INVALID_USAGE
+    if not traffic:
+        print(f"Traffic: {STATUS_ERROR} (no requests)", file=sys.stderr)
+        return EXIT_INVALID_USAGE
+
+    candidates = [Candidate()] + [Candidate(draft, draft_max, threads)
+                                  for draft in args.draft
+                                  for draft_max in args.draft_max
+                                  for threads in args.threads_draft]
+    print("Speculative decoding evaluation")
+    print(f"  Traffic: {len(traffic)} requests ({args.traffic or 'benchmark prompts'}, {args.sampling} sampling)")
+    print(f"  Candidates: {len(candidates) - 1} plus baseline")
+    print()
+
+    evaluation = SpeculativeEval(launcher, args.port, traffic, args.sampling == "greedy",
+                                 args.timeout, args.load_timeout)
+    runs: List[Dict[str, Any]] = []
+    summaries: List[Dict[str, Any]] = []
+    try:
+        for candidate in candidates:
+            try:
+                run = evaluation.run_candidate(candidate)
+            except LaunchError as e:
+                if candidate.draft is None:
+                    raise
+                print(f"  Candidate: {STATUS_ERROR} ({e})")
+                continue
+            run["summary"] = summarize(run, runs[0] if runs else None)
+            runs.append(run)
+            summaries.append(run["summary"])
+    except LaunchError as e:
+        print(f"Baseline: {STATUS_ERROR} ({e})", file=sys.stderr)
+        return EXIT_FAILURE
+    except KeyboardInterrupt:
+        launcher.stop()
+        return EXIT_FAILURE
+
+    max_extra = int(args.max_extra_memory_gb * 1024 ** 3) if args.max_extra_memory_gb is not None else None
+    recommendation = recommend(summaries, args.min_speedup,
+                               args.min_match if args.sampling == "greedy" else None, max_extra)
+    print_report(summaries, recommendation)
+
+    filename = args.output or f"speculative_eval_{datetime.now().strftime('%Y%m%d_%H%M%S')}.json"
+    try:
+        with open(filename, "w") as f:
+            json.dump({"timestamp": datetime.now().isoformat(), "traffic": args.traffic,
+                       "sampling": args.sampling, "candidates": summaries,
+                       "recommendation": recommendation}, f, indent=2)
+        print(f"Results: {STATUS_OK} (saved to {filename})")
+    except OSError as e:
+        print(f"Results: {STATUS_ERROR} (cannot save {filename}: {e})", file=sys.stderr)
+        return EXIT_FAILURE
+    return EXIT_SUCCESS
+
+
+if __name__ == "__main__":
+    sys.exit(main())
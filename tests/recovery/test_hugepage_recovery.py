@@ -0,0 +1,143 @@
+"""hugepage_recovery against a fake /proc and /sys tree (--root)."""
+
+import shutil
+import subprocess
+from pathlib import Path
+
+import pytest
+
+SOURCE = Path(__file__).resolve().parents[2] / "docker" / "llama-cpu" / "hugepage_recovery.cpp"
+POOL_2M = "sys/kernel/mm/hugepages/hugepages-2048kB"
+GiB_KB = 1024 * 1024
+
+# Free blocks per order 0..10 of a zone (/proc/buddyinfo)
+FRAGMENTED = [4000, 2000, 1000, 500, 100, 0, 0, 0, 0, 0, 0]
+COMPACT = [10, 5, 2, 1, 0, 0, 0, 0, 0, 40, 200]
+
+
+@pytest.fixture(scope="session")
+def recovery(tmp_path_factory) -> Path:
+    if not shutil.which("g++"):
+        pytest.skip("g++ not installed")
+    binary = tmp_path_factory.mktemp("build") / "hugepage_recovery"
+    subprocess.run(["g++", "-O2", "-Wall", "-o", str(binary), str(SOURCE)], check=True)
+    return binary
+
+
+def fake_host(root: Path, nr: int, mem_available_kb: int = 64 * GiB_KB,
+              zones=(("Normal", COMPACT),)) -> Path:
+    pool = root / POOL_2M
+    pool.mkdir(parents=True)
+    for name, value in (("nr_hugepages", nr), ("free_hugepages", nr), ("resv_hugepages", 0),
+                        ("surplus_hugepages", 0)):
+        (pool / name).write_text(f"{value}\n")
+    proc = root / "proc"
+    (proc / "sys" / "vm").mkdir(parents=True)
+    (proc / "meminfo").write_text(f"MemTotal:       {128 * GiB_KB} kB\n"
+                                  f"MemAvailable:   {mem_available_kb} kB\n")
+    (proc / "buddyinfo").write_text("".join(
+        f"Node 0, zone {name:>8} " + " ".join(f"{n:6d}" for n in blocks) + "\n" for name, blocks in zones))
+    (proc / "vmstat").write_text("compact_stall 3\ncompact_fail 1\ncompact_success 2\n"
+                                 "htlb_buddy_alloc_success 100\nhtlb_buddy_alloc_fail 7\n")
+    return root
+
+
+def run(binary: Path, root: Path, *args: str) -> subprocess.CompletedProcess:
+    return subprocess.run([str(binary), "--once", "--root", str(root), "--metrics", str(root / "metrics.prom"),
+                           *args], capture_output=True, text=True)
+
+
+def nr_hugepages(root: Path) -> int:
+    return int((root / POOL_2M / "nr_hugepages").read_text())
+
+
+def compacted(root: Path) -> bool:
+    return (root / "proc" / "sys" / "vm" / "compact_memory").exists()
+
+
+def metric(root: Path, name: str) -> str:
+    for line in (root / "metrics.prom").read_text().splitlines():
+        if line.startswith(name + " ") or line.startswith(name + "{"):
+            return line.rsplit(" ", 1)[1]
+    raise KeyError(name)
+
+
+def test_grows_pool_below_target(recovery, tmp_path):
+    root = fake_host(tmp_path, nr=10)
+    result = run(recovery, root, "--target", "2M=64")
+    assert result.returncode == 0, result.stderr
+    assert nr_hugepages(root) == 64
+    assert "2M pool 10 -> 64 pages (target 64)" in result.stderr
+    assert metric(root, "hugepage_recovery_grown_pages_total") == "54"
+    assert "2M pool: 64 pages" in result.stdout
+
+
+def test_growth_stops_at_keep_free(recovery, tmp_path):
+    # 20 pages of MemAvailable above --keep-free
+    root = fake_host(tmp_path, nr=10, mem_available_kb=4 * GiB_KB + 20 * 2048)
+    result = run(recovery, root, "--target", "2M=100", "--keep-free", "4G")
+    assert result.returncode == 2
+    assert nr_hugepages(root) == 30
+    assert "BELOW TARGET" in result.stdout
+
+
+def test_never_shrinks_pool_above_target(recovery, tmp_path):
+    root = fake_host(tmp_path, nr=80)
+    result = run(recovery, root, "--target", "2M=64")
+    assert result.returncode == 0, result.stderr
+    assert nr_hugepages(root) == 80
+    assert metric(root, "hugepage_recovery_attempts_total") == "0"
+
+
+def test_target_defaults_to_pool_at_startup(recovery, tmp_path):
+    root = fake_host(tmp_path, nr=48)
+    result = run(recovery, root)
+    assert result.returncode == 0, result.stderr
+    assert nr_hugepages(root) == 48
+    assert "target 48 - OK" in result.stdout
+
+
+def test_empty_pool_without_target_is_an_error(recovery, tmp_path):
+    root = fake_host(tmp_path, nr=0)
+    result = run(recovery, root)
+    assert result.returncode == 1
+    assert "No huge page pools to keep" in result.stderr
+
+
+def test_dry_run_changes_nothing(recovery, tmp_path):
+    root = fake_host(tmp_path, nr=10, zones=(("Normal", FRAGMENTED),))
+    result = run(recovery, root, "--target", "2M=64", "--dry-run")
+    assert result.returncode == 2
+    assert nr_hugepages(root) == 10
+    assert not compacted(root)
+    assert "[dry run]" in result.stderr
+
+
+def test_buddyinfo_unusable_index(recovery, tmp_path):
+    root = fake_host(tmp_path, nr=16, zones=(("DMA32", FRAGMENTED), ("Normal", COMPACT)))
+    result = run(recovery, root)
+    assert result.returncode == 0, result.stderr
+    assert "Node 0 DMA32" in result.stdout and "100.0% in runs below 2MB" in result.stdout
+    assert metric(root, 'hugepage_unusable_free_ratio{node="0",zone="DMA32"}') == "1.0000"
+    assert metric(root, 'hugepage_buddy_free_blocks{node="0",zone="Normal",order="10"}') == "200"
+    assert metric(root, "hugepage_kernel_pool_alloc_fail_total") == "7"
+    # Only DMA zones are fragmented: no compaction
+    assert not compacted(root)
+    assert metric(root, "hugepage_recovery_proactive_compactions_total") == "0"
+
+
+def test_compacts_fragmented_host_at_target(recovery, tmp_path):
+    root = fake_host(tmp_path, nr=16, zones=(("Normal", FRAGMENTED),))
+    result = run(recovery, root)
+    assert result.returncode == 0, result.stderr
+    assert (root / "proc" / "sys" / "vm" / "compact_memory").read_text() == "1\n"
+    assert "100% of free memory in runs below 2MB, compacting" in result.stderr
+    assert metric(root, "hugepage_recovery_proactive_compactions_total") == "1"
+
+
+def test_no_proactive_compaction_while_growing(recovery, tmp_path):
+    root = fake_host(tmp_path, nr=10, mem_available_kb=4 * GiB_KB, zones=(("Normal", FRAGMENTED),))
+    result = run(recovery, root, "--target", "2M=64")
+    assert result.returncode == 2
+    assert nr_hugepages(root) == 10
+    assert not compacted(root)
@@ -0,0 +1,6 @@
+"""The router is run as a script from scripts/router; import its modules the same way."""
+
+import sys
+from pathlib import Path
+
+sys.path.insert(0, str(Path(__file__).resolve().parents[2] / "scripts" / "router"))
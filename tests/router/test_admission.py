@@ -0,0 +1,156 @@
+"""Cost estimation, request validation, classification and admission policy."""
+
+import asyncio
+
+import pytest
+from admission import (
+    PRIORITY_BATCH,
+    PRIORITY_INTERACTIVE,
+    AdmissionController,
+    AdmissionRejected,
+    ClassPolicy,
+    InvalidRequest,
+    RateCalibrator,
+    RequestCost,
+    classify_priority,
+)
+
+
+def calibrator() -> RateCalibrator:
+    return RateCalibrator(prefill_tps=100.0, decode_tps=10.0, chars_per_token=4.0)
+
+
+def controller(interactive_concurrency=2, batch_concurrency=1, batch_max_wait=0.5,
+               ttft_slo=1.0, max_queue=4) -> AdmissionController:
+    policies = {
+        PRIORITY_INTERACTIVE: ClassPolicy(PRIORITY_INTERACTIVE, interactive_concurrency, 100000,
+                                          max_queue, 5.0),
+        PRIORITY_BATCH: ClassPolicy(PRIORITY_BATCH, batch_concurrency, 100000, max_queue, batch_max_wait),
+    }
+    return AdmissionController(calibrator(), policies, ttft_slo)
+
+
+# --- Cost estimation ---
+
+def test_chat_cost_counts_text_parts():
+    body = {"messages": [{"role": "user", "content": "a" * 400},
+                         {"role": "user", "content": [{"type": "text", "text": "b" * 40},
+                                                      {"type": "image_url", "image_url": {}}]},
+                         {"role": "assistant", "content": None}],
+            "max_tokens": 64}
+    cost = calibrator().estimate_cost(body)
+    assert cost.prompt_chars == 440
+    assert cost.prompt_tokens == 110
+    assert cost.max_tokens == 64
+
+
+def test_completion_cost_and_defaults():
+    cal = calibrator()
+    assert cal.estimate_cost({"prompt": "x" * 80}).max_tokens == 512
+    assert cal.estimate_cost({"prompt": ["x" * 40, "y" * 40], "n_predict": 7}).prompt_tokens == 20
+    assert cal.estimate_cost({"prompt": "x", "n_predict": -1}).max_tokens == 512
+    assert cal.estimate_cost({}).prompt_tokens == 1
+
+
+@pytest.mark.parametrize("body", [
+    [],
+    "prompt",
+    {"messages": "hello"},
+    {"messages": ["hello"]},
+    {"messages": [{"content": "hi"}, 3]},
+    {"prompt": "hi", "max_tokens": "64"},
+    {"prompt": "hi", "max_tokens": 6.5},
+    {"prompt": "hi", "max_tokens": True},
+    {"prompt": "hi", "n_predict": [1]},
+])
+def test_malformed_bodies_are_rejected(body):
+    with pytest.raises(InvalidRequest):
+        calibrator().estimate_cost(body)
+
+
+def test_calibration_ignores_short_samples():
+    cal = calibrator()
+    cal.observe({"prompt_n": 10, "prompt_per_second": 1000.0, "predicted_n": 2,
+                 "predicted_per_second": 1000.0}, None, 0)
+    assert (cal.prefill_tps, cal.decode_tps) == (100.0, 10.0)
+    cal.observe({"prompt_n": 512, "prompt_per_second": 200.0, "predicted_n": 64,
+                 "predicted_per_second": 20.0}, {"prompt_tokens": 100}, 500)
+    assert cal.prefill_tps == pytest.approx(120.0)
+    assert cal.decode_tps == pytest.approx(12.0)
+    assert cal.chars_per_token == pytest.approx(4.2)
+
+
+# --- Classification ---
+
+def test_header_wins_and_body_field_is_stripped():
+    body = {"prompt": "hi", "priority": "interactive"}
+    assert classify_priority("batch", body, 10, 1000) == PRIORITY_BATCH
+    assert "priority" not in body
+
+
+def test_body_field_selects_class():
+    body = {"prompt": "hi", "priority": "batch"}
+    assert classify_priority(None, body, 10, 1000) == PRIORITY_BATCH
+    assert "priority" not in body
+
+
+def test_threshold_selects_class():
+    assert classify_priority(None, {}, 999, 1000) == PRIORITY_INTERACTIVE
+    assert classify_priority(None, {}, 1000, 1000) == PRIORITY_BATCH
+    body = {"priority": "urgent"}
+    assert classify_priority(None, body, 10, 1000) == PRIORITY_INTERACTIVE
+    assert "priority" not in body
+
+
+# --- Admission policy ---
+
+def test_concurrency_limit_queues_then_admits_on_release():
+    async def run():
+        ac = controller(interactive_concurrency=1)
+        first = await ac.acquire(RequestCost(10, 10), PRIORITY_INTERACTIVE)
+        waiting = asyncio.ensure_future(ac.acquire(RequestCost(10, 10), PRIORITY_INTERACTIVE))
+        await asyncio.sleep(0)
+        assert not waiting.done()
+        ac.release(first)
+        second = await asyncio.wait_for(waiting, 1.0)
+        assert second.priority == PRIORITY_INTERACTIVE
+        assert ac.counters == {"admitted": 2, "deferred": 1, "shed": 0}
+        ac.release(second)
+    asyncio.run(run())
+
+
+def test_batch_deferred_behind_interactive_slo_then_shed():
+    async def run():
+        ac = controller(batch_concurrency=2, batch_max_wait=0.3, ttft_slo=1.0)
+        # 500 prompt tokens at 100 tokens/s: the backlog alone breaks the SLO
+        interactive = await ac.acquire(RequestCost(500, 10), PRIORITY_INTERACTIVE)
+        with pytest.raises(AdmissionRejected):
+            await ac.acquire(RequestCost(200, 10), PRIORITY_BATCH)
+        assert ac.counters["shed"] == 1
+        ac.release(interactive)
+    asyncio.run(run())
+
+
+def test_batch_admitted_when_interactive_idle():
+    async def run():
+        ac = controller(ttft_slo=0.1)
+        ticket = await ac.acquire(RequestCost(5000, 10), PRIORITY_BATCH)
+        assert ticket.priority == PRIORITY_BATCH
+        ac.release(ticket)
+    asyncio.run(run())
+
+
+def test_full_queue_sheds_immediately():
+    async def run():
+        ac = controller(interactive_concurrency=1, max_queue=1)
+        held = await ac.acquire(RequestCost(10, 10), PRIORITY_INTERACTIVE)
+        queued = asyncio.ensure_future(ac.acquire(RequestCost(10, 10), PRIORITY_INTERACTIVE))
+        await asyncio.sleep(0)
+        with pytest.raises(AdmissionRejected):
+            await ac.acquire(RequestCost(10, 10), PRIORITY_INTERACTIVE)
+        queued.cancel()
+        with pytest.raises(asyncio.CancelledError):
+            await queued
+        assert ac.queued_costs() == []
+        ac.release(held)
+    asyncio.run(run())
@@ -0,0 +1,119 @@
+"""Backend selection against mock_backend replicas: queue spill, context limits and health."""
+
+import asyncio
+from contextlib import asynccontextmanager
+
+import pytest
+
+pytest.importorskip("aiohttp")
+
+import mock_backend  # noqa: E402
+from aiohttp.test_utils import TestClient, TestServer  # noqa: E402
+from cost_model import KIND_CPU, KIND_GPU  # noqa: E402
+from router import BACKEND_HEADER, Backend, Router, build_admission, create_parser  # noqa: E402
+
+# The router's seed rates match the mocks, so predictions hold from the first request
+ROUTER_ARGS = ["--prefill-tps", "5000", "--decode-tps", "10",
+               "--gpu-prefill-tps", "20000", "--gpu-decode-tps", "50"]
+GPU = ["--prefill-tps", "20000", "--decode-tps", "50", "--slots", "1", "--min-generation", "1.0"]
+CPU = ["--prefill-tps", "5000", "--decode-tps", "10", "--slots", "4", "--min-generation", "1.0"]
+NOT_LOADED = ["--load-time", "3600"]   # /health answers 503 for the whole test
+
+
+@asynccontextmanager
+async def routed(*specs):
+    """Start a mock_backend per (kind, mock args) spec and a router in front of them.
+
+    Yields the router's test client and a (engine, url) pair per mock.
+    """
+    servers = []
+    try:
+        for kind, argv in specs:
+            engine = mock_backend.MockEngine(mock_backend.create_parser().parse_args(argv))
+            server = TestServer(engine.build_app(), host="127.0.0.1")
+            await server.start_server()
+            servers.append((kind, engine, server))
+        args = create_parser().parse_args(ROUTER_ARGS)
+        backends = [Backend(str(server.make_url("")), build_admission(args, kind), kind)
+                    for kind, _, server in servers]
+        router = Router(backends, args.batch_threshold)
+        async with TestClient(TestServer(router.build_app(), host="127.0.0.1")) as client:
+            yield client, [(engine, backend.url) for (_, engine, _), backend in zip(servers, backends)]
+    finally:
+        for _, _, server in servers:
+            await server.close()
+
+
+def chat(content: str = "hi", max_tokens: int = 10) -> dict:
+    return {"messages": [{"role": "user", "content": content}], "max_tokens": max_tokens}
+
+
+async def complete(client: TestClient, body: dict) -> tuple:
+    """(status, serving backend url, JSON body) of a routed completion."""
+    response = await client.post("/v1/chat/completions", json=body)
+    payload = await response.json()
+    return response.status, response.headers.get(BACKEND_HEADER), payload
+
+
+def test_loaded_gpu_spills_to_cpu():
+    async def run():
+        async with routed((KIND_GPU, GPU), (KIND_CPU, CPU)) as (client, mocks):
+            (gpu, gpu_url), (cpu, cpu_url) = mocks
+            # Idle, 10 tokens take 0.2 s on the GPU and 1 s on the CPU
+            status, served_by, _ = await complete(client, chat())
+            assert status == 200 and served_by == gpu_url
+
+            # 100 tokens hold the GPU's only slot for 2 s; waiting for it costs
+            # more than generating on the CPU, so the next request spills
+            hog = asyncio.create_task(complete(client, chat(max_tokens=100)))
+            while gpu.counters["processing"] == 0:
+                await asyncio.sleep(0.01)
+            status, served_by, _ = await complete(client, chat())
+            assert status == 200 and served_by == cpu_url
+            assert gpu.counters["processing"] == 1
+
+            status, served_by, _ = await hog
+            assert status == 200 and served_by == gpu_url
+            assert gpu.counters["requests"] == 2 and cpu.counters["requests"] == 1
+
+    asyncio.run(run())
+
+
+def test_prompt_over_context_limit_goes_elsewhere():
+    async def run():
+        # The vLLM flavor reports its limit as max_model_len, llama-server as n_ctx
+        small_gpu = GPU + ["--flavor", "vllm", "--ctx-size", "512"]
+        async with routed((KIND_GPU, small_gpu), (KIND_CPU, CPU + ["--ctx-size", "4096"])) as (client, mocks):
+            (gpu, _), (cpu, cpu_url) = mocks
+            # ~1000 prompt tokens: faster on the GPU, but only the CPU holds them
+            status, served_by, _ = await complete(client, chat("x" * 3500, max_tokens=4))
+            assert status == 200 and served_by == cpu_url
+            assert gpu.counters["requests"] == 0
+
+            # ~10000 prompt tokens fit nowhere: rejected without reaching a backend
+            status, served_by, payload = await complete(client, chat("x" * 35000, max_tokens=4))
+            assert status == 400 and served_by is None
+            assert "context limit" in payload["error"]["message"]
+            assert gpu.counters["requests"] == 0 and cpu.counters["requests"] == 1
+
+    asyncio.run(run())
+
+
+def test_unhealthy_backend_is_skipped():
+    async def run():
+        async with routed((KIND_GPU, GPU + NOT_LOADED), (KIND_CPU, CPU)) as (client, mocks):
+            (gpu, _), (cpu, cpu_url) = mocks
+            status, served_by, _ = await complete(client, chat())
+            assert status == 200 and served_by == cpu_url
+            assert gpu.counters["requests"] == 0
+
+            response = await client.get("/router/stats")
+            health = [b["model"]["healthy"] for b in (await response.json())["backends"]]
+            assert health == [False, True]
+
+        async with routed((KIND_GPU, GPU + NOT_LOADED)) as (client, mocks):
+            status, _, payload = await complete(client, chat())
+            assert status == 503
+            assert payload["error"]["message"] == "no healthy backend"
+
+    asyncio.run(run())